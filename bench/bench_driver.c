@@ -0,0 +1,207 @@
+#define _POSIX_C_SOURCE 200112L
+#include "Assembler.h"
+#include <time.h>
+#include <sys/resource.h>
+
+/*
+ * End-to-end Benchmark Driver
+ * ----------------------------
+ * Generates synthetic sources of doubling sizes with bench/gen_source and
+ * assembles each one in process, timing every phase separately:
+ * preassembly, first pass, second pass and output writing. For every size
+ * the best of the repetitions is reported with the throughput in lines per
+ * second and the peak resident memory of the run so far.
+ *
+ * A size whose total time grows more than SUPERLINEAR_RATIO times over the
+ * previous (half) size is flagged, and the driver then exits with 1.
+ *
+ * Options:
+ *   --start <lines>   Lines of the smallest source (default 10000).
+ *   --steps <n>       Number of sizes, each twice the previous (default 5).
+ *   --reps <n>        Repetitions per size, the best one is kept (default 3).
+ *   --threads <n>     Threads of the parallel passes (default 1).
+ *   --dir <dir>       Directory for the generated sources and outputs.
+ */
+
+#define BENCH_PHASES 4
+#define BENCH_PATH 512
+#define SUPERLINEAR_RATIO 3.0
+
+static const char *phase_names[BENCH_PHASES] = {"preasm", "first", "second", "output"};
+
+
+/*******************************************************************************
+ * Returns the current time of the monotonic clock in seconds.
+ ******************************************************************************/
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*******************************************************************************
+ * Assembles a source file once, like the main loop of the assembler.
+ *
+ * Parameters:
+ * - file_name: The source file.
+ * - Code, Data: The image arrays, Options.image_words words each.
+ * - times: Receives the duration of every phase in seconds.
+ *
+ * Returns:
+ * - 1 if the file assembled without errors, 0 otherwise.
+ ******************************************************************************/
+static int assembleOnce(char* file_name, signed short Code[], signed short Data[], double times[]){
+    FILE *am_file;
+    LabelTable *table;
+    int PC[2] = {0}, Error = 0;
+    double start;
+
+    memset(Code, 0, Options.image_words * sizeof(signed short));
+    memset(Data, 0, Options.image_words * sizeof(signed short));
+
+    start = now();
+    am_file = PreAssembler(file_name);
+    times[0] = now() - start;
+    if (!am_file) {
+        diagFlush(file_name, 1, 0);
+        return 0;
+    }
+
+    start = now();
+    table = FirstPass(am_file, &Error);
+    times[1] = now() - start;
+
+    start = now();
+    SecondPass(am_file, table, Code, Data, PC, &Error);
+    times[2] = now() - start;
+
+    start = now();
+    if (!Error) {
+        Write_object_file(Code, Data, PC, file_name);
+        Write_extern_entry_files(table, file_name);
+    }
+    times[3] = now() - start;
+
+    diagFlush(file_name, Error != 0, Error);
+    freeLabelTable(table);
+    return !Error;
+}
+
+
+/*******************************************************************************
+ * Generates the source file of one size.
+ *
+ * Parameters:
+ * - path: The file to write.
+ * - lines: The number of source lines.
+ *
+ * Returns:
+ * - 1 on success, 0 otherwise.
+ ******************************************************************************/
+static int generateSource(char* path, long lines){
+    char command[2 * BENCH_PATH];
+
+    sprintf(command, "bench/gen_source --lines %ld --labels %ld --macros %ld --macro-uses %ld > %s",
+            lines, lines / 20, lines / 1000 + 1, lines / 50, path);
+    return system(command) == 0;
+}
+
+
+/*******************************************************************************
+ * Returns the peak resident memory of the process in KB.
+ ******************************************************************************/
+static long peakMemory(void){
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+
+int main(int argc, char** argv){
+    long start_lines = 10000, lines, peak;
+    int steps = 5, reps = 3, threads = 1, flagged = 0, step, rep, p, ok;
+    char *dir = "bench/run";
+    char path[BENCH_PATH], command[2 * BENCH_PATH];
+    double times[BENCH_PHASES], best[BENCH_PHASES], total, previous = 0, ratio;
+    signed short *Code, *Data;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (i + 1 >= argc) break;
+        if (strcmp(argv[i], "--start") == 0) start_lines = atol(argv[++i]);
+        else if (strcmp(argv[i], "--steps") == 0) steps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--reps") == 0) reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--dir") == 0) dir = argv[++i];
+        else break;
+    }
+    if (i < argc || start_lines < 1 || steps < 1 || reps < 1 || threads < 1 || strlen(dir) > BENCH_PATH / 2) {
+        fprintf(stderr, "Usage: bench_driver [--start <lines>] [--steps <n>] [--reps <n>] [--threads <n>] [--dir <dir>]\n");
+        return 1;
+    }
+
+    sprintf(command, "mkdir -p %s", dir);
+    if (system(command) != 0) {
+        fprintf(stderr, "Error: Could not create %s\n", dir);
+        return 1;
+    }
+
+    Options.keep_am = 1;
+    Options.load_base = OBJECT_BASE;
+    Options.threads = threads;
+    Options.chunk_lines = 0;
+
+    printf("%10s %10s %10s %10s %10s %10s %12s %10s\n",
+           "lines", phase_names[0], phase_names[1], phase_names[2], phase_names[3], "total", "lines/s", "peak KB");
+
+    for (step = 0, lines = start_lines; step < steps; step++, lines *= 2) {
+        sprintf(path, "%s/bench_%ld.as", dir, lines);
+        if (!generateSource(path, lines)) {
+            fprintf(stderr, "Error: Could not generate %s\n", path);
+            return 1;
+        }
+
+        /* The benchmark image holds every generated word, well past MAX_LENGTH */
+        Options.image_words = (int)(lines * 10 + MAX_LENGTH);
+        Code = (signed short*)memCalloc(MEM_OTHER, Options.image_words, sizeof(signed short));
+        Data = (signed short*)memCalloc(MEM_OTHER, Options.image_words, sizeof(signed short));
+        if (!Code || !Data) {
+            fprintf(stderr, "Error: Failed to allocate memory for the image\n");
+            exit(1);
+        }
+
+        for (p = 0; p < BENCH_PHASES; p++) best[p] = -1;
+        for (rep = 0, ok = 1; rep < reps && ok; rep++) {
+            ok = assembleOnce(path, Code, Data, times);
+            for (p = 0; p < BENCH_PHASES; p++) {
+                if (best[p] < 0 || times[p] < best[p]) best[p] = times[p];
+            }
+        }
+        memFree(Code);
+        memFree(Data);
+        if (!ok) {
+            fprintf(stderr, "Error: %s did not assemble\n", path);
+            return 1;
+        }
+
+        for (p = 0, total = 0; p < BENCH_PHASES; p++) total += best[p];
+        peak = peakMemory();
+        printf("%10ld %10.4f %10.4f %10.4f %10.4f %10.4f %12.0f %10ld",
+               lines, best[0], best[1], best[2], best[3], total, total > 0 ? lines / total : 0.0, peak);
+
+        /* Doubling the input should about double the time */
+        ratio = previous > 0 ? total / previous : 0;
+        if (ratio > SUPERLINEAR_RATIO) {
+            printf("  SUPERLINEAR x%.2f", ratio);
+            flagged = 1;
+        }
+        printf("\n");
+        previous = total;
+    }
+
+    freeIncludeCache();
+    return flagged;
+}
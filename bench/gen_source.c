@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Synthetic Source Generator
+ * ----------------------------
+ * Writes a valid assembly program of a configurable size to stdout, for the
+ * benchmarks. The shape of the program is controlled by:
+ *   --lines <n>       Approximate number of source lines.
+ *   --labels <n>      Number of code labels defined along the program.
+ *   --externs <n>     Number of extern labels.
+ *   --macros <n>      Number of macro definitions.
+ *   --macro-uses <n>  Number of macro expansions, spread along the program.
+ *   --refs <p>        Percentage of operands that reference a label.
+ *   --data <n>        Number of values in every .data initializer.
+ *   --mat <r> <c>     Dimensions of every .mat initializer.
+ *   --data-every <n>  Body lines between .data and .mat lines, 0 for none.
+ *   --seed <n>        Seed of the pseudo random choices.
+ */
+
+/* Generator parameters */
+typedef struct GenParams {
+    long lines;
+    long labels;
+    long externs;
+    long macros;
+    long macro_uses;
+    int refs;
+    int data;
+    int mat_rows;
+    int mat_cols;
+    long data_every;
+    unsigned long seed;
+} GenParams;
+
+static const char *two_operand[] = {"mov", "cmp", "add", "sub", "lea"};
+static const char *one_operand[] = {"clr", "not", "inc", "dec", "jmp", "bne", "jsr", "red", "prn"};
+
+
+/*******************************************************************************
+ * Returns the next pseudo random number below limit.
+ ******************************************************************************/
+static long nextRandom(GenParams* params, long limit){
+    params->seed = params->seed * 1103515245UL + 12345UL;
+    return limit > 0 ? (long)((params->seed >> 8) % (unsigned long)limit) : 0;
+}
+
+
+/*******************************************************************************
+ * Writes an operand. Immediates are only written where allowed, label
+ * references follow the reference density.
+ *
+ * Parameters:
+ * - params: The generator parameters.
+ * - immediate: 1 if an immediate is allowed.
+ * - only_label: 1 if the operand must reference memory (lea source).
+ ******************************************************************************/
+static void writeOperand(GenParams* params, int immediate, int only_label){
+    long kind = nextRandom(params, 100);
+
+    if (only_label || kind < params->refs) {
+        kind = nextRandom(params, 4);
+        if (kind == 0 && params->externs > 0) printf("X%ld", nextRandom(params, params->externs));
+        else if (kind == 1) printf("MAT[r%ld][r%ld]", nextRandom(params, 8), nextRandom(params, 8));
+        else if (kind == 2 || params->labels == 0) printf("D");
+        else printf("L%ld", nextRandom(params, params->labels));
+    }
+    else if (immediate && nextRandom(params, 2)) printf("#%ld", nextRandom(params, 512) - 256);
+    else printf("r%ld", nextRandom(params, 8));
+}
+
+
+/*******************************************************************************
+ * Writes one instruction line, without its label.
+ ******************************************************************************/
+static void writeInstruction(GenParams* params){
+    long kind = nextRandom(params, 16);
+    int opcode;
+
+    if (kind < 7) {
+        opcode = (int)nextRandom(params, 5);
+        printf("%s ", two_operand[opcode]);
+        writeOperand(params, opcode != 4, opcode == 4);
+        printf(", ");
+        writeOperand(params, opcode == 1, 0);
+    }
+    else if (kind < 15) {
+        opcode = (int)nextRandom(params, 9);
+        printf("%s ", one_operand[opcode]);
+        writeOperand(params, opcode == 8, 0);
+    }
+    else printf("rts");
+    printf("\n");
+}
+
+
+/*******************************************************************************
+ * Writes a .data line with the configured number of values.
+ ******************************************************************************/
+static void writeData(GenParams* params, const char* label){
+    int i;
+
+    printf("%s.data", label);
+    for (i = 0; i < params->data; i++) printf("%s %ld", i ? "," : "", nextRandom(params, 1024) - 512);
+    printf("\n");
+}
+
+
+/*******************************************************************************
+ * Writes a .mat line with the configured dimensions, labeled M<index>
+ * unless index is negative.
+ ******************************************************************************/
+static void writeMatrix(GenParams* params, long index){
+    int i;
+
+    if (index >= 0) printf("M%ld: ", index);
+    printf(".mat [%d][%d]", params->mat_rows, params->mat_cols);
+    for (i = 0; i < params->mat_rows * params->mat_cols; i++) printf("%s %ld", i ? "," : "", nextRandom(params, 64));
+    printf("\n");
+}
+
+
+/*******************************************************************************
+ * Parses the command line into the generator parameters.
+ *
+ * Returns:
+ * - 1 if the command line is valid, 0 otherwise.
+ ******************************************************************************/
+static int parseParams(int argc, char** argv, GenParams* params){
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (i + 1 >= argc) return 0;
+        if (strcmp(argv[i], "--lines") == 0) params->lines = atol(argv[++i]);
+        else if (strcmp(argv[i], "--labels") == 0) params->labels = atol(argv[++i]);
+        else if (strcmp(argv[i], "--externs") == 0) params->externs = atol(argv[++i]);
+        else if (strcmp(argv[i], "--macros") == 0) params->macros = atol(argv[++i]);
+        else if (strcmp(argv[i], "--macro-uses") == 0) params->macro_uses = atol(argv[++i]);
+        else if (strcmp(argv[i], "--refs") == 0) params->refs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--data") == 0) params->data = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--data-every") == 0) params->data_every = atol(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0) params->seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--mat") == 0 && i + 2 < argc) {
+            params->mat_rows = atoi(argv[++i]);
+            params->mat_cols = atoi(argv[++i]);
+        }
+        else return 0;
+    }
+    return params->lines > 0 && params->data > 0 && params->mat_rows > 0 && params->mat_cols > 0;
+}
+
+
+int main(int argc, char** argv){
+    GenParams params = {1000, 50, 4, 10, 50, 30, 4, 2, 2, 20, 1};
+    long line = 0, body, label_every, use_every, next_label = 0, num_mats = 0, i;
+
+    if (!parseParams(argc, argv, &params)) {
+        fprintf(stderr, "Usage: gen_source --lines <n> [--labels <n>] [--externs <n>] [--macros <n>]\n"
+                        "       [--macro-uses <n>] [--refs <percent>] [--data <n>] [--mat <rows> <cols>]\n"
+                        "       [--data-every <n>] [--seed <n>]\n");
+        return 1;
+    }
+
+    /* Header: externs and macro definitions */
+    for (i = 0; i < params.externs; i++, line++) printf(".extern X%ld\n", i);
+    for (i = 0; i < params.macros; i++, line += 4) {
+        printf("mcro m%ld\n", i);
+        writeInstruction(&params);
+        writeInstruction(&params);
+        printf("mcroend\n");
+    }
+
+    /* Body: instructions, with the labels and macro uses spread evenly */
+    body = params.lines - line - 4 - params.labels / 8;
+    if (body < 1) body = 1;
+    label_every = params.labels > 0 ? (body + params.labels - 1) / params.labels : 0;
+    use_every = params.macro_uses > 0 && params.macros > 0 ? (body + params.macro_uses - 1) / params.macro_uses : 0;
+    for (i = 0; i < body; i++) {
+        if (label_every && i % label_every == 0 && next_label < params.labels) {
+            printf("L%ld: ", next_label++);
+            writeInstruction(&params);
+        }
+        else if (use_every && i % use_every == use_every - 1) printf("m%ld\n", nextRandom(&params, params.macros));
+        else if (params.data_every && i % params.data_every == params.data_every - 1) {
+            if (i / params.data_every % 2) writeMatrix(&params, num_mats++);
+            else writeData(&params, "");
+        }
+        else writeInstruction(&params);
+    }
+    for (; next_label < params.labels; next_label++) printf("L%ld: stop\n", next_label);
+    printf("stop\n");
+
+    /* Data: the referenced data and matrix labels, and a string */
+    writeData(&params, "D: ");
+    printf("S: .string \"benchmark\"\nMAT: ");
+    writeMatrix(&params, -1);
+
+    /* Entries: every eighth label */
+    for (i = 0; i < params.labels; i += 8) printf(".entry L%ld\n", i);
+    return 0;
+}
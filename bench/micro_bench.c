@@ -0,0 +1,468 @@
+#define _POSIX_C_SOURCE 200112L
+#include "Assembler.h"
+#include <time.h>
+
+/*
+ * Microbenchmark Harness
+ * ----------------------------
+ * Times the hot helpers of the assembler in isolation, each on a batch of
+ * inputs drawn from the distributions the assembler sees in real programs.
+ * After warmup batches every repetition times one whole batch, and the
+ * report gives the min, p50, p90, p99, max and mean nanoseconds per call
+ * over the repetitions, as a table and as JSON for tracking across
+ * revisions.
+ *
+ * To compare a replacement with the current implementation, add it to the
+ * kernel table with the name of the kernel it replaces as its baseline.
+ * Both run on the same inputs, a candidate whose results differ from its
+ * baseline fails the run, and the report gives its p50 speedup.
+ *
+ * Options:
+ *   --reps <n>       Timed batches per kernel (default 200).
+ *   --warmup <n>     Untimed batches per kernel (default 20).
+ *   --filter <text>  Only run the kernels whose name contains text.
+ *   --json <file>    Write the JSON report to file (default stdout).
+ */
+
+#define MICRO_BATCH 4096
+#define MICRO_LABELS 512
+#define MICRO_MACROS 32
+
+/* A benchmarked kernel */
+typedef struct MicroKernel {
+    const char *name; /* Name in the report */
+    const char *baseline; /* Kernel this one replaces, NULL for the current implementation */
+    unsigned long (*batch)(void); /* Runs the kernel on every input, returns a checksum */
+} MicroKernel;
+
+/* Results of one kernel, nanoseconds per call */
+typedef struct MicroResult {
+    double min, p50, p90, p99, max, mean;
+    unsigned long checksum;
+} MicroResult;
+
+/* Inputs shared by the kernels, built once by setupInputs */
+static signed short words[MICRO_BATCH];
+static int positions[MICRO_BATCH];
+static unsigned int addresses[MICRO_BATCH];
+static char names[MICRO_BATCH][MAX_LABEL + 1];
+static char lines[MICRO_BATCH][MAX_LINE_LENGTH];
+static char mnemonics[MICRO_BATCH][5];
+static char macro_lines[MICRO_BATCH][MAX_LINE_LENGTH];
+static LabelTable *labels;
+static MacroList macros;
+static FILE *macro_sink;
+static signed short image[MAX_LENGTH];
+static unsigned long seed = 1;
+
+static const char *mnemonic_names[] = {"mov", "cmp", "add", "sub", "lea", "clr", "not", "inc",
+                                       "dec", "jmp", "bne", "jsr", "red", "prn", "rts", "stop"};
+static const char *common_names[] = {"MAIN", "LOOP", "END", "STR", "LIST", "COUNT", "K", "W", "LENGTH", "NEXT"};
+static char encoding_table[] = {'a', 'b', 'c', 'd'};
+
+
+/*******************************************************************************
+ * Returns the next pseudo random number below limit.
+ ******************************************************************************/
+static long nextRandom(long limit){
+    seed = seed * 1103515245UL + 12345UL;
+    return (long)((seed >> 8) % (unsigned long)limit);
+}
+
+
+/*******************************************************************************
+ * Writes a label name: mostly generated L<n> names and common words, some
+ * random names up to MAX_LABEL characters.
+ ******************************************************************************/
+static void randomName(char* name){
+    static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    long kind = nextRandom(20), len, i;
+
+    if (kind < 12) sprintf(name, "L%ld", nextRandom(MICRO_LABELS));
+    else if (kind < 17) strcpy(name, common_names[nextRandom(10)]);
+    else {
+        len = 1 + nextRandom(MAX_LABEL);
+        name[0] = chars[nextRandom(52)];
+        for (i = 1; i < len; i++) name[i] = chars[nextRandom(62)];
+        name[len] = '\0';
+    }
+}
+
+
+/*******************************************************************************
+ * Builds the inputs of every kernel, the label table and the macro list.
+ ******************************************************************************/
+static void setupInputs(void){
+    char name[MAX_LABEL + 1], line[MAX_LINE_LENGTH];
+    Label *label;
+    long kind;
+    int i;
+
+    /* The options of a plain run, which parseOptions does not fill here */
+    Options.image_words = MAX_LENGTH;
+    Options.load_base = OBJECT_BASE;
+
+    /* A frozen table of the label names the lookups hit */
+    labels = create_LabelTable(TABLE_SIZE);
+    for (i = 0; i < MICRO_LABELS; i++) {
+        sprintf(name, "L%d", i);
+        label = createLabel(name, 0, 0);
+        label->address = 100 + i;
+        insertLabel(labels, label);
+    }
+    for (i = 0; i < 10; i++) insertLabel(labels, createLabel((char*)common_names[i], 0, 0));
+    freezeLabelTable(labels);
+
+    /* Macros with two lines each, like the generated programs */
+    initMacroList(&macros);
+    for (i = 0; i < MICRO_MACROS; i++) {
+        sprintf(name, "m%d", i);
+        insertMacroName(&macros, name);
+        insertMacroLine(&macros, "inc r1\n", name);
+        insertMacroLine(&macros, "mov L1, r2\n", name);
+    }
+    macro_sink = tmpfile();
+    if (!macro_sink) {
+        fprintf(stderr, "Error: Could not open a temporary file\n");
+        exit(1);
+    }
+
+    for (i = 0; i < MICRO_BATCH; i++) {
+        /* Machine words and where they go */
+        words[i] = (signed short)(nextRandom(1024) - 512);
+        positions[i] = (int)nextRandom(MAX_LENGTH);
+        addresses[i] = 100 + (unsigned int)nextRandom(MAX_LENGTH);
+
+        randomName(names[i]);
+
+        /* Source lines with the blanks deleteSpaces trims */
+        kind = nextRandom(4);
+        sprintf(line, "%s%s r%ld, %.31s%s", kind == 0 ? "" : kind == 1 ? " " : "\t  ",
+                mnemonic_names[nextRandom(16)], nextRandom(8), names[i], kind == 3 ? " \t" : "");
+        strcpy(lines[i], line);
+
+        /* Mnemonics in the mix of the generated programs, mostly valid */
+        kind = nextRandom(32);
+        if (kind < 14) strcpy(mnemonics[i], mnemonic_names[nextRandom(5)]);
+        else if (kind < 30) strcpy(mnemonics[i], mnemonic_names[5 + nextRandom(9)]);
+        else if (kind < 31) strcpy(mnemonics[i], mnemonic_names[14 + nextRandom(2)]);
+        else strcpy(mnemonics[i], "movv");
+
+        /* Lines of the preassembler, a macro use or an ordinary line */
+        if (nextRandom(4) == 0) sprintf(macro_lines[i], "m%ld\n", nextRandom(MICRO_MACROS));
+        else sprintf(macro_lines[i], "%s\n", lines[i] + strspn(lines[i], " \t"));
+    }
+}
+
+
+/* Current implementations */
+
+static unsigned long benchInsertBin(void){
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < MICRO_BATCH; i++) {
+        image[positions[i]] = 0;
+        insertBin(words[i], image, positions[i], MAX_LENGTH);
+        sum += (unsigned short)image[positions[i]];
+    }
+    return sum;
+}
+
+static unsigned long benchEncodeBase4(void){
+    char word[SIZE_OF_WORD + 1] = {'\0'}, address[SIZE_OF_ADDRESS + 1] = {'\0'};
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < MICRO_BATCH; i++) {
+        encodeBase4(encoding_table, addresses[i], address, SIZE_OF_ADDRESS);
+        encodeBase4(encoding_table, words[i], word, SIZE_OF_WORD);
+        sum += address[0] + word[SIZE_OF_WORD - 1];
+    }
+    return sum;
+}
+
+static unsigned long benchEncodeCounter(void){
+    char counter[SIZE_OF_ADDRESS + 1];
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < MICRO_BATCH; i++) {
+        encodeCounter(encoding_table, (unsigned int)positions[i], counter);
+        sum += counter[0];
+    }
+    return sum;
+}
+
+static unsigned long benchHash(void){
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < MICRO_BATCH; i++) sum += hash(names[i]);
+    return sum;
+}
+
+static unsigned long benchFindLabel(void){
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < MICRO_BATCH; i++) sum += findLabel(labels, names[i]);
+    return sum;
+}
+
+static unsigned long benchDeleteSpaces(void){
+    char buffer[MAX_LINE_LENGTH];
+    unsigned long sum = 0;
+    int i;
+
+    /* deleteSpaces trims in place, the copy is part of every call */
+    for (i = 0; i < MICRO_BATCH; i++) {
+        strcpy(buffer, lines[i]);
+        sum += deleteSpaces(buffer, NULL) - buffer;
+    }
+    return sum;
+}
+
+static unsigned long benchGetOpcode(void){
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < MICRO_BATCH; i++) sum += getOpcode(mnemonics[i]) + 1;
+    return sum;
+}
+
+static unsigned long benchLexLine(void){
+    static LineTokens tokens;
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < MICRO_BATCH; i++) sum += lexLine(lines[i], &tokens);
+    return sum;
+}
+
+static unsigned long benchPlanTokens(void){
+    static LineTokens tokens;
+    LinePlan plan;
+    unsigned long sum = 0;
+    int i;
+
+    /* Lexed and checked silently, as the parallel encoder measures a line */
+    for (i = 0; i < MICRO_BATCH; i++) {
+        lexLine(lines[i], &tokens);
+        if (planTokens(&tokens, labels, &plan, 0)) sum += plan.words[0];
+    }
+    return sum;
+}
+
+static unsigned long benchFindAndReplaceMacro(void){
+    unsigned long sum = 0;
+    int i;
+
+    rewind(macro_sink);
+    for (i = 0; i < MICRO_BATCH; i++) sum += findAndReplaceMacro(&macros, macro_lines[i], NULL, macro_sink);
+    return sum;
+}
+
+
+/* Replacement candidates, compared with the kernel named as their baseline */
+
+static unsigned long benchInsertBinMask(void){
+    unsigned long sum = 0;
+    int i;
+
+    /* The low SIZE_OF_BITS bits in one operation instead of bit by bit */
+    for (i = 0; i < MICRO_BATCH; i++) {
+        image[positions[i]] = 0;
+        image[positions[i]] |= (signed short)((unsigned short)words[i] & ((1 << SIZE_OF_BITS) - 1));
+        sum += (unsigned short)image[positions[i]];
+    }
+    return sum;
+}
+
+static unsigned long benchGetOpcodeSwitch(void){
+    unsigned long sum = 0;
+    const char *m;
+    int i, opcode;
+
+    /* One comparison after dispatching on the first character */
+    for (i = 0; i < MICRO_BATCH; i++) {
+        m = mnemonics[i];
+        switch (m[0]) {
+            case 'm': opcode = strcmp(m, "mov") == 0 ? 0 : -1; break;
+            case 'c': opcode = strcmp(m, "cmp") == 0 ? 1 : strcmp(m, "clr") == 0 ? 5 : -1; break;
+            case 'a': opcode = strcmp(m, "add") == 0 ? 2 : -1; break;
+            case 's': opcode = strcmp(m, "sub") == 0 ? 3 : strcmp(m, "stop") == 0 ? 15 : -1; break;
+            case 'l': opcode = strcmp(m, "lea") == 0 ? 4 : -1; break;
+            case 'n': opcode = strcmp(m, "not") == 0 ? 6 : -1; break;
+            case 'i': opcode = strcmp(m, "inc") == 0 ? 7 : -1; break;
+            case 'd': opcode = strcmp(m, "dec") == 0 ? 8 : -1; break;
+            case 'j': opcode = strcmp(m, "jmp") == 0 ? 9 : strcmp(m, "jsr") == 0 ? 11 : -1; break;
+            case 'b': opcode = strcmp(m, "bne") == 0 ? 10 : -1; break;
+            case 'r': opcode = strcmp(m, "red") == 0 ? 12 : strcmp(m, "rts") == 0 ? 14 : -1; break;
+            case 'p': opcode = strcmp(m, "prn") == 0 ? 13 : -1; break;
+            default: opcode = -1;
+        }
+        sum += opcode + 1;
+    }
+    return sum;
+}
+
+
+static const MicroKernel kernels[] = {
+    {"insertBin", NULL, benchInsertBin},
+    {"encodeBase4", NULL, benchEncodeBase4},
+    {"encodeCounter", NULL, benchEncodeCounter},
+    {"hash", NULL, benchHash},
+    {"findLabel", NULL, benchFindLabel},
+    {"deleteSpaces", NULL, benchDeleteSpaces},
+    {"getOpcode", NULL, benchGetOpcode},
+    {"lexLine", NULL, benchLexLine},
+    {"planTokens", NULL, benchPlanTokens},
+    {"findAndReplaceMacro", NULL, benchFindAndReplaceMacro},
+    {"insertBin/mask", "insertBin", benchInsertBinMask},
+    {"getOpcode/switch", "getOpcode", benchGetOpcodeSwitch}
+};
+
+#define NUM_KERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+
+/*******************************************************************************
+ * Returns the current time of the monotonic clock in nanoseconds.
+ ******************************************************************************/
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static int compareDoubles(const void* a, const void* b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+
+/*******************************************************************************
+ * Runs a kernel and computes its percentiles.
+ *
+ * Parameters:
+ * - kernel: The kernel to run.
+ * - warmup: Untimed batches before the measurement.
+ * - samples: Scratch array for reps samples.
+ * - reps: Timed batches.
+ * - result: Receives the percentiles and the checksum.
+ ******************************************************************************/
+static void runKernel(const MicroKernel* kernel, int warmup, double samples[], int reps, MicroResult* result){
+    double start, sum = 0;
+    int i;
+
+    result->checksum = kernel->batch();
+    for (i = 0; i < warmup; i++) kernel->batch();
+    for (i = 0; i < reps; i++) {
+        start = now();
+        kernel->batch();
+        samples[i] = (now() - start) / MICRO_BATCH;
+        sum += samples[i];
+    }
+
+    qsort(samples, reps, sizeof(double), compareDoubles);
+    result->min = samples[0];
+    result->p50 = samples[(reps - 1) * 50 / 100];
+    result->p90 = samples[(reps - 1) * 90 / 100];
+    result->p99 = samples[(reps - 1) * 99 / 100];
+    result->max = samples[reps - 1];
+    result->mean = sum / reps;
+}
+
+
+/*******************************************************************************
+ * Returns the index of the kernel with the given name, or -1.
+ ******************************************************************************/
+static int findKernel(const char* name){
+    int i;
+
+    for (i = 0; i < NUM_KERNELS; i++) {
+        if (strcmp(kernels[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+
+int main(int argc, char** argv){
+    MicroResult results[NUM_KERNELS];
+    int ran[NUM_KERNELS] = {0};
+    int reps = 200, warmup = 20, failed = 0, first = 1, i, base;
+    char *filter = NULL, *json_name = NULL;
+    double *samples;
+    FILE *json = stdout;
+
+    for (i = 1; i < argc; i++) {
+        if (i + 1 >= argc) break;
+        if (strcmp(argv[i], "--reps") == 0) reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--warmup") == 0) warmup = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--filter") == 0) filter = argv[++i];
+        else if (strcmp(argv[i], "--json") == 0) json_name = argv[++i];
+        else break;
+    }
+    if (i < argc || reps < 1 || warmup < 0) {
+        fprintf(stderr, "Usage: micro_bench [--reps <n>] [--warmup <n>] [--filter <text>] [--json <file>]\n");
+        return 1;
+    }
+    if (json_name && !(json = fopen(json_name, "w"))) {
+        fprintf(stderr, "Error: Could not open %s\n", json_name);
+        return 1;
+    }
+    samples = (double*)memAlloc(MEM_OTHER, reps * sizeof(double));
+    if (!samples) {
+        fprintf(stderr, "Error: Failed to allocate memory for the samples\n");
+        exit(1);
+    }
+
+    setupInputs();
+
+    /* The table goes to stderr when the JSON report takes stdout */
+    fprintf(json_name ? stdout : stderr, "%-22s %9s %9s %9s %9s %9s %9s %8s\n",
+            "kernel (ns/call)", "min", "p50", "p90", "p99", "max", "mean", "speedup");
+    fprintf(json, "{\n  \"batch\": %d,\n  \"warmup\": %d,\n  \"reps\": %d,\n  \"kernels\": [", MICRO_BATCH, warmup, reps);
+
+    for (i = 0; i < NUM_KERNELS; i++) {
+        if (filter && !strstr(kernels[i].name, filter)) continue;
+
+        /* A candidate runs after its baseline, which is run even if filtered out */
+        base = kernels[i].baseline ? findKernel(kernels[i].baseline) : -1;
+        if (base >= 0 && !ran[base]) {
+            runKernel(&kernels[base], warmup, samples, reps, &results[base]);
+            ran[base] = 1;
+        }
+        runKernel(&kernels[i], warmup, samples, reps, &results[i]);
+        ran[i] = 1;
+
+        fprintf(json_name ? stdout : stderr, "%-22s %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f",
+                kernels[i].name, results[i].min, results[i].p50, results[i].p90, results[i].p99,
+                results[i].max, results[i].mean);
+        fprintf(json, "%s\n    {\"name\": \"%s\", ", first ? "" : ",", kernels[i].name);
+        first = 0;
+        if (base >= 0) {
+            fprintf(json_name ? stdout : stderr, " %7.2fx%s\n", results[base].p50 / results[i].p50,
+                    results[i].checksum != results[base].checksum ? "  MISMATCH" : "");
+            fprintf(json, "\"baseline\": \"%s\", \"speedup_p50\": %.3f, \"matches_baseline\": %s, ",
+                    kernels[base].name, results[base].p50 / results[i].p50,
+                    results[i].checksum == results[base].checksum ? "true" : "false");
+            if (results[i].checksum != results[base].checksum) failed = 1;
+        } else {
+            fprintf(json_name ? stdout : stderr, "\n");
+            fprintf(json, "\"baseline\": null, ");
+        }
+        fprintf(json, "\"ns_per_call\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f, \"mean\": %.3f}}",
+                results[i].min, results[i].p50, results[i].p90, results[i].p99, results[i].max, results[i].mean);
+    }
+    fprintf(json, "\n  ]\n}\n");
+
+    if (json_name) fclose(json);
+    fclose(macro_sink);
+    freeMacroList(&macros);
+    freeLabelTable(labels);
+    memFree(samples);
+    return failed;
+}
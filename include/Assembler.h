@@ -24,6 +24,111 @@
 #define OBJECT_EXT ".ob"
 #define ENTRY_EXT ".ent"
 #define EXTERN_EXT ".ext"
+#define RELOCATION_EXT ".rel"
+#define PARALLEL_MIN_CHUNK_LINES 16
+#define MAX_THREADS 64
+#define INCLUDE_DIRECTIVE ".include"
+#define MAX_INCLUDE_DEPTH 16
+#define MACRO_CACHE_MAGIC "MCCH"
+#define MACRO_CACHE_VERSION 1
+#define MACRO_CACHE_HEADER_SIZE 16
+#define SCAN_CAPACITY 128
+#define SCAN_WORDS (SCAN_CAPACITY / 32)
+#define SCAN_BLANK 0
+#define SCAN_SPACE 1
+#define SCAN_COMMA 2
+#define SCAN_COLON 3
+#define SCAN_OPEN 4
+#define SCAN_CLOSE 5
+#define SCAN_QUOTE 6
+#define SCAN_SEMICOLON 7
+#define SCAN_CUT 8
+#define SCAN_CLASSES 9
+#define LABEL_OK 0
+#define LABEL_SPACE 1
+#define LABEL_TOO_LONG 2
+#define LABEL_FIRST_CHAR 3
+#define LABEL_EXTRA_TEXT 4
+#define LABEL_RESERVED 5
+#define LABEL_REGISTER 6
+#define LABEL_INSTRUCTION 7
+#define MAX_LINE_TOKENS MAX_LINE_LENGTH
+#define TOKEN_LABEL_DEF 0
+#define TOKEN_MNEMONIC 1
+#define TOKEN_DIRECTIVE 2
+#define TOKEN_REGISTER 3
+#define TOKEN_IMMEDIATE 4
+#define TOKEN_MATRIX 5
+#define TOKEN_IDENT 6
+#define TOKEN_STRING 7
+#define TOKEN_NUMBER 8
+#define TOKEN_DIMENSION 9
+#define TOKEN_COMMA 10
+#define TOKEN_INVALID 11
+#define DIRECTIVE_DATA 0
+#define DIRECTIVE_STRING 1
+#define DIRECTIVE_MAT 2
+#define DIRECTIVE_ENTRY 3
+#define DIRECTIVE_EXTERN 4
+#define STATS_TEXT 1
+#define STATS_JSON 2
+#define STATS_PREASM 0
+#define STATS_FIRST_PASS 1
+#define STATS_SECOND_PASS 2
+#define STATS_OUTPUT 3
+#define STATS_PHASES 4
+#define STATS_AM 0
+#define STATS_OB 1
+#define STATS_ENT 2
+#define STATS_EXT 3
+#define STATS_OUTPUTS 4
+#define STATS_CHAINS 5
+#define MEM_LABELS 0
+#define MEM_REFERENCES 1
+#define MEM_MACROS 2
+#define MEM_LINES 3
+#define MEM_FILE_NAMES 4
+#define MEM_OUTPUT 5
+#define MEM_DIAGNOSTICS 6
+#define MEM_OTHER 7
+#define MEM_SUBSYSTEMS 8
+#define DIAG_FILE 0
+#define DIAG_MACRO 1
+#define DIAG_INCLUDE 2
+#define DIAG_SYNTAX 3
+#define DIAG_LABEL 4
+#define DIAG_ENTRY 5
+#define DIAG_INSTRUCTION 6
+#define DIAG_OPERAND 7
+#define DIAG_DATA 8
+#define DIAG_MATRIX 9
+#define DIAG_UNUSED_LABEL 10
+#define DIAG_CODES 11
+#define TRACE_SPAN 'X'
+#define TRACE_COUNTER 'C'
+#define TRACE_ARGS 4
+#define TRACE_PREASM 0
+#define TRACE_FIRST_PASS 1
+#define TRACE_SECOND_PASS 2
+#define XREF_EXT ".xref"
+#define XREF_TEXT_EXT ".xref.txt"
+#define XREF_MAGIC "XREF"
+#define XREF_VERSION 1
+#define XREF_HEADER_SIZE 16
+#define XREF_SYMBOL_SIZE 24
+#define XREF_USE_SIZE 8
+#define XREF_BINARY 1
+#define XREF_TEXT 2
+#define XREF_EXTERN 1
+#define XREF_ENTRY 2
+#define XREF_MATRIX 4
+#define XREF_MACRO 8
+#define OBJECT_BASE 100
+#define OBJECT_MEMORY 256
+#define OBJECT_MAX_WORDS (2 * MAX_LENGTH)
+#define DISASSEMBLY_EXT ".dis.as"
+#define SIM_MAX_STEPS 100000000L
+#define SIM_STACK_DEPTH 256
 
 
 /*macro structs:dynamic array*/
@@ -41,8 +146,32 @@ typedef struct Macro{
 typedef struct MacroList{
     Macro *head; /* Pointer to the first macro in the list*/
     Macro *tail; /* Pointer to the last macro in the list*/
+    struct MacroList *parent; /* Fallback list searched after this one (preloaded library) */
 } MacroList;
 
+/*Include structs: process wide cache of mapped files*/
+typedef struct IncludeFile{
+    char *path; /* Path the file was first included by */
+    unsigned long device; /* Device of the file, the cache key with its inode */
+    unsigned long inode; /* Inode of the file, so every path to it finds the same entry */
+    char *buffer; /* Mapped contents of the file */
+    size_t size; /* Size of the mapped contents */
+    struct IncludeFile *next; /* next pointer*/
+} IncludeFile;
+
+/*PreAssembler state of one translation unit*/
+typedef struct PreAssemblerState{
+    MacroList macroList; /* Macros defined in this translation unit */
+    char macro_name[MAX_LINE_LENGTH]; /* Name of the macro being defined */
+    int inside_macro; /* Flag detecting inside macro */
+    FILE *am_file; /* The .am output file */
+    IncludeFile **included; /* Files already included, for the include guard */
+    int num_included; /* Number of included files */
+    int depth; /* Current include nesting depth */
+    char *source; /* Included file being expanded, NULL for the file itself */
+    int include_line; /* Line of the outermost .include being expanded */
+} PreAssemblerState;
+
 /*Label structs: hash table*/
 typedef struct reference {
     unsigned short pos;
@@ -56,24 +185,230 @@ typedef struct Label{
     unsigned short address;
     Reference* ref;
     unsigned int dc;
+    unsigned int hash_value; /* Hash of the name, kept for the frozen index */
+    int line; /* Line of the definition in the .am file, 0 if unknown */
     struct Label* next;
 } Label;
 typedef struct LabelTable {
     int table_size;
     int num_labels;
     Label** Labels; 
+    Label** frozen; /* Open addressing index built by freezeLabelTable, NULL while labels are added */
+    unsigned int frozen_mask; /* Size of the frozen index minus one */
 } LabelTable;
 
+/*Object programs: the image and symbols read back from the output files*/
+typedef struct ObjectSymbol {
+    char name[MAX_LABEL + 1]; /* Name of the symbol */
+    unsigned short address; /* Address of an entry, or of a use of an extern */
+} ObjectSymbol;
+typedef struct ObjectImage {
+    short words[OBJECT_BASE + OBJECT_MAX_WORDS]; /* The 10 bit words at their addresses, 0 outside the image */
+    int ICF; /* Code words, from OBJECT_BASE */
+    int DCF; /* Data words, after the code */
+    ObjectSymbol *entries; /* Symbols of the .ent file */
+    int num_entries; /* Number of entries */
+    ObjectSymbol *externs; /* Uses of the .ext file */
+    int num_externs; /* Number of extern uses */
+} ObjectImage;
+typedef struct ObjectOperand {
+    int mode; /* IMMEDIATE, LABEL, MATRIX or REGISTER */
+    int value; /* Immediate value, label address or register number */
+    int are; /* A,R,E bits of the word: 0 absolute, 1 external, 2 relocatable */
+    int row, col; /* Registers indexing a matrix */
+    int word; /* Address of the first word of the operand */
+} ObjectOperand;
+typedef struct ObjectInstruction {
+    int opcode; /* The opcode, 0 (mov) to 15 (stop) */
+    int length; /* Words of the instruction */
+    int num_operands; /* Number of operands */
+    ObjectOperand operands[2]; /* The operands in source order */
+} ObjectInstruction;
+
+/*Line scan: class bitmaps of a string*/
+typedef struct LineScan {
+    const char *text; /* The scanned string */
+    int length; /* Length of the string, -1 if it did not fit */
+    unsigned long bits[SCAN_CLASSES][SCAN_WORDS]; /* Positions of each SCAN_* class, 32 per word */
+} LineScan;
+
+/*Lexer structs: typed tokens of a line*/
+typedef struct Token {
+    int type; /* One of the TOKEN_* types */
+    const char *start; /* First character of the token inside the line */
+    int length; /* Length of the token, a label definition without its colon */
+    int value; /* Number, register, opcode, DIRECTIVE_* kind, first register of a matrix, or lexer state an invalid token failed in */
+    int value2; /* Second register of a matrix reference, or where an invalid token failed */
+} Token;
+
+typedef struct LineTokens {
+    Token tokens[MAX_LINE_TOKENS]; /* Tokens in line order */
+    int count; /* Number of tokens */
+} LineTokens;
+
+typedef struct LinePlan {
+    Label *def; /* Label defined by the line, NULL if none */
+    Token *op; /* The mnemonic or directive token */
+    int num_operands; /* Operands of an instruction */
+    Token *operands[2]; /* Operand tokens of an instruction, the string of .string */
+    int modes[2]; /* Addressing mode of every operand */
+    Label *labels[2]; /* Labels of label and matrix operands, the label of .entry */
+    int values[MAX_LINE_TOKENS]; /* Values of .data and .mat */
+    int count; /* Number of values */
+    int words[2]; /* Code and data words of the line */
+} LinePlan;
+
+/*Parallel encoding structs*/
+typedef struct Fixup {
+    Label *label; /* The referenced label */
+    unsigned short pos; /* Position of the reference in the code image */
+    int entry; /* 1 for an entry mark, 0 for a reference */
+} Fixup;
+
+typedef struct FixupLog {
+    Fixup *fixups; /* Dynamic array of deferred fixups */
+    int size; /* Number of fixups stored */
+    int capacity; /* Current capacity of the array */
+} FixupLog;
+
+typedef struct EncodeChunk {
+    char *lines; /* First line of the chunk, lines are MAX_LINE_LENGTH apart */
+    int first_line; /* Line number of the first line */
+    int num_lines; /* Number of lines in the chunk */
+    int measured; /* 1 if every line of the chunk could be measured */
+    int size[2]; /* Code and data words of the chunk */
+    int PC[2]; /* Base counters of the chunk, advanced while encoding */
+    int Error; /* Error flag of the chunk */
+    FixupLog log; /* References and entry marks, merged after encoding */
+} EncodeChunk;
+
+typedef struct ThreadTask {
+    void* (*body)(void*); /* The thread body */
+    const char *name; /* Name of the work in the trace */
+    void *shared; /* Work shared by all threads */
+    int first; /* First item handled by this thread */
+    int step; /* Distance between items handled by this thread */
+} ThreadTask;
+
+/*Output files: written to disk, or buffered as a record of the framed output stream*/
+typedef struct OutputFile {
+    char *name; /* Name of the output file, also the name of its record */
+    FILE *file; /* The opened file, NULL for a record */
+    char *data; /* Buffered contents of a record */
+    size_t size; /* Number of bytes in data */
+    size_t capacity; /* Current capacity of data */
+} OutputFile;
+
+/*Statistics of one file, or of the whole batch*/
+typedef struct FileStats {
+    char *file_name; /* The file being assembled, NULL for the aggregate */
+    double phase_start[STATS_PHASES]; /* Clock time each STATS_* phase started, 0 if it did not run */
+    double phase_time[STATS_PHASES]; /* Seconds spent in each STATS_* phase */
+    long source_lines; /* Lines of the source before macro expansion */
+    long am_lines; /* Lines of the .am file */
+    long macro_expansions; /* Macro uses replaced by their bodies */
+    long labels; /* Labels in the table */
+    long table_size; /* Buckets of the label table */
+    long chains[STATS_CHAINS]; /* Buckets by chain length, the last one counts longer chains too */
+    long resizes; /* Label table resize events */
+    long references; /* Label references in the code */
+    long IC; /* Final instruction counter */
+    long DC; /* Final data counter */
+    long output_bytes[STATS_OUTPUTS]; /* Bytes of the .am, .ob, .ent and .ext files */
+    long allocations; /* Calls to malloc, calloc and realloc */
+    int files; /* Files counted, for the aggregate */
+    int failed; /* Files that failed to assemble */
+} FileStats;
+
+/*Trace event, a span or a counter sample of the Chrome trace*/
+typedef struct TraceEvent {
+    char phase; /* TRACE_SPAN or TRACE_COUNTER */
+    const char *name; /* Name of the event */
+    const char *file; /* Source file of the event, NULL for none */
+    double start; /* Clock time of the start */
+    double duration; /* Duration of a span in seconds */
+    const char *arg_names[TRACE_ARGS]; /* Names of the numeric arguments */
+    long args[TRACE_ARGS]; /* The numeric arguments */
+    int num_args; /* Number of arguments */
+} TraceEvent;
+
+/*Command line options*/
+typedef struct AssemblerOptions {
+    char *macro_cache; /* --macros: precompiled macro library to preload */
+    char *compile_source; /* --compile-macros: macro library source to compile */
+    char *compile_target; /* --compile-macros: cache file to write */
+    int keep_am; /* --keep-am (default) / --no-am: keep the expanded .am file */
+    int threads; /* --threads: worker threads for large files */
+    int chunk_lines; /* --chunk-lines: lines per parallel chunk, 0 to split the lines among the threads */
+    int stream; /* --stream: assemble line by line in memory independent of the file size */
+    char *output; /* -o: framed output stream, "-" for stdout */
+    FILE *output_stream; /* The opened framed output stream, NULL to write sibling files */
+    char *output_dir; /* --output-dir: directory for the output files */
+    int async_io; /* --async-io: I/O threads prefetching sources and writing outputs, 0 for none */
+    int stats; /* --stats / --stats-json: STATS_TEXT or STATS_JSON report, 0 for none */
+    char *stats_file; /* --stats-json: file of the JSON report, - for stderr */
+    char *trace; /* --trace: file of the Chrome trace events, NULL for none */
+    int mem_report; /* --mem-report: print the allocations of every subsystem */
+    int max_errors; /* --max-errors / --fail-fast: error lines that stop a file, 0 for no limit */
+    int diag_json; /* --diagnostics-json: print the diagnostics as JSON lines */
+    int check; /* --check: report the diagnostics only, without encoding or writing anything */
+    int lsp; /* --lsp: serve the language server protocol on stdin and stdout */
+    int xref; /* --xref / --xref-text: XREF_BINARY or XREF_TEXT cross-reference index, 0 for none */
+    int run; /* --run: simulate the object programs named by the files instead of assembling */
+    long max_steps; /* --max-steps: instructions a simulated program may execute */
+    int dump; /* --dump: print the registers and memory of a simulated program when it halts */
+    int disassemble; /* --disassemble / --verify: write the object programs named by the files back as source */
+    int verify; /* --verify: also assemble the disassembly again and compare the words */
+    char *link; /* --link <name>: link the object modules named by the files into this program, NULL for none */
+    int relocatable; /* --relocatable: write base-relative object files and their .rel relocation lists */
+    int load_base; /* Address of the first word of a program: OBJECT_BASE, 0 with --relocatable */
+    int image_words; /* Size of the Code and Data arrays, MAX_LENGTH except in the benchmarks */
+    char **files; /* Source files to assemble */
+    int num_files; /* Number of source files */
+} AssemblerOptions;
+
+extern AssemblerOptions Options;
+extern FileStats Stats;
+
 /*Assembler Functions Prototypes*/
 FILE* PreAssembler(char* file_name);
+int PreProcessLine(PreAssemblerState* state, char* source_line, int counter, char* file_name);
+FILE* openAmFile(char* file_name);
+FILE* rewindAmFile(FILE* am_file);
+void closeAmFile(FILE* am_file);
+char* readSourceFile(FILE* source_file, size_t* size);
+int nextSourceLine(const char* source, size_t size, size_t* pos, char line[]);
+int sourceNeedsMacroPass(const char* source, size_t size, int* canonical);
+int copySourceFile(FILE* source_file, FILE* am_file, size_t size);
 LabelTable* FirstPass(FILE *amFile, int *errorFlag);
+void ProcessFirstPassLine(char *line, LabelTable *table, int lineCount, int *errorFlag);
 void SecondPass(FILE* am_file, LabelTable* table, signed short Code[], signed short Data[], int PC[], int* Error);
+void ParallelSecondPass(FILE* am_file, LabelTable* table, signed short Code[], signed short Data[], int PC[], int* Error);
+int measureLine(char* source_line, LabelTable* table, int sizes[]);
+int deferFixup(Label* label, unsigned short pos, int entry);
+void ParallelFirstPass(FILE* am_file, LabelTable* table, int* errorFlag);
+char* readLines(FILE* file, int* num_lines);
+int chunkLines(int num_lines, int num_threads);
+void runParallel(void* (*body)(void*), const char* name, void* shared, int num_threads);
 
 
 /* File Writing Functions */
 char* changeFileNameExtension(char* file_name,char* extension);
+char* outputFileName(char* file_name, char* extension);
+OutputFile* openOutputFile(char* file_name, char* extension);
+void writeOutput(OutputFile* out, const char* bytes, size_t len);
+void closeOutputFile(OutputFile* out);
+void writeOutputRecord(char* name, FILE* file);
+void writeOutputFile(OutputFile* out);
+
+/* Asynchronous I/O Functions */
+void startAsyncIO(int num_threads);
+char* takePrefetchedSource(char* file_name, size_t* size);
+void submitOutputFile(OutputFile* out);
+void finishAsyncIO(void);
 void Write_object_file(signed short Code[], signed short Data[], int counter[], char *file_name);
 void Write_extern_entry_files(LabelTable* Labels, char* file_name);
+void Write_relocation_file(signed short Code[], int counter[], char *file_name);
 void get_word(char encoding_table[], signed short x, char* word);
 void get_address(char encoding_table[], unsigned int x, char* address);
 void encodeBase4(char encoding_table[], unsigned int x, char *buffer, int len);
@@ -83,69 +418,154 @@ void encodeCounter(const char encoding_table[], unsigned int x, char *buf);
 void initMacroList(MacroList* list);
 void initLinesArray(LinesArray* array);
 Macro *createMacro(const char *macro_name);
-char* getMacroName(char* line, int* counter);
+char* getMacroName(char* line, LineScan* scan, int* counter);
 void insertMacroName(MacroList* list, const char* macro_name);
 void addMacroToList(MacroList* list, Macro* macro);
 void insertMacroLine(MacroList* list, char* line, const char* macro_name);
 void addLineToArray(LinesArray* array, char* line);
-int findAndReplaceMacro(MacroList* list, char* line, FILE* am_file);
+int findAndReplaceMacro(MacroList* list, char* line, const LineScan* scan, FILE* am_file);
 void resizeLinesArray(LinesArray* array);
 void freeMacroList(MacroList* list);
 void freeMacro(Macro* macro);
 void freeLinesArray(LinesArray* array);
 
+/* Macro Cache Functions Prototypes */
+int CompileMacroLibrary(char* source_name, char* cache_name);
+int readMacroDefinitions(FILE* source_file, MacroList* list);
+int writeMacroCache(MacroList* list, char* cache_name);
+int loadMacroCache(char* cache_name);
+MacroList* getMacroLibrary(void);
+void freeMacroLibrary(void);
+unsigned long cacheHash(const unsigned char* data, unsigned long len);
+void putWord32(unsigned char* buffer, unsigned long x);
+unsigned long getWord32(const unsigned char* buffer);
+
+/* Include Functions Prototypes */
+int isIncludeDirective(char* line);
+int ProcessIncludeLine(PreAssemblerState* state, char* line, LineScan* scan, int counter, char* file_name);
+char* resolveIncludePath(char* including_file, char* include_name);
+IncludeFile* getIncludeFile(char* path);
+IncludeFile* loadIncludeFile(char* path);
+int markIncluded(PreAssemblerState* state, IncludeFile* file);
+void freeIncludeCache(void);
+
+/* Scan Functions Prototypes */
+int scanString(const char* str, LineScan* scan);
+int scanStringScalar(const char* str, LineScan* scan);
+int scanFirst(const LineScan* scan, int cls, int from, int to);
+int scanFirstNot(const LineScan* scan, int cls, int from, int to);
+int scanLastNot(const LineScan* scan, int cls, int from, int to);
+int scanSpan(const LineScan* scan, const char* str, int* end);
+void scanCut(LineScan* scan, char* at);
+int hasBlank(const char* str, const LineScan* scan);
+
+/* Lexer Functions Prototypes */
+int lexLine(const char* line, LineTokens* tokens);
+int planTokens(LineTokens* tokens, LabelTable* table, LinePlan* plan, int line_count);
+int EncodeTokens(LineTokens* tokens, LabelTable* table, signed short Code[], signed short Data[], int PC[], int line_count);
+
+/* Memory Functions Prototypes */
+void* memAlloc(int subsystem, size_t size);
+void* memCalloc(int subsystem, size_t count, size_t size);
+void* memRealloc(int subsystem, void* ptr, size_t size);
+void memFree(void* ptr);
+void memBeginFile(void);
+long memFileAllocations(void);
+void memEndFile(char* file_name);
+void memReport(void);
+
+/* Stats Functions Prototypes */
+void statsAdd(long* counter, long n);
+double statsClock(void);
+void statsBeginFile(char* file_name);
+void statsOutputBytes(const char* name, long bytes);
+void statsEndFile(char* file_name, LabelTable* table, int PC[], int failed);
+void statsReport(void);
+
+/* Diagnostic Functions Prototypes */
+void diagSetSource(const char* included, int line);
+void diagnose(int line, int code, const char* format, ...);
+int diagCount(void);
+void diagDiscard(int mark);
+void diagFlush(char* file_name, int failed, int error_lines);
+void diagDrain(void (*sink)(void* context, int line, int code, const char* message), void* context);
+int diagIsWarning(int code);
+const char* diagCodeName(int code);
+
+/* Cross-Reference Functions Prototypes */
+void xrefMacro(const char* name, int line, int definition);
+void xrefLine(int line, int IC);
+void xrefEndFile(LabelTable* table, char* file_name, int failed);
+
+/* Object Functions Prototypes */
+long decodeBase4(const char* digits, int len);
+int loadObject(char* name, ObjectImage* image);
+void freeObject(ObjectImage* image);
+const char* decodeObjectInstruction(const short words[], int pc, int end, ObjectInstruction* ins);
+
+/* Disassembler Functions Prototypes */
+int disassemble(char* name);
+
+/* Linker Functions Prototypes */
+int linkObjects(char* name, char** names, int num_modules);
+
+/* Simulator Functions Prototypes */
+int simulate(char* name);
+
+/* Language Server Functions Prototypes */
+int lspServe(FILE* in, FILE* out);
+
+/* Trace Functions Prototypes */
+void traceStart(void);
+void traceThreadName(const char* name);
+void traceEvent(char phase, const char* name, const char* file, double start, double duration,
+                const char** arg_names, const long* args, int num_args);
+void traceWrite(void);
+
+/* Options Functions Prototypes */
+int parseOptions(int argc, char** argv, AssemblerOptions* options);
+void freeOptions(AssemblerOptions* options);
+int errorLimitReached(int errors);
+
 /* Label Functions Prototypes */
-void ProcessLabelDefinition(char *line, LabelTable *table, int lineCount, int *errorFlag);
-void ProcessExternDefinition(char* line, LabelTable* table, int lineCount, int* errorFlag);
+void ProcessLabelDefinition(char *line, LineScan* scan, LabelTable *table, int lineCount, int *errorFlag);
+void ProcessExternDefinition(char* line, LineScan* scan, LabelTable* table, int lineCount, int* errorFlag);
 LabelTable* create_LabelTable(int size);
 void CheckAndResizeTable(LabelTable* table);
 void resizeLabelTable(LabelTable* table);
 Label *createLabel(char *name, int ext, int mat);
 unsigned int hash(char* str);
-void addLabel(LabelTable* table, char* name, int ext , int mat, int *Label_error);
+unsigned int hashSpan(const char* str, int len);
+Label *addLabel(LabelTable* table, char* name, int ext , int mat, int *Label_error);
+void insertLabel(LabelTable* table, Label* label);
 short int findLabel(LabelTable* table, char* name);
-Label *UpdateAddressAndGetLabel(char *label_name, LabelTable *table, int PC[]);
+Label *getLabel(LabelTable* table, char* name);
+Label *getLabelSpan(LabelTable* table, const char* name, int len);
+void freezeLabelTable(LabelTable* table);
 void reallocateLabels(LabelTable* table, signed short Code[], int IC);
 void freeLabelTable(LabelTable* table);
 
 
 /* Instructions Encoding Functions Prototypes */
-void EncodeInstruction(char *line, LabelTable *table, signed short Code[], int PC[], int line_count, int *Error);
 int getNumOperand(int opcode);
-void EncodeOperands(int numOprnd, char* line, LabelTable *table, signed short Code[], int opcode, int PC[], int line_count, int *Encoding_Error);
-void encodeImmediate(char *operand, signed short Code[], int IC, int *word_count);
-int encodeLabelOperand(char *operand, LabelTable *table, signed short Code[], int IC, int *word_count);
-int encodeMatrixOperand(char *matrix, LabelTable* table, signed short Code[], int IC, int* word_count, int line_count);
-int encodeRegisterOperand(char *operand, signed short Code[], int i, int numOprnd, int opcode, int IC, int *is_reg, int *word_count);
+int operandAllowed(int mode, int i, int numOprnd, int opcode);
+int instructionWords(int numOprnd, const int modes[]);
+void encodeInstructionWords(int opcode, int numOprnd, const int modes[], Token* operands[], Label* labels[], signed short Code[], int IC);
 int getOpcode(char *inst);
-void insertBin(signed short x, signed short Code[], int count);
+void insertBin(signed short x, signed short Code[], int count, int size);
 void saveRef(Label *label, unsigned short address);
-int getAddressingMode(char* operand, LabelTable* table);
 
 
 /* Directive Processing Functions Prototypes */
-void ProcessDirectives(char *line, LabelTable *table, signed short Data[], Label *tmp_label, int *is_label, int PC[], int line_count, int *Error);
-void ProcessEntryLine(char* line, LabelTable* table, int line_count, int* Error);
-void EncodeDataLine(char *line, signed short Data[], int PC[], int line_count, int *Error);
-void EncodeStringLine(char *line, signed short Data[], int PC[], int line_count, int *Error);
-int EncodeMatrixLine(char *line, signed short Data[], int PC[], int line_count, int *Error);
+void markEntry(Label* label);
+void encodeDataWords(const int values[], int count, signed short Data[], int DC);
+int encodeStringWords(const char* text, signed short Data[], int DC);
 
 
 /* Validation Functions Prototypes */
 int IsValidMacroName(char* macro_name, int* counter);
-int validLabel(char *label_name, int line_count);
-int IsValidInstSyntax(char *line, int numOprnd, int line_count);
-int IsValidImmUse(int i, int opcode, int numOprnd , int line_count);
-int isValidImmediate(char *operand, int line_count);
-int isValidNum(char *num);
-int isValidReg(char *operand, int line_count);
-int IsValidRegUse(char *operand, int i, int numOprnd, int opcode, int line_count);
-int isLegalBrackets(char *operand);
-int ValidateAndParseMatrixOperand(char* operand, LabelTable *table, unsigned short regs[], char mat_name[], int line_count);
-int IsValidDataSyntax(char *dataLine, int line_count);
-int hasDoubleCommas(const char* line);
-int IsValidDataParam(char *param, int line_count);
-int IsValidString(char *string, int line_count);
+int checkLabelName(char *label_name, const LineScan* scan);
+int validLabel(char *label_name, const LineScan* scan, int line_count);
 
 
 
@@ -155,10 +575,36 @@ void ProcessLine(char* source_line, LabelTable* table, signed short Code[], sign
 int isEmptyOrComment(char* line);
 int startsWith(char* line, char* word, int num);
 int IsLabelDefinition(char *line);
-int IsInstructionLine(char *line);
-int IsDataDirective(char *line);
 int IsMatrixDirective(char *line);
-int IsStringDirective(char *line);
-int IsEntryDirective(char *line, int *is_label, int line_count);
 int isExtern(char *line);
-char* deleteSpaces(char *str);
\ No newline at end of file
+char* deleteSpaces(char *str, LineScan* scan);
+char* deleteLineEnd(char *str, LineScan* scan);
+char* nextToken(char* str, const char* delim, char** save);
+char* splitLabelDefinition(char* line, LineScan* scan, char** rest);
+
+
+/*
+ * Static tracepoints for perf and bpftrace, in the "assembler" provider.
+ * Built with make USDT=1 they are USDT probes from sys/sdt.h, a single nop
+ * each until a tracer attaches; otherwise they compile to nothing and
+ * their arguments are never evaluated.
+ *   file__start(file, index)            file__end(file, failed, IC, DC)
+ *   preasm__start(file)                 preasm__end(file, source_lines, ok)
+ *   pass1__start(file)                  pass1__end(file, labels, error)
+ *   pass2__start(file)                  pass2__end(file, IC, DC, error)
+ *   macro__expand(macro, lines)         table__resize(old_size, new_size, labels)
+ *   diagnostic(file, line, TRACE_* pass)
+ *   output__flush(name, bytes)
+ */
+#ifdef ASSEMBLER_USDT
+#include <sys/sdt.h>
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(assembler, name, a)
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(assembler, name, a, b)
+#define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(assembler, name, a, b, c)
+#define TRACE_PROBE4(name, a, b, c, d) DTRACE_PROBE4(assembler, name, a, b, c, d)
+#else
+#define TRACE_PROBE1(name, a) ((void)0)
+#define TRACE_PROBE2(name, a, b) ((void)0)
+#define TRACE_PROBE3(name, a, b, c) ((void)0)
+#define TRACE_PROBE4(name, a, b, c, d) ((void)0)
+#endif
@@ -10,13 +10,84 @@
  * For each input file, the assembler:
  *   1. Preprocesses macros and expands them into a temporary file.
  *   2. Performs a first pass to build a symbol table and identify labels.
- *   3. Executes a second pass to encode assembly instructions and data into machine code.
+ *   3. Executes a second pass to encode assembly instructions and data into machine code,
+ *      unless the first pass found errors.
  *   4. Handles errors gracefully, reporting issues and cleaning up resources as needed.
  *   5. Outputs the resulting object code, as well as external and entry label files.
  * 
  * The assembler is designed to handle multiple files in a single run, ensuring
  * that each file is processed independently and that all allocated resources are
  * properly released after processing each file.
+ *
+ * Options:
+ *   --compile-macros <source> <cache>  Compile a macro library into a cache file.
+ *   --macros <cache>                   Preload a compiled macro library for all files.
+ *   --keep-am / --no-am                Keep (default) or drop the expanded .am files.
+ *   --threads <n> [--chunk-lines <n>]  Assemble large files in parallel chunks.
+ *   --stream                           Assemble huge files line by line, with memory
+ *                                      that does not grow with the file size.
+ *   -o <target>                        Write the outputs of all files as one framed
+ *                                      stream to target (- for stdout): every output
+ *                                      is a "<length> <name>" line and length bytes.
+ *   --output-dir <dir>                 Create the output files in dir.
+ *   --async-io <n>                     Read the next n sources and write the outputs
+ *                                      on n I/O threads while assembling.
+ *   --stats                            Report phase times, line, macro, label table,
+ *                                      image, output and allocation counts per file
+ *                                      and for the batch, on stderr.
+ *   --stats-json <file>                The same report as one JSON document in file.
+ *   --trace <file>                     Write a Chrome/Perfetto trace of the files,
+ *                                      their phases and the worker threads.
+ *   --mem-report                       Report allocations, bytes, high-water marks
+ *                                      and outstanding blocks of every subsystem,
+ *                                      per file and for the run, on stderr.
+ *   --max-errors <n>                   Stop a file after n lines with errors.
+ *   --fail-fast                        Stop a file at its first error.
+ *   --diagnostics-json                 Print the diagnostics as JSON lines, with a
+ *                                      summary line per file.
+ *   --check                            Only report the diagnostics: the expanded
+ *                                      source stays in memory, nothing is encoded
+ *                                      or written, and the exit status is 1 if
+ *                                      any file has errors.
+ *   --lsp                              Serve the language server protocol on
+ *                                      stdin and stdout: diagnostics of open
+ *                                      documents, updated on every edit,
+ *                                      go to definition and find references
+ *                                      for labels and macros. No files are
+ *                                      written.
+ *   --xref                             Write a .xref index of every label and
+ *                                      macro: its definition line, address and
+ *                                      use sites with their code addresses,
+ *                                      sorted by name for binary search.
+ *   --xref-text                        Also write the index as .xref.txt text.
+ *   --run                              Run the assembled programs named by the
+ *                                      files (their .ob, .ent, .ext and .am
+ *                                      files) instead of assembling; the exit
+ *                                      status is 1 unless all of them stop.
+ *   --max-steps <n>                    Stop a program after n instructions
+ *                                      (100000000 by default) as a fault.
+ *   --dump                             Print the registers, flags, entries and
+ *                                      memory of every program when it halts.
+ *   --disassemble                      Write the object programs named by the
+ *                                      files (their .ob, .ent and .ext files)
+ *                                      back as source, to .dis.as files.
+ *   --verify                           Disassemble, then assemble every
+ *                                      disassembly again and compare it with
+ *                                      the object program word by word.
+ *   --relocatable                      Assemble every file from address 0 and
+ *                                      write a .rel file listing the words a
+ *                                      loader adds its base address to.
+ *   --link <name>                      Link the object modules named by the
+ *                                      files into one program: its .ob file
+ *                                      and a .ent file of all entries. Every
+ *                                      external label must be the entry of
+ *                                      one module.
+ *
+ * The diagnostics of a file are collected while it is assembled and printed
+ * once it is done, sorted by line and without duplicates.
+ *
+ * Source files may share code and macros with .include "file" lines; every
+ * included file is read once per run and reused by all files including it.
  */
 int main(int argc, char** argv){
     FILE *am_file = NULL; /* Pointer to the assembly file */
@@ -25,60 +96,182 @@ int main(int argc, char** argv){
     signed short Code[MAX_LENGTH] = {0}; /* Array to store compiled code */
     signed short Data[MAX_LENGTH] = {0}; /* Array to store compiled data */
     int PC[2] = {0}; /* Program counters array s.t. PC[0] = IC , PC[1] = DC */
-    int Error = 0 /*Error flag*/, i /*loop counter*/;
+    int Error = 0 /*Error flag*/, i /*loop counter*/, failed = 0 /*Files that did not assemble*/;
+    char *am_name = NULL; /* Name of the .am record in the framed output stream */
     
 
+    /* Parse the command line options and collect the source files */
+    if (!parseOptions(argc, argv, &Options)) {
+        freeOptions(&Options);
+        return 1;
+    }
+
+    /* Compile a macro library and exit */
+    if (Options.compile_source) {
+        Error = !CompileMacroLibrary(Options.compile_source, Options.compile_target);
+        diagFlush(Options.compile_source, Error, 0);
+        freeOptions(&Options);
+        return Error;
+    }
+
     /* Check if at least one file name is provided as argument, else return Error */
-    if (argc < 2) {
+    if (Options.num_files < 1 && !Options.lsp) {
         printf("Missing File Name!\n");
+        freeOptions(&Options);
+        return 1;
+    }
+
+    /* Run assembled programs instead of assembling */
+    if (Options.run) {
+        for (i = 0; i < Options.num_files; i++) failed += !simulate(Options.files[i]);
+        freeOptions(&Options);
+        memReport();
+        return failed > 0;
+    }
+
+    /* Open the framed output stream shared by all files */
+    if (Options.output) {
+        Options.output_stream = strcmp(Options.output, "-") == 0 ? stdout : fopen(Options.output, "wb");
+        if (!Options.output_stream) {
+            fprintf(stderr, "Error: Could not open output %s\n", Options.output);
+            freeOptions(&Options);
+            return 1;
+        }
+    }
+
+    /* Record the trace from the start, the I/O threads included */
+    if (Options.trace) traceStart();
+
+    /* Start reading sources ahead and writing outputs in the background */
+    if (Options.async_io > 0) startAsyncIO(Options.async_io);
+
+    /* Preload the precompiled macro library, shared by all files */
+    if (Options.macro_cache && !loadMacroCache(Options.macro_cache)) {
+        freeOptions(&Options);
         return 1;
     }
 
+    /* Serve an editor instead of assembling the files */
+    if (Options.lsp) failed = lspServe(stdin, stdout);
+
+    /* Write object programs back as source instead of assembling */
+    for (i = 0; Options.disassemble && i < Options.num_files; i++) failed += !disassemble(Options.files[i]);
+
+    /* Link object modules into one program instead of assembling */
+    if (Options.link) failed = !linkObjects(Options.link, Options.files, Options.num_files);
+
     /* Loop through each input file */
-    for (i = 1; i < argc; i++) {
+    for (i = 0; !Options.lsp && !Options.disassemble && !Options.link && i < Options.num_files; i++) {
         /* Allocate memory for storing file name */
-        file_name = malloc(strlen(argv[i]) + 1);
+        file_name = memAlloc(MEM_FILE_NAMES, strlen(Options.files[i]) + 1);
         if (!file_name){
             fprintf(stderr, "Error: Failed to allocate memory for filename!\n");
             continue; 
         }
-        strcpy(file_name, argv[i]);
+        strcpy(file_name, Options.files[i]);
         
         /* Pre-process the file for macros and return a new file pointer */
+        statsBeginFile(Options.files[i]);
+        TRACE_PROBE2(file__start, file_name, i);
+        TRACE_PROBE1(preasm__start, file_name);
+        Stats.phase_start[STATS_PREASM] = statsClock();
         am_file = PreAssembler(file_name);
+        Stats.phase_time[STATS_PREASM] = statsClock() - Stats.phase_start[STATS_PREASM];
+        TRACE_PROBE3(preasm__end, file_name, Stats.source_lines, am_file != NULL);
+        if (!am_file) {
+            diagFlush(file_name, 1, Error);
+            xrefEndFile(NULL, file_name, 1);
+            failed++;
+            statsEndFile(file_name, NULL, PC, 1);
+            TRACE_PROBE4(file__end, file_name, 1, 0, 0);
+            memFree(file_name);
+            memEndFile(Options.files[i]);
+            continue;
+        }
+        if (Options.stats) {
+            fseek(am_file, 0, SEEK_END);
+            Stats.output_bytes[STATS_AM] = ftell(am_file);
+            rewind(am_file);
+        }
+
+        /* The .am file goes to the framed output stream as its first record */
+        if (Options.output_stream && Options.keep_am && (am_name = outputFileName(file_name, AFTER_MACRO_EXT))) {
+            writeOutputRecord(am_name, am_file);
+            memFree(am_name);
+        }
 
         /*firstPass Process labels and return the Labels table for Second Pass */
+        TRACE_PROBE1(pass1__start, file_name);
+        Stats.phase_start[STATS_FIRST_PASS] = statsClock();
         table = FirstPass(am_file, &Error);
+        Stats.phase_time[STATS_FIRST_PASS] = statsClock() - Stats.phase_start[STATS_FIRST_PASS];
+        TRACE_PROBE3(pass1__end, file_name, table->num_labels, Error);
         
-        /* Encode assembly instructions into machine code */
-        SecondPass(am_file, table, Code, Data, PC, &Error);
+        /* Encode assembly instructions into machine code. A file that failed
+           its first pass is not encoded, as nothing of the encoding would be
+           written; its report holds the first pass errors only */
+        if (Error) {
+            fclose(am_file);
+        } else {
+            TRACE_PROBE1(pass2__start, file_name);
+            Stats.phase_start[STATS_SECOND_PASS] = statsClock();
+            SecondPass(am_file, table, Code, Data, PC, &Error);
+            Stats.phase_time[STATS_SECOND_PASS] = statsClock() - Stats.phase_start[STATS_SECOND_PASS];
+            TRACE_PROBE4(pass2__end, file_name, PC[0], PC[1], Error);
+        }
 
         /* Check for errors during compilation, if found clean all resources */
         if (Error) {
-            fprintf(stderr, "Failed to Compile File %s\n", file_name);
+            diagFlush(file_name, 1, Error);
+            xrefEndFile(table, file_name, 1);
+            failed++;
+            statsEndFile(file_name, table, PC, 1);
+            TRACE_PROBE4(file__end, file_name, 1, PC[0], PC[1]);
             memset(Code, 0, sizeof(Code));
             memset(Data, 0, sizeof(Data));
             memset(PC, 0, sizeof(PC));
             freeLabelTable(table);
-            free(file_name);
+            memFree(file_name);
+            memEndFile(Options.files[i]);
             Error = 0;
             continue;
         }
         
-        /* Write the compiled code and data to an object file */
-        Write_object_file(Code, Data, PC, file_name);
-
-        /* Write the external and entry labels to respective files */
-        Write_extern_entry_files(table, file_name);
+        /* Write the compiled code and data to an object file, and the external
+           and entry labels to respective files, unless only checking */
+        if (!Options.check) {
+            Stats.phase_start[STATS_OUTPUT] = statsClock();
+            Write_object_file(Code, Data, PC, file_name);
+            Write_extern_entry_files(table, file_name);
+            if (Options.relocatable) Write_relocation_file(Code, PC, file_name);
+            xrefEndFile(table, file_name, 0);
+            Stats.phase_time[STATS_OUTPUT] = statsClock() - Stats.phase_start[STATS_OUTPUT];
+        }
+        diagFlush(file_name, 0, 0);
+        statsEndFile(file_name, table, PC, 0);
+        TRACE_PROBE4(file__end, file_name, 0, PC[0], PC[1]);
         
         /* Cleanup: reset arrays and free allocated memory */
         memset(Code, 0, sizeof(Code));
         memset(Data, 0, sizeof(Data));
         memset(PC, 0, sizeof(PC));
         freeLabelTable(table);
-        free(file_name);
+        memFree(file_name);
+        memEndFile(Options.files[i]);
         Error = 0;
         
     }
-    return 0;
+
+    finishAsyncIO();
+    statsReport();
+    traceWrite();
+    if (Options.output_stream && Options.output_stream != stdout) fclose(Options.output_stream);
+    else if (Options.output_stream) fflush(stdout);
+    freeIncludeCache();
+    freeMacroLibrary();
+    freeOptions(&Options);
+    memReport();
+    /* A check, a disassembly or a link fails when any file does, the server
+       when it was not shut down */
+    return (Options.check || Options.disassemble || Options.link) && failed;
 }
@@ -0,0 +1,238 @@
+#define _POSIX_C_SOURCE 200112L
+#include "Assembler.h"
+#include <pthread.h>
+
+/* States of a prefetched source */
+#define SLOT_WAITING 0
+#define SLOT_READING 1
+#define SLOT_READY 2
+#define SLOT_FAILED 3
+#define SLOT_TAKEN 4
+
+/* A source file read ahead by the I/O threads */
+typedef struct PrefetchSlot {
+    char *data; /* Contents of the file once read */
+    size_t size; /* Size of the contents */
+    int state; /* One of the SLOT_* states */
+} PrefetchSlot;
+
+/* State shared by the I/O threads and the assembling thread */
+typedef struct AsyncEngine {
+    int active; /* 1 once the I/O threads are running */
+    pthread_mutex_t lock; /* Guards everything below */
+    pthread_cond_t wake; /* Signals the I/O threads about new work */
+    pthread_cond_t done; /* Signals the assembling thread about finished work */
+    pthread_t threads[MAX_THREADS]; /* The I/O threads */
+    int num_threads; /* Number of running I/O threads */
+    PrefetchSlot *slots; /* One slot per source file of the run */
+    int num_slots; /* Number of source files */
+    int next_read; /* Next source to read */
+    int cursor; /* First source not yet taken by the assembling thread */
+    int depth; /* How many sources past the cursor may be read ahead */
+    OutputFile **writes; /* Output files waiting to be written, in order */
+    int num_writes; /* Number of waiting output files */
+    int write_capacity; /* Current capacity of the writes array */
+    int writing; /* 1 while a thread writes a batch, keeps batches in order */
+    int stopping; /* Set by finishAsyncIO */
+} AsyncEngine;
+
+static AsyncEngine engine;
+
+
+/*******************************************************************************
+ * Body of an I/O thread. Queued output files are written as one batch by
+ * one thread at a time, so files are written in the order they were
+ * closed; otherwise the next source inside the prefetch window is read.
+ ******************************************************************************/
+static void* asyncWorker(void* arg){
+    static const char *write_names[] = {"files"};
+    static const char *read_names[] = {"bytes"};
+    OutputFile **batch;
+    FILE *file;
+    char *data;
+    size_t size = 0;
+    int count, slot, i;
+    double start;
+    long arg_value;
+
+    traceThreadName("io");
+    pthread_mutex_lock(&engine.lock);
+    for (;;) {
+        if (engine.num_writes > 0 && !engine.writing) {
+            /* Take every waiting output file as one batch */
+            batch = engine.writes;
+            count = engine.num_writes;
+            engine.writes = NULL;
+            engine.num_writes = engine.write_capacity = 0;
+            engine.writing = 1;
+            pthread_mutex_unlock(&engine.lock);
+
+            start = statsClock();
+            for (i = 0; i < count; i++) writeOutputFile(batch[i]);
+            memFree(batch);
+            arg_value = count;
+            traceEvent(TRACE_SPAN, "write outputs", NULL, start, statsClock() - start, write_names, &arg_value, 1);
+
+            pthread_mutex_lock(&engine.lock);
+            engine.writing = 0;
+            pthread_cond_broadcast(&engine.done);
+            continue;
+        }
+        if (!engine.stopping && engine.next_read < engine.num_slots && engine.next_read < engine.cursor + engine.depth) {
+            slot = engine.next_read++;
+            engine.slots[slot].state = SLOT_READING;
+            pthread_mutex_unlock(&engine.lock);
+
+            data = NULL;
+            start = statsClock();
+            if ((file = fopen(Options.files[slot], "r"))) {
+                data = readSourceFile(file, &size);
+                fclose(file);
+            }
+            arg_value = data ? (long)size : 0;
+            traceEvent(TRACE_SPAN, "read source", Options.files[slot], start, statsClock() - start, read_names, &arg_value, 1);
+
+            pthread_mutex_lock(&engine.lock);
+            engine.slots[slot].data = data;
+            engine.slots[slot].size = size;
+            engine.slots[slot].state = data ? SLOT_READY : SLOT_FAILED;
+            pthread_cond_broadcast(&engine.done);
+            continue;
+        }
+        /* Waiting writes are left to the thread writing a batch */
+        if (engine.stopping && (engine.num_writes == 0 || engine.writing)) break;
+        pthread_cond_wait(&engine.wake, &engine.lock);
+    }
+    pthread_mutex_unlock(&engine.lock);
+    return NULL;
+}
+
+
+/*******************************************************************************
+ * Starts the I/O threads. They read up to num_threads source files ahead of
+ * the one being assembled (none in streaming mode, which never holds a
+ * whole source) and write the closed output files in the background.
+ *
+ * Parameters:
+ * - num_threads: The number of I/O threads, at most MAX_THREADS.
+ ******************************************************************************/
+void startAsyncIO(int num_threads){
+    int i;
+
+    if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+    engine.slots = (PrefetchSlot*)memCalloc(MEM_OTHER, Options.num_files + 1, sizeof(PrefetchSlot));
+    if (!engine.slots) {
+        fprintf(stderr, "Error, Failed to allocate memory for the prefetched sources\n");
+        exit(1);
+    }
+    engine.num_slots = Options.num_files;
+    engine.depth = Options.stream ? 0 : num_threads;
+    pthread_mutex_init(&engine.lock, NULL);
+    pthread_cond_init(&engine.wake, NULL);
+    pthread_cond_init(&engine.done, NULL);
+
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&engine.threads[engine.num_threads], NULL, asyncWorker, NULL) == 0) engine.num_threads++;
+    }
+    /* Without any thread all I/O stays synchronous */
+    engine.active = engine.num_threads > 0;
+}
+
+
+/*******************************************************************************
+ * Takes the prefetched contents of a source file, waiting for the I/O
+ * threads if the file is still being read.
+ *
+ * Parameters:
+ * - file_name: The name of the source file.
+ * - size: Pointer to store the size of the contents.
+ *
+ * Returns:
+ * - The contents, to be freed by the caller, or NULL if the file was not
+ *   prefetched and has to be read by the caller.
+ ******************************************************************************/
+char* takePrefetchedSource(char* file_name, size_t* size){
+    PrefetchSlot *slot = NULL;
+    char *data;
+    int i;
+
+    if (!engine.active) return NULL;
+
+    pthread_mutex_lock(&engine.lock);
+    for (i = engine.cursor; i < engine.num_slots && i < engine.cursor + engine.depth; i++) {
+        if (engine.slots[i].state != SLOT_TAKEN && strcmp(Options.files[i], file_name) == 0) {
+            slot = &engine.slots[i];
+            break;
+        }
+    }
+    if (!slot) {
+        pthread_mutex_unlock(&engine.lock);
+        return NULL;
+    }
+
+    while (slot->state == SLOT_WAITING || slot->state == SLOT_READING) pthread_cond_wait(&engine.done, &engine.lock);
+    data = slot->data;
+    *size = slot->size;
+    slot->data = NULL;
+    slot->state = SLOT_TAKEN;
+
+    /* Move the prefetch window past the taken sources */
+    while (engine.cursor < engine.num_slots && engine.slots[engine.cursor].state == SLOT_TAKEN) engine.cursor++;
+    pthread_cond_broadcast(&engine.wake);
+    pthread_mutex_unlock(&engine.lock);
+    return data;
+}
+
+
+/*******************************************************************************
+ * Queues a closed output file to be written by the I/O threads, or writes
+ * it right away when they are not running.
+ *
+ * Parameters:
+ * - out: The buffered output file, freed once written.
+ ******************************************************************************/
+void submitOutputFile(OutputFile* out){
+    if (!engine.active) {
+        writeOutputFile(out);
+        return;
+    }
+
+    pthread_mutex_lock(&engine.lock);
+    if (engine.num_writes == engine.write_capacity) {
+        engine.write_capacity = engine.write_capacity ? engine.write_capacity * 2 : 16;
+        engine.writes = (OutputFile**)memRealloc(MEM_OTHER, engine.writes, engine.write_capacity * sizeof(OutputFile*));
+        if (!engine.writes) {
+            fprintf(stderr, "Error, Failed to allocate memory for the output queue\n");
+            exit(1);
+        }
+    }
+    engine.writes[engine.num_writes++] = out;
+    pthread_cond_signal(&engine.wake);
+    pthread_mutex_unlock(&engine.lock);
+}
+
+
+/*******************************************************************************
+ * Waits for every queued output file to be written and stops the I/O
+ * threads.
+ ******************************************************************************/
+void finishAsyncIO(void){
+    int i;
+
+    if (!engine.active) return;
+
+    pthread_mutex_lock(&engine.lock);
+    engine.stopping = 1;
+    pthread_cond_broadcast(&engine.wake);
+    pthread_mutex_unlock(&engine.lock);
+    for (i = 0; i < engine.num_threads; i++) pthread_join(engine.threads[i], NULL);
+
+    /* Sources that were read but never taken */
+    for (i = 0; i < engine.num_slots; i++) memFree(engine.slots[i].data);
+    memFree(engine.slots);
+    memFree(engine.writes);
+    pthread_mutex_destroy(&engine.lock);
+    pthread_cond_destroy(&engine.wake);
+    pthread_cond_destroy(&engine.done);
+    engine.active = 0;
+}
@@ -0,0 +1,319 @@
+#define _POSIX_C_SOURCE 200112L
+#include "Assembler.h"
+#include <stdarg.h>
+#include <pthread.h>
+
+/* A diagnostic of the file being assembled, kept until the file is done */
+typedef struct Diagnostic {
+    int line; /* Source line, 0 for the whole file */
+    int code; /* DIAG_* code */
+    long order; /* Order of the report, keeps the diagnostics of a line in sequence */
+    const char *source; /* Included file the diagnostic is in, NULL for the file itself */
+    int source_line; /* Line in the included file, line is then the line of its .include */
+    char *message; /* The formatted message */
+} Diagnostic;
+
+static pthread_mutex_t diag_lock = PTHREAD_MUTEX_INITIALIZER; /* Guards the buffer, the passes may report from several threads */
+static Diagnostic *diagnostics; /* Diagnostics of the current file */
+static int num_diagnostics; /* Number of diagnostics */
+static int capacity; /* Capacity of the diagnostics array */
+static long next_order; /* Order of the next diagnostic */
+static const char *source; /* Included file being expanded, NULL for the file itself */
+static int include_line; /* Line of the outermost .include being expanded */
+
+static const char *code_names[DIAG_CODES] = {
+    "file", "macro", "include", "syntax", "label", "entry",
+    "instruction", "operand", "data", "matrix", "unused-label"
+};
+
+
+/*******************************************************************************
+ * Returns 1 if diagnostics with the code are warnings, 0 for errors.
+ ******************************************************************************/
+int diagIsWarning(int code){
+    return code == DIAG_UNUSED_LABEL;
+}
+
+
+/*******************************************************************************
+ * Returns the name of a DIAG_* code, as printed with --diagnostics-json.
+ ******************************************************************************/
+const char* diagCodeName(int code){
+    return code_names[code < 0 || code >= DIAG_CODES ? DIAG_SYNTAX : code];
+}
+
+
+/*******************************************************************************
+ * Sets the file the following diagnostics are in. The pre-assembler sets an
+ * included file while it expands it; its diagnostics keep their line in it
+ * and sort at the line of the .include in the file being assembled.
+ *
+ * Parameters:
+ * - included: The included file, NULL for the file being assembled. The
+ *   name must stay valid until the diagnostics are flushed.
+ * - line: The line of the outermost .include of the file being assembled.
+ ******************************************************************************/
+void diagSetSource(const char* included, int line){
+    pthread_mutex_lock(&diag_lock);
+    source = included;
+    include_line = line;
+    pthread_mutex_unlock(&diag_lock);
+}
+
+
+/*******************************************************************************
+ * Records a diagnostic of the file being assembled. Nothing is printed until
+ * the file is done and diagFlush writes its diagnostics in line order.
+ *
+ * Parameters:
+ * - line: The source line, 0 for the whole file.
+ * - code: The DIAG_* code, which also tells errors from warnings.
+ * - format: printf format of the message, followed by its arguments.
+ ******************************************************************************/
+void diagnose(int line, int code, const char* format, ...){
+    Diagnostic *diagnostic;
+    va_list args;
+    char *copy;
+    int len;
+
+    /* Measure the message first, its arguments may hold paths of any length */
+    va_start(args, format);
+    len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    copy = (char*)memAlloc(MEM_DIAGNOSTICS, (len < 0 ? 0 : len) + 1);
+    if (!copy) {
+        fprintf(stderr, "Error, Failed to allocate memory for a diagnostic\n");
+        exit(1);
+    }
+    va_start(args, format);
+    vsnprintf(copy, (len < 0 ? 0 : len) + 1, format, args);
+    va_end(args);
+
+    pthread_mutex_lock(&diag_lock);
+    if (num_diagnostics == capacity) {
+        capacity = capacity ? capacity * 2 : 32;
+        diagnostics = (Diagnostic*)memRealloc(MEM_DIAGNOSTICS, diagnostics, capacity * sizeof(Diagnostic));
+        if (!diagnostics) {
+            fprintf(stderr, "Error, Failed to allocate memory for the diagnostics\n");
+            exit(1);
+        }
+    }
+    diagnostic = &diagnostics[num_diagnostics++];
+    diagnostic->line = source ? include_line : line;
+    diagnostic->code = code < 0 || code >= DIAG_CODES ? DIAG_SYNTAX : code;
+    diagnostic->order = next_order++;
+    diagnostic->source = source;
+    diagnostic->source_line = source ? line : 0;
+    diagnostic->message = copy;
+    pthread_mutex_unlock(&diag_lock);
+}
+
+
+/*******************************************************************************
+ * Returns the number of diagnostics recorded for the current file, a mark
+ * diagDiscard can go back to.
+ ******************************************************************************/
+int diagCount(void){
+    int count;
+
+    pthread_mutex_lock(&diag_lock);
+    count = num_diagnostics;
+    pthread_mutex_unlock(&diag_lock);
+    return count;
+}
+
+
+/*******************************************************************************
+ * Drops the diagnostics recorded after a mark, the reports of work that is
+ * thrown away and done again.
+ *
+ * Parameters:
+ * - mark: A count returned by diagCount.
+ ******************************************************************************/
+void diagDiscard(int mark){
+    pthread_mutex_lock(&diag_lock);
+    while (num_diagnostics > mark) memFree(diagnostics[--num_diagnostics].message);
+    pthread_mutex_unlock(&diag_lock);
+}
+
+
+/*******************************************************************************
+ * Orders diagnostics by line, then in the order they were reported.
+ ******************************************************************************/
+static int compareDiagnostics(const void* a, const void* b){
+    const Diagnostic *first = (const Diagnostic*)a, *second = (const Diagnostic*)b;
+
+    if (first->line != second->line) return first->line < second->line ? -1 : 1;
+    return first->order < second->order ? -1 : first->order > second->order;
+}
+
+
+/*******************************************************************************
+ * Checks if a sorted diagnostic repeats an earlier one of the same line,
+ * as a line checked by both passes reports the same problem twice.
+ ******************************************************************************/
+static int isDuplicate(int index){
+    Diagnostic *diagnostic = &diagnostics[index];
+    int i;
+
+    for (i = index - 1; i >= 0 && diagnostics[i].line == diagnostic->line; i--) {
+        if (diagnostics[i].code == diagnostic->code && diagnostics[i].source == diagnostic->source &&
+            diagnostics[i].source_line == diagnostic->source_line && strcmp(diagnostics[i].message, diagnostic->message) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+ * Makes room for need more bytes and a terminator in the flush buffer.
+ ******************************************************************************/
+static void reserve(char** buffer, size_t* len, size_t* size, size_t need){
+    if (*len + need + 1 <= *size) return;
+    while (*len + need + 1 > *size) *size = *size ? *size * 2 : 1024;
+    if (!(*buffer = (char*)memRealloc(MEM_DIAGNOSTICS, *buffer, *size))) {
+        fprintf(stderr, "Error, Failed to allocate memory for the diagnostics\n");
+        exit(1);
+    }
+}
+
+
+/*******************************************************************************
+ * Appends a JSON string literal to the flush buffer.
+ ******************************************************************************/
+static void appendJsonString(char** buffer, size_t* len, size_t* size, const char* str){
+    reserve(buffer, len, size, 6 * strlen(str) + 2);
+    (*buffer)[(*len)++] = '"';
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') *len += sprintf(*buffer + *len, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20) *len += sprintf(*buffer + *len, "\\u%04x", (unsigned char)*str);
+        else (*buffer)[(*len)++] = *str;
+    }
+    (*buffer)[(*len)++] = '"';
+}
+
+
+/*******************************************************************************
+ * Writes the diagnostics of a finished file on stderr with a single write,
+ * sorted by line and without duplicates, and starts a new file. The text
+ * format ends with the failure notice of the file; with --diagnostics-json
+ * every diagnostic is a JSON line and a summary line closes the file.
+ *
+ * Parameters:
+ * - file_name: The source file.
+ * - failed: 1 if the file did not assemble.
+ * - error_lines: The error count of the file, to tell if --max-errors
+ *   stopped it.
+ ******************************************************************************/
+void diagFlush(char* file_name, int failed, int error_lines){
+    char *buffer = NULL;
+    size_t len = 0, size = 0, name_len = strlen(file_name);
+    int errors = 0, warnings = 0, stopped = failed && errorLimitReached(error_lines), i;
+    Diagnostic *diagnostic;
+
+    pthread_mutex_lock(&diag_lock);
+    if (num_diagnostics) qsort(diagnostics, num_diagnostics, sizeof(Diagnostic), compareDiagnostics);
+
+    for (i = 0; i < num_diagnostics; i++) {
+        diagnostic = &diagnostics[i];
+        if (isDuplicate(i)) continue;
+        if (diagIsWarning(diagnostic->code)) warnings++;
+        else errors++;
+
+        if (Options.diag_json) {
+            reserve(&buffer, &len, &size, 64);
+            len += sprintf(buffer + len, "{\"kind\": \"diagnostic\", \"file\": ");
+            appendJsonString(&buffer, &len, &size, file_name);
+            reserve(&buffer, &len, &size, 32);
+            len += sprintf(buffer + len, ", \"line\": %d", diagnostic->line);
+            if (diagnostic->source) {
+                reserve(&buffer, &len, &size, 16);
+                len += sprintf(buffer + len, ", \"source\": ");
+                appendJsonString(&buffer, &len, &size, diagnostic->source);
+                reserve(&buffer, &len, &size, 32);
+                len += sprintf(buffer + len, ", \"source_line\": %d", diagnostic->source_line);
+            }
+            reserve(&buffer, &len, &size, 96);
+            len += sprintf(buffer + len, ", \"severity\": \"%s\", \"code\": \"%s\", \"message\": ",
+                           diagIsWarning(diagnostic->code) ? "warning" : "error", diagCodeName(diagnostic->code));
+            appendJsonString(&buffer, &len, &size, diagnostic->message);
+            reserve(&buffer, &len, &size, 2);
+            len += sprintf(buffer + len, "}\n");
+        } else {
+            reserve(&buffer, &len, &size, strlen(diagnostic->message) + (diagnostic->source ? strlen(diagnostic->source) : 0) + 48);
+            if (diagnostic->source)
+                len += sprintf(buffer + len, "%s at Line %d of %s: %s\n", diagIsWarning(diagnostic->code) ? "Warning" : "Error",
+                               diagnostic->source_line, diagnostic->source, diagnostic->message);
+            else if (diagnostic->line)
+                len += sprintf(buffer + len, "%s at Line %d: %s\n", diagIsWarning(diagnostic->code) ? "Warning" : "Error",
+                               diagnostic->line, diagnostic->message);
+            else
+                len += sprintf(buffer + len, "%s: %s\n", diagIsWarning(diagnostic->code) ? "Warning" : "Error", diagnostic->message);
+        }
+    }
+
+    if (Options.diag_json) {
+        reserve(&buffer, &len, &size, 32);
+        len += sprintf(buffer + len, "{\"kind\": \"summary\", \"file\": ");
+        appendJsonString(&buffer, &len, &size, file_name);
+        reserve(&buffer, &len, &size, 128);
+        len += sprintf(buffer + len, ", \"errors\": %d, \"warnings\": %d, \"stopped\": %s, \"failed\": %s}\n",
+                       errors, warnings, stopped ? "true" : "false", failed ? "true" : "false");
+    } else {
+        reserve(&buffer, &len, &size, 2 * name_len + 64);
+        if (stopped) len += sprintf(buffer + len, "Stopped after %d errors in %s\n", error_lines, file_name);
+        if (failed) len += sprintf(buffer + len, "Failed to Compile File %s\n", file_name);
+    }
+    if (len) fwrite(buffer, 1, len, stderr);
+    memFree(buffer);
+
+    for (i = 0; i < num_diagnostics; i++) memFree(diagnostics[i].message);
+    memFree(diagnostics);
+    diagnostics = NULL;
+    num_diagnostics = capacity = 0;
+    next_order = 0;
+    pthread_mutex_unlock(&diag_lock);
+}
+
+
+/*******************************************************************************
+ * Hands the buffered diagnostics to a sink in the order they were reported,
+ * instead of printing them, and empties the buffer. The language server
+ * keeps them with the lines they belong to. A diagnostic of an included
+ * file is given at the line of its .include, with the file and its line in
+ * front of the message.
+ *
+ * Parameters:
+ * - sink: Called for every diagnostic; the message is only valid during
+ *   the call.
+ * - context: Passed to the sink.
+ ******************************************************************************/
+void diagDrain(void (*sink)(void* context, int line, int code, const char* message), void* context){
+    Diagnostic *diagnostic;
+    char *located;
+    int i;
+
+    pthread_mutex_lock(&diag_lock);
+    for (i = 0; i < num_diagnostics; i++) {
+        diagnostic = &diagnostics[i];
+        if (diagnostic->source) {
+            located = (char*)memAlloc(MEM_DIAGNOSTICS, strlen(diagnostic->source) + strlen(diagnostic->message) + 32);
+            if (!located) {
+                fprintf(stderr, "Error, Failed to allocate memory for a diagnostic\n");
+                exit(1);
+            }
+            sprintf(located, "%s, line %d: %s", diagnostic->source, diagnostic->source_line, diagnostic->message);
+            sink(context, diagnostic->line, diagnostic->code, located);
+            memFree(located);
+        } else {
+            sink(context, diagnostic->line, diagnostic->code, diagnostic->message);
+        }
+        memFree(diagnostic->message);
+    }
+    memFree(diagnostics);
+    diagnostics = NULL;
+    num_diagnostics = capacity = 0;
+    next_order = 0;
+    pthread_mutex_unlock(&diag_lock);
+}
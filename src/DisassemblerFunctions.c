@@ -0,0 +1,467 @@
+#define _POSIX_C_SOURCE 200112L
+#include "Assembler.h"
+#include <stdarg.h>
+
+/* Longest line the assembler reads back, without its newline */
+#define DIS_LINE (MAX_LINE_LENGTH - 2)
+/* What the operands of the code say about an address */
+#define DIS_START 1 /* An instruction starts there */
+#define DIS_LABEL 2 /* An operand names it */
+#define DIS_MATRIX 4 /* A matrix operand names it */
+
+/* An object program being written back as source */
+typedef struct Disassembly {
+    char *name; /* The program */
+    ObjectImage image; /* Its image and symbols */
+    int code_end; /* First address past the code */
+    int end; /* First address past the data */
+    unsigned char flags[OBJECT_BASE + OBJECT_MAX_WORDS]; /* DIS_* flags of every address */
+    const char *labels[OBJECT_BASE + OBJECT_MAX_WORDS]; /* Label defined at every address, NULL for none */
+    const char *externs[OBJECT_BASE + OBJECT_MAX_WORDS]; /* External label used by every operand word, NULL for none */
+    char generated[2 * OBJECT_MAX_WORDS][MAX_LABEL + 1]; /* Names made up for addresses and extern uses the symbols do not name */
+    int num_generated; /* Names made up */
+    char *text; /* The disassembly */
+    size_t len; /* Bytes of text */
+    size_t size; /* Capacity of text */
+    int errors; /* Words that cannot be written back as source */
+} Disassembly;
+
+static const char *mnemonics[] = {"mov", "cmp", "add", "sub", "lea", "clr", "not", "inc",
+                                  "dec", "jmp", "bne", "jsr", "red", "prn", "rts", "stop"};
+static char encoding_table[] = {'a', 'b', 'c', 'd'};
+
+
+/*******************************************************************************
+ * Appends formatted text to the disassembly.
+ ******************************************************************************/
+static void append(Disassembly* d, const char* format, ...){
+    va_list args;
+    int len;
+
+    /* Measured first, the header holds the object path */
+    va_start(args, format);
+    len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (len < 0) return;
+
+    if (d->len + len + 1 > d->size) {
+        d->size = 2 * (d->len + len + 1) > 4096 ? 2 * (d->len + len + 1) : 4096;
+        if (!(d->text = (char*)memRealloc(MEM_OUTPUT, d->text, d->size))) {
+            fprintf(stderr, "Error, Failed to allocate memory for the disassembly\n");
+            exit(1);
+        }
+    }
+    va_start(args, format);
+    vsnprintf(d->text + d->len, len + 1, format, args);
+    va_end(args);
+    d->len += len;
+}
+
+
+/*******************************************************************************
+ * Reports words that cannot be written back as source.
+ ******************************************************************************/
+static void disError(Disassembly* d, int address, const char* message){
+    fprintf(stderr, "Error: %s: %s at address %d\n", d->name, message, address);
+    d->errors++;
+}
+
+
+/*******************************************************************************
+ * Checks if a name is already used by an entry, an extern or a made up name.
+ ******************************************************************************/
+static int nameTaken(Disassembly* d, const char* name){
+    int i;
+
+    for (i = 0; i < d->image.num_entries; i++) if (strcmp(d->image.entries[i].name, name) == 0) return 1;
+    for (i = 0; i < d->image.num_externs; i++) if (strcmp(d->image.externs[i].name, name) == 0) return 1;
+    for (i = 0; i < d->num_generated; i++) if (strcmp(d->generated[i], name) == 0) return 1;
+    return 0;
+}
+
+
+/*******************************************************************************
+ * Makes up a name no symbol of the program has: the prefix and the address,
+ * with the prefix repeated until the name is free.
+ ******************************************************************************/
+static const char* generateName(Disassembly* d, const char* prefix, int address){
+    char *name = d->generated[d->num_generated];
+    int repeat, i;
+
+    for (repeat = 1; ; repeat++) {
+        name[0] = '\0';
+        for (i = 0; i < repeat; i++) strcat(name, prefix);
+        sprintf(name + strlen(name), "%d", address);
+        if (!nameTaken(d, name)) break;
+    }
+    d->num_generated++;
+    return name;
+}
+
+
+/*******************************************************************************
+ * Walks the code once: marks where instructions start and which addresses
+ * the label and matrix operands name, and names the extern uses from the
+ * .ext file. An address below OBJECT_BASE in a label word is one past the
+ * first OBJECT_MEMORY words, as the word keeps its low 8 bits.
+ ******************************************************************************/
+static void markOperands(Disassembly* d){
+    ObjectInstruction ins;
+    ObjectOperand *op;
+    const char *fault;
+    int pc, i, address;
+
+    for (i = 0; i < d->image.num_externs; i++) {
+        if (d->image.externs[i].address < d->code_end) d->externs[d->image.externs[i].address] = d->image.externs[i].name;
+    }
+
+    for (pc = OBJECT_BASE; pc < d->code_end; pc += ins.length) {
+        d->flags[pc] |= DIS_START;
+        if ((fault = decodeObjectInstruction(d->image.words, pc, d->code_end, &ins))) {
+            disError(d, pc, fault);
+            ins.length = 1;
+            continue;
+        }
+        for (i = 0; i < ins.num_operands; i++) {
+            op = &ins.operands[i];
+            if (op->mode != LABEL && op->mode != MATRIX) continue;
+
+            if (op->are == 1) {
+                if (op->value) disError(d, op->word, "external label word with an address");
+                if (!d->externs[op->word]) d->externs[op->word] = generateName(d, "X", op->word);
+                continue;
+            }
+            if (op->are != 2) {
+                disError(d, op->word, "label word that is not relocatable");
+                continue;
+            }
+            address = op->value < OBJECT_BASE ? op->value + OBJECT_MEMORY : op->value;
+            if (address >= d->end) disError(d, op->word, "label outside the image");
+            else d->flags[address] |= op->mode == MATRIX ? DIS_LABEL | DIS_MATRIX : DIS_LABEL;
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * Names every address a label is defined at: entries by their names, the
+ * other addresses operands name by made up ones. A label in the code must
+ * start an instruction, and a matrix must be in the data.
+ ******************************************************************************/
+static void nameLabels(Disassembly* d){
+    ObjectSymbol *entry;
+    int i, address;
+
+    for (i = 0; i < d->image.num_entries; i++) {
+        entry = &d->image.entries[i];
+        if (entry->address < OBJECT_BASE || entry->address >= d->end) disError(d, entry->address, "entry outside the image");
+        else if (d->labels[entry->address]) disError(d, entry->address, "two entries at the same address");
+        else d->labels[entry->address] = entry->name;
+    }
+
+    for (address = OBJECT_BASE; address < d->end; address++) {
+        if ((d->flags[address] & DIS_LABEL) && !d->labels[address]) d->labels[address] = generateName(d, "L", address);
+        if (!d->labels[address] || address >= d->code_end) continue;
+        if (!(d->flags[address] & DIS_START)) disError(d, address, "label inside an instruction");
+        if (d->flags[address] & DIS_MATRIX) disError(d, address, "matrix in the code");
+    }
+}
+
+
+/*******************************************************************************
+ * Writes an operand as source.
+ ******************************************************************************/
+static void appendOperand(Disassembly* d, const ObjectOperand* op){
+    int address = op->value < OBJECT_BASE ? op->value + OBJECT_MEMORY : op->value;
+    const char *name = op->are == 1 ? d->externs[op->word] : address < d->end ? d->labels[address] : NULL;
+
+    switch (op->mode) {
+        case IMMEDIATE:
+            append(d, "#%d", op->value);
+            break;
+        case REGISTER:
+            append(d, "r%d", op->value);
+            break;
+        case LABEL:
+            append(d, "%s", name ? name : "?");
+            break;
+        default:
+            append(d, "%s[r%d][r%d]", name ? name : "?", op->row, op->col);
+    }
+}
+
+
+/*******************************************************************************
+ * Writes the declarations and the code: the entries, every external label
+ * once in the order of its first use, and an instruction per line. Words
+ * that are not an instruction are written as comments.
+ ******************************************************************************/
+static void appendCode(Disassembly* d){
+    ObjectInstruction ins;
+    const char *declared[OBJECT_MAX_WORDS];
+    int num_declared = 0, pc, i, j;
+
+    for (i = 0; i < d->image.num_entries; i++) append(d, ".entry %s\n", d->image.entries[i].name);
+    for (pc = OBJECT_BASE; pc < d->code_end; pc++) {
+        if (!d->externs[pc]) continue;
+        for (j = 0; j < num_declared && strcmp(declared[j], d->externs[pc]) != 0; j++);
+        if (j < num_declared) continue;
+        declared[num_declared++] = d->externs[pc];
+        append(d, ".extern %s\n", d->externs[pc]);
+    }
+
+    for (pc = OBJECT_BASE; pc < d->code_end; pc += ins.length) {
+        if (decodeObjectInstruction(d->image.words, pc, d->code_end, &ins)) {
+            append(d, "; the word %d at address %d is not an instruction\n", d->image.words[pc], pc);
+            ins.length = 1;
+            continue;
+        }
+        if (d->labels[pc]) append(d, "%s: ", d->labels[pc]);
+        append(d, "%s", mnemonics[ins.opcode]);
+        for (i = 0; i < ins.num_operands; i++) {
+            append(d, i ? ", " : " ");
+            appendOperand(d, &ins.operands[i]);
+        }
+        append(d, "\n");
+    }
+}
+
+
+/*******************************************************************************
+ * Finds the end of a string starting at an address: printable characters
+ * but quotes, ending with a 0 word, that fit on one .string line.
+ *
+ * Returns:
+ * - The address of the 0 word, or -1 if no string starts there.
+ ******************************************************************************/
+static int stringEnd(Disassembly* d, int address, int end, int prefix){
+    int i, c;
+
+    for (i = address; i < end && (c = d->image.words[i]) != 0; i++) {
+        if (c < ' ' || c > '~' || c == '"') return -1;
+    }
+    if (i == end || i - address < 2 || prefix + (int)strlen(".string \"\"") + i - address > DIS_LINE) return -1;
+    return i;
+}
+
+
+/*******************************************************************************
+ * Writes the data words from a labelled address up to the next label: a
+ * matrix starts with a one row .mat line, strings are written as .string
+ * lines and the other words as .data lines, split to fit the lines the
+ * assembler reads.
+ ******************************************************************************/
+static void appendDataRun(Disassembly* d, int address, int end){
+    const char *label = d->labels[address];
+    int prefix, count, i, value, string, len;
+
+    while (address < end) {
+        prefix = label ? (int)strlen(label) + 2 : 0;
+        if (label) append(d, "%s: ", label);
+
+        if (!(d->flags[address] & DIS_MATRIX) && (string = stringEnd(d, address, end, prefix)) >= 0) {
+            append(d, ".string \"");
+            for (i = address; i < string; i++) append(d, "%c", d->image.words[i]);
+            append(d, "\"\n");
+            address = string + 1;
+            label = NULL;
+            continue;
+        }
+
+        /* Count the words that fit on the line, stopping before a string */
+        len = prefix + (int)strlen(".mat [1][000] ");
+        for (count = 0; address + count < end; count++) {
+            value = ((d->image.words[address + count] & 0x3FF) ^ 0x200) - 0x200;
+            len += sprintf(d->generated[d->num_generated], "%d, ", value);
+            if (len > DIS_LINE + 1 || (count && stringEnd(d, address + count, end, 0) >= 0)) break;
+        }
+        if (!count) count = 1;
+
+        if (label && (d->flags[address] & DIS_MATRIX)) append(d, ".mat [1][%d] ", count);
+        else append(d, ".data ");
+        for (i = 0; i < count; i++) {
+            value = ((d->image.words[address + i] & 0x3FF) ^ 0x200) - 0x200;
+            append(d, i ? ", %d" : "%d", value);
+        }
+        append(d, "\n");
+        address += count;
+        label = NULL;
+    }
+}
+
+
+/*******************************************************************************
+ * Hands a diagnostic of the assembled disassembly to stderr.
+ ******************************************************************************/
+static void reportDiagnostic(void* context, int line, int code, const char* message){
+    Disassembly *d = (Disassembly*)context;
+
+    fprintf(stderr, "%s: %s: line %d of the disassembly: %s\n", diagIsWarning(code) ? "Warning" : "Error", d->name, line, message);
+}
+
+
+/*******************************************************************************
+ * Orders symbols by address, then by name.
+ ******************************************************************************/
+static int compareSymbols(const void* a, const void* b){
+    const ObjectSymbol *first = (const ObjectSymbol*)a, *second = (const ObjectSymbol*)b;
+
+    if (first->address != second->address) return first->address < second->address ? -1 : 1;
+    return strcmp(first->name, second->name);
+}
+
+
+/*******************************************************************************
+ * Compares the entries or extern uses of the reassembled label table with
+ * the ones of the object program, in any order.
+ *
+ * Parameters:
+ * - d: The disassembly.
+ * - table: The label table of the reassembled disassembly.
+ * - external: 1 to compare the extern uses, 0 for the entries.
+ *
+ * Returns:
+ * - 1 if they are the same, 0 otherwise.
+ ******************************************************************************/
+static int sameSymbols(Disassembly* d, LabelTable* table, int external){
+    ObjectSymbol *expected = external ? d->image.externs : d->image.entries, *found;
+    int num_expected = external ? d->image.num_externs : d->image.num_entries, num_found = 0, capacity = 16, i, same;
+    Label *label;
+    Reference *ref;
+
+    found = (ObjectSymbol*)memAlloc(MEM_LABELS, capacity * sizeof(ObjectSymbol));
+    for (i = 0; found && i < table->table_size; i++) {
+        for (label = table->Labels[i]; found && label; label = label->next) {
+            if (external ? !label->ext || !label->ref : !label->ent) continue;
+            for (ref = external ? label->ref : NULL; ; ref = ref->next) {
+                if (num_found == capacity) found = (ObjectSymbol*)memRealloc(MEM_LABELS, found, (capacity *= 2) * sizeof(ObjectSymbol));
+                if (!found) break;
+                strcpy(found[num_found].name, label->name);
+                found[num_found++].address = external ? ref->pos + OBJECT_BASE : label->address;
+                if (!external || !ref->next) break;
+            }
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "Error, Failed to allocate memory for the symbols\n");
+        exit(1);
+    }
+
+    if (num_expected) qsort(expected, num_expected, sizeof(ObjectSymbol), compareSymbols);
+    qsort(found, num_found, sizeof(ObjectSymbol), compareSymbols);
+    same = num_found == num_expected;
+    for (i = 0; same && i < num_found; i++) same = compareSymbols(&found[i], &expected[i]) == 0;
+    memFree(found);
+    return same;
+}
+
+
+/*******************************************************************************
+ * Assembles the disassembly again, as the .am file of a source without
+ * macros, and compares the words, the entries and, when the program has an
+ * .ext file, the extern uses with the object program.
+ *
+ * Returns:
+ * - 1 if the disassembly assembles to the same program, 0 otherwise.
+ ******************************************************************************/
+static int verifyDisassembly(Disassembly* d){
+    signed short Code[MAX_LENGTH] = {0}, Data[MAX_LENGTH] = {0};
+    char expected[SIZE_OF_WORD + 1] = {'\0'}, found[SIZE_OF_WORD + 1] = {'\0'};
+    int PC[2] = {0}, errors = 0, same, i, word;
+    const char *line, *end;
+    LabelTable *table;
+    FILE *file;
+
+    if (!(file = tmpfile())) {
+        fprintf(stderr, "Error: Could not create a temporary file to verify %s\n", d->name);
+        return 0;
+    }
+    /* Without the comments, as the pre-assembler would leave it */
+    for (line = d->text; line < d->text + d->len; line = end + 1) {
+        end = memchr(line, '\n', d->text + d->len - line);
+        if (*line != ';') fwrite(line, 1, end - line + 1, file);
+    }
+    rewind(file);
+
+    table = FirstPass(file, &errors);
+    if (!errors) SecondPass(file, table, Code, Data, PC, &errors);
+    else fclose(file);
+    diagDrain(reportDiagnostic, d);
+
+    same = !errors && PC[0] == d->image.ICF && PC[1] == d->image.DCF;
+    if (!errors && !same)
+        fprintf(stderr, "Error: %s: the disassembly assembles to %d code and %d data words, not %d and %d\n",
+                d->name, PC[0], PC[1], d->image.ICF, d->image.DCF);
+
+    for (i = 0; same && i < PC[0] + PC[1]; i++) {
+        word = (i < PC[0] ? Code[i] : Data[i - PC[0]]) & 0x3FF;
+        if (word == d->image.words[OBJECT_BASE + i]) continue;
+        encodeBase4(encoding_table, d->image.words[OBJECT_BASE + i], expected, SIZE_OF_WORD);
+        encodeBase4(encoding_table, word, found, SIZE_OF_WORD);
+        fprintf(stderr, "Error: %s: the word at address %d is %s, the disassembly assembles to %s\n",
+                d->name, OBJECT_BASE + i, expected, found);
+        same = 0;
+    }
+    if (same && !sameSymbols(d, table, 0)) {
+        fprintf(stderr, "Error: %s: the entries of the disassembly differ\n", d->name);
+        same = 0;
+    }
+    if (same && d->image.num_externs && !sameSymbols(d, table, 1)) {
+        fprintf(stderr, "Error: %s: the extern uses of the disassembly differ\n", d->name);
+        same = 0;
+    }
+    freeLabelTable(table);
+    return same;
+}
+
+
+/*******************************************************************************
+ * Writes an object program back as source, to a .dis.as file next to it (or
+ * a record of -o, or a file in --output-dir). The .ent and .ext files give
+ * the names of the entries and external labels; the other labels are named
+ * after their addresses. With --verify the disassembly is assembled again
+ * and must give the same words.
+ *
+ * Parameters:
+ * - name: The program, its .ob file or any name with the same base.
+ *
+ * Returns:
+ * - 1 if every word could be written back (and verified), 0 otherwise.
+ ******************************************************************************/
+int disassemble(char* name){
+    Disassembly *d;
+    OutputFile *out;
+    int address, run, ok;
+
+    d = (Disassembly*)memCalloc(MEM_OTHER, 1, sizeof(Disassembly));
+    if (!d) {
+        fprintf(stderr, "Error, Failed to allocate memory for the disassembly\n");
+        exit(1);
+    }
+    d->name = name;
+    if (!loadObject(name, &d->image)) {
+        memFree(d);
+        return 0;
+    }
+    d->code_end = OBJECT_BASE + d->image.ICF;
+    d->end = d->code_end + d->image.DCF;
+
+    markOperands(d);
+    nameLabels(d);
+    append(d, "; %d code and %d data words of %s\n", d->image.ICF, d->image.DCF, name);
+    appendCode(d);
+    for (address = d->code_end; address < d->end; address = run) {
+        for (run = address + 1; run < d->end && !d->labels[run]; run++);
+        appendDataRun(d, address, run);
+    }
+
+    out = openOutputFile(name, DISASSEMBLY_EXT);
+    writeOutput(out, d->text, d->len);
+    closeOutputFile(out);
+
+    ok = !d->errors && (!Options.verify || verifyDisassembly(d));
+    freeObject(&d->image);
+    memFree(d->text);
+    memFree(d);
+    return ok;
+}
@@ -28,7 +28,7 @@ char* changeFileNameExtension(char* file_name,char* extension){
 
     /*Allocate space: name + new extension + null terminator */
     new_len = name_len + strlen(extension) + 1;
-    new_name = (char*)malloc(new_len);
+    new_name = (char*)memAlloc(MEM_FILE_NAMES, new_len);
     if (!new_name) {
         fprintf(stderr, "MemError, Failed to allocate Memory for file name Extension!\n");
         return NULL;
@@ -42,6 +42,170 @@ char* changeFileNameExtension(char* file_name,char* extension){
 }
 
 
+/*******************************************************************************
+ * Builds the name of an output file: the source name with a new extension,
+ * placed in the --output-dir directory when one is given.
+ *
+ * Parameters:
+ * - file_name: The source file name.
+ * - extension: The extension of the output file.
+ *
+ * Returns:
+ * - A pointer to the newly allocated output file name, or NULL on failure.
+ ******************************************************************************/
+char* outputFileName(char* file_name, char* extension){
+    char *name, *base, *path;
+
+    name = changeFileNameExtension(file_name, extension);
+    if (!name || !Options.output_dir) return name;
+
+    /* Keep only the last component of the name */
+    base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+
+    path = (char*)memAlloc(MEM_FILE_NAMES, strlen(Options.output_dir) + strlen(base) + 2);
+    if (!path) {
+        fprintf(stderr, "MemError, Failed to allocate Memory for output file name!\n");
+        memFree(name);
+        return NULL;
+    }
+    sprintf(path, "%s/%s", Options.output_dir, base);
+    memFree(name);
+    return path;
+}
+
+
+/*******************************************************************************
+ * Opens an output file of a source file. With -o the file is not created,
+ * its contents are buffered and written as one record of the framed output
+ * stream when it is closed. With --async-io the contents are buffered and
+ * the file is created and written by an I/O thread once closed.
+ *
+ * Parameters:
+ * - file_name: The source file name.
+ * - extension: The extension of the output file.
+ *
+ * Returns:
+ * - The opened output file.
+ ******************************************************************************/
+OutputFile* openOutputFile(char* file_name, char* extension){
+    OutputFile *out = (OutputFile*)memCalloc(MEM_OUTPUT, 1, sizeof(OutputFile));
+
+    if (!out || !(out->name = outputFileName(file_name, extension))) {
+        fprintf(stderr, "MemError, Failed to allocate Memory for output file!\n");
+        exit(1);
+    }
+    if (!Options.output_stream && !Options.async_io && !(out->file = fopen(out->name, "w+b"))) {
+        fprintf(stderr, "Error: Could not create file %s\n", out->name);
+        exit(1);
+    }
+    return out;
+}
+
+
+/*******************************************************************************
+ * Writes bytes to an output file.
+ *
+ * Parameters:
+ * - out: The output file.
+ * - bytes: The bytes to write.
+ * - len: Number of bytes.
+ ******************************************************************************/
+void writeOutput(OutputFile* out, const char* bytes, size_t len){
+    if (out->file) {
+        fwrite(bytes, sizeof(char), len, out->file);
+        out->size += len;
+        return;
+    }
+    if (out->size + len > out->capacity) {
+        out->capacity = (out->size + len) * 2;
+        out->data = (char*)memRealloc(MEM_OUTPUT, out->data, out->capacity);
+        if (!out->data) {
+            fprintf(stderr, "MemError, Failed to allocate Memory for output file!\n");
+            exit(1);
+        }
+    }
+    memcpy(out->data + out->size, bytes, len);
+    out->size += len;
+}
+
+
+/*******************************************************************************
+ * Closes an output file. A buffered file is written as a record of the
+ * framed output stream, a header line "<length> <name>" followed by length
+ * bytes, or handed to the I/O threads.
+ *
+ * Parameters:
+ * - out: The output file, freed.
+ ******************************************************************************/
+void closeOutputFile(OutputFile* out){
+    statsOutputBytes(out->name, (long)out->size);
+    if (out->file) {
+        fclose(out->file);
+        TRACE_PROBE2(output__flush, out->name, out->size);
+    } else if (!Options.output_stream) {
+        submitOutputFile(out);
+        return;
+    } else {
+        fprintf(Options.output_stream, "%lu %s\n", (unsigned long)out->size, out->name);
+        fwrite(out->data, sizeof(char), out->size, Options.output_stream);
+        TRACE_PROBE2(output__flush, out->name, out->size);
+    }
+    memFree(out->data);
+    memFree(out->name);
+    memFree(out);
+}
+
+
+/*******************************************************************************
+ * Creates and writes a buffered output file.
+ *
+ * Parameters:
+ * - out: The buffered output file, freed.
+ ******************************************************************************/
+void writeOutputFile(OutputFile* out){
+    FILE *file = fopen(out->name, "w+b");
+
+    if (!file) {
+        fprintf(stderr, "Error: Could not create file %s\n", out->name);
+        exit(1);
+    }
+    fwrite(out->data, sizeof(char), out->size, file);
+    fclose(file);
+    TRACE_PROBE2(output__flush, out->name, out->size);
+    memFree(out->data);
+    memFree(out->name);
+    memFree(out);
+}
+
+
+/*******************************************************************************
+ * Writes the whole contents of an open file as a record of the framed
+ * output stream, then rewinds the file.
+ *
+ * Parameters:
+ * - name: The name of the record.
+ * - file: The file to copy.
+ ******************************************************************************/
+void writeOutputRecord(char* name, FILE* file){
+    char buffer[4096];
+    long size;
+    size_t n;
+
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    rewind(file);
+
+    fprintf(Options.output_stream, "%lu %s\n", (unsigned long)size, name);
+    while (size > 0 && (n = fread(buffer, sizeof(char), sizeof(buffer), file)) > 0) {
+        fwrite(buffer, sizeof(char), n, Options.output_stream);
+        size -= n;
+    }
+    TRACE_PROBE2(output__flush, name, ftell(file));
+    rewind(file);
+}
+
+
 /*******************************************************************************
  * Writes the object file with the given code, data, and counters.
  *
@@ -53,10 +217,9 @@ char* changeFileNameExtension(char* file_name,char* extension){
  ******************************************************************************/
 void Write_object_file(signed short Code[], signed short Data[], int counter[], char *file_name) {
     static char encoding_table[] = {'a', 'b', 'c', 'd'};
-    FILE *obj = NULL;
+    OutputFile *obj = NULL;
     int i, len, IC, DC;
-    unsigned int addr = 100;
-    char *filename = NULL;
+    unsigned int addr = Options.load_base;
     char line[MAX_LINE_LENGTH+1] = {'\0'};
     char address[SIZE_OF_ADDRESS+1]= {'\0'};
     char word[SIZE_OF_WORD+1]= {'\0'};
@@ -65,19 +228,14 @@ void Write_object_file(signed short Code[], signed short Data[], int counter[],
     IC = counter[0];
     DC = counter[1];
 
-    /* Change file name extension */
-    filename = changeFileNameExtension(file_name, OBJECT_EXT);
-    obj = fopen(filename, "w+b");
-    if (obj == NULL) {
-        fprintf(stderr, "Error: Could not create file %s\n", filename);
-        exit(1);
-    }
+    /* Open the file with the object extension */
+    obj = openOutputFile(file_name, OBJECT_EXT);
 
     /* Write ICF and DCF */
     encodeCounter(encoding_table, IC, ICF);
     encodeCounter(encoding_table, DC, DCF);
     len = sprintf(line, "\t%s %s\n", ICF, DCF);
-    fwrite(line, sizeof(char), len, obj);
+    writeOutput(obj, line, len);
 
     /* Write code */
     for (i = 0; i < IC; i++) {
@@ -86,7 +244,7 @@ void Write_object_file(signed short Code[], signed short Data[], int counter[],
         encodeBase4(encoding_table, Code[i], word, SIZE_OF_WORD);
         /* Write address and word representations */
         len = sprintf(line, "%s\t%s\n", address, word);
-        fwrite(line, sizeof(char), len, obj);
+        writeOutput(obj, line, len);
 
         /* Clear buffers */
         memset(line, '\0', MAX_LINE_LENGTH);
@@ -103,7 +261,7 @@ void Write_object_file(signed short Code[], signed short Data[], int counter[],
         encodeBase4(encoding_table, Data[i], word, SIZE_OF_WORD);
 
         len = sprintf(line, "%s\t%s\n", address, word);
-        fwrite(line, sizeof(char), len, obj);
+        writeOutput(obj, line, len);
 
 
         memset(line, '\0', MAX_LINE_LENGTH);
@@ -113,8 +271,7 @@ void Write_object_file(signed short Code[], signed short Data[], int counter[],
         addr++;
     }
     
-    free(filename);
-    fclose(obj);
+    closeOutputFile(obj);
 }
 
 
@@ -128,12 +285,10 @@ void Write_object_file(signed short Code[], signed short Data[], int counter[],
 void Write_extern_entry_files(LabelTable* Labels, char* file_name) {
     static char encoding_table[] = {'a', 'b', 'c', 'd'}; /* Encoding table for base 4 */
     unsigned int i, len, pos; /* Position in the line buffer */
-    FILE *ext = NULL, *ent = NULL; /* File pointers for extern and entry files */
+    OutputFile *ext = NULL, *ent = NULL; /* Extern and entry files */
     Reference* ref; /* Reference to the current label's references */
     Label* current_label; /* Current label being processed */
     char line[MAX_LINE_LENGTH] = {'\0'}; /* Line buffer for writing */
-    char *ext_file = NULL; /* Extern file name */
-    char *ent_file = NULL; /* Entry file name */
     char address[SIZE_OF_ADDRESS+1] = {'\0'}; /* Address buffer */
 
     /* Iterate over all labels */
@@ -142,21 +297,13 @@ void Write_extern_entry_files(LabelTable* Labels, char* file_name) {
         while (current_label) {
             /* If extern, open file and write references */
             if (current_label->ext){
-                if (!ext) {
-                    ext_file = changeFileNameExtension(file_name, EXTERN_EXT);
-                    
-                    ext = fopen(ext_file, "w+b");
-                    if (!ext) {
-                        fprintf(stderr, "Error, could not create file %s\n", ext_file);
-                        exit(1);
-                    }
-                }
+                if (!ext) ext = openOutputFile(file_name, EXTERN_EXT);
                 ref = current_label->ref;
                 while (ref != NULL) {
-                    pos = (ref->pos) + 100;
+                    pos = (ref->pos) + Options.load_base;
                     encodeBase4(encoding_table, pos, address, SIZE_OF_ADDRESS);
                     len = sprintf(line, "%s\t%s\n", current_label->name, address);
-                    fwrite(line, sizeof(char), len, ext);
+                    writeOutput(ext, line, len);
                     memset(line, '\0', MAX_LINE_LENGTH);
                     memset(address, '\0', SIZE_OF_ADDRESS);
                     ref = ref->next;
@@ -165,18 +312,11 @@ void Write_extern_entry_files(LabelTable* Labels, char* file_name) {
 
             /* If entry, open file and write entry */
             else if (current_label->ent) {
-                if (!ent) {
-                    ent_file = changeFileNameExtension(file_name, ENTRY_EXT);
-                    ent = fopen(ent_file, "w+b");
-                    if (!ent) {
-                        fprintf(stderr, "Error, could not create file %s\n", ent_file);
-                        exit(1);
-                    }
-                }
+                if (!ent) ent = openOutputFile(file_name, ENTRY_EXT);
                 pos = current_label->address;
                 encodeBase4(encoding_table, pos, address, SIZE_OF_ADDRESS);
                 len = sprintf(line, "%s\t%s\n", current_label->name, address);
-                fwrite(line, sizeof(char), len, ent);
+                writeOutput(ent, line, len);
                 memset(line, '\0', MAX_LINE_LENGTH);
                 memset(address, '\0', SIZE_OF_ADDRESS);
             }
@@ -185,10 +325,37 @@ void Write_extern_entry_files(LabelTable* Labels, char* file_name) {
     }
 
     /* Clean up */
-    free(ext_file);
-    free(ent_file);
-    if (ext){ fclose(ext);}
-    if (ent){ fclose(ent);}
+    if (ext){ closeOutputFile(ext);}
+    if (ent){ closeOutputFile(ent);}
+}
+
+
+/*******************************************************************************
+ * Writes the relocation file of a relocatable object file: the address of
+ * every word that holds the address of a label of the file, found by the
+ * relocatable A,R,E bits encodeLabelOperand and encodeMatrixOperand set. A
+ * loader rebases the program by adding its base address to the address in
+ * each listed word. Nothing is written when no word needs it.
+ *
+ * Parameters:
+ * - Code: The code array.
+ * - counter: The counters for instruction and data.
+ * - file_name: The original file name.
+ ******************************************************************************/
+void Write_relocation_file(signed short Code[], int counter[], char *file_name) {
+    static char encoding_table[] = {'a', 'b', 'c', 'd'};
+    OutputFile *rel = NULL;
+    char line[SIZE_OF_ADDRESS + 2] = {'\0'};
+    int i;
+
+    for (i = 0; i < counter[0]; i++) {
+        if ((Code[i] & 3) != 2) continue;
+        if (!rel) rel = openOutputFile(file_name, RELOCATION_EXT);
+        encodeBase4(encoding_table, i + Options.load_base, line, SIZE_OF_ADDRESS);
+        line[SIZE_OF_ADDRESS] = '\n';
+        writeOutput(rel, line, SIZE_OF_ADDRESS + 1);
+    }
+    if (rel) closeOutputFile(rel);
 }
 
 
@@ -236,7 +403,8 @@ void encodeCounter(const char encoding_table[], unsigned int x, char *buf) {
         return;
     }
 
-    while (x > 0) {
+    /* Like the addresses, counters keep their low SIZE_OF_ADDRESS digits */
+    while (x > 0 && len < SIZE_OF_ADDRESS) {
         temp[len++] = encoding_table[x % 4];
         x /= 4;
     }
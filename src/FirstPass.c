@@ -4,11 +4,13 @@
  * First Pass of the Assembler
  * -----------------------------
  * This function performs the first pass of the assembler, processing labels and
- * external definitions within an assembly file.
+ * external definitions within an assembly file. Once every label is collected
+ * the table is frozen for fast read only lookups during encoding.
  *
  * Parameters:
  *   amFile - Pointer to the assembly file after macro processing.
- *   errorFlag - Pointer to an integer flag to indicate errors.
+ *   errorFlag - Pointer to the error count of the file. Lines are read
+ *               until the end or until it reaches --max-errors.
  *
  * Returns:
  *   A pointer to the label table if successful, NULL otherwise.
@@ -17,27 +19,58 @@ LabelTable* FirstPass(FILE *amFile, int *errorFlag) {
     LabelTable *table = NULL; /* Pointer to the label table. */
     char line[MAX_LINE_LENGTH]; /* Buffer to hold each line read from the file. */
     int lineCount = 0; /* Counter to track the current line number. */
-    int len = 0; /* Length of the current line. */
 
     table = create_LabelTable(TABLE_SIZE);
 
+    /* Large files can have their labels collected by several threads,
+       unless streaming, as the parallel pass holds every line in memory. */
+    if (Options.threads > 1 && !Options.stream) {
+        ParallelFirstPass(amFile, table, errorFlag);
+    }
     /* Read each line of the file until the end is reached. */
-    while (fgets(line, MAX_LINE_LENGTH, amFile)) {
+    else while (!errorLimitReached(*errorFlag) && fgets(line, MAX_LINE_LENGTH, amFile)) {
         lineCount++; 
-        
-        if (isExtern(line) || IsLabelDefinition(line)){
-            len = strlen(line)-1;
-            while(line[len] == '\r' || line[len] == '\n'){
-                line[len] = '\0';
-                len--;
-            }
-        if (isExtern(line))
-            ProcessExternDefinition(line, table, lineCount, errorFlag);
-        else
-            ProcessLabelDefinition(line, table, lineCount, errorFlag);
-        }
+        ProcessFirstPassLine(line, table, lineCount, errorFlag);
     }
+    /* The parallel pass counts the lines it reads */
+    if (lineCount) Stats.am_lines = lineCount;
 
+    freezeLabelTable(table);
     rewind(amFile);
     return table;
 }
+
+
+/*******************************************************************************
+ * Processes one line of the first pass, adding the label or extern label it
+ * defines to the label table.
+ *
+ * Parameters:
+ *   line - The line of the .am file (modified in place).
+ *   table - Pointer to the label table.
+ *   lineCount - The line number for error reporting.
+ *   errorFlag - Pointer to the error count of the file, incremented for every
+ *               line with errors.
+ ******************************************************************************/
+void ProcessFirstPassLine(char *line, LabelTable *table, int lineCount, int *errorFlag) {
+    int len = 0; /* Length of the current line. */
+    int line_error = 0; /* Error flag of this line alone. */
+    LineScan scan; /* Class bitmaps of the line, shared by its helpers. */
+
+    if (isExtern(line) || IsLabelDefinition(line)){
+        len = strlen(line)-1;
+        while(line[len] == '\r' || line[len] == '\n'){
+            line[len] = '\0';
+            len--;
+        }
+        scanString(line, &scan);
+        if (isExtern(line))
+            ProcessExternDefinition(line, &scan, table, lineCount, &line_error);
+        else
+            ProcessLabelDefinition(line, &scan, table, lineCount, &line_error);
+    }
+    if (line_error) {
+        TRACE_PROBE3(diagnostic, Stats.file_name, lineCount, TRACE_FIRST_PASS);
+        (*errorFlag)++;
+    }
+}
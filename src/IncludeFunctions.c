@@ -0,0 +1,260 @@
+#define _POSIX_C_SOURCE 200112L
+#include "Assembler.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Process wide cache of included files, shared by every file of the run */
+static IncludeFile *include_cache = NULL;
+
+
+/*******************************************************************************
+ * Checks if a line contains an include directive.
+ *
+ * Parameters:
+ * - line: The line to check.
+ *
+ * Returns:
+ * - 1 if the line contains an include directive, 0 otherwise.
+ ******************************************************************************/
+int isIncludeDirective(char* line){
+    int len = strlen(INCLUDE_DIRECTIVE);
+    if (!startsWith(line, INCLUDE_DIRECTIVE, len)) return 0;
+    return line[len] == ' ' || line[len] == '\t' || line[len] == '\"';
+}
+
+
+/*******************************************************************************
+ * Processes an include line.
+ * The included file is taken from the include cache and its lines are
+ * pre-processed as if they appeared in place of the include line, split
+ * like the lines of a source file. A file is included only once per
+ * translation unit (include guard). Diagnostics of the included lines name
+ * the included file and are placed at the line of the outermost include.
+ *
+ * Parameters:
+ * - state: The PreAssembler state of the current file.
+ * - line: The include line, without leading spaces.
+ * - scan: The scan of the line, or NULL.
+ * - counter: The line number for error messages.
+ * - file_name: The name of the file containing the include line.
+ *
+ * Returns:
+ * - 1 on success, 0 on an error that stops pre-processing.
+ ******************************************************************************/
+int ProcessIncludeLine(PreAssemblerState* state, char* line, LineScan* scan, int counter, char* file_name){
+    char source_line[MAX_LINE_LENGTH + 1]; /* Buffer for the current included line */
+    char *name, *end, *path, *outer_source = state->source;
+    IncludeFile *file;
+    size_t pos = 0, len;
+    int line_number = 0, ok = 1, marked;
+
+    /* Extract the quoted file name */
+    line += strlen(INCLUDE_DIRECTIVE);
+    name = deleteSpaces(deleteLineEnd(line, scan), scan);
+    end = (*name == '\"') ? strchr(name + 1, '\"') : NULL;
+    if (!end || end == name + 1) {
+        diagnose(counter, DIAG_INCLUDE, "Missing quoted file name after %s", INCLUDE_DIRECTIVE);
+        return 0;
+    }
+    if (!isEmptyOrComment(deleteSpaces(end + 1, scan))) {
+        diagnose(counter, DIAG_INCLUDE, "Extra text after %s file name", INCLUDE_DIRECTIVE);
+        return 0;
+    }
+    *end = '\0';
+    name++;
+
+    if (state->depth >= MAX_INCLUDE_DEPTH) {
+        diagnose(counter, DIAG_INCLUDE, "Includes nested too deeply: %s", name);
+        return 0;
+    }
+
+    /* Find the file in the include cache, reading it on first use */
+    path = resolveIncludePath(file_name, name);
+    if (!path) return 0;
+    file = getIncludeFile(path);
+    if (!file) {
+        diagnose(counter, DIAG_INCLUDE, "Cannot include file: %s", path);
+        memFree(path);
+        return 0;
+    }
+    memFree(path);
+
+    /* Include guard: every file is expanded once per translation unit */
+    if ((marked = markIncluded(state, file)) <= 0) return marked == 0;
+
+    if (state->depth++ == 0) state->include_line = counter;
+    state->source = file->path;
+    diagSetSource(file->path, state->include_line);
+
+    /* The lines are read like the lines of a source file: a line longer than
+       a source line continues on the next one and is reported there */
+    while (ok && nextSourceLine(file->buffer, file->size, &pos, source_line)) {
+        line_number++;
+        /* A last line without a newline still ends before the next line */
+        len = strlen(source_line);
+        if (pos == file->size && source_line[len - 1] != '\n') strcpy(source_line + len, "\n");
+        ok = PreProcessLine(state, source_line, line_number, file->path);
+    }
+
+    state->depth--;
+    state->source = outer_source;
+    diagSetSource(outer_source, state->include_line);
+    return ok;
+}
+
+
+/*******************************************************************************
+ * Resolves an include name relative to the directory of the including file.
+ *
+ * Parameters:
+ * - including_file: The name of the file containing the include line.
+ * - include_name: The name given in the include line.
+ *
+ * Returns:
+ * - A newly allocated path, or NULL on failure.
+ ******************************************************************************/
+char* resolveIncludePath(char* including_file, char* include_name){
+    char *slash, *path;
+    int dir_len = 0;
+
+    slash = strrchr(including_file, '/');
+    if (slash && *include_name != '/') dir_len = slash - including_file + 1;
+
+    path = (char*)memAlloc(MEM_FILE_NAMES, dir_len + strlen(include_name) + 1);
+    if (!path) {
+        fprintf(stderr, "MemError, Failed to allocate Memory for include path!\n");
+        return NULL;
+    }
+    strncpy(path, including_file, dir_len);
+    strcpy(path + dir_len, include_name);
+    return path;
+}
+
+
+/*******************************************************************************
+ * Looks up a file in the include cache, loading it on first use. Files are
+ * told apart by their device and inode, so "x.inc", "./x.inc" and a link
+ * to it are the same file, read once and guarded once.
+ *
+ * Parameters:
+ * - path: The resolved path of the file.
+ *
+ * Returns:
+ * - A pointer to the cached file, or NULL if it cannot be read.
+ ******************************************************************************/
+IncludeFile* getIncludeFile(char* path){
+    IncludeFile *file;
+    struct stat st;
+
+    if (stat(path, &st) != 0) return NULL;
+    for (file = include_cache; file != NULL; file = file->next) {
+        if (file->device == (unsigned long)st.st_dev && file->inode == (unsigned long)st.st_ino) return file;
+    }
+
+    file = loadIncludeFile(path);
+    if (!file) return NULL;
+    file->next = include_cache;
+    include_cache = file;
+    return file;
+}
+
+
+/*******************************************************************************
+ * Maps a file into memory.
+ *
+ * Parameters:
+ * - path: The path of the file.
+ *
+ * Returns:
+ * - A newly allocated IncludeFile, or NULL if the file cannot be read or
+ *   memory runs out.
+ ******************************************************************************/
+IncludeFile* loadIncludeFile(char* path){
+    IncludeFile *file;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    file = (IncludeFile*)memCalloc(MEM_LINES, 1, sizeof(IncludeFile));
+    if (!file) {
+        fprintf(stderr, "MemError, Failed to allocate Memory for include file!\n");
+        close(fd);
+        return NULL;
+    }
+    file->device = (unsigned long)st.st_dev;
+    file->inode = (unsigned long)st.st_ino;
+    file->size = (size_t)st.st_size;
+    if (file->size > 0) {
+        file->buffer = (char*)mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file->buffer == MAP_FAILED) {
+            close(fd);
+            memFree(file);
+            return NULL;
+        }
+    }
+    close(fd);
+
+    file->path = (char*)memAlloc(MEM_FILE_NAMES, strlen(path) + 1);
+    if (!file->path) {
+        fprintf(stderr, "MemError, Failed to allocate Memory for include file!\n");
+        if (file->buffer) munmap(file->buffer, file->size);
+        memFree(file);
+        return NULL;
+    }
+    strcpy(file->path, path);
+    return file;
+}
+
+
+/*******************************************************************************
+ * Marks a file as included in the current translation unit.
+ *
+ * Parameters:
+ * - state: The PreAssembler state of the current file.
+ * - file: The included file.
+ *
+ * Returns:
+ * - 1 if the file was not included before, 0 if it was, -1 if memory runs
+ *   out.
+ ******************************************************************************/
+int markIncluded(PreAssemblerState* state, IncludeFile* file){
+    IncludeFile **included;
+    int i;
+
+    for (i = 0; i < state->num_included; i++) {
+        if (state->included[i] == file) return 0;
+    }
+
+    included = (IncludeFile**)memRealloc(MEM_OTHER, state->included, (state->num_included + 1) * sizeof(IncludeFile*));
+    if (!included) {
+        fprintf(stderr, "MemError, Failed to allocate Memory for include list!\n");
+        return -1;
+    }
+    state->included = included;
+    state->included[state->num_included++] = file;
+    return 1;
+}
+
+
+/*******************************************************************************
+ * Unmaps and frees every file of the include cache.
+ ******************************************************************************/
+void freeIncludeCache(void){
+    IncludeFile *file = include_cache, *next;
+    while (file != NULL) {
+        next = file->next;
+        if (file->buffer) munmap(file->buffer, file->size);
+        memFree(file->path);
+        memFree(file);
+        file = next;
+    }
+    include_cache = NULL;
+}
@@ -6,31 +6,32 @@
  *
  * Parameters:
  * - line: The line containing the label definition.
+ * - scan: The scan of the line, or NULL.
  * - table: Pointer to the LabelTable for label management.
  * - lineCount: Current line number for error reporting.
  * - errorFlag: Pointer to an integer flag indicating if an error has occurred.
  ******************************************************************************/
-void ProcessLabelDefinition(char *line, LabelTable *table, int lineCount, int *errorFlag){
+void ProcessLabelDefinition(char *line, LineScan* scan, LabelTable *table, int lineCount, int *errorFlag){
 
     char *label_name = NULL; /* Pointer to store the name of the label. */
     char *line_rest = NULL;
     int mat = 0;
 
-    label_name = deleteSpaces(strtok(line, ":\r\n"));
-    if (!validLabel(label_name, lineCount)) {
+    label_name = deleteSpaces(splitLabelDefinition(line, scan, &line_rest), scan);
+    if (!validLabel(label_name, scan, lineCount)) {
         *errorFlag = 1; 
         return;
     }
 
     if (findLabel(table, label_name) != -1) {
-        fprintf(stderr, "Error at line %d, Duplicate Label definition %s\n", lineCount, label_name);
+        diagnose(lineCount, DIAG_LABEL, "Duplicate Label definition %s", label_name);
         *errorFlag = 1;
         return;
     }
-    line_rest = deleteSpaces(strtok(NULL, "\r\n"));
-    mat = IsMatrixDirective(line_rest);
+    line_rest = deleteSpaces(line_rest, scan);
+    mat = line_rest && IsMatrixDirective(line_rest);
 
-    addLabel(table, label_name, 0, mat, errorFlag);
+    addLabel(table, label_name, 0, mat, errorFlag)->line = lineCount;
 }
 
 
@@ -40,42 +41,43 @@ void ProcessLabelDefinition(char *line, LabelTable *table, int lineCount, int *e
  *
  * Parameters:
  * - line: The line containing the extern label definition.
+ * - scan: The scan of the line, or NULL.
  * - table: Pointer to the LabelTable for label management.
  * - lineCount: Current line number for error reporting.
  * - errorFlag: Pointer to an integer flag indicating if an error has occurred.
  ******************************************************************************/
-void ProcessExternDefinition(char* line, LabelTable* table, int lineCount, int* errorFlag) {
+void ProcessExternDefinition(char* line, LineScan* scan, LabelTable* table, int lineCount, int* errorFlag) {
     char *label_name = NULL; /* Pointer to store the name of the external label. */
 
     
     line += strlen(".extern");
-    label_name = deleteSpaces(line);
+    label_name = deleteSpaces(line, scan);
     if (!label_name || isEmptyOrComment(label_name)) {
-        fprintf(stderr, "Error at Line %d: Missing extern label name\n", lineCount);
+        diagnose(lineCount, DIAG_LABEL, "Missing extern label name");
         *errorFlag = 1; /* Set error flag. */
         return;
     }
 
-    if(strchr(label_name, ' ') || strchr(label_name, '\t')) {
-        fprintf(stderr, "Error at Line %d: Extra text after extern label definition\n", lineCount);
+    if(hasBlank(label_name, scan)) {
+        diagnose(lineCount, DIAG_LABEL, "Extra text after extern label definition");
         *errorFlag = 1; /* Set error flag. */
         return;
     }
 
-    label_name = deleteSpaces(label_name);
+    label_name = deleteSpaces(label_name, scan);
 
     
-    if (!validLabel(label_name, lineCount)) {
+    if (!validLabel(label_name, scan, lineCount)) {
         *errorFlag = 1; /* Set error flag. */
         return;
     }
 
     if (findLabel(table, label_name) != -1) {
-        fprintf(stderr, "Error at line %d, Duplicate extern label definition %s\n", lineCount, label_name);
+        diagnose(lineCount, DIAG_LABEL, "Duplicate extern label definition %s", label_name);
         *errorFlag = 1;
         return;
     }
-    addLabel(table, label_name, 1, 0, errorFlag);/* Add the label as an external label. */
+    addLabel(table, label_name, 1, 0, errorFlag)->line = lineCount; /* Add the label as an external label. */
 }
 
 
@@ -90,18 +92,20 @@ void ProcessExternDefinition(char* line, LabelTable* table, int lineCount, int*
  ******************************************************************************/
 LabelTable* create_LabelTable(int size){
     int i;
-    LabelTable* table = (LabelTable *)malloc(sizeof(LabelTable)); /* Allocate memory for label table */
+    LabelTable* table = (LabelTable *)memAlloc(MEM_LABELS, sizeof(LabelTable)); /* Allocate memory for label table */
     if(table == NULL){
         fprintf(stderr, "Error, Failed to allocate memory for the Labels table\n");
         exit(1);
     } 
     table->table_size = size; /* Set initial table size */
-    table->Labels = (Label **)malloc(size * sizeof(Label *)); /* Allocate memory for label pointers */
+    table->Labels = (Label **)memAlloc(MEM_LABELS, size * sizeof(Label *)); /* Allocate memory for label pointers */
     if(table->Labels == NULL){
         fprintf(stderr, "Error, Failed to allocate memory for the Labels\n");
         exit(1);
     } 
     table->num_labels = 0; /* Initialize number of labels to 0 */
+    table->frozen = NULL; /* Not frozen while labels are added */
+    table->frozen_mask = 0;
     for(i = 0; i < size; i++){ /* Initialize label pointers to NULL */
         table->Labels[i] = NULL;
     }
@@ -135,7 +139,7 @@ void resizeLabelTable(LabelTable* table) {
     int i = 0, index = 0;
 
     /*Allocate new array of pointers to Label*/
-    Label** new_labels = calloc(new_size, sizeof(Label*));
+    Label** new_labels = memCalloc(MEM_LABELS, new_size, sizeof(Label*));
     if (!new_labels) {
         fprintf(stderr, "Error: Failed to allocate memory for the new Labels table\n");
         exit(1);
@@ -156,7 +160,9 @@ void resizeLabelTable(LabelTable* table) {
     }
 
     /*Free old table and update the table structure*/
-    free(table->Labels);
+    statsAdd(&Stats.resizes, 1);
+    TRACE_PROBE3(table__resize, old_size, new_size, table->num_labels);
+    memFree(table->Labels);
     table->Labels = new_labels;
     table->table_size = new_size;
 }
@@ -174,9 +180,12 @@ void resizeLabelTable(LabelTable* table) {
  * - A pointer to the newly created Label.
  ******************************************************************************/
 Label *createLabel(char *name, int ext, int mat){
-    Label *new_label = (Label *)malloc(sizeof(Label));
-    new_label->name = NULL; 
-    new_label->name = (char *)malloc(MAX_LABEL);
+    Label *new_label = (Label *)memAlloc(MEM_LABELS, sizeof(Label));
+    if(new_label == NULL){
+        fprintf(stderr, "Failed to allocate memory for new Label\n");
+        exit(1);
+    }
+    new_label->name = (char *)memAlloc(MEM_LABELS, strlen(name) + 1);
     if(new_label->name == NULL){
         fprintf(stderr, "Failed to allocate memory for new Label\n");
         exit(1);
@@ -188,6 +197,8 @@ Label *createLabel(char *name, int ext, int mat){
     new_label->mat = mat;
     new_label->ref = NULL;
     new_label->dc = 0;
+    new_label->hash_value = hash(name);
+    new_label->line = 0;
     new_label->next = NULL;
     
     return new_label;
@@ -204,9 +215,25 @@ Label *createLabel(char *name, int ext, int mat){
  * - The hashed index.
  ******************************************************************************/
 unsigned int hash(char* str){
+    return hashSpan(str, strlen(str));
+}
+
+
+/*******************************************************************************
+ * Hashes the first characters of a string, like hash does for the whole
+ * string, so names can be hashed in place inside a line.
+ *
+ * Parameters:
+ * - str: The characters to hash.
+ * - len: Number of characters to hash.
+ *
+ * Returns:
+ * - The hashed index.
+ ******************************************************************************/
+unsigned int hashSpan(const char* str, int len){
     unsigned int hash = 0;
     int i;
-    for (i = 0; str[i] != '\0'; i++) {
+    for (i = 0; i < len; i++) {
         hash = (hash << 3) ^ str[i]; /*Bitwise XOR to provide a better distribution*/
     }
     return hash;
@@ -222,23 +249,36 @@ unsigned int hash(char* str){
  * - ext: The external flag for the label.
  * - mat: The matrix flag for the label.
  * - Label_error: Pointer to an integer flag indicating if an error has occurred.
+ *
+ * Returns:
+ * - The new label.
  ******************************************************************************/
-void addLabel(LabelTable* table, char* name, int ext , int mat, int *Label_error){
+Label *addLabel(LabelTable* table, char* name, int ext , int mat, int *Label_error){
+    Label *label = createLabel(name, ext, mat);
+
+    insertLabel(table, label);
+    return label;
+}
+
+
+/*******************************************************************************
+ * Links an already created label into the label table.
+ *
+ * Parameters:
+ * - table: Pointer to the LabelTable to modify.
+ * - label: The label to link, its next pointer is overwritten.
+ ******************************************************************************/
+void insertLabel(LabelTable* table, Label* label){
     unsigned int index;
     Label *current_label = NULL; 
-    Label *new_label;
-    
-    new_label = createLabel(name, ext, mat);
-    index = hash(name) % (table->table_size);
+
+    index = label->hash_value % (table->table_size);
     current_label = table->Labels[index];
     if(current_label == NULL) table->num_labels++;
-    new_label->next = current_label;
-    table->Labels[index] = new_label;
+    label->next = current_label;
+    table->Labels[index] = label;
     
     CheckAndResizeTable(table);
-    
-    
-    
 }
 
 
@@ -253,60 +293,95 @@ void addLabel(LabelTable* table, char* name, int ext , int mat, int *Label_error
  * - The index of the label if found, or -1 if not found.
  ******************************************************************************/
 short int findLabel(LabelTable* table, char* name){
-    unsigned int index;
-    Label *current_label;
-    index = hash(name) % table->table_size;
-    current_label = table->Labels[index];
-    while (current_label != NULL){
-        if (strcmp(current_label->name, name) == 0) {
-            return index;
-        }
-        current_label = current_label->next;
-    }
-    return -1; 
+    Label *label = getLabel(table, name);
+    if (label == NULL) return -1;
+    return label->hash_value % table->table_size;
 }
 
 
 /*******************************************************************************
- * Updates the address of a label in the label table and returns a pointer to the label.
+ * Looks up a label by name.
+ * A frozen table is searched through its open addressing index, otherwise
+ * the chain of the label's bucket is walked.
  *
  * Parameters:
- * - label_name: The name of the label to update.
- * - table: Pointer to the LabelTable to modify.
- * - PC : Program counters array (PC[0] for IC, PC[1] for DC).
+ * - table: Pointer to the LabelTable to search.
+ * - name: The name of the label to find.
  *
  * Returns:
- * - A pointer to the updated Label, or NULL if not found.
+ * - A pointer to the label, or NULL if not found.
  ******************************************************************************/
-Label *UpdateAddressAndGetLabel(char *label_name, LabelTable *table, int PC[]){
-    Label *current_label; /* Pointer to traverse through labels in the table */
-    int index; /* Index where the label is expected to be found based on hashing or similar mechanism */
-
-    /* Validate input parameters */
-    if (!label_name || !table) return NULL;
-
-    /* Find the index of the label in the table */
-    index = findLabel(table, label_name);
-
-    /* Validate the index */
-    if (index < 0 || index >= table->table_size) return NULL;
-
-    /* Traverse the linked list at the found index to search for the label */
-    for (current_label = table->Labels[index]; current_label; current_label = current_label->next) {
-        /* Compare the current label's name with the target label name */
-        if (strcmp(current_label->name, label_name) == 0) {
-            /* If found, update the label's address */
-            current_label->address = PC[0] + PC[1] + 100;
-            /* Return the pointer to the updated label */
-            return current_label;
+Label *getLabel(LabelTable* table, char* name){
+    return getLabelSpan(table, name, strlen(name));
+}
+
+
+/*******************************************************************************
+ * Looks up a label by a name that is not terminated, such as a token
+ * inside a line, without copying it.
+ *
+ * Parameters:
+ * - table: Pointer to the LabelTable to search.
+ * - name: The first character of the name.
+ * - len: Length of the name.
+ *
+ * Returns:
+ * - A pointer to the label, or NULL if not found.
+ ******************************************************************************/
+Label *getLabelSpan(LabelTable* table, const char* name, int len){
+    unsigned int h = hashSpan(name, len), i;
+    Label *current_label;
+
+    if (table->frozen) {
+        for (i = h & table->frozen_mask; (current_label = table->frozen[i]) != NULL; i = (i + 1) & table->frozen_mask) {
+            if (current_label->hash_value == h && strncmp(current_label->name, name, len) == 0 && current_label->name[len] == '\0') return current_label;
         }
+        return NULL;
     }
 
-    /* Return NULL if the label is not found */
+    for (current_label = table->Labels[h % table->table_size]; current_label; current_label = current_label->next) {
+        if (strncmp(current_label->name, name, len) == 0 && current_label->name[len] == '\0') return current_label;
+    }
     return NULL;
 }
 
 
+/*******************************************************************************
+ * Freezes the label table once the first pass has collected every label.
+ * Builds a read only open addressing index, at most half full, so lookups
+ * during encoding probe a flat array with cached hashes instead of chains.
+ * The chains are kept as they are for the output files.
+ *
+ * Parameters:
+ * - table: Pointer to the LabelTable to freeze.
+ ******************************************************************************/
+void freezeLabelTable(LabelTable* table){
+    Label *current_label;
+    unsigned int size = 16, count = 0, i;
+    int j;
+
+    for (j = 0; j < table->table_size; j++) {
+        for (current_label = table->Labels[j]; current_label; current_label = current_label->next) count++;
+    }
+    while (size < 2 * count) size *= 2;
+
+    memFree(table->frozen);
+    table->frozen = (Label **)memCalloc(MEM_LABELS, size, sizeof(Label *));
+    if (table->frozen == NULL) {
+        fprintf(stderr, "Error, Failed to allocate memory for the frozen Labels table\n");
+        exit(1);
+    }
+    table->frozen_mask = size - 1;
+
+    for (j = 0; j < table->table_size; j++) {
+        for (current_label = table->Labels[j]; current_label; current_label = current_label->next) {
+            for (i = current_label->hash_value & table->frozen_mask; table->frozen[i]; i = (i + 1) & table->frozen_mask);
+            table->frozen[i] = current_label;
+        }
+    }
+}
+
+
 /*******************************************************************************
  * Reallocates the label table to accommodate more labels.
  *
@@ -348,20 +423,21 @@ void freeLabelTable(LabelTable* table){
         current_label = table->Labels[i];
         while (current_label != NULL) {
             next_label = current_label->next;
-            free(current_label->name);
+            memFree(current_label->name);
             current_ref = current_label->ref;
             while(current_ref){
                 next_ref = current_ref->next;
-                free(current_ref);
+                memFree(current_ref);
                 current_ref = next_ref;
             }
-            free(current_label);
+            memFree(current_label);
             current_label = next_label;
         }
     }
-    if(table->Labels) free(table->Labels);
+    if(table->Labels) memFree(table->Labels);
     table->Labels = NULL;
-    free(table);
+    memFree(table->frozen);
+    memFree(table);
 }
 
 
@@ -0,0 +1,606 @@
+#include "Assembler.h"
+
+/* Character classes */
+#define BL 0  /* blank: space, tab */
+#define EL 1  /* end of line: \r, \n and the terminator */
+#define LE 2  /* letter other than r */
+#define RR 3  /* r, starts registers */
+#define OC 4  /* digit 0-7, valid register number */
+#define DI 5  /* digit 8-9 */
+#define SG 6  /* sign: + or - */
+#define HS 7  /* # */
+#define DT 8  /* . */
+#define CL 9  /* : */
+#define CM 10 /* , */
+#define OP 11 /* [ */
+#define CS 12 /* ] */
+#define QT 13 /* " */
+#define OT 14 /* anything else */
+#define LEX_CLASSES 15
+
+/* Lexer states */
+#define ST 0  /* between tokens */
+#define ID 1  /* identifier */
+#define NU 2  /* number */
+#define SI 3  /* sign of a number */
+#define HA 4  /* # of an immediate */
+#define HG 5  /* sign of an immediate */
+#define IM 6  /* immediate digits */
+#define DO 7  /* . of a directive */
+#define DR 8  /* directive name */
+#define SR 9  /* inside a string */
+#define SE 10 /* closing quote of a string */
+#define DM 11 /* [ of a matrix dimension */
+#define DN 12 /* dimension digits */
+#define M1 13 /* first [ of a matrix reference */
+#define R1 14 /* r of the first register */
+#define G1 15 /* first register number */
+#define C1 16 /* first ] */
+#define M2 17 /* second [ */
+#define R2 18 /* r of the second register */
+#define G2 19 /* second register number */
+#define ME 20 /* second ], end of the matrix reference */
+#define EN 21 /* end of line */
+#define ER 22 /* invalid token, up to the next blank or comma */
+#define LEX_STATES 23
+
+/* Transition flags */
+#define STATE_MASK 0x1F
+#define LS 0x20 /* a token starts at this character */
+#define LE_ 0x40 /* emit the token before this character, then lex it from ST */
+#define LT 0x80 /* emit the token including this character */
+#define XX (ST|LE_) /* a blank or comma ends the token */
+
+/* Class of every character */
+static const unsigned char lexClass[256] = {
+    OT, OT, OT, OT, OT, OT, OT, OT, OT, BL, EL, OT, OT, EL, OT, OT,
+    OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT,
+    BL, OT, QT, HS, OT, OT, OT, OT, OT, OT, OT, SG, CM, SG, DT, OT,
+    OC, OC, OC, OC, OC, OC, OC, OC, DI, DI, CL, OT, OT, OT, OT, OT,
+    OT, LE, LE, LE, LE, LE, LE, LE, LE, LE, LE, LE, LE, LE, LE, LE,
+    LE, LE, LE, LE, LE, LE, LE, LE, LE, LE, LE, OP, OT, CS, OT, OT,
+    OT, LE, LE, LE, LE, LE, LE, LE, LE, LE, LE, LE, LE, LE, LE, LE,
+    LE, LE, RR, LE, LE, LE, LE, LE, LE, LE, LE, OT, OT, OT, OT, OT,
+    OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT,
+    OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT,
+    OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT,
+    OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT,
+    OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT,
+    OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT,
+    OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT,
+    OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT, OT
+};
+
+/* Next state and flags for every state and class */
+static const unsigned char lexTable[LEX_STATES][LEX_CLASSES] = {
+    /*        BL      EL      LE      RR      OC      DI      SG      HS      DT      CL      CM         OP      CS      QT      OT */
+    /* ST */ {ST,     EN,     ID|LS,  ID|LS,  NU|LS,  NU|LS,  SI|LS,  HA|LS,  DO|LS,  ER|LS,  ST|LS|LT,  DM|LS,  ER|LS,  SR|LS,  ER|LS},
+    /* ID */ {XX,     XX,     ID,     ID,     ID,     ID,     ER,     ER,     ER,     ST|LT,  XX,        M1,     ER,     ER,     ER},
+    /* NU */ {XX,     XX,     ER,     ER,     NU,     NU,     ER,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER},
+    /* SI */ {XX,     XX,     ER,     ER,     NU,     NU,     ER,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER},
+    /* HA */ {XX,     XX,     ER,     ER,     IM,     IM,     HG,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER},
+    /* HG */ {XX,     XX,     ER,     ER,     IM,     IM,     ER,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER},
+    /* IM */ {XX,     XX,     ER,     ER,     IM,     IM,     ER,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER},
+    /* DO */ {XX,     XX,     DR,     DR,     ER,     ER,     ER,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER},
+    /* DR */ {XX,     XX,     DR,     DR,     ER,     ER,     ER,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER},
+    /* SR */ {SR,     XX,     SR,     SR,     SR,     SR,     SR,     SR,     SR,     SR,     SR,        SR,     SR,     SE,     SR},
+    /* SE */ {XX,     XX,     ER,     ER,     ER,     ER,     ER,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER},
+    /* DM */ {XX,     XX,     ER,     ER,     DN,     DN,     ER,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER},
+    /* DN */ {XX,     XX,     ER,     ER,     DN,     DN,     ER,     ER,     ER,     ER,     XX,        ER,     ST|LT,  ER,     ER},
+    /* M1 */ {XX,     XX,     ER,     R1,     ER,     ER,     ER,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER},
+    /* R1 */ {XX,     XX,     ER,     ER,     G1,     ER,     ER,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER},
+    /* G1 */ {XX,     XX,     ER,     ER,     ER,     ER,     ER,     ER,     ER,     ER,     XX,        ER,     C1,     ER,     ER},
+    /* C1 */ {XX,     XX,     ER,     ER,     ER,     ER,     ER,     ER,     ER,     ER,     XX,        M2,     ER,     ER,     ER},
+    /* M2 */ {XX,     XX,     ER,     R2,     ER,     ER,     ER,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER},
+    /* R2 */ {XX,     XX,     ER,     ER,     G2,     ER,     ER,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER},
+    /* G2 */ {XX,     XX,     ER,     ER,     ER,     ER,     ER,     ER,     ER,     ER,     XX,        ER,     ME,     ER,     ER},
+    /* ME */ {XX,     XX,     ER,     ER,     ER,     ER,     ER,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER},
+    /* EN */ {EN,     EN,     ER|LS,  ER|LS,  ER|LS,  ER|LS,  ER|LS,  ER|LS,  ER|LS,  ER|LS,  ER|LS,     ER|LS,  ER|LS,  ER|LS,  ER|LS},
+    /* ER */ {XX,     XX,     ER,     ER,     ER,     ER,     ER,     ER,     ER,     ER,     XX,        ER,     ER,     ER,     ER}
+};
+
+/* Token emitted when a state ends before the current character,
+   a state that is no complete token ends an invalid one */
+static const signed char emitType[LEX_STATES] = {
+    -1, TOKEN_IDENT, TOKEN_NUMBER, TOKEN_INVALID, TOKEN_INVALID, TOKEN_INVALID, TOKEN_IMMEDIATE, TOKEN_INVALID,
+    TOKEN_DIRECTIVE, TOKEN_INVALID, TOKEN_STRING, TOKEN_INVALID, TOKEN_INVALID, TOKEN_INVALID, TOKEN_INVALID,
+    TOKEN_INVALID, TOKEN_INVALID, TOKEN_INVALID, TOKEN_INVALID, TOKEN_INVALID, TOKEN_MATRIX, -1, TOKEN_INVALID
+};
+
+/* Token emitted when a state ends with the current character */
+static const signed char takeType[LEX_STATES] = {
+    TOKEN_COMMA, TOKEN_LABEL_DEF, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, TOKEN_DIMENSION, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+/* Directive names, indexed by DIRECTIVE_* */
+static const char *directiveName[] = {".data", ".string", ".mat", ".entry", ".extern"};
+
+/* Instruction mnemonics, indexed by opcode */
+static const char *mnemonicName[] = {"mov", "cmp", "add", "sub", "lea", "clr", "not", "inc",
+                                     "dec", "jmp", "bne", "jsr", "red", "prn", "rts", "stop"};
+
+
+/*******************************************************************************
+ * Finds the index of a span in a table of names.
+ *
+ * Parameters:
+ * - names: The table of names.
+ * - count: Number of names in the table.
+ * - start: The span.
+ * - length: Length of the span.
+ *
+ * Returns:
+ * - The index of the name, or -1 if the span matches none.
+ ******************************************************************************/
+static int findName(const char** names, int count, const char* start, int length){
+    int i;
+    for (i = 0; i < count; i++) {
+        if ((int)strlen(names[i]) == length && strncmp(names[i], start, length) == 0) return i;
+    }
+    return -1;
+}
+
+
+/*******************************************************************************
+ * Appends a token to the tokens of a line, refining identifiers into
+ * registers and mnemonics and resolving directive names. A number of more
+ * than 9 digits or an unknown directive becomes an invalid token.
+ *
+ * Parameters:
+ * - tokens: The tokens of the line.
+ * - type: The TOKEN_* type of the token.
+ * - state: The lexer state the token ends in.
+ * - start: First character of the token.
+ * - length: Length of the token.
+ * - value: Value of the token, the lexer state an invalid token failed in.
+ * - value2: Second value of the token, where an invalid token failed.
+ * - digits: Digits of a number.
+ ******************************************************************************/
+static void emitToken(LineTokens* tokens, int type, int state, const char* start, int length, int value, int value2, int digits){
+    Token *token = &tokens->tokens[tokens->count++];
+
+    if (type == TOKEN_IDENT) {
+        if (length == 2 && start[0] == 'r' && start[1] >= '0' && start[1] <= '7') {
+            type = TOKEN_REGISTER;
+            value = start[1] - '0';
+        } else if ((value = findName(mnemonicName, 16, start, length)) != -1) {
+            type = TOKEN_MNEMONIC;
+        }
+    }
+    if ((type == TOKEN_DIRECTIVE && (value = findName(directiveName, 5, start, length)) == -1) ||
+        ((type == TOKEN_NUMBER || type == TOKEN_IMMEDIATE || type == TOKEN_DIMENSION) && digits > 9)) {
+        type = TOKEN_INVALID;
+        value = state;
+        value2 = length;
+    }
+
+    token->type = type;
+    token->start = start;
+    token->length = length;
+    token->value = value;
+    token->value2 = value2;
+}
+
+
+/*******************************************************************************
+ * Splits a line into typed tokens in one pass, driven by a character class
+ * table and a state transition table. Numbers, registers and matrix
+ * references are checked and their values computed while lexing. Text that
+ * is no valid token becomes an invalid token up to the next blank or comma,
+ * holding the state it failed in and where, for the error message.
+ *
+ * Parameters:
+ * - line: The line to split.
+ * - tokens: Receives the tokens, as spans of the line.
+ *
+ * Returns:
+ * - The number of tokens.
+ ******************************************************************************/
+int lexLine(const char* line, LineTokens* tokens){
+    const char *p, *start = line;
+    int state = ST, from, next, cls, type, value = 0, digits = 0, negative = 0, reg[2] = {0, 0};
+    int fail = ST, fail_at = 0; /* Where the invalid token being lexed failed */
+
+    tokens->count = 0;
+    for (p = line; ; p++) {
+        cls = (*p == '\0') ? EL : lexClass[(unsigned char)*p];
+
+        /* The first pass trims a label name, a blank may come before its colon */
+        if (state == ST && cls == CL && tokens->count == 1 && tokens->tokens[0].type == TOKEN_IDENT) {
+            tokens->tokens[0].type = TOKEN_LABEL_DEF;
+            continue;
+        }
+
+        next = lexTable[state][cls];
+        from = state;
+
+        if (next & LE_) {
+            type = emitType[state];
+            if (type == TOKEN_INVALID && state != ER) {
+                fail = state;
+                fail_at = (int)(p - start);
+            }
+            emitToken(tokens, type, state, start, (int)(p - start),
+                      type == TOKEN_INVALID ? fail : type == TOKEN_MATRIX ? reg[0] : (negative ? -value : value),
+                      type == TOKEN_INVALID ? fail_at : reg[1], digits);
+            from = ST;
+            next = lexTable[ST][cls];
+        }
+        if (next & LS) {
+            start = p;
+            value = digits = negative = 0;
+        }
+        if ((next & STATE_MASK) == ER && from != ER) {
+            fail = from;
+            fail_at = (int)(p - start);
+        }
+        if (next & LT) {
+            /* A label definition ends before its colon */
+            emitToken(tokens, takeType[from], from, start, (int)(p - start) + (from == ID ? 0 : 1), value, 0, digits);
+        }
+
+        state = next & STATE_MASK;
+        if (cls == OC || cls == DI) {
+            if (state == NU || state == IM || state == DN) {
+                if (digits++ < 9) value = value * 10 + (*p - '0');
+            }
+            else if (state == G1) reg[0] = *p - '0';
+            else if (state == G2) reg[1] = *p - '0';
+        }
+        else if (cls == SG) negative = (*p == '-');
+
+        if (*p == '\0') break;
+    }
+    return tokens->count;
+}
+
+
+/*******************************************************************************
+ * Reports an operand that is no immediate, register, label or matrix, with
+ * the reason its token gives.
+ *
+ * Parameters:
+ * - operand: The operand token.
+ * - line_count: The line number for error reporting.
+ ******************************************************************************/
+static void reportOperand(Token* operand, int line_count){
+    const char *text = operand->start, *reg;
+    int fail = operand->type == TOKEN_INVALID ? operand->value : -1, length;
+
+    if (fail == HA || fail == HG || fail == IM) {
+        diagnose(line_count, DIAG_OPERAND, "Invalid immediate format2: %.*s", operand->length - 1, text + 1);
+    }
+    else if ((fail == R1 || fail == R2) && isdigit((unsigned char)text[operand->value2])) {
+        /* A register of a matrix beyond r7 */
+        reg = text + operand->value2 - 1;
+        for (length = 0; length < operand->length - operand->value2 + 1 && reg[length] != ']'; length++);
+        if (length == 2) diagnose(line_count, DIAG_OPERAND, "Invalid register number: %.*s", length, reg);
+        else diagnose(line_count, DIAG_OPERAND, "Invalid register format: %.*s", length, reg);
+        diagnose(line_count, DIAG_OPERAND, "Invalid register in matrix operand: %.*s", length, reg);
+    }
+    else if (fail >= M1 && fail <= ME) {
+        diagnose(line_count, DIAG_OPERAND, "Invalid matrix operand %.*s", operand->length, text);
+    }
+    else if (text[0] == 'r' && (operand->type == TOKEN_IDENT || fail == ID)) {
+        if (operand->length == 2 && isdigit((unsigned char)text[1])) diagnose(line_count, DIAG_OPERAND, "Invalid register number: %.*s", operand->length, text);
+        else diagnose(line_count, DIAG_OPERAND, "Invalid register format: %.*s", operand->length, text);
+    }
+    else {
+        diagnose(line_count, DIAG_OPERAND, "Invalid operand %.*s", operand->length, text);
+    }
+}
+
+
+/*******************************************************************************
+ * Checks an instruction operand and gives its addressing mode.
+ *
+ * Parameters:
+ * - operand: The operand token.
+ * - i: The index of the operand (1-based).
+ * - numOprnd: The number of operands of the instruction.
+ * - opcode: The opcode of the instruction.
+ * - table: Pointer to the LabelTable.
+ * - label: Receives the label of a label or matrix operand.
+ * - line_count: The line number for error reporting, 0 to check silently.
+ *
+ * Returns:
+ * - The addressing mode of the operand, or -1 if it is invalid.
+ ******************************************************************************/
+static int operandMode(Token* operand, int i, int numOprnd, int opcode, LabelTable* table, Label** label, int line_count){
+    switch (operand->type) {
+        case TOKEN_IMMEDIATE:
+            if (operandAllowed(IMMEDIATE, i, numOprnd, opcode)) return IMMEDIATE;
+            if (line_count) diagnose(line_count, DIAG_OPERAND, "Immediate value not allowed in this position for opcode %d", opcode);
+            return -1;
+
+        case TOKEN_REGISTER:
+            if (operandAllowed(REGISTER, i, numOprnd, opcode)) return REGISTER;
+            if (line_count) diagnose(line_count, DIAG_OPERAND, "Register not allowed in this position for opcode %d", opcode);
+            return -1;
+
+        case TOKEN_IDENT:
+            *label = getLabelSpan(table, operand->start, operand->length);
+            if (*label && !(*label)->mat) return LABEL;
+            /* A .mat label is no label operand */
+            if (*label && line_count) diagnose(line_count, DIAG_OPERAND, "Invalid label operand %.*s", operand->length, operand->start);
+            else if (line_count) reportOperand(operand, line_count);
+            return -1;
+
+        case TOKEN_MATRIX:
+            /* The name is followed by [rX][rY] */
+            *label = getLabelSpan(table, operand->start, operand->length - 8);
+            if (*label && (*label)->mat) return MATRIX;
+            if (!*label && line_count) diagnose(line_count, DIAG_OPERAND, "matrix %.*s not found", operand->length - 8, operand->start);
+            else if (line_count) diagnose(line_count, DIAG_OPERAND, "label %.*s is not a Matrix", operand->length - 8, operand->start);
+            return -1;
+    }
+    if (line_count) reportOperand(operand, line_count);
+    return -1;
+}
+
+
+/*******************************************************************************
+ * Plans the operands of an instruction.
+ *
+ * Parameters:
+ * - tokens: The tokens of the line.
+ * - first: Index of the mnemonic.
+ * - table: Pointer to the LabelTable.
+ * - plan: Receives the plan of the line.
+ * - line_count: The line number for error reporting, 0 to check silently.
+ *
+ * Returns:
+ * - 1 if the instruction is valid, 0 otherwise.
+ ******************************************************************************/
+static int planInstruction(LineTokens* tokens, int first, LabelTable* table, LinePlan* plan, int line_count){
+    Token *mnemonic = &tokens->tokens[first], *rest = &tokens->tokens[first + 1];
+    int count = tokens->count - first - 1, commas = 0, i;
+    const char *error = NULL;
+
+    plan->num_operands = getNumOperand(mnemonic->value);
+    for (i = 0; i < count; i++) commas += rest[i].type == TOKEN_COMMA;
+
+    if (plan->num_operands == 0) {
+        if (count > 0) error = "Extraneous text after end of Instruction";
+    }
+    else if (count == 0) error = "Missing operand(s).";
+    else if (rest[0].type == TOKEN_COMMA || rest[count - 1].type == TOKEN_COMMA) error = "Illegal Comma";
+    /* One operand takes no comma, two are split by a single one */
+    else if (plan->num_operands == 1 && commas > 0) error = "Illegal Comma";
+    else if (plan->num_operands == 1 && count > 1) error = "Extraneous text after end of Instruction";
+    else if (plan->num_operands == 2 && commas == 0) error = "Missing Comma";
+    else if (plan->num_operands == 2 && commas > 1) error = "Illegal Comma";
+    else if (plan->num_operands == 2 && (count != 3 || rest[1].type != TOKEN_COMMA)) error = "Extraneous text after end of Instruction";
+    if (error) {
+        if (line_count) diagnose(line_count, DIAG_INSTRUCTION, "%s", error);
+        return 0;
+    }
+
+    plan->operands[0] = &rest[0];
+    plan->operands[1] = &rest[2];
+    for (i = 0; i < plan->num_operands; i++) {
+        plan->modes[i] = operandMode(plan->operands[i], i + 1, plan->num_operands, mnemonic->value, table, &plan->labels[i], line_count);
+        if (plan->modes[i] < 0) return 0;
+    }
+    plan->words[0] = instructionWords(plan->num_operands, plan->modes);
+    return 1;
+}
+
+
+/*******************************************************************************
+ * Checks that a span of tokens is a comma separated list of numbers and
+ * takes their values.
+ *
+ * Parameters:
+ * - tokens: The tokens of the line.
+ * - first: Index of the first value.
+ * - values: Receives the values.
+ * - line_count: The line number for error reporting, 0 to check silently.
+ *
+ * Returns:
+ * - The number of values, or -1 if the tokens are not such a list.
+ ******************************************************************************/
+static int numberList(LineTokens* tokens, int first, int values[], int line_count){
+    Token *list = &tokens->tokens[first];
+    int length = tokens->count - first, count = 0, commas = 0, i;
+    const char *error = NULL;
+
+    for (i = 0; i < length; i++) commas += list[i].type == TOKEN_COMMA;
+
+    if (list[0].type == TOKEN_COMMA || list[length - 1].type == TOKEN_COMMA) error = "Illegal Comma in data line";
+    else if (commas == 0 && length > 1) error = "Missing Comma in data line";
+    for (i = 1; i < length && !error; i++) {
+        if (list[i].type == TOKEN_COMMA && list[i - 1].type == TOKEN_COMMA) error = "Double Commas in data line";
+    }
+
+    for (i = 0; i < length && !error; i++) {
+        if (list[i].type == TOKEN_COMMA) continue;
+        if (i + 1 < length && list[i + 1].type != TOKEN_COMMA) error = "Missing Comma";
+        else if (list[i].type != TOKEN_NUMBER) error = "Extraneous text in data line";
+        else values[count++] = list[i].value;
+    }
+    if (error) {
+        if (line_count) diagnose(line_count, DIAG_DATA, "%s", error);
+        return -1;
+    }
+    return count;
+}
+
+
+/*******************************************************************************
+ * Plans the operands of a directive.
+ *
+ * Parameters:
+ * - tokens: The tokens of the line.
+ * - first: Index of the directive, 1 after a label definition.
+ * - table: Pointer to the LabelTable.
+ * - plan: Receives the plan of the line.
+ * - line_count: The line number for error reporting, 0 to check silently.
+ *
+ * Returns:
+ * - 1 if the directive is valid, 0 otherwise.
+ ******************************************************************************/
+static int planDirective(LineTokens* tokens, int first, LabelTable* table, LinePlan* plan, int line_count){
+    Token *directive = &tokens->tokens[first], *token = &tokens->tokens[first + 1], *last = &tokens->tokens[tokens->count - 1];
+    int count = tokens->count - first - 1, rows, cols, i;
+
+    switch (directive->value) {
+        case DIRECTIVE_DATA:
+            if (count == 0) {
+                if (line_count) diagnose(line_count, DIAG_DATA, "Missing Data parameters");
+                return 0;
+            }
+            if ((plan->count = numberList(tokens, first + 1, plan->values, line_count)) < 0) return 0;
+            plan->words[1] = plan->count;
+            return 1;
+
+        case DIRECTIVE_STRING:
+            if (count == 0) {
+                if (line_count) diagnose(line_count, DIAG_DATA, "Missing Data parameters");
+                return 0;
+            }
+            if (token->type != TOKEN_STRING) {
+                if (line_count) diagnose(line_count, DIAG_DATA, "Missing quotation mark%.*s", (int)(last->start + last->length - token->start), token->start);
+                return 0;
+            }
+            if (count > 1) {
+                if (line_count) diagnose(line_count, DIAG_DATA, "Extraneous text after end of string data");
+                return 0;
+            }
+            plan->operands[0] = token;
+            /* The characters between the quotes and the terminator */
+            plan->words[1] = token->length - 1;
+            return 1;
+
+        case DIRECTIVE_MAT:
+            if (first == 0) {
+                if (line_count) diagnose(line_count, DIAG_MATRIX, "Missing label name for .matrix directive");
+                return 0;
+            }
+            for (i = 1; i <= 2; i++) {
+                if (i <= count && tokens->tokens[first + i].type == TOKEN_DIMENSION) continue;
+                if (!line_count) return 0;
+                if (i <= count && tokens->tokens[first + i].start[0] == '[') diagnose(line_count, DIAG_MATRIX, "Extraneous text in matrix definition line");
+                else diagnose(line_count, DIAG_MATRIX, "Illegal Brackets in .mat directive.");
+                return 0;
+            }
+            rows = token->value;
+            cols = tokens->tokens[first + 2].value;
+            if (cols > 0 && rows > Options.image_words / cols) {
+                if (line_count) diagnose(line_count, DIAG_MATRIX, "Matrix of %d by %d does not fit in %d words", rows, cols, Options.image_words);
+                return 0;
+            }
+            plan->count = 0;
+            if (count > 2 && (plan->count = numberList(tokens, first + 3, plan->values, line_count)) < 0) return 0;
+            if (plan->count > rows * cols) {
+                if (line_count) diagnose(line_count, DIAG_MATRIX, "More values than cells in matrix definition");
+                return 0;
+            }
+            /* The values are stored as unsigned words */
+            for (i = 0; i < plan->count; i++) plan->values[i] = (unsigned short)plan->values[i];
+            plan->words[1] = rows * cols;
+            return 1;
+
+        case DIRECTIVE_ENTRY:
+            if (first == 1 && line_count) diagnose(line_count, DIAG_UNUSED_LABEL, "unused Label defined");
+            if (count == 0) {
+                if (line_count) diagnose(line_count, DIAG_ENTRY, "Missing label name after entry definition:");
+                return 0;
+            }
+            if (count > 1) {
+                if (line_count) diagnose(line_count, DIAG_ENTRY, "Extraneous text after entry label defined:");
+                return 0;
+            }
+            if ((plan->labels[0] = getLabelSpan(table, token->start, token->length)) == NULL) {
+                if (line_count) diagnose(line_count, DIAG_ENTRY, "Undefined Label has been set as entry: %.*s", token->length, token->start);
+                return 0;
+            }
+            return 1;
+    }
+    /* Extern lines were handled by the first pass */
+    return 1;
+}
+
+
+/*******************************************************************************
+ * Plans a line from its tokens: checks it and gives the words it takes,
+ * without encoding anything. The second pass encodes the plan and the
+ * parallel encoder measures it; both go through here, so every line is
+ * checked by the same rules.
+ *
+ * Parameters:
+ * - tokens: The tokens of the line.
+ * - table: Pointer to the LabelTable, only read.
+ * - plan: Receives the plan of the line.
+ * - line_count: The line number for error reporting, 0 to check silently.
+ *
+ * Returns:
+ * - 1 if the line is valid, 0 otherwise.
+ ******************************************************************************/
+int planTokens(LineTokens* tokens, LabelTable* table, LinePlan* plan, int line_count){
+    int first = 0;
+
+    plan->def = NULL;
+    plan->labels[0] = plan->labels[1] = NULL;
+    plan->words[0] = plan->words[1] = 0;
+
+    /* The first pass checked the label, it is in the table unless it was a duplicate */
+    if (tokens->count > 0 && tokens->tokens[0].type == TOKEN_LABEL_DEF) {
+        plan->def = getLabelSpan(table, tokens->tokens[0].start, tokens->tokens[0].length);
+        first = 1;
+    }
+    if (first >= tokens->count) {
+        if (line_count) diagnose(line_count, DIAG_SYNTAX, "Missing instruction or directive after label");
+        return 0;
+    }
+
+    plan->op = &tokens->tokens[first];
+    if (plan->op->type == TOKEN_MNEMONIC) return planInstruction(tokens, first, table, plan, line_count);
+    if (plan->op->type == TOKEN_DIRECTIVE) return planDirective(tokens, first, table, plan, line_count);
+
+    if (!line_count) return 0;
+    if (plan->op->start[0] == '.') diagnose(line_count, DIAG_SYNTAX, "Unrecognized line format.");
+    else diagnose(line_count, DIAG_INSTRUCTION, "Invalid Instruction %.*s", plan->op->length, plan->op->start);
+    return 0;
+}
+
+
+/*******************************************************************************
+ * Checks a line from its tokens and encodes it, reporting its errors.
+ *
+ * Parameters:
+ * - tokens: The tokens of the line.
+ * - table: Pointer to the LabelTable.
+ * - Code: Array to hold the encoded instructions.
+ * - Data: Array to hold the encoded data.
+ * - PC : Program counters array (PC[0] for IC, PC[1] for DC).
+ * - line_count: The line number for error reporting.
+ *
+ * Returns:
+ * - 1 if the line was encoded, 0 if it has errors.
+ ******************************************************************************/
+int EncodeTokens(LineTokens* tokens, LabelTable* table, signed short Code[], signed short Data[], int PC[], int line_count){
+    LinePlan plan;
+    int kind;
+
+    if (!planTokens(tokens, table, &plan, line_count)) return 0;
+
+    kind = plan.op->type == TOKEN_MNEMONIC ? -1 : plan.op->value;
+    if (plan.def) {
+        plan.def->address = PC[0] + PC[1] + Options.load_base;
+        if (kind == DIRECTIVE_DATA || kind == DIRECTIVE_STRING || kind == DIRECTIVE_MAT) plan.def->dc = PC[1];
+    }
+    if (kind == DIRECTIVE_ENTRY) markEntry(plan.labels[0]);
+
+    /* The writers skip the words with --check, words past the image are dropped */
+    if (kind == -1)
+        encodeInstructionWords(plan.op->value, plan.num_operands, plan.modes, plan.operands, plan.labels, Code, PC[0]);
+    else if (kind == DIRECTIVE_STRING)
+        encodeStringWords(plan.operands[0]->start + 1, Data, PC[1]);
+    else if (kind == DIRECTIVE_DATA || kind == DIRECTIVE_MAT)
+        encodeDataWords(plan.values, plan.count, Data, PC[1]);
+    PC[0] += plan.words[0];
+    PC[1] += plan.words[1];
+    return 1;
+}
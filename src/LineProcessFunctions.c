@@ -11,36 +11,21 @@
  * - Data: Array to hold the data values.
  * - PC : Program counters array (PC[0] for IC, PC[1] for DC).
  * - line_count: The current line number for error reporting.
- * - Error: Pointer to an integer flag indicating if an error has occurred.
+ * - Error: Pointer to the error count of the file, incremented for every line
+ *   with errors.
  ******************************************************************************/
 void ProcessLine(char* source_line, LabelTable* table, signed short Code[], signed short Data[], int PC[], int line_count, int* Error) 
 {
-    char* line = NULL; /* Pointer to manipulate and process the source_line. */
-    Label *tmp_label = NULL; /* Temporary pointer to hold label information. */
-    char *label_name = NULL; /* Pointer to hold the extracted label name. */
-    int is_label = 0; /* Flag to indicate if the current line defines a label. */
-    
-    line = source_line; 
-    
-    /* Check if the line defines a label. */
-    if (IsLabelDefinition(line)){
+    LineTokens tokens; /* Typed tokens of the line. */
 
-        label_name = deleteSpaces(strtok(line, ":\r\n")); /* Extract the label name. */
+    /* The cross-reference maps code addresses back to their lines. */
+    if (Options.xref) xrefLine(line_count, PC[0]);
 
-        tmp_label = UpdateAddressAndGetLabel(label_name, table, PC); /* Update label address. */
-
-        line = deleteSpaces(strtok(NULL, "\r\n")); /* Move to the next part of the line after the label. */
-
-        is_label = 1; /* Set the flag indicating this line contains a label definition. */
-    }
-    
-    /* Check if the line contains an assembly instruction and encode it. */
-    if (IsInstructionLine(line)){
-        EncodeInstruction(line, table, Code, PC, line_count, Error);
-    } 
-    /* Otherwise, process directives. */
-    else {
-        ProcessDirectives(line, table, Data, tmp_label, &is_label, PC, line_count, Error);
+    /* The tokens are checked and encoded in one place, errors included. */
+    lexLine(source_line, &tokens);
+    if (!EncodeTokens(&tokens, table, Code, Data, PC, line_count)) {
+        TRACE_PROBE3(diagnostic, Stats.file_name, line_count, TRACE_SECOND_PASS);
+        (*Error)++;
     }
 }
 
@@ -94,123 +79,156 @@ int IsLabelDefinition(char *line){
 
 
 /*******************************************************************************
- * Checks if a line contains an assembly instruction.
+ * Checks if a line contains a matrix directive.
  *
  * Parameters:
  * - line: The line to check.
  *
  * Returns:
- * - 1 if the line contains an instruction, 0 otherwise.
+ * - 1 if the line contains a matrix directive, 0 otherwise.
  ******************************************************************************/
-int IsInstructionLine(char *line){
-    return *line != '.';
+int IsMatrixDirective(char *line){
+    if(startsWith(line, ".mat", strlen(".mat"))) return 1;
+    return 0; 
 }
 
 
 /*******************************************************************************
- * Checks if a line contains a data directive.
+ * Checks if a line contains an extern directive.
  *
  * Parameters:
  * - line: The line to check.
  *
  * Returns:
- * - 1 if the line contains a data directive, 0 otherwise.
+ * - 1 if the line contains an extern directive, 0 otherwise.
  ******************************************************************************/
-int IsDataDirective(char *line){
-    if(startsWith(line, ".data", strlen(".data"))) return 1;
+int isExtern(char *line){
+    if (startsWith(line, ".extern", strlen(".extern"))) return 1;
     return 0;
 }
 
-
 /*******************************************************************************
- * Checks if a line contains a matrix directive.
+ * Deletes leading and trailing whitespace from a string.
  *
  * Parameters:
- * - line: The line to check.
+ * - str: The string to modify.
+ * - scan: The scan of the line holding the string, or NULL.
  *
  * Returns:
- * - 1 if the line contains a matrix directive, 0 otherwise.
+ * - A pointer to the modified string.
  ******************************************************************************/
-int IsMatrixDirective(char *line){
-    if(startsWith(line, ".mat", strlen(".mat"))) return 1;
-    return 0; 
-}
+char* deleteSpaces(char *str, LineScan* scan){
+    int len;
+    int i, from, end, first, last;
+    if(str == NULL){
+        return NULL;
+    }
 
+    /* The line's scan finds both ends of the text */
+    if((from = scanSpan(scan, str, &end)) != -1){
+        first = scanFirstNot(scan, SCAN_SPACE, from, end);
+        last = scanLastNot(scan, SCAN_BLANK, from, end);
+        scanCut(scan, str + (last < first ? first : last + 1) - from);
+        return str + first - from;
+    }
 
-/*******************************************************************************
- * Checks if a line contains a string directive.
- *
- * Parameters:
- * - line: The line to check.
- *
- * Returns:
- * - 1 if the line contains a string directive, 0 otherwise.
- ******************************************************************************/
-int IsStringDirective(char *line){
-    if(startsWith(line, ".string", strlen(".string"))) return 1; 
-    return 0; 
+    while(isspace(*str) || *str == '\t') str++;
+    if(str == NULL){
+        return NULL;
+    }
+    len = strlen(str);
+    for (i = len - 1; i >= 0; i--){
+        if ((str[i]) != ' ' && str[i] != '\t') break;
+    }
+    str[i+1] = '\0';
+    return str;
 }
 
-
 /*******************************************************************************
- * Checks if a line contains an entry directive.
+ * Deletes the line terminator and any white space before it from a string.
  *
  * Parameters:
- * - line: The line to check.
- * - is_label: Pointer to the label flag.
- * - line_count: The current line number.
+ * - str: The string to modify.
+ * - scan: The scan of the line holding the string, or NULL.
  *
  * Returns:
- * - 1 if the line contains an entry directive, 0 otherwise.
+ * - A pointer to the modified string.
  ******************************************************************************/
-int IsEntryDirective(char *line, int *is_label, int line_count){
-    if(startsWith(line, ".entry", strlen(".entry"))){
-        if(*is_label){
-            fprintf(stderr, "Warning at Line %d, unused Label defined\n", line_count);
-            *is_label = 0; /* Reset the label flag as it's considered unused */
-        }
-        return 1; 
+char* deleteLineEnd(char *str, LineScan* scan){
+    int len, from, end, last;
+
+    if((from = scanSpan(scan, str, &end)) != -1){
+        last = scanLastNot(scan, SCAN_SPACE, from, end);
+        scanCut(scan, str + (last < from ? 0 : last + 1 - from));
+        return str;
     }
-    return 0;
+
+    len = strlen(str);
+    while (len > 0 && isspace((unsigned char)str[len - 1])) len--;
+    str[len] = '\0';
+    return str;
 }
 
 /*******************************************************************************
- * Checks if a line contains an extern directive.
+ * Splits a string into tokens, like strtok but keeping its position in the
+ * caller's save pointer instead of hidden global state, so it is reentrant.
  *
  * Parameters:
- * - line: The line to check.
+ * - str: The string to split on the first call, NULL to continue.
+ * - delim: The delimiter characters.
+ * - save: Pointer to the caller's position pointer.
  *
  * Returns:
- * - 1 if the line contains an extern directive, 0 otherwise.
+ * - A pointer to the next token, or NULL if there are no more tokens.
  ******************************************************************************/
-int isExtern(char *line){
-    if (startsWith(line, ".extern", strlen(".extern"))) return 1;
-    return 0;
+char* nextToken(char* str, const char* delim, char** save){
+    char* token;
+    if (str == NULL) str = *save;
+    if (str == NULL) return NULL;
+
+    /* Skip leading delimiters */
+    str += strspn(str, delim);
+    if (*str == '\0') {
+        *save = str;
+        return NULL;
+    }
+
+    /* Terminate the token and remember where the next one starts */
+    token = str;
+    str += strcspn(str, delim);
+    if (*str != '\0') *str++ = '\0';
+    *save = str;
+    return token;
 }
 
+
 /*******************************************************************************
- * Deletes leading and trailing whitespace from a string.
+ * Splits a label definition at its colon, like nextToken with ":" but
+ * finding the colon in the line's scan and recording the cut there.
  *
  * Parameters:
- * - str: The string to modify.
+ * - line: The line to split, modified in place.
+ * - scan: The scan of the line.
+ * - rest: Receives the text after the colon, or NULL if there is none.
  *
  * Returns:
- * - A pointer to the modified string.
+ * - A pointer to the text before the colon, leading colons skipped.
  ******************************************************************************/
-char* deleteSpaces(char *str){
-    int len;
-    int i;
-    if(str == NULL){
-        return NULL;
+char* splitLabelDefinition(char* line, LineScan* scan, char** rest){
+    char *save = NULL;
+    int first, colon;
+
+    if (scan->length < 0) {
+        line = nextToken(line, ":", &save);
+        *rest = nextToken(NULL, "", &save);
+        return line;
     }
-    while(isspace(*str) || *str == '\t') str++;
-    if(str == NULL){
-        return NULL;
-    }
-    len = strlen(str);
-    for (i = len - 1; i >= 0; i--){
-        if ((str[i]) != ' ' && str[i] != '\t') break;
+    first = scanFirstNot(scan, SCAN_COLON, 0, scan->length);
+    colon = scanFirst(scan, SCAN_COLON, first, scan->length);
+    *rest = NULL;
+    if (colon != -1) {
+        scanCut(scan, line + colon);
+        if (colon + 1 < scan->length) *rest = line + colon + 1;
     }
-    str[i+1] = '\0';
-    return str;
-}
\ No newline at end of file
+    return line + first;
+}
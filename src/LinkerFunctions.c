@@ -0,0 +1,366 @@
+#define _POSIX_C_SOURCE 200112L
+#include "Assembler.h"
+#include <stdarg.h>
+
+/* Bytes of an "address<tab>word" line of an object file */
+#define LINK_LINE (SIZE_OF_ADDRESS + 1 + SIZE_OF_WORD + 1)
+
+/* An object module being linked */
+typedef struct LinkModule {
+    char *name; /* The module */
+    ObjectImage image; /* Its image and symbols, relocated in place */
+    int loaded; /* 1 if the image could be read */
+    int code_base; /* Address of its first code word in the linked image */
+    int data_base; /* Address of its first data word in the linked image */
+    char *errors; /* Its error lines, printed once all modules are done */
+    size_t errors_len; /* Bytes of errors */
+} LinkModule;
+
+/* An entry of the global symbol index */
+typedef struct LinkSymbol {
+    const char *name; /* Name of the entry, NULL for an empty slot */
+    unsigned int hash_value; /* Hash of the name */
+    int module; /* Module defining it */
+    int address; /* Its address in the linked image */
+} LinkSymbol;
+
+/* Work shared by the linking threads */
+typedef struct LinkWork {
+    LinkModule *modules; /* All modules, in command line order */
+    int num_modules; /* Number of modules */
+    LinkSymbol *index; /* Open addressing index of every entry */
+    unsigned int index_mask; /* Size of the index minus one */
+    int ICF; /* Code words of the linked image */
+    char *text; /* The linked .ob file, every module formats its own lines */
+    size_t header_len; /* Bytes of the header line of text */
+} LinkWork;
+
+static char encoding_table[] = {'a', 'b', 'c', 'd'};
+
+
+/*******************************************************************************
+ * Records an error of a module, printed with the errors of the other modules
+ * in command line order once the threads are done.
+ ******************************************************************************/
+static void linkError(LinkModule* module, const char* format, ...){
+    va_list args;
+    size_t prefix;
+    int len;
+
+    /* The message is measured first, module paths can be of any length */
+    va_start(args, format);
+    len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (len < 0) len = 0;
+
+    prefix = strlen("Error: ") + strlen(module->name) + strlen(": ");
+    if (!(module->errors = (char*)memRealloc(MEM_OTHER, module->errors, module->errors_len + prefix + len + 2))) {
+        fprintf(stderr, "Error, Failed to allocate memory for the link errors\n");
+        exit(1);
+    }
+    sprintf(module->errors + module->errors_len, "Error: %s: ", module->name);
+    va_start(args, format);
+    vsnprintf(module->errors + module->errors_len + prefix, len + 1, format, args);
+    va_end(args);
+    module->errors_len += prefix + len;
+    module->errors[module->errors_len++] = '\n';
+    module->errors[module->errors_len] = '\0';
+}
+
+
+/*******************************************************************************
+ * Thread body loading modules.
+ ******************************************************************************/
+static void* loadModules(void* arg){
+    ThreadTask *task = (ThreadTask*)arg;
+    LinkWork *work = (LinkWork*)task->shared;
+    int i;
+
+    for (i = task->first; i < work->num_modules; i += task->step) {
+        work->modules[i].loaded = loadObject(work->modules[i].name, &work->modules[i].image);
+    }
+    return NULL;
+}
+
+
+/*******************************************************************************
+ * Moves an address of a module to the linked image: code after the code of
+ * the modules before it, data after all the code and the data of the modules
+ * before it.
+ *
+ * Returns:
+ * - The address in the linked image, -1 if it is not in the module.
+ ******************************************************************************/
+static int relocate(LinkModule* module, int address){
+    int code_end = OBJECT_BASE + module->image.ICF;
+
+    if (address < OBJECT_BASE || address >= code_end + module->image.DCF) return -1;
+    return address < code_end ? module->code_base + address - OBJECT_BASE : module->data_base + address - code_end;
+}
+
+
+/*******************************************************************************
+ * Finds an entry in the global symbol index.
+ *
+ * Returns:
+ * - The slot of the entry, or the empty slot it would take.
+ ******************************************************************************/
+static LinkSymbol* findSymbol(LinkWork* work, const char* name, unsigned int hash_value){
+    unsigned int i = hash_value & work->index_mask;
+
+    while (work->index[i].name && (work->index[i].hash_value != hash_value || strcmp(work->index[i].name, name) != 0))
+        i = (i + 1) & work->index_mask;
+    return &work->index[i];
+}
+
+
+/*******************************************************************************
+ * Builds the global symbol index of the entries of every module, at their
+ * addresses in the linked image. Two modules may not define the same entry.
+ ******************************************************************************/
+static void indexEntries(LinkWork* work){
+    LinkModule *module;
+    LinkSymbol *slot;
+    ObjectSymbol *entry;
+    unsigned int size = 16, hash_value;
+    int num_entries = 0, i, j, address;
+
+    for (i = 0; i < work->num_modules; i++) num_entries += work->modules[i].image.num_entries;
+    while (size < 2 * (unsigned int)num_entries) size *= 2;
+    work->index = (LinkSymbol*)memCalloc(MEM_LABELS, size, sizeof(LinkSymbol));
+    if (!work->index) {
+        fprintf(stderr, "Error, Failed to allocate memory for the symbol index\n");
+        exit(1);
+    }
+    work->index_mask = size - 1;
+
+    for (i = 0; i < work->num_modules; i++) {
+        module = &work->modules[i];
+        for (j = 0; j < module->image.num_entries; j++) {
+            entry = &module->image.entries[j];
+            if ((address = relocate(module, entry->address)) < 0) {
+                linkError(module, "entry %s is outside the module", entry->name);
+                continue;
+            }
+            hash_value = hash(entry->name);
+            slot = findSymbol(work, entry->name, hash_value);
+            if (slot->name) {
+                linkError(module, "entry %s is also defined by %s", entry->name, work->modules[slot->module].name);
+                continue;
+            }
+            slot->name = entry->name;
+            slot->hash_value = hash_value;
+            slot->module = i;
+            slot->address = address;
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * Relocates the code of a module: every relocatable label word gets the
+ * linked address of its label, and every use of an external label listed in
+ * the .ext file the address of the entry of that name.
+ ******************************************************************************/
+static void relocateModule(LinkWork* work, LinkModule* module){
+    short *words = module->image.words;
+    int code_end = OBJECT_BASE + module->image.ICF, pc, i, address;
+    const char *fault;
+    ObjectInstruction ins;
+    ObjectOperand *op;
+    ObjectSymbol *use;
+    LinkSymbol *symbol;
+    unsigned char linked[OBJECT_BASE + OBJECT_MAX_WORDS] = {0}; /* 1 for the uses listed in the .ext file */
+
+    /* The uses of external labels, which must be external label words */
+    for (i = 0; i < module->image.num_externs; i++) {
+        use = &module->image.externs[i];
+        if (use->address < OBJECT_BASE || use->address >= code_end || (words[use->address] & 0x3FF) != 1) {
+            linkError(module, "the use of %s at address %d is not an external label word", use->name, use->address);
+            continue;
+        }
+        linked[use->address] = 1;
+        symbol = findSymbol(work, use->name, hash(use->name));
+        if (!symbol->name) {
+            linkError(module, "undefined symbol %s used at address %d", use->name, use->address);
+            continue;
+        }
+        words[use->address] = (short)(((symbol->address << 2) | 2) & 0x3FF);
+    }
+
+    /* The relocatable label words, found by walking the instructions */
+    for (pc = OBJECT_BASE; pc < code_end; pc += ins.length) {
+        if ((fault = decodeObjectInstruction(words, pc, code_end, &ins))) {
+            linkError(module, "%s at address %d", fault, pc);
+            break;
+        }
+        for (i = 0; i < ins.num_operands; i++) {
+            op = &ins.operands[i];
+            if ((op->mode != LABEL && op->mode != MATRIX) || linked[op->word]) continue;
+            if (op->are == 1) {
+                linkError(module, "external label word at address %d is missing from the .ext file", op->word);
+                continue;
+            }
+            address = relocate(module, op->value < OBJECT_BASE ? op->value + OBJECT_MEMORY : op->value);
+            if (op->are != 2 || address < 0) {
+                linkError(module, "label word at address %d does not name an address of the module", op->word);
+                continue;
+            }
+            words[op->word] = (short)(((address << 2) | 2) & 0x3FF);
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * Formats the words of a module into their lines of the linked .ob file.
+ * Every line has the same length, so the lines of a module start at a
+ * known offset and the modules can be formatted concurrently.
+ ******************************************************************************/
+static void formatModule(LinkWork* work, LinkModule* module){
+    int code_end = OBJECT_BASE + module->image.ICF, address, linked;
+    char *line;
+
+    for (address = OBJECT_BASE; address < code_end + module->image.DCF; address++) {
+        linked = address < code_end ? module->code_base + address - OBJECT_BASE : module->data_base + address - code_end;
+        line = work->text + work->header_len + (size_t)(linked - OBJECT_BASE) * LINK_LINE;
+        encodeBase4(encoding_table, linked, line, SIZE_OF_ADDRESS);
+        line[SIZE_OF_ADDRESS] = '\t';
+        encodeBase4(encoding_table, module->image.words[address], line + SIZE_OF_ADDRESS + 1, SIZE_OF_WORD);
+        line[LINK_LINE - 1] = '\n';
+    }
+}
+
+
+/*******************************************************************************
+ * Thread body relocating modules and formatting their lines, against the
+ * read only symbol index.
+ ******************************************************************************/
+static void* linkModules(void* arg){
+    ThreadTask *task = (ThreadTask*)arg;
+    LinkWork *work = (LinkWork*)task->shared;
+    int i;
+
+    for (i = task->first; i < work->num_modules; i += task->step) {
+        relocateModule(work, &work->modules[i]);
+        if (!work->modules[i].errors) formatModule(work, &work->modules[i]);
+    }
+    return NULL;
+}
+
+
+/*******************************************************************************
+ * Writes the entries of the linked program to its .ent file, at their linked
+ * addresses, in the order of the modules.
+ ******************************************************************************/
+static void writeLinkedEntries(LinkWork* work, char* name){
+    char line[MAX_LABEL + SIZE_OF_ADDRESS + 3], address[SIZE_OF_ADDRESS + 1] = {'\0'};
+    OutputFile *ent = NULL;
+    LinkModule *module;
+    int i, j, len;
+
+    for (i = 0; i < work->num_modules; i++) {
+        module = &work->modules[i];
+        for (j = 0; j < module->image.num_entries; j++) {
+            if (!ent) ent = openOutputFile(name, ENTRY_EXT);
+            encodeBase4(encoding_table, relocate(module, module->image.entries[j].address), address, SIZE_OF_ADDRESS);
+            len = sprintf(line, "%s\t%s\n", module->image.entries[j].name, address);
+            writeOutput(ent, line, len);
+        }
+    }
+    if (ent) closeOutputFile(ent);
+}
+
+
+/*******************************************************************************
+ * Links object modules into one program. The modules are laid out in command
+ * line order, their code first and then their data, as the assembler lays
+ * out a single file. The entries of all modules form a global symbol index,
+ * every use of an external label is patched with the address of the entry
+ * of that name, and every other label word moves with its module. The linked
+ * program gets a .ob file, written at once, and a .ent file of all entries;
+ * it has no .ext file, as every external label must be resolved.
+ *
+ * Modules are loaded, relocated and formatted by --threads threads.
+ *
+ * Parameters:
+ * - name: The linked program, its extension is replaced.
+ * - names: The modules, their .ob, .ent and .ext files are read.
+ * - num_modules: Number of modules.
+ *
+ * Returns:
+ * - 1 if the program was linked, 0 otherwise (reported on stderr).
+ ******************************************************************************/
+int linkObjects(char* name, char** names, int num_modules){
+    char ICF[SIZE_OF_ADDRESS + 1] = {'\0'}, DCF[SIZE_OF_ADDRESS + 1] = {'\0'};
+    LinkWork work;
+    LinkModule *module;
+    OutputFile *out;
+    int num_threads = Options.threads < MAX_THREADS ? Options.threads : MAX_THREADS, DCF_total = 0, failed = 0, i;
+
+    memset(&work, 0, sizeof(LinkWork));
+    work.num_modules = num_modules;
+    work.modules = (LinkModule*)memCalloc(MEM_OTHER, num_modules, sizeof(LinkModule));
+    if (!work.modules) {
+        fprintf(stderr, "Error, Failed to allocate memory for the modules\n");
+        exit(1);
+    }
+    for (i = 0; i < num_modules; i++) work.modules[i].name = names[i];
+    runParallel(loadModules, "load modules", &work, num_threads);
+
+    /* Lay the modules out: all code first, then all data */
+    for (i = 0; i < num_modules; i++) {
+        failed += !work.modules[i].loaded;
+        work.modules[i].code_base = OBJECT_BASE + work.ICF;
+        work.ICF += work.modules[i].image.ICF;
+    }
+    for (i = 0; i < num_modules; i++) {
+        work.modules[i].data_base = OBJECT_BASE + work.ICF + DCF_total;
+        DCF_total += work.modules[i].image.DCF;
+    }
+    /* A label word keeps 8 bits of its address, read back as one of the
+       OBJECT_MEMORY addresses from OBJECT_BASE */
+    if (!failed && work.ICF + DCF_total > OBJECT_MEMORY) {
+        fprintf(stderr, "Error: The linked image of %d code and %d data words does not fit the %d words a label can address\n",
+                work.ICF, DCF_total, OBJECT_MEMORY);
+        failed = 1;
+    }
+
+    if (!failed) {
+        encodeCounter(encoding_table, work.ICF, ICF);
+        encodeCounter(encoding_table, DCF_total, DCF);
+        work.text = (char*)memAlloc(MEM_OUTPUT, strlen(ICF) + strlen(DCF) + 3 + (size_t)(work.ICF + DCF_total) * LINK_LINE);
+        if (!work.text) {
+            fprintf(stderr, "Error, Failed to allocate memory for the linked image\n");
+            exit(1);
+        }
+        work.header_len = sprintf(work.text, "\t%s %s\n", ICF, DCF);
+
+        indexEntries(&work);
+        runParallel(linkModules, "link modules", &work, num_threads);
+        for (i = 0; i < num_modules; i++) {
+            if (!work.modules[i].errors) continue;
+            fwrite(work.modules[i].errors, 1, work.modules[i].errors_len, stderr);
+            failed = 1;
+        }
+    }
+
+    if (!failed) {
+        out = openOutputFile(name, OBJECT_EXT);
+        writeOutput(out, work.text, work.header_len + (size_t)(work.ICF + DCF_total) * LINK_LINE);
+        closeOutputFile(out);
+        writeLinkedEntries(&work, name);
+    } else {
+        fprintf(stderr, "Failed to Link %s\n", name);
+    }
+
+    for (i = 0; i < num_modules; i++) {
+        module = &work.modules[i];
+        freeObject(&module->image);
+        memFree(module->errors);
+    }
+    memFree(work.modules);
+    memFree(work.index);
+    memFree(work.text);
+    return !failed;
+}
@@ -0,0 +1,1403 @@
+#define _POSIX_C_SOURCE 200809L
+#include "Assembler.h"
+
+/* Kinds of document lines, as the macro pass saw them */
+#define LSP_BLANK 0 /* Empty line or comment */
+#define LSP_PLAIN 1 /* Statement or macro use */
+#define LSP_MACRO_START 2 /* This kind and the following ones change the macro table */
+#define LSP_MACRO_BODY 3
+#define LSP_MACRO_END 4
+#define LSP_INCLUDE 5
+
+/* Types of JSON values */
+#define JSON_NULL 0
+#define JSON_FALSE 1
+#define JSON_TRUE 2
+#define JSON_NUMBER 3
+#define JSON_STRING 4
+#define JSON_ARRAY 5
+#define JSON_OBJECT 6
+
+/* A parsed JSON value, the members of objects and elements of arrays are its children */
+typedef struct JsonValue {
+    int type; /* JSON_* type */
+    char *key; /* Name of an object member, NULL otherwise */
+    char *string; /* Value of a string */
+    double number; /* Value of a number */
+    struct JsonValue *child; /* First member or element */
+    struct JsonValue *next; /* Next member or element of the parent */
+} JsonValue;
+
+/* A message being written */
+typedef struct LspBuffer {
+    char *data; /* The message */
+    size_t len; /* Bytes written */
+    size_t size; /* Capacity of data */
+} LspBuffer;
+
+/* A diagnostic kept with its line, so it moves with the line on edits */
+typedef struct LspDiagnostic {
+    int code; /* DIAG_* code */
+    char *message; /* The message */
+} LspDiagnostic;
+
+typedef struct LspDiagnostics {
+    LspDiagnostic *items; /* Diagnostics in report order */
+    int count; /* Number of diagnostics */
+} LspDiagnostics;
+
+/* A line of an open document and what the passes found in it */
+typedef struct LspLine {
+    char *text; /* The line without its newline */
+    int kind; /* LSP_* kind */
+    int inside_macro; /* 1 if a macro definition is open after the line */
+    Macro *macros; /* Last macro defined up to this line, NULL for none */
+    char *expansion; /* The .am lines of the line, NULL if it has none */
+    Label **defs; /* Labels the line defines, linked into the label table unless duplicated */
+    int num_defs; /* Number of labels */
+    unsigned int *deps; /* Hashes of the names in the expansion */
+    int num_deps; /* Number of names */
+    LspDiagnostics parse; /* Macro pass and first pass diagnostics */
+    LspDiagnostics duplicates; /* Duplicate definitions, found when the labels are linked */
+    LspDiagnostics check; /* Second pass diagnostics */
+    int dirty; /* 1 if the second pass has to check the line again */
+} LspLine;
+
+/* An open document, resident between edits */
+typedef struct LspDocument {
+    char *uri; /* The document */
+    char *path; /* File name of the uri, includes are resolved from it */
+    LspLine *lines; /* The lines */
+    int num_lines; /* Number of lines */
+    int capacity; /* Capacity of lines */
+    PreAssemblerState state; /* Macro table of the document and its includes */
+    LabelTable *labels; /* Labels of the document, relinked from the lines after every edit */
+    LabelTable *scratch; /* Empty table the labels of one line are collected in */
+    unsigned int *changed; /* Hashes of the names defined by edited lines */
+    int num_changed; /* Number of hashes */
+    int changed_capacity; /* Capacity of changed */
+    struct LspDocument *next; /* Next open document */
+} LspDocument;
+
+static LspDocument *documents; /* The open documents */
+
+
+/*******************************************************************************
+ * Makes room for need more bytes and a terminator in a message.
+ ******************************************************************************/
+static void reserve(LspBuffer* buffer, size_t need){
+    if (buffer->len + need + 1 <= buffer->size) return;
+    while (buffer->len + need + 1 > buffer->size) buffer->size = buffer->size ? buffer->size * 2 : 1024;
+    if (!(buffer->data = (char*)memRealloc(MEM_OTHER, buffer->data, buffer->size))) {
+        fprintf(stderr, "Error, Failed to allocate memory for a language server message\n");
+        exit(1);
+    }
+}
+
+
+/*******************************************************************************
+ * Appends text to a message.
+ ******************************************************************************/
+static void appendText(LspBuffer* buffer, const char* text){
+    size_t len = strlen(text);
+
+    reserve(buffer, len);
+    memcpy(buffer->data + buffer->len, text, len + 1);
+    buffer->len += len;
+}
+
+
+/*******************************************************************************
+ * Appends a number to a message.
+ ******************************************************************************/
+static void appendNumber(LspBuffer* buffer, long n){
+    reserve(buffer, 24);
+    buffer->len += sprintf(buffer->data + buffer->len, "%ld", n);
+}
+
+
+/*******************************************************************************
+ * Appends a JSON string literal to a message.
+ ******************************************************************************/
+static void appendJsonString(LspBuffer* buffer, const char* str){
+    reserve(buffer, 6 * strlen(str) + 2);
+    buffer->data[buffer->len++] = '"';
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') buffer->len += sprintf(buffer->data + buffer->len, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20) buffer->len += sprintf(buffer->data + buffer->len, "\\u%04x", (unsigned char)*str);
+        else buffer->data[buffer->len++] = *str;
+    }
+    buffer->data[buffer->len++] = '"';
+    buffer->data[buffer->len] = '\0';
+}
+
+
+/*******************************************************************************
+ * Converts a column counted in UTF-16 code units, as positions are, to the
+ * byte offset of the UTF-8 line, clamped to the line.
+ ******************************************************************************/
+static long byteColumn(const char* text, long character){
+    long units = 0, i = 0;
+
+    while (text[i] && units < character) {
+        units += (unsigned char)text[i] >= 0xF0 ? 2 : 1;
+        for (i++; ((unsigned char)text[i] & 0xC0) == 0x80; i++);
+    }
+    return i;
+}
+
+
+/*******************************************************************************
+ * Converts a byte offset of a UTF-8 line to a column in UTF-16 code units.
+ ******************************************************************************/
+static long unitColumn(const char* text, long bytes){
+    long units = 0, i;
+
+    for (i = 0; i < bytes && text[i]; i++) {
+        if (((unsigned char)text[i] & 0xC0) != 0x80) units += (unsigned char)text[i] >= 0xF0 ? 2 : 1;
+    }
+    return units;
+}
+
+
+/*******************************************************************************
+ * Appends the range of the bytes start to end of a line of text.
+ ******************************************************************************/
+static void appendRange(LspBuffer* buffer, const char* text, int line, int start, int end){
+    appendText(buffer, "{\"start\": {\"line\": ");
+    appendNumber(buffer, line);
+    appendText(buffer, ", \"character\": ");
+    appendNumber(buffer, unitColumn(text, start));
+    appendText(buffer, "}, \"end\": {\"line\": ");
+    appendNumber(buffer, line);
+    appendText(buffer, ", \"character\": ");
+    appendNumber(buffer, unitColumn(text, end));
+    appendText(buffer, "}}");
+}
+
+
+/*******************************************************************************
+ * Appends a location of a document.
+ ******************************************************************************/
+static void appendLocation(LspBuffer* buffer, LspDocument* doc, int line, int start, int end){
+    appendText(buffer, "{\"uri\": ");
+    appendJsonString(buffer, doc->uri);
+    appendText(buffer, ", \"range\": ");
+    appendRange(buffer, doc->lines[line].text, line, start, end);
+    appendText(buffer, "}");
+}
+
+
+/*******************************************************************************
+ * Writes a message with its Content-Length header and empties the buffer.
+ ******************************************************************************/
+static void sendMessage(FILE* out, LspBuffer* buffer){
+    fprintf(out, "Content-Length: %lu\r\n\r\n", (unsigned long)buffer->len);
+    fwrite(buffer->data, 1, buffer->len, out);
+    fflush(out);
+    memFree(buffer->data);
+    buffer->data = NULL;
+    buffer->len = buffer->size = 0;
+}
+
+
+/*******************************************************************************
+ * Starts the response to a request, up to its result.
+ *
+ * Parameters:
+ * - buffer: The empty message.
+ * - id: The id of the request, a number or a string.
+ ******************************************************************************/
+static void startResponse(LspBuffer* buffer, JsonValue* id){
+    appendText(buffer, "{\"jsonrpc\": \"2.0\", \"id\": ");
+    if (id && id->type == JSON_STRING) appendJsonString(buffer, id->string);
+    else if (id && id->type == JSON_NUMBER) appendNumber(buffer, (long)id->number);
+    else appendText(buffer, "null");
+}
+
+
+/*******************************************************************************
+ * Sends the error response to a request.
+ ******************************************************************************/
+static void sendError(FILE* out, JsonValue* id, int code, const char* message){
+    LspBuffer buffer = {NULL, 0, 0};
+
+    startResponse(&buffer, id);
+    appendText(&buffer, ", \"error\": {\"code\": ");
+    appendNumber(&buffer, code);
+    appendText(&buffer, ", \"message\": ");
+    appendJsonString(&buffer, message);
+    appendText(&buffer, "}}");
+    sendMessage(out, &buffer);
+}
+
+
+/*******************************************************************************
+ * Frees a JSON value, its children and the values following it.
+ ******************************************************************************/
+static void freeJson(JsonValue* value){
+    JsonValue *next;
+
+    while (value) {
+        next = value->next;
+        freeJson(value->child);
+        memFree(value->key);
+        memFree(value->string);
+        memFree(value);
+        value = next;
+    }
+}
+
+
+/*******************************************************************************
+ * Skips the white space of JSON text.
+ ******************************************************************************/
+static void skipJsonSpaces(const char** p){
+    while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n') (*p)++;
+}
+
+
+/*******************************************************************************
+ * Parses a JSON string literal, \u escapes become UTF-8.
+ *
+ * Parameters:
+ * - p: Pointer to the text, at the opening quote; moved past the literal.
+ *
+ * Returns:
+ * - The allocated string, or NULL if the literal is not terminated.
+ ******************************************************************************/
+static char* parseJsonString(const char** p){
+    const char *s = *p + 1, *end;
+    char *string, *out, hex[5];
+    unsigned long code;
+
+    for (end = s; *end && *end != '"'; end++) {
+        if (*end == '\\' && end[1]) end++;
+    }
+    if (*end != '"') return NULL;
+
+    /* The decoded string is never longer than the literal */
+    if (!(string = (char*)memAlloc(MEM_OTHER, end - s + 1))) {
+        fprintf(stderr, "Error, Failed to allocate memory for a language server message\n");
+        exit(1);
+    }
+    for (out = string; s < end; s++) {
+        if (*s != '\\') {
+            *out++ = *s;
+            continue;
+        }
+        switch (*++s) {
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'u':
+                if (end - s < 5) break;
+                memcpy(hex, s + 1, 4);
+                hex[4] = '\0';
+                code = strtoul(hex, NULL, 16);
+                s += 4;
+                if (code < 0x80) *out++ = (char)code;
+                else if (code < 0x800) {
+                    *out++ = (char)(0xC0 | (code >> 6));
+                    *out++ = (char)(0x80 | (code & 0x3F));
+                } else {
+                    *out++ = (char)(0xE0 | (code >> 12));
+                    *out++ = (char)(0x80 | ((code >> 6) & 0x3F));
+                    *out++ = (char)(0x80 | (code & 0x3F));
+                }
+                break;
+            default: *out++ = *s;
+        }
+    }
+    *out = '\0';
+    *p = end + 1;
+    return string;
+}
+
+
+static JsonValue* parseJson(const char** p);
+
+
+/*******************************************************************************
+ * Parses the JSON value at the text into an allocated value.
+ *
+ * Returns:
+ * - 1 on success, 0 on malformed text.
+ ******************************************************************************/
+static int parseJsonInto(const char** p, JsonValue* value){
+    JsonValue **link = &value->child;
+    char close, *key;
+    const char *start;
+
+    skipJsonSpaces(p);
+    if (**p == '{' || **p == '[') {
+        value->type = **p == '{' ? JSON_OBJECT : JSON_ARRAY;
+        close = **p == '{' ? '}' : ']';
+        (*p)++;
+        skipJsonSpaces(p);
+        if (**p == close) {
+            (*p)++;
+            return 1;
+        }
+        for (;;) {
+            key = NULL;
+            if (value->type == JSON_OBJECT) {
+                skipJsonSpaces(p);
+                if (**p != '"' || !(key = parseJsonString(p))) return 0;
+                skipJsonSpaces(p);
+                if (**p != ':') {
+                    memFree(key);
+                    return 0;
+                }
+                (*p)++;
+            }
+            if (!(*link = parseJson(p))) {
+                memFree(key);
+                return 0;
+            }
+            (*link)->key = key;
+            link = &(*link)->next;
+            skipJsonSpaces(p);
+            if (**p == close) {
+                (*p)++;
+                return 1;
+            }
+            if (**p != ',') return 0;
+            (*p)++;
+        }
+    }
+    if (**p == '"') {
+        value->type = JSON_STRING;
+        return (value->string = parseJsonString(p)) != NULL;
+    }
+    if (strncmp(*p, "true", 4) == 0 || strncmp(*p, "null", 4) == 0) {
+        value->type = **p == 't' ? JSON_TRUE : JSON_NULL;
+        *p += 4;
+        return 1;
+    }
+    if (strncmp(*p, "false", 5) == 0) {
+        value->type = JSON_FALSE;
+        *p += 5;
+        return 1;
+    }
+    start = *p;
+    value->type = JSON_NUMBER;
+    value->number = strtod(start, (char**)p);
+    return *p != start;
+}
+
+
+/*******************************************************************************
+ * Parses a JSON value.
+ *
+ * Parameters:
+ * - p: Pointer to the text, moved past the value.
+ *
+ * Returns:
+ * - The value, to be freed with freeJson, or NULL on malformed text.
+ ******************************************************************************/
+static JsonValue* parseJson(const char** p){
+    JsonValue *value = (JsonValue*)memCalloc(MEM_OTHER, 1, sizeof(JsonValue));
+
+    if (!value) {
+        fprintf(stderr, "Error, Failed to allocate memory for a language server message\n");
+        exit(1);
+    }
+    if (!parseJsonInto(p, value)) {
+        freeJson(value);
+        return NULL;
+    }
+    return value;
+}
+
+
+/*******************************************************************************
+ * Returns the member of an object, NULL if it has none or is not an object.
+ ******************************************************************************/
+static JsonValue* member(JsonValue* object, const char* key){
+    JsonValue *child;
+
+    if (!object || object->type != JSON_OBJECT) return NULL;
+    for (child = object->child; child; child = child->next) {
+        if (strcmp(child->key, key) == 0) return child;
+    }
+    return NULL;
+}
+
+
+/*******************************************************************************
+ * Returns a string member of an object, NULL if it is missing.
+ ******************************************************************************/
+static const char* memberString(JsonValue* object, const char* key){
+    JsonValue *value = member(object, key);
+
+    return value && value->type == JSON_STRING ? value->string : NULL;
+}
+
+
+/*******************************************************************************
+ * Returns a number member of an object, or -1 if it is missing.
+ ******************************************************************************/
+static long memberNumber(JsonValue* object, const char* key){
+    JsonValue *value = member(object, key);
+
+    return value && value->type == JSON_NUMBER ? (long)value->number : -1;
+}
+
+
+/*******************************************************************************
+ * Reads the next message from the client.
+ *
+ * Returns:
+ * - The allocated body of the message, or NULL at the end of the input.
+ ******************************************************************************/
+static char* readMessage(FILE* in){
+    char header[256], *body;
+    long length = -1;
+
+    while (fgets(header, sizeof(header), in)) {
+        if (header[0] == '\r' || header[0] == '\n') {
+            if (length >= 0) break;
+        }
+        else if (strncasecmp(header, "Content-Length:", 15) == 0) length = atol(header + 15);
+    }
+    if (length < 0) return NULL;
+
+    if (!(body = (char*)memAlloc(MEM_OTHER, length + 1))) {
+        fprintf(stderr, "Error, Failed to allocate memory for a language server message\n");
+        exit(1);
+    }
+    if (fread(body, 1, length, in) != (size_t)length) {
+        memFree(body);
+        return NULL;
+    }
+    body[length] = '\0';
+    return body;
+}
+
+
+/*******************************************************************************
+ * Copies a string into memory of a subsystem.
+ ******************************************************************************/
+static char* copyString(int subsystem, const char* str, size_t len){
+    char *copy = (char*)memAlloc(subsystem, len + 1);
+
+    if (!copy) {
+        fprintf(stderr, "Error, Failed to allocate memory for a document\n");
+        exit(1);
+    }
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+
+/*******************************************************************************
+ * Returns the file name of a file: uri, for the includes of the document.
+ ******************************************************************************/
+static char* uriPath(const char* uri){
+    char *path, *out, hex[3];
+
+    if (strncmp(uri, "file://", 7) == 0) uri += 7;
+    path = copyString(MEM_FILE_NAMES, uri, strlen(uri));
+    for (out = path; *uri; uri++) {
+        if (*uri == '%' && isxdigit((unsigned char)uri[1]) && isxdigit((unsigned char)uri[2])) {
+            hex[0] = uri[1];
+            hex[1] = uri[2];
+            hex[2] = '\0';
+            *out++ = (char)strtol(hex, NULL, 16);
+            uri += 2;
+        }
+        else *out++ = *uri;
+    }
+    *out = '\0';
+    return path;
+}
+
+
+/*******************************************************************************
+ * Finds the next name in text: a label, macro, mnemonic or register, skipping
+ * strings, comment lines, numbers and directive names.
+ *
+ * Parameters:
+ * - text: Lines of source.
+ * - pos: Pointer to the position to search from, moved past the name.
+ * - start: Pointer to store the position of the name.
+ *
+ * Returns:
+ * - The length of the name, 0 if there are no more names.
+ ******************************************************************************/
+static int nextName(const char* text, int* pos, int* start){
+    const char *p = text + *pos, *line;
+    int len;
+
+    while (*p) {
+        if (*p == '"') {
+            for (p++; *p && *p != '"' && *p != '\n'; p++);
+            if (*p == '"') p++;
+            continue;
+        }
+        if (*p == ';') {
+            for (line = p; line > text && (line[-1] == ' ' || line[-1] == '\t'); line--);
+            if (line == text || line[-1] == '\n') {
+                while (*p && *p != '\n') p++;
+                continue;
+            }
+        }
+        if (isalnum((unsigned char)*p) || *p == '_') {
+            for (len = 0; isalnum((unsigned char)p[len]) || p[len] == '_'; len++);
+            if (isalpha((unsigned char)*p) && (p == text || p[-1] != '.')) {
+                *start = p - text;
+                *pos = *start + len;
+                return len;
+            }
+            p += len;
+            continue;
+        }
+        p++;
+    }
+    *pos = p - text;
+    return 0;
+}
+
+
+/*******************************************************************************
+ * Keeps a diagnostic handed out by diagDrain in a line's list.
+ ******************************************************************************/
+static void keepDiagnostic(void* context, int line, int code, const char* message){
+    LspDiagnostics *list = (LspDiagnostics*)context;
+
+    list->items = (LspDiagnostic*)memRealloc(MEM_DIAGNOSTICS, list->items, (list->count + 1) * sizeof(LspDiagnostic));
+    if (!list->items) {
+        fprintf(stderr, "Error, Failed to allocate memory for the diagnostics\n");
+        exit(1);
+    }
+    list->items[list->count].code = code;
+    list->items[list->count++].message = copyString(MEM_DIAGNOSTICS, message, strlen(message));
+}
+
+
+/*******************************************************************************
+ * Frees the diagnostics of a list.
+ ******************************************************************************/
+static void freeDiagnostics(LspDiagnostics* list){
+    int i;
+
+    for (i = 0; i < list->count; i++) memFree(list->items[i].message);
+    memFree(list->items);
+    list->items = NULL;
+    list->count = 0;
+}
+
+
+/*******************************************************************************
+ * Frees what the passes found in a line, keeping its text.
+ ******************************************************************************/
+static void clearLine(LspLine* line){
+    int i;
+
+    for (i = 0; i < line->num_defs; i++) {
+        memFree(line->defs[i]->name);
+        memFree(line->defs[i]);
+    }
+    memFree(line->defs);
+    memFree(line->deps);
+    memFree(line->expansion);
+    freeDiagnostics(&line->parse);
+    freeDiagnostics(&line->duplicates);
+    freeDiagnostics(&line->check);
+    line->defs = NULL;
+    line->deps = NULL;
+    line->expansion = NULL;
+    line->num_defs = line->num_deps = 0;
+    line->kind = LSP_BLANK;
+    line->inside_macro = 0;
+    line->macros = NULL;
+    line->dirty = 1;
+}
+
+
+/*******************************************************************************
+ * Replaces lines of a document with the lines of a text. The new lines are
+ * not parsed yet.
+ *
+ * Parameters:
+ * - doc: The document.
+ * - first: The first line to replace.
+ * - count: Number of lines to replace.
+ * - text: The new text, every newline starts another line.
+ * - len: Length of the text.
+ *
+ * Returns:
+ * - The number of new lines, at least 1.
+ ******************************************************************************/
+static int spliceLines(LspDocument* doc, int first, int count, const char* text, size_t len){
+    const char *end;
+    size_t n;
+    int added = 1, i;
+
+    for (end = text; (end = memchr(end, '\n', text + len - end)); end++) added++;
+    for (i = first; i < first + count; i++) {
+        clearLine(&doc->lines[i]);
+        memFree(doc->lines[i].text);
+    }
+
+    if (doc->num_lines - count + added > doc->capacity) {
+        doc->capacity = doc->capacity * 2 > doc->num_lines - count + added ? doc->capacity * 2 : doc->num_lines - count + added;
+        doc->lines = (LspLine*)memRealloc(MEM_LINES, doc->lines, doc->capacity * sizeof(LspLine));
+        if (!doc->lines) {
+            fprintf(stderr, "Error, Failed to allocate memory for a document\n");
+            exit(1);
+        }
+    }
+    memmove(doc->lines + first + added, doc->lines + first + count, (doc->num_lines - first - count) * sizeof(LspLine));
+    doc->num_lines += added - count;
+
+    for (i = first; i < first + added; i++) {
+        end = (const char*)memchr(text, '\n', len);
+        n = end ? (size_t)(end - text) : len;
+        memset(&doc->lines[i], 0, sizeof(LspLine));
+        doc->lines[i].text = copyString(MEM_LINES, text, n);
+        doc->lines[i].dirty = 1;
+        if (end) {
+            len -= n + 1;
+            text = end + 1;
+        }
+    }
+    return added;
+}
+
+
+/*******************************************************************************
+ * Runs the macro pass over lines of a document, continuing from the macro
+ * state of the line before them. Every line keeps the .am lines it expands
+ * to, its kind and the diagnostics of the pass.
+ *
+ * Parameters:
+ * - doc: The document.
+ * - first: The first line.
+ * - last: The line after the last one.
+ ******************************************************************************/
+static void expandLines(LspDocument* doc, int first, int last){
+    char source_line[MAX_LINE_LENGTH], *source, *buffer = NULL, *line;
+    size_t size = 0, len, pos;
+    long *ends;
+    FILE *stream;
+    LspLine *current;
+    int i;
+
+    stream = open_memstream(&buffer, &size);
+    ends = (long*)memAlloc(MEM_LINES, (last - first + 1) * sizeof(long));
+    if (!stream || !ends) {
+        fprintf(stderr, "Error, Failed to allocate memory for a document\n");
+        exit(1);
+    }
+    doc->state.am_file = stream;
+    ends[0] = 0;
+
+    for (i = first; i < last; i++) {
+        current = &doc->lines[i];
+        len = strlen(current->text);
+        source = copyString(MEM_LINES, current->text, len + 1);
+        source[len] = '\n';
+
+        /* The kind of the line, in the order PreProcessLine checks them */
+        pos = 0;
+        nextSourceLine(source, len + 1, &pos, source_line);
+        line = deleteSpaces(source_line, NULL);
+        if (isEmptyOrComment(line)) current->kind = LSP_BLANK;
+        else if (startsWith(line, MCREND, strlen(MCREND))) current->kind = LSP_MACRO_END;
+        else if (startsWith(line, MCRSTRT, strlen(MCRSTRT))) current->kind = LSP_MACRO_START;
+        else if (isIncludeDirective(line)) current->kind = LSP_INCLUDE;
+        else current->kind = doc->state.inside_macro ? LSP_MACRO_BODY : LSP_PLAIN;
+
+        /* Long lines are cut like fgets would, the parts keep the line number */
+        pos = 0;
+        while (nextSourceLine(source, len + 1, &pos, source_line)) PreProcessLine(&doc->state, source_line, i + 1, doc->path);
+        memFree(source);
+        diagDrain(keepDiagnostic, &current->parse);
+
+        current->inside_macro = doc->state.inside_macro;
+        current->macros = doc->state.macroList.tail;
+        ends[i - first + 1] = ftell(stream);
+    }
+    fclose(stream);
+    doc->state.am_file = NULL;
+
+    for (i = first; i < last; i++) {
+        len = ends[i - first + 1] - ends[i - first];
+        if (len) doc->lines[i].expansion = copyString(MEM_LINES, buffer + ends[i - first], len);
+    }
+    /* The buffer comes from the C library, not from memAlloc */
+    (free)(buffer);
+    memFree(ends);
+}
+
+
+/*******************************************************************************
+ * Runs the first pass over the expansion of a line. The labels it defines
+ * are collected in the scratch table and kept by the line, and the names it
+ * uses are hashed to know which edits it depends on.
+ *
+ * Parameters:
+ * - doc: The document.
+ * - index: The line.
+ ******************************************************************************/
+static void firstPassLine(LspDocument* doc, int index){
+    LspLine *current = &doc->lines[index];
+    LabelTable *scratch = doc->scratch;
+    char line[MAX_LINE_LENGTH];
+    size_t pos = 0, size;
+    Label *label, *next;
+    int errors = 0, count = 0, capacity = 0, start, len, i;
+
+    if (!current->expansion) return;
+    size = strlen(current->expansion);
+    while (nextSourceLine(current->expansion, size, &pos, line)) ProcessFirstPassLine(line, scratch, index + 1, &errors);
+    diagDrain(keepDiagnostic, &current->parse);
+
+    for (i = 0; i < scratch->table_size; i++) {
+        for (label = scratch->Labels[i]; label; label = label->next) count++;
+    }
+    if (count && !(current->defs = (Label**)memAlloc(MEM_LABELS, count * sizeof(Label*)))) {
+        fprintf(stderr, "Error, Failed to allocate memory for a document\n");
+        exit(1);
+    }
+    for (i = 0; i < scratch->table_size; i++) {
+        for (label = scratch->Labels[i]; label; label = next) {
+            next = label->next;
+            label->next = NULL;
+            current->defs[current->num_defs++] = label;
+        }
+        scratch->Labels[i] = NULL;
+    }
+    scratch->num_labels = 0;
+
+    i = 0;
+    while ((len = nextName(current->expansion, &i, &start))) {
+        if (current->num_deps == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            if (!(current->deps = (unsigned int*)memRealloc(MEM_LINES, current->deps, capacity * sizeof(unsigned int)))) {
+                fprintf(stderr, "Error, Failed to allocate memory for a document\n");
+                exit(1);
+            }
+        }
+        current->deps[current->num_deps++] = hashSpan(current->expansion + start, len);
+    }
+}
+
+
+/*******************************************************************************
+ * Links the labels of every line into the label table of the document, in
+ * line order as the first pass would, and reports the duplicates.
+ ******************************************************************************/
+static void linkLabels(LspDocument* doc){
+    LabelTable *table = doc->labels;
+    LspLine *current;
+    Label *label;
+    int i, j;
+
+    memset(table->Labels, 0, table->table_size * sizeof(Label*));
+    table->num_labels = 0;
+    for (i = 0; i < doc->num_lines; i++) {
+        current = &doc->lines[i];
+        freeDiagnostics(&current->duplicates);
+        for (j = 0; j < current->num_defs; j++) {
+            label = current->defs[j];
+            if (getLabel(table, label->name)) {
+                diagnose(i + 1, DIAG_LABEL, label->ext ? "Duplicate extern label definition %s" : "Duplicate Label definition %s", label->name);
+                diagDrain(keepDiagnostic, &current->duplicates);
+            }
+            else insertLabel(table, label);
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * Runs the second pass over the expansion of a line, with the validators
+ * and the label table of the assembler. Nothing is encoded as the server
+ * runs in --check mode; the counters start from 0 for every line.
+ *
+ * Parameters:
+ * - doc: The document.
+ * - index: The line.
+ ******************************************************************************/
+static void secondPassLine(LspDocument* doc, int index){
+    static signed short Code[MAX_LENGTH], Data[MAX_LENGTH];
+    LspLine *current = &doc->lines[index];
+    char line[MAX_LINE_LENGTH];
+    size_t pos = 0, size;
+    int PC[2], errors = 0;
+
+    freeDiagnostics(&current->check);
+    current->dirty = 0;
+    if (!current->expansion) return;
+    PC[0] = PC[1] = 0;
+    size = strlen(current->expansion);
+    while (nextSourceLine(current->expansion, size, &pos, line)) ProcessLine(line, doc->labels, Code, Data, PC, index + 1, &errors);
+    diagDrain(keepDiagnostic, &current->check);
+}
+
+
+/*******************************************************************************
+ * Orders name hashes for bsearch.
+ ******************************************************************************/
+static int compareHashes(const void* a, const void* b){
+    unsigned int first = *(const unsigned int*)a, second = *(const unsigned int*)b;
+
+    return first < second ? -1 : first > second;
+}
+
+
+/*******************************************************************************
+ * Remembers the labels of a line as changed: the lines using them are
+ * checked again.
+ ******************************************************************************/
+static void rememberDefinitions(LspDocument* doc, LspLine* line){
+    int i;
+
+    for (i = 0; i < line->num_defs; i++) {
+        if (doc->num_changed == doc->changed_capacity) {
+            doc->changed_capacity = doc->changed_capacity ? doc->changed_capacity * 2 : 16;
+            doc->changed = (unsigned int*)memRealloc(MEM_LINES, doc->changed, doc->changed_capacity * sizeof(unsigned int));
+            if (!doc->changed) {
+                fprintf(stderr, "Error, Failed to allocate memory for a document\n");
+                exit(1);
+            }
+        }
+        doc->changed[doc->num_changed++] = line->defs[i]->hash_value;
+    }
+}
+
+
+/*******************************************************************************
+ * Parses a whole document again: the macro table, every line and the label
+ * table. Used when a document is opened or replaced, and for edits of macro
+ * definitions and includes, which change how every following line expands.
+ ******************************************************************************/
+static void reparseDocument(LspDocument* doc){
+    int i;
+
+    for (i = 0; i < doc->num_lines; i++) clearLine(&doc->lines[i]);
+    freeMacroList(&doc->state.macroList);
+    memFree(doc->state.included);
+    memset(&doc->state, 0, sizeof(doc->state));
+    initMacroList(&doc->state.macroList);
+    doc->state.macroList.parent = getMacroLibrary();
+
+    expandLines(doc, 0, doc->num_lines);
+    for (i = 0; i < doc->num_lines; i++) firstPassLine(doc, i);
+    linkLabels(doc);
+    for (i = 0; i < doc->num_lines; i++) secondPassLine(doc, i);
+    doc->num_changed = 0;
+}
+
+
+/*******************************************************************************
+ * Replaces lines of a document and parses only the new lines, with the
+ * macros defined above them. The second pass is left to updateDocument.
+ *
+ * Parameters:
+ * - doc: The document.
+ * - first: The first line to replace.
+ * - count: Number of lines to replace.
+ * - text: The new text of the lines.
+ * - len: Length of the text.
+ *
+ * Returns:
+ * - 1 if the new lines were parsed, 0 if the edit touches a macro
+ *   definition or an include and the document has to be reparsed whole.
+ ******************************************************************************/
+static int editLines(LspDocument* doc, int first, int count, const char* text, size_t len){
+    MacroList *macros = &doc->state.macroList;
+    Macro *tail, *hidden, *last;
+    int added, structural = first > 0 && doc->lines[first - 1].inside_macro, i;
+
+    for (i = first; i < first + count; i++) {
+        if (doc->lines[i].kind >= LSP_MACRO_START) structural = 1;
+        rememberDefinitions(doc, &doc->lines[i]);
+    }
+    added = spliceLines(doc, first, count, text, len);
+    if (structural) return 0;
+
+    /* Hide the macros defined below the edit while expanding it */
+    tail = first > 0 ? doc->lines[first - 1].macros : NULL;
+    hidden = tail ? tail->next : macros->head;
+    last = macros->tail;
+    if (tail) tail->next = NULL;
+    else macros->head = NULL;
+    macros->tail = tail;
+    doc->state.inside_macro = 0;
+    doc->state.depth = 0;
+
+    expandLines(doc, first, first + added);
+
+    if (macros->tail) macros->tail->next = hidden;
+    else macros->head = hidden;
+    if (hidden) macros->tail = last;
+
+    for (i = first; i < first + added; i++) {
+        if (doc->lines[i].kind >= LSP_MACRO_START || doc->lines[i].inside_macro) return 0;
+    }
+    for (i = first; i < first + added; i++) {
+        firstPassLine(doc, i);
+        rememberDefinitions(doc, &doc->lines[i]);
+    }
+    return 1;
+}
+
+
+/*******************************************************************************
+ * Completes the edits of a document: links the label table again and runs
+ * the second pass over the edited lines and the lines using a label whose
+ * definition changed.
+ ******************************************************************************/
+static void updateDocument(LspDocument* doc){
+    LspLine *current;
+    int i, j;
+
+    linkLabels(doc);
+    if (doc->num_changed) qsort(doc->changed, doc->num_changed, sizeof(unsigned int), compareHashes);
+    for (i = 0; i < doc->num_lines; i++) {
+        current = &doc->lines[i];
+        for (j = 0; !current->dirty && doc->num_changed && j < current->num_deps; j++) {
+            if (bsearch(&current->deps[j], doc->changed, doc->num_changed, sizeof(unsigned int), compareHashes))
+                current->dirty = 1;
+        }
+        if (current->dirty) secondPassLine(doc, i);
+    }
+    doc->num_changed = 0;
+}
+
+
+/*******************************************************************************
+ * Checks if a diagnostic of a line repeats an earlier one of the line, as
+ * both passes report some problems.
+ ******************************************************************************/
+static int isRepeated(LspDiagnostics** lists, int list, int item){
+    LspDiagnostic *diagnostic = &lists[list]->items[item];
+    int i, j;
+
+    for (i = 0; i <= list; i++) {
+        for (j = 0; j < (i == list ? item : lists[i]->count); j++) {
+            if (lists[i]->items[j].code == diagnostic->code && strcmp(lists[i]->items[j].message, diagnostic->message) == 0)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+ * Sends the diagnostics of a document, every one over the text of its line.
+ ******************************************************************************/
+static void publishDiagnostics(FILE* out, LspDocument* doc){
+    LspBuffer buffer = {NULL, 0, 0};
+    LspDiagnostics *lists[3];
+    LspDiagnostic *diagnostic;
+    LspLine *current;
+    int first = 1, start, end, i, j, k;
+
+    appendText(&buffer, "{\"jsonrpc\": \"2.0\", \"method\": \"textDocument/publishDiagnostics\", \"params\": {\"uri\": ");
+    appendJsonString(&buffer, doc->uri);
+    appendText(&buffer, ", \"diagnostics\": [");
+    for (i = 0; i < doc->num_lines; i++) {
+        current = &doc->lines[i];
+        lists[0] = &current->parse;
+        lists[1] = &current->duplicates;
+        lists[2] = &current->check;
+        for (k = 0; k < 3; k++) {
+            for (j = 0; j < lists[k]->count; j++) {
+                if (isRepeated(lists, k, j)) continue;
+                diagnostic = &lists[k]->items[j];
+                for (start = 0; current->text[start] == ' ' || current->text[start] == '\t'; start++);
+                for (end = strlen(current->text); end > start && isspace((unsigned char)current->text[end - 1]); end--);
+                appendText(&buffer, first ? "{\"range\": " : ", {\"range\": ");
+                appendRange(&buffer, current->text, i, start, end);
+                appendText(&buffer, diagIsWarning(diagnostic->code) ? ", \"severity\": 2" : ", \"severity\": 1");
+                appendText(&buffer, ", \"code\": ");
+                appendJsonString(&buffer, diagCodeName(diagnostic->code));
+                appendText(&buffer, ", \"source\": \"assembler\", \"message\": ");
+                appendJsonString(&buffer, diagnostic->message);
+                appendText(&buffer, "}");
+                first = 0;
+            }
+        }
+    }
+    appendText(&buffer, "]}}");
+    sendMessage(out, &buffer);
+}
+
+
+/*******************************************************************************
+ * Returns the open document of a uri, NULL if it is not open.
+ ******************************************************************************/
+static LspDocument* findDocument(const char* uri){
+    LspDocument *doc;
+
+    for (doc = documents; uri && doc; doc = doc->next) {
+        if (strcmp(doc->uri, uri) == 0) return doc;
+    }
+    return NULL;
+}
+
+
+/*******************************************************************************
+ * Frees a document, its lines, macro table and label table.
+ ******************************************************************************/
+static void freeDocument(LspDocument* doc){
+    int i;
+
+    for (i = 0; i < doc->num_lines; i++) {
+        clearLine(&doc->lines[i]);
+        memFree(doc->lines[i].text);
+    }
+    memFree(doc->lines);
+    /* The labels belong to the lines */
+    memset(doc->labels->Labels, 0, doc->labels->table_size * sizeof(Label*));
+    freeLabelTable(doc->labels);
+    freeLabelTable(doc->scratch);
+    freeMacroList(&doc->state.macroList);
+    memFree(doc->state.included);
+    memFree(doc->changed);
+    memFree(doc->uri);
+    memFree(doc->path);
+    memFree(doc);
+}
+
+
+/*******************************************************************************
+ * Closes a document, if it is open.
+ ******************************************************************************/
+static void closeDocument(const char* uri){
+    LspDocument **link, *doc;
+
+    for (link = &documents; (doc = *link); link = &doc->next) {
+        if (strcmp(doc->uri, uri) == 0) {
+            *link = doc->next;
+            freeDocument(doc);
+            return;
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * Handles textDocument/didOpen: parses the document and publishes its
+ * diagnostics.
+ ******************************************************************************/
+static void openDocument(FILE* out, JsonValue* params){
+    JsonValue *item = member(params, "textDocument");
+    const char *uri = memberString(item, "uri"), *text = memberString(item, "text");
+    LspDocument *doc;
+
+    if (!uri || !text) return;
+    closeDocument(uri);
+
+    if (!(doc = (LspDocument*)memCalloc(MEM_OTHER, 1, sizeof(LspDocument)))) {
+        fprintf(stderr, "Error, Failed to allocate memory for a document\n");
+        exit(1);
+    }
+    doc->uri = copyString(MEM_FILE_NAMES, uri, strlen(uri));
+    doc->path = uriPath(uri);
+    doc->labels = create_LabelTable(TABLE_SIZE);
+    doc->scratch = create_LabelTable(TABLE_SIZE);
+    initMacroList(&doc->state.macroList);
+    spliceLines(doc, 0, 0, text, strlen(text));
+    reparseDocument(doc);
+    doc->next = documents;
+    documents = doc;
+    publishDiagnostics(out, doc);
+}
+
+
+/*******************************************************************************
+ * Handles textDocument/didChange: applies the edits, reparses only the
+ * edited lines and publishes the diagnostics again.
+ ******************************************************************************/
+static void changeDocument(FILE* out, JsonValue* params){
+    LspDocument *doc = findDocument(memberString(member(params, "textDocument"), "uri"));
+    JsonValue *changes = member(params, "contentChanges"), *change, *range;
+    const char *text, *first_text, *last_text;
+    char *edit;
+    size_t first_len, text_len, last_len;
+    long first, first_char, last, last_char;
+    int reparse = 0;
+
+    if (!doc || !changes || changes->type != JSON_ARRAY) return;
+    for (change = changes->child; change; change = change->next) {
+        if (!(text = memberString(change, "text"))) continue;
+        if (!(range = member(change, "range"))) {
+            spliceLines(doc, 0, doc->num_lines, text, strlen(text));
+            reparse = 1;
+            continue;
+        }
+
+        /* The edit replaces whole lines: the start of the first, the text, the rest of the last */
+        first = memberNumber(member(range, "start"), "line");
+        first_char = memberNumber(member(range, "start"), "character");
+        last = memberNumber(member(range, "end"), "line");
+        last_char = memberNumber(member(range, "end"), "character");
+        first = first < 0 ? 0 : first >= doc->num_lines ? doc->num_lines - 1 : first;
+        last = last < first ? first : last >= doc->num_lines ? doc->num_lines - 1 : last;
+        first_text = doc->lines[first].text;
+        last_text = doc->lines[last].text;
+        first_len = byteColumn(first_text, first_char);
+        last_len = strlen(last_text);
+        last_char = byteColumn(last_text, last_char);
+        if (first == last && last_char < (long)first_len) last_char = first_len;
+        last_len -= last_char;
+        text_len = strlen(text);
+
+        edit = (char*)memAlloc(MEM_LINES, first_len + text_len + last_len + 1);
+        if (!edit) {
+            fprintf(stderr, "Error, Failed to allocate memory for a document\n");
+            exit(1);
+        }
+        memcpy(edit, first_text, first_len);
+        memcpy(edit + first_len, text, text_len);
+        memcpy(edit + first_len + text_len, last_text + last_char, last_len + 1);
+
+        if (reparse) spliceLines(doc, first, last - first + 1, edit, first_len + text_len + last_len);
+        else reparse = !editLines(doc, first, last - first + 1, edit, first_len + text_len + last_len);
+        memFree(edit);
+    }
+
+    if (reparse) reparseDocument(doc);
+    else updateDocument(doc);
+    publishDiagnostics(out, doc);
+}
+
+
+/*******************************************************************************
+ * Finds the name at a position of a document.
+ *
+ * Parameters:
+ * - doc: The document.
+ * - line: The line.
+ * - character: The column, in UTF-16 code units.
+ * - start: Pointer to store the byte offset of the name.
+ *
+ * Returns:
+ * - The length of the name, 0 if there is none at the position.
+ ******************************************************************************/
+static int nameAt(LspDocument* doc, long line, long character, int* start){
+    const char *text;
+    int pos = 0, len;
+
+    if (line < 0 || line >= doc->num_lines) return 0;
+    text = doc->lines[line].text;
+    character = byteColumn(text, character);
+    while ((len = nextName(text, &pos, start))) {
+        if (*start <= character && character <= *start + len) return len;
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+ * Finds a name in a line of a document.
+ *
+ * Returns:
+ * - The column of its first use, or -1 if the line does not use it.
+ ******************************************************************************/
+static int findName(LspDocument* doc, int line, const char* name, int len){
+    const char *text = doc->lines[line].text;
+    int pos = 0, start, found;
+
+    while ((found = nextName(text, &pos, &start))) {
+        if (found == len && strncmp(text + start, name, len) == 0) return start;
+    }
+    return -1;
+}
+
+
+/*******************************************************************************
+ * Finds where a label or macro is defined.
+ *
+ * Parameters:
+ * - doc: The document.
+ * - name: The name, not terminated.
+ * - len: Length of the name.
+ * - line: Pointer to store the line of the definition.
+ * - start: Pointer to store the column of the name in it, -1 if the line
+ *   does not show it, as for a label defined by a macro.
+ *
+ * Returns:
+ * - 1 if the name is defined in the document, 0 otherwise.
+ ******************************************************************************/
+static int findDefinition(LspDocument* doc, const char* name, int len, int* line, int* start){
+    Label *label = getLabelSpan(doc->labels, name, len);
+    int i, j, pos, found;
+
+    for (i = 0; i < doc->num_lines; i++) {
+        if (label) {
+            for (j = 0; j < doc->lines[i].num_defs; j++) {
+                if (doc->lines[i].defs[j] != label) continue;
+                *line = i;
+                *start = findName(doc, i, name, len);
+                return 1;
+            }
+        }
+        /* The name of a macro follows the macro start keyword */
+        else if (doc->lines[i].kind == LSP_MACRO_START) {
+            pos = 0;
+            if (nextName(doc->lines[i].text, &pos, start) && (found = nextName(doc->lines[i].text, &pos, start)) == len &&
+                strncmp(doc->lines[i].text + *start, name, len) == 0) {
+                *line = i;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+ * Handles textDocument/definition for labels and macros.
+ ******************************************************************************/
+static void replyDefinition(FILE* out, JsonValue* id, JsonValue* params){
+    LspDocument *doc = findDocument(memberString(member(params, "textDocument"), "uri"));
+    JsonValue *position = member(params, "position");
+    LspBuffer buffer = {NULL, 0, 0};
+    int start, len = 0, line, def_start;
+
+    startResponse(&buffer, id);
+    appendText(&buffer, ", \"result\": ");
+    if (doc) len = nameAt(doc, memberNumber(position, "line"), memberNumber(position, "character"), &start);
+    if (len && findDefinition(doc, doc->lines[memberNumber(position, "line")].text + start, len, &line, &def_start)) {
+        if (def_start < 0) appendLocation(&buffer, doc, line, 0, strlen(doc->lines[line].text));
+        else appendLocation(&buffer, doc, line, def_start, def_start + len);
+    }
+    else appendText(&buffer, "null");
+    appendText(&buffer, "}");
+    sendMessage(out, &buffer);
+}
+
+
+/*******************************************************************************
+ * Checks if a name in a line is where it is defined: a label followed by a
+ * colon, or the name of an extern label or a macro.
+ ******************************************************************************/
+static int isDeclaration(const char* text, int start, int len){
+    int end = start;
+
+    if (text[start + len] == ':') return 1;
+    while (end > 0 && (text[end - 1] == ' ' || text[end - 1] == '\t')) end--;
+    if (end >= 7 && strncmp(text + end - 7, ".extern", 7) == 0) return 1;
+    return end >= 4 && strncmp(text + end - 4, MCRSTRT, 4) == 0 && (end == 4 || isspace((unsigned char)text[end - 5]));
+}
+
+
+/*******************************************************************************
+ * Handles textDocument/references: every use of the name at the position,
+ * and its definition when the context asks for it.
+ ******************************************************************************/
+static void replyReferences(FILE* out, JsonValue* id, JsonValue* params){
+    LspDocument *doc = findDocument(memberString(member(params, "textDocument"), "uri"));
+    JsonValue *position = member(params, "position"), *declaration = member(member(params, "context"), "includeDeclaration");
+    LspBuffer buffer = {NULL, 0, 0};
+    const char *name = NULL, *text;
+    int start, len = 0, first = 1, pos, found, i;
+
+    startResponse(&buffer, id);
+    appendText(&buffer, ", \"result\": [");
+    if (doc && (len = nameAt(doc, memberNumber(position, "line"), memberNumber(position, "character"), &start)))
+        name = doc->lines[memberNumber(position, "line")].text + start;
+    for (i = 0; name && i < doc->num_lines; i++) {
+        text = doc->lines[i].text;
+        pos = 0;
+        while ((found = nextName(text, &pos, &start))) {
+            if (found != len || strncmp(text + start, name, len) != 0) continue;
+            if ((!declaration || declaration->type != JSON_TRUE) && isDeclaration(text, start, len)) continue;
+            if (!first) appendText(&buffer, ", ");
+            appendLocation(&buffer, doc, i, start, start + len);
+            first = 0;
+        }
+    }
+    appendText(&buffer, "]}");
+    sendMessage(out, &buffer);
+}
+
+
+/*******************************************************************************
+ * Serves the language server protocol: JSON-RPC messages with a
+ * Content-Length header, until the exit notification or the end of the
+ * input. Open documents stay resident with their macro and label tables;
+ * every edit reparses only the edited lines and the lines using labels
+ * whose definition changed, then the diagnostics are published again.
+ * The server runs in --check mode and writes no files.
+ *
+ * Supported: initialize, shutdown, exit, textDocument/didOpen, didChange
+ * (incremental), didClose, definition and references.
+ *
+ * Parameters:
+ * - in: The stream of the client's messages.
+ * - out: The stream of the server's messages.
+ *
+ * Returns:
+ * - 0 after a shutdown request and the exit notification, 1 otherwise.
+ ******************************************************************************/
+int lspServe(FILE* in, FILE* out){
+    LspBuffer buffer = {NULL, 0, 0};
+    JsonValue *message, *id, *params;
+    const char *method, *uri, *text;
+    char *body;
+    int shutdown = 0, exited = 0;
+    LspDocument *next;
+
+    while (!exited && (body = readMessage(in))) {
+        text = body;
+        message = parseJson(&text);
+        memFree(body);
+        if (!message) {
+            sendError(out, NULL, -32700, "Parse error");
+            continue;
+        }
+        method = memberString(message, "method");
+        id = member(message, "id");
+        params = member(message, "params");
+
+        if (!method) {
+            /* A response of the client, nothing was asked */
+        }
+        else if (strcmp(method, "initialize") == 0) {
+            startResponse(&buffer, id);
+            appendText(&buffer, ", \"result\": {\"capabilities\": {\"textDocumentSync\": {\"openClose\": true, \"change\": 2}, "
+                                "\"definitionProvider\": true, \"referencesProvider\": true}, "
+                                "\"serverInfo\": {\"name\": \"Assembler\"}}}");
+            sendMessage(out, &buffer);
+        }
+        else if (strcmp(method, "shutdown") == 0) {
+            shutdown = 1;
+            startResponse(&buffer, id);
+            appendText(&buffer, ", \"result\": null}");
+            sendMessage(out, &buffer);
+        }
+        else if (strcmp(method, "exit") == 0) exited = 1;
+        else if (strcmp(method, "textDocument/didOpen") == 0) openDocument(out, params);
+        else if (strcmp(method, "textDocument/didChange") == 0) changeDocument(out, params);
+        else if (strcmp(method, "textDocument/didClose") == 0) {
+            if ((uri = memberString(member(params, "textDocument"), "uri")) && findDocument(uri)) {
+                closeDocument(uri);
+                appendText(&buffer, "{\"jsonrpc\": \"2.0\", \"method\": \"textDocument/publishDiagnostics\", \"params\": {\"uri\": ");
+                appendJsonString(&buffer, uri);
+                appendText(&buffer, ", \"diagnostics\": []}}");
+                sendMessage(out, &buffer);
+            }
+        }
+        else if (strcmp(method, "textDocument/definition") == 0) replyDefinition(out, id, params);
+        else if (strcmp(method, "textDocument/references") == 0) replyReferences(out, id, params);
+        else if (id) sendError(out, id, -32601, "Method not found");
+        freeJson(message);
+    }
+
+    for (; documents; documents = next) {
+        next = documents->next;
+        freeDocument(documents);
+    }
+    return !(shutdown && exited);
+}
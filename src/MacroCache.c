@@ -0,0 +1,421 @@
+#define _POSIX_C_SOURCE 200112L
+#include "Assembler.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Preloaded macro library, its mapping and the mapping size */
+static MacroList macro_library = {0};
+static Macro *library_macros = NULL;
+static char **library_lines = NULL;
+static void *library_map = NULL;
+static size_t library_map_size = 0;
+
+
+/*******************************************************************************
+ * Compiles a macro library source into a binary macro cache file.
+ * The source may only contain macro definitions, comments and empty lines.
+ *
+ * Cache layout (all numbers are 32 bit little endian):
+ * - header: magic "MCCH", version, payload size, FNV-1a hash of the payload.
+ * - payload: macro count, then for each macro its name length and name,
+ *   its line count, and every line as length and bytes.
+ *   Names and lines are stored with a terminating '\0'.
+ *
+ * Parameters:
+ * - source_name: The name of the macro library source file.
+ * - cache_name: The name of the cache file to create.
+ *
+ * Returns:
+ * - 1 on success, 0 otherwise.
+ ******************************************************************************/
+int CompileMacroLibrary(char* source_name, char* cache_name){
+    FILE *source_file = NULL;
+    MacroList list;
+    int result;
+
+    source_file = fopen(source_name, "r");
+    if (!source_file) {
+        diagnose(0, DIAG_FILE, "Cannot open file %s", source_name);
+        return 0;
+    }
+
+    initMacroList(&list);
+    result = readMacroDefinitions(source_file, &list);
+    fclose(source_file);
+
+    if (result) result = writeMacroCache(&list, cache_name);
+
+    freeMacroList(&list);
+    return result;
+}
+
+
+/*******************************************************************************
+ * Reads the macro definitions of a macro library source into a macro list.
+ * Applies the same macro validation as the PreAssembler.
+ *
+ * Parameters:
+ * - source_file: The opened macro library source.
+ * - list: Pointer to the MacroList to fill.
+ *
+ * Returns:
+ * - 1 if all definitions are valid, 0 otherwise.
+ ******************************************************************************/
+int readMacroDefinitions(FILE* source_file, MacroList* list){
+    char source_line[MAX_LINE_LENGTH] = {0}; /* Buffer for reading source lines */
+    char macro_name[MAX_LINE_LENGTH] = {0}; /* Buffer for macro names */
+    char *line = NULL, *name = NULL;
+    int inside_macro = 0, counter = 0, valid = 1;
+    LineScan scan; /* Class bitmaps of the current line */
+
+    while (fgets(source_line, MAX_LINE_LENGTH, source_file)) {
+        counter++;
+        scanString(source_line, &scan);
+        line = deleteSpaces(source_line, &scan);
+        if (isEmptyOrComment(line)) continue;
+
+        if (startsWith(line, MCREND, strlen(MCREND))) {
+            line += strlen(MCREND);
+            if (!isEmptyOrComment(deleteSpaces(line, &scan))) {
+                diagnose(counter, DIAG_MACRO, "Extra Text after macro end.");
+                valid = 0;
+            }
+            inside_macro = 0;
+            continue;
+        }
+
+        if (startsWith(line, MCRSTRT, strlen(MCRSTRT))) {
+            name = getMacroName(line, &scan, &counter);
+            if (!name || !IsValidMacroName(name, &counter)) {
+                valid = 0;
+                continue;
+            }
+            strcpy(macro_name, name);
+            insertMacroName(list, macro_name);
+            inside_macro = 1;
+            continue;
+        }
+
+        if (!inside_macro) {
+            diagnose(counter, DIAG_MACRO, "Only macro definitions are allowed in a macro library");
+            valid = 0;
+            continue;
+        }
+        insertMacroLine(list, line, macro_name);
+    }
+
+    if (inside_macro) {
+        diagnose(counter, DIAG_MACRO, "Missing %s at end of macro library", MCREND);
+        valid = 0;
+    }
+    return valid;
+}
+
+
+/*******************************************************************************
+ * Stores a 32 bit number in little endian order.
+ *
+ * Parameters:
+ * - buffer: The destination buffer (at least 4 bytes).
+ * - x: The number to store.
+ ******************************************************************************/
+void putWord32(unsigned char* buffer, unsigned long x){
+    buffer[0] = (unsigned char)(x & 0xFF);
+    buffer[1] = (unsigned char)((x >> 8) & 0xFF);
+    buffer[2] = (unsigned char)((x >> 16) & 0xFF);
+    buffer[3] = (unsigned char)((x >> 24) & 0xFF);
+}
+
+
+/*******************************************************************************
+ * Reads a 32 bit little endian number.
+ *
+ * Parameters:
+ * - buffer: The source buffer (at least 4 bytes).
+ *
+ * Returns:
+ * - The number read.
+ ******************************************************************************/
+unsigned long getWord32(const unsigned char* buffer){
+    return (unsigned long)buffer[0] | ((unsigned long)buffer[1] << 8) |
+           ((unsigned long)buffer[2] << 16) | ((unsigned long)buffer[3] << 24);
+}
+
+
+/*******************************************************************************
+ * Computes the 32 bit FNV-1a hash used to validate cache payloads.
+ *
+ * Parameters:
+ * - data: The bytes to hash.
+ * - len: The number of bytes.
+ *
+ * Returns:
+ * - The hash value.
+ ******************************************************************************/
+unsigned long cacheHash(const unsigned char* data, unsigned long len){
+    unsigned long hash = 2166136261UL;
+    unsigned long i;
+    for (i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+    }
+    return hash;
+}
+
+
+/*******************************************************************************
+ * Appends a length prefixed, '\0' terminated string to the payload buffer.
+ *
+ * Parameters:
+ * - payload: The payload buffer (NULL to only measure).
+ * - pos: The current write position.
+ * - str: The string to append.
+ *
+ * Returns:
+ * - The new write position.
+ ******************************************************************************/
+static unsigned long appendString(unsigned char* payload, unsigned long pos, const char* str){
+    unsigned long len = strlen(str);
+    if (payload) {
+        putWord32(payload + pos, len);
+        memcpy(payload + pos + 4, str, len + 1);
+    }
+    return pos + 4 + len + 1;
+}
+
+
+/*******************************************************************************
+ * Serializes a macro list into the payload buffer.
+ *
+ * Parameters:
+ * - list: The macro list to serialize.
+ * - payload: The payload buffer (NULL to only measure).
+ *
+ * Returns:
+ * - The payload size in bytes.
+ ******************************************************************************/
+static unsigned long serializeMacros(MacroList* list, unsigned char* payload){
+    unsigned long pos = 4, count = 0;
+    Macro *macro;
+    int i;
+
+    for (macro = list->head; macro != NULL; macro = macro->next) {
+        pos = appendString(payload, pos, macro->name);
+        if (payload) putWord32(payload + pos, macro->linesArray.size);
+        pos += 4;
+        for (i = 0; i < macro->linesArray.size; i++) {
+            pos = appendString(payload, pos, macro->linesArray.lines[i]);
+        }
+        count++;
+    }
+    if (payload) putWord32(payload, count);
+    return pos;
+}
+
+
+/*******************************************************************************
+ * Writes a macro list to a binary macro cache file.
+ *
+ * Parameters:
+ * - list: The macro list to write.
+ * - cache_name: The name of the cache file to create.
+ *
+ * Returns:
+ * - 1 on success, 0 otherwise.
+ ******************************************************************************/
+int writeMacroCache(MacroList* list, char* cache_name){
+    unsigned char header[MACRO_CACHE_HEADER_SIZE];
+    unsigned char *payload = NULL;
+    unsigned long size;
+    FILE *cache_file = NULL;
+    int result = 1;
+
+    size = serializeMacros(list, NULL);
+    payload = (unsigned char*)memAlloc(MEM_MACROS, size);
+    if (!payload) {
+        fprintf(stderr, "Error, Failed to allocate memory for macro cache\n");
+        return 0;
+    }
+    serializeMacros(list, payload);
+
+    memcpy(header, MACRO_CACHE_MAGIC, 4);
+    putWord32(header + 4, MACRO_CACHE_VERSION);
+    putWord32(header + 8, size);
+    putWord32(header + 12, cacheHash(payload, size));
+
+    cache_file = fopen(cache_name, "wb");
+    if (!cache_file) {
+        fprintf(stderr, "Error, Failed to create file: %s\n", cache_name);
+        memFree(payload);
+        return 0;
+    }
+    if (fwrite(header, 1, MACRO_CACHE_HEADER_SIZE, cache_file) != MACRO_CACHE_HEADER_SIZE ||
+        fwrite(payload, 1, size, cache_file) != size) {
+        fprintf(stderr, "Error, Failed to write file: %s\n", cache_name);
+        result = 0;
+    }
+    fclose(cache_file);
+    memFree(payload);
+    return result;
+}
+
+
+/*******************************************************************************
+ * Reads a length prefixed string from a mapped payload.
+ *
+ * Parameters:
+ * - payload: The mapped payload.
+ * - size: The payload size.
+ * - pos: Pointer to the read position, advanced past the string.
+ *
+ * Returns:
+ * - A pointer to the string inside the mapping, or NULL if it is malformed.
+ ******************************************************************************/
+static char* readString(const unsigned char* payload, unsigned long size, unsigned long* pos){
+    unsigned long len;
+    char *str;
+
+    if (*pos + 4 > size) return NULL;
+    len = getWord32(payload + *pos);
+    if (len >= size || *pos + 4 + len + 1 > size) return NULL;
+    str = (char*)(payload + *pos + 4);
+    if (str[len] != '\0') return NULL;
+    *pos += 4 + len + 1;
+    return str;
+}
+
+
+/*******************************************************************************
+ * Builds the library macro list on top of a mapped payload.
+ * Macro names and lines point straight into the mapping, only the list nodes
+ * and the line pointer arrays are allocated.
+ *
+ * Parameters:
+ * - payload: The mapped payload.
+ * - size: The payload size.
+ *
+ * Returns:
+ * - 1 on success, 0 if the payload is malformed, -1 if memory runs out.
+ ******************************************************************************/
+static int buildLibrary(const unsigned char* payload, unsigned long size){
+    unsigned long count, total_lines = 0, pos, i, j, lines;
+    Macro *macro;
+
+    if (size < 4) return 0;
+    count = getWord32(payload);
+
+    /* First walk: validate the payload and count the lines */
+    pos = 4;
+    for (i = 0; i < count; i++) {
+        if (!readString(payload, size, &pos) || pos + 4 > size) return 0;
+        lines = getWord32(payload + pos);
+        pos += 4;
+        for (j = 0; j < lines; j++) {
+            if (!readString(payload, size, &pos)) return 0;
+        }
+        total_lines += lines;
+    }
+
+    library_macros = (Macro*)memCalloc(MEM_MACROS, count ? count : 1, sizeof(Macro));
+    library_lines = (char**)memCalloc(MEM_MACROS, total_lines ? total_lines : 1, sizeof(char*));
+    if (!library_macros || !library_lines) {
+        fprintf(stderr, "MemError, Failed to allocate Memory for macro library!\n");
+        return -1;
+    }
+
+    /* Second walk: link the macros, in definition order */
+    pos = 4;
+    total_lines = 0;
+    for (i = 0; i < count; i++) {
+        macro = &library_macros[i];
+        macro->name = readString(payload, size, &pos);
+        lines = getWord32(payload + pos);
+        pos += 4;
+        macro->linesArray.lines = library_lines + total_lines;
+        macro->linesArray.size = (int)lines;
+        macro->linesArray.capacity = (int)lines;
+        for (j = 0; j < lines; j++) {
+            library_lines[total_lines++] = readString(payload, size, &pos);
+        }
+        addMacroToList(&macro_library, macro);
+    }
+    return 1;
+}
+
+
+/*******************************************************************************
+ * Loads a binary macro cache file as the process wide macro library.
+ * The file is mapped read only and validated by its header and hash.
+ *
+ * Parameters:
+ * - cache_name: The name of the cache file.
+ *
+ * Returns:
+ * - 1 on success, 0 otherwise.
+ ******************************************************************************/
+int loadMacroCache(char* cache_name){
+    const unsigned char *map;
+    unsigned long size;
+    struct stat st;
+    int fd, built = 0;
+
+    fd = open(cache_name, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening file: %s\n", cache_name);
+        return 0;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < MACRO_CACHE_HEADER_SIZE) {
+        fprintf(stderr, "Error, Invalid macro cache file: %s\n", cache_name);
+        close(fd);
+        return 0;
+    }
+    library_map_size = (size_t)st.st_size;
+    library_map = mmap(NULL, library_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (library_map == MAP_FAILED) {
+        fprintf(stderr, "Error, Failed to map file: %s\n", cache_name);
+        library_map = NULL;
+        return 0;
+    }
+
+    map = (const unsigned char*)library_map;
+    size = getWord32(map + 8);
+    if (memcmp(map, MACRO_CACHE_MAGIC, 4) != 0 || getWord32(map + 4) != MACRO_CACHE_VERSION ||
+        size != library_map_size - MACRO_CACHE_HEADER_SIZE ||
+        getWord32(map + 12) != cacheHash(map + MACRO_CACHE_HEADER_SIZE, size) ||
+        !(built = buildLibrary(map + MACRO_CACHE_HEADER_SIZE, size))) {
+        fprintf(stderr, "Error, Invalid or stale macro cache file: %s\n", cache_name);
+        freeMacroLibrary();
+        return 0;
+    }
+    if (built < 0) {
+        freeMacroLibrary();
+        return 0;
+    }
+    return 1;
+}
+
+
+/*******************************************************************************
+ * Returns the preloaded macro library, or NULL if none was loaded.
+ ******************************************************************************/
+MacroList* getMacroLibrary(void){
+    return macro_library.head ? &macro_library : NULL;
+}
+
+
+/*******************************************************************************
+ * Releases the preloaded macro library and unmaps its cache file.
+ ******************************************************************************/
+void freeMacroLibrary(void){
+    memFree(library_macros);
+    memFree(library_lines);
+    library_macros = NULL;
+    library_lines = NULL;
+    if (library_map) munmap(library_map, library_map_size);
+    library_map = NULL;
+    library_map_size = 0;
+    initMacroList(&macro_library);
+}
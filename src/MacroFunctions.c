@@ -2,7 +2,7 @@
 
 /*******************************************************************************
  * Initializes a MacroList structure.
- * Sets the head and tail pointers to NULL.
+ * Sets the head, tail and parent pointers to NULL.
  *
  * Parameters:
  * - list: Pointer to the MacroList to initialize.
@@ -10,6 +10,7 @@
 void initMacroList(MacroList* list) {
     list->head = NULL;
     list->tail = NULL;
+    list->parent = NULL;
 }
 
 
@@ -23,7 +24,7 @@ void initMacroList(MacroList* list) {
 void initLinesArray(LinesArray* array) {
     array->capacity = 1;
     array->size = 0;
-    array->lines = (char **)malloc(array->capacity * sizeof(char*));
+    array->lines = (char **)memAlloc(MEM_MACROS, array->capacity * sizeof(char*));
     if (!array->lines) {
         fprintf(stderr, "Failed to allocate memory for lines array\n");
         exit(1);
@@ -44,15 +45,15 @@ void initLinesArray(LinesArray* array) {
  ******************************************************************************/
 Macro *createMacro(const char *macro_name) {
     int len = strlen(macro_name)+1;
-    Macro *new_macro = malloc(sizeof(Macro));
+    Macro *new_macro = memAlloc(MEM_MACROS, sizeof(Macro));
     if (!new_macro) {
         fprintf(stderr, "Failed to allocate memory for new macro\n");
         exit(1);
     }
-    new_macro->name = (char *)malloc(len);
+    new_macro->name = (char *)memAlloc(MEM_MACROS, len);
     if (!new_macro->name) {
         fprintf(stderr, "Failed to allocate memory for new macro name\n");
-        free(new_macro);
+        memFree(new_macro);
         exit(1);
     }
     strcpy(new_macro->name, macro_name);
@@ -67,23 +68,25 @@ Macro *createMacro(const char *macro_name) {
  *
  * Parameters:
  * - line: The line of code to process.
+ * - scan: The scan of the line, or NULL.
  * - counter: Pointer to the line counter for error reporting.
  *
  * Returns:
  * - The extracted macro name, or NULL if not found.
  ******************************************************************************/
-char* getMacroName(char* line, int* counter) {
+char* getMacroName(char* line, LineScan* scan, int* counter) {
     char* name;
     line += strlen(MCRSTRT);
-    name = deleteSpaces(line);
+    /* Drop the line terminator so the name matches its uses */
+    name = deleteSpaces(deleteLineEnd(line, scan), scan);
 
     /* In case no macro name found*/
     if (!name || *name == '\0'){
-        printf("Error at line %d: Missing macro name after macro definition\n", *counter);
+        diagnose(*counter, DIAG_MACRO, "Missing macro name after macro definition");
         return NULL;
     }
-    if(strchr(name, ' ') || strchr(name, '\t')){
-        fprintf(stderr, "Error at line %d, Extra text after macro definition\n", *counter);
+    if(hasBlank(name, scan)){
+        diagnose(*counter, DIAG_MACRO, "Extra text after macro definition");
         return NULL;
     } 
     return name;
@@ -149,7 +152,7 @@ void insertMacroLine(MacroList* list, char* line, const char* macro_name) {
  * - line: The line of code to add.
  ******************************************************************************/
 void addLineToArray(LinesArray* array, char* line) {
-    array->lines[array->size] = (char *)calloc(strlen(line)+1, sizeof(char));
+    array->lines[array->size] = (char *)memCalloc(MEM_MACROS, strlen(line)+1, sizeof(char));
     if(!array->lines[array->size]){
         fprintf(stderr,"Error, failed to Allocate memory for lines array");
         exit(1);
@@ -166,45 +169,55 @@ void addLineToArray(LinesArray* array, char* line) {
 
 /*******************************************************************************
  * Finds and replaces a macro in the given line.
+ * The list is searched first, then its parent lists (the preloaded library).
  *
  * Parameters:
  * - list: Pointer to the MacroList to search.
  * - line: The line of code to process.
+ * - scan: The scan of the line, or NULL to scan it here.
  * - am_file: Pointer to the output file.
  *
  * Returns:
  * - 1 if a macro was found and replaced, 0 otherwise.
  ******************************************************************************/
-int findAndReplaceMacro(MacroList* list, char* line, FILE* am_file) {
-    int i, len;
+int findAndReplaceMacro(MacroList* list, char* line, const LineScan* scan, FILE* am_file) {
+    int i, len, from, end, first, last;
     Macro* macro;
-    char* name = (char *)malloc(strlen(line)+1);
-    if(!name){
-        fprintf(stderr, "Error, failed to allocate memory for macro name");
-        exit(1);
-    }
-    strcpy(name, line);
-    name = strtok(name, "\r\n");
-    name = deleteSpaces(name);
-    if(strchr(name, ' ') || strchr(name, '\t')){
-        free(name);
-        return 0;
+    MacroList* current;
+    LineScan line_scan; /* Scan of the line when the caller has none */
+    const char* name;
+
+    if ((from = scanSpan(scan, line, &end)) == -1) {
+        if (!scanString(line, &line_scan)) return 0;
+        scan = &line_scan;
+        from = 0;
+        end = line_scan.length;
     }
-    macro = list->head;
-    while(macro) {
-        if (macro->name && (strcmp(name, macro->name) == 0)) {
-            for (i = 0; i < macro->linesArray.size; i++) {
-                if (macro->linesArray.lines[i]) {
-                    len = strlen(macro->linesArray.lines[i]);
-                    fwrite(macro->linesArray.lines[i], sizeof(char), len, am_file);
-                }          
+
+    /* The name is the line without its surrounding white space, compared in place */
+    first = scanFirstNot(scan, SCAN_SPACE, from, end);
+    last = scanLastNot(scan, SCAN_SPACE, first, end);
+    if (last < first || scanFirst(scan, SCAN_BLANK, first, last) != -1) return 0;
+    name = line + first - from;
+    len = last + 1 - first;
+
+    for (current = list; current != NULL; current = current->parent) {
+        macro = current->head;
+        while(macro) {
+            if (macro->name && strncmp(name, macro->name, len) == 0 && macro->name[len] == '\0') {
+                for (i = 0; i < macro->linesArray.size; i++) {
+                    if (macro->linesArray.lines[i]) {
+                        len = strlen(macro->linesArray.lines[i]);
+                        fwrite(macro->linesArray.lines[i], sizeof(char), len, am_file);
+                    }          
+                }
+                Stats.macro_expansions++;
+                TRACE_PROBE2(macro__expand, macro->name, macro->linesArray.size);
+                return 1;
             }
-            free(name);
-            return 1;
+            macro = macro->next;
         }
-        macro = macro->next;
     }
-    free(name);
     return 0;
 }
 
@@ -220,7 +233,7 @@ void resizeLinesArray(LinesArray* array) {
     int newCapacity = array->capacity * 2, i;     /* Double the capacity*/
     
     /* Allocate new memory block for the array of pointers based on the new capacity*/
-    new_array = realloc(array->lines, newCapacity * sizeof(char*));
+    new_array = memRealloc(MEM_MACROS, array->lines, newCapacity * sizeof(char*));
     if (!new_array) {
         fprintf(stderr, "Failed to allocate memory for resizing lines array\n");
         exit(1);
@@ -262,9 +275,9 @@ void freeMacroList(MacroList* list) {
  ******************************************************************************/
 void freeMacro(Macro* macro) {
     if (macro) {
-        free(macro->name);
+        memFree(macro->name);
         freeLinesArray(&macro->linesArray);
-        free(macro);
+        memFree(macro);
         macro = NULL;
     }
 }
@@ -280,8 +293,9 @@ void freeLinesArray(LinesArray* array) {
     int i;
     if (array) {
         for( i = 0; i < array->size; ++i) {
-            if(array->lines[i]) free(array->lines[i]);
+            if(array->lines[i]) memFree(array->lines[i]);
         }
+        memFree(array->lines);
         array->lines = NULL;
         array->size = 0;
         array->capacity = 0;
@@ -0,0 +1,219 @@
+#include "Assembler.h"
+
+/* Prefix of every block: its size and subsystem, aligned for any type */
+typedef union BlockHeader {
+    struct {
+        size_t size; /* Bytes requested by the caller */
+        int subsystem; /* MEM_* subsystem of the block */
+    } info;
+    double align_double;
+    long align_long;
+    void *align_pointer;
+} BlockHeader;
+
+/* Counters of one subsystem, updated by every thread */
+typedef struct MemCounters {
+    long count; /* Allocations, reallocations included */
+    long bytes; /* Bytes requested */
+    long live_count; /* Blocks not freed yet */
+    long live_bytes; /* Bytes of the blocks not freed yet */
+    long peak_bytes; /* Highest live_bytes since the current file started */
+} MemCounters;
+
+static MemCounters counters[MEM_SUBSYSTEMS];
+static MemCounters file_start[MEM_SUBSYSTEMS]; /* counters when the current file started */
+static long run_peak[MEM_SUBSYSTEMS]; /* Highest live_bytes of the whole run */
+
+static const char *subsystem_names[MEM_SUBSYSTEMS] = {
+    "labels", "references", "macros", "lines", "file names", "output", "diagnostics", "other"
+};
+
+
+/*******************************************************************************
+ * Adds to a counter that several threads may update at once.
+ *
+ * Returns:
+ * - The new value of the counter.
+ ******************************************************************************/
+static long addAndFetch(long* counter, long n){
+#ifdef __GNUC__
+    return __sync_add_and_fetch(counter, n);
+#else
+    return *counter += n;
+#endif
+}
+
+
+/*******************************************************************************
+ * Raises a high-water mark to value if it is lower.
+ ******************************************************************************/
+static void raisePeak(long* peak, long value){
+#ifdef __GNUC__
+    long seen;
+
+    while ((seen = *peak) < value && !__sync_bool_compare_and_swap(peak, seen, value));
+#else
+    if (*peak < value) *peak = value;
+#endif
+}
+
+
+/*******************************************************************************
+ * Accounts a new block and returns the memory after its header.
+ ******************************************************************************/
+static void* track(BlockHeader* block, int subsystem, size_t size){
+    MemCounters *c;
+    long live;
+
+    if (!block) return NULL;
+    if (subsystem < 0 || subsystem >= MEM_SUBSYSTEMS) subsystem = MEM_OTHER;
+    block->info.size = size;
+    block->info.subsystem = subsystem;
+
+    c = &counters[subsystem];
+    addAndFetch(&c->count, 1);
+    addAndFetch(&c->bytes, (long)size);
+    addAndFetch(&c->live_count, 1);
+    live = addAndFetch(&c->live_bytes, (long)size);
+    raisePeak(&c->peak_bytes, live);
+    return block + 1;
+}
+
+
+/*******************************************************************************
+ * Removes a block from the live counters of its subsystem.
+ ******************************************************************************/
+static void untrack(BlockHeader* block){
+    MemCounters *c = &counters[block->info.subsystem];
+
+    addAndFetch(&c->live_count, -1);
+    addAndFetch(&c->live_bytes, -(long)block->info.size);
+}
+
+
+/*******************************************************************************
+ * The instrumented allocator. Every allocation of the assembler goes through
+ * these, tagged with the MEM_* subsystem it belongs to, and must be released
+ * with memFree. They behave like malloc, calloc, realloc and free.
+ *
+ * Parameters:
+ * - subsystem: The MEM_* subsystem of the block.
+ * - size, count: As for malloc and calloc.
+ * - ptr: A block from this allocator, or NULL.
+ ******************************************************************************/
+void* memAlloc(int subsystem, size_t size){
+    return track((BlockHeader*)malloc(sizeof(BlockHeader) + size), subsystem, size);
+}
+
+void* memCalloc(int subsystem, size_t count, size_t size){
+    if (size && count > ((size_t)-1 - sizeof(BlockHeader)) / size) return NULL;
+    return track((BlockHeader*)calloc(1, sizeof(BlockHeader) + count * size), subsystem, count * size);
+}
+
+void* memRealloc(int subsystem, void* ptr, size_t size){
+    BlockHeader *block, *moved;
+
+    if (!ptr) return memAlloc(subsystem, size);
+    block = (BlockHeader*)ptr - 1;
+    subsystem = block->info.subsystem;
+    /* On failure the old block stays valid and accounted */
+    if (!(moved = (BlockHeader*)realloc(block, sizeof(BlockHeader) + size))) return NULL;
+    untrack(moved);
+    return track(moved, subsystem, size);
+}
+
+void memFree(void* ptr){
+    BlockHeader *block;
+
+    if (!ptr) return;
+    block = (BlockHeader*)ptr - 1;
+    untrack(block);
+    free(block);
+}
+
+
+/*******************************************************************************
+ * Starts the per file counters: the high-water marks restart from the
+ * memory still live.
+ ******************************************************************************/
+void memBeginFile(void){
+    int i;
+
+    for (i = 0; i < MEM_SUBSYSTEMS; i++) {
+        raisePeak(&run_peak[i], counters[i].peak_bytes);
+        counters[i].peak_bytes = counters[i].live_bytes;
+        file_start[i] = counters[i];
+    }
+}
+
+
+/*******************************************************************************
+ * Returns the allocations since the current file started.
+ ******************************************************************************/
+long memFileAllocations(void){
+    long sum = 0;
+    int i;
+
+    for (i = 0; i < MEM_SUBSYSTEMS; i++) sum += counters[i].count - file_start[i].count;
+    return sum;
+}
+
+
+/*******************************************************************************
+ * Prints the table of the --mem-report on stderr.
+ *
+ * Parameters:
+ * - file_name: The file of the table, NULL for the run.
+ * - since: The counters the counts and bytes are relative to, NULL for the run.
+ * - peaks: The high-water marks to print.
+ ******************************************************************************/
+static void printMemTable(const char* file_name, MemCounters* since, long* peaks){
+    long count, bytes, total[4] = {0};
+    int i;
+
+    if (file_name) fprintf(stderr, "Memory for %s:\n", file_name);
+    else fprintf(stderr, "Memory for the run:\n");
+    fprintf(stderr, "  %-12s %10s %12s %12s %12s\n", "subsystem", "allocs", "bytes", "high-water", "outstanding");
+    for (i = 0; i < MEM_SUBSYSTEMS; i++) {
+        count = counters[i].count - (since ? since[i].count : 0);
+        bytes = counters[i].bytes - (since ? since[i].bytes : 0);
+        fprintf(stderr, "  %-12s %10ld %12ld %12ld %12ld\n", subsystem_names[i],
+                count, bytes, peaks[i], counters[i].live_count);
+        total[0] += count;
+        total[1] += bytes;
+        total[2] += peaks[i];
+        total[3] += counters[i].live_count;
+    }
+    fprintf(stderr, "  %-12s %10ld %12ld %12ld %12ld\n", "total", total[0], total[1], total[2], total[3]);
+}
+
+
+/*******************************************************************************
+ * Prints the allocations of a finished file with --mem-report, once all its
+ * memory is released: what is still outstanding then is kept by the run
+ * (macro library, include cache, --async-io buffers) or leaked.
+ *
+ * Parameters:
+ * - file_name: The source file.
+ ******************************************************************************/
+void memEndFile(char* file_name){
+    long peaks[MEM_SUBSYSTEMS];
+    int i;
+
+    if (!Options.mem_report) return;
+    for (i = 0; i < MEM_SUBSYSTEMS; i++) peaks[i] = counters[i].peak_bytes;
+    printMemTable(file_name, file_start, peaks);
+}
+
+
+/*******************************************************************************
+ * Prints the allocations of the whole run with --mem-report, after the
+ * last release: anything outstanding then is a leak.
+ ******************************************************************************/
+void memReport(void){
+    int i;
+
+    if (!Options.mem_report) return;
+    for (i = 0; i < MEM_SUBSYSTEMS; i++) raisePeak(&run_peak[i], counters[i].peak_bytes);
+    printMemTable(NULL, NULL, run_peak);
+}
@@ -0,0 +1,300 @@
+#include "Assembler.h"
+
+/* Value of every character as a base 4 digit of the object files, -1 for
+ * anything but the letters a to d */
+static const signed char digit_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1,  0,  1,  2,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+
+/*******************************************************************************
+ * Decodes a number written in the base 4 letters of the object files.
+ *
+ * Parameters:
+ * - digits: The letters, most significant first.
+ * - len: Number of letters.
+ *
+ * Returns:
+ * - The number, or -1 if a character is not a base 4 letter.
+ ******************************************************************************/
+long decodeBase4(const char* digits, int len){
+    long value = 0;
+    int i, digit;
+
+    for (i = 0; i < len; i++) {
+        if ((digit = digit_values[(unsigned char)digits[i]]) < 0) return -1;
+        value = (value << 2) | digit;
+    }
+    return value;
+}
+
+
+/*******************************************************************************
+ * Reads a whole file of an object program into memory. A program named by
+ * its .ob file takes it from the --async-io prefetch when it is there.
+ *
+ * Parameters:
+ * - name: The program name, any extension is replaced.
+ * - extension: The extension of the file to read.
+ * - size: Pointer to store the number of bytes read.
+ *
+ * Returns:
+ * - The contents, NULL if the file cannot be opened.
+ ******************************************************************************/
+static char* readObjectPart(char* name, char* extension, size_t* size){
+    char *file_name = changeFileNameExtension(name, extension), *contents = NULL;
+    FILE *file;
+
+    if (file_name && strcmp(file_name, name) == 0) contents = takePrefetchedSource(name, size);
+    if (!contents && file_name && (file = fopen(file_name, "rb"))) {
+        contents = readSourceFile(file, size);
+        fclose(file);
+    }
+    memFree(file_name);
+    return contents;
+}
+
+
+/*******************************************************************************
+ * Parses the "name<tab>address" lines of a .ent or .ext file, moving the
+ * addresses of a relocatable object file to OBJECT_BASE.
+ *
+ * Parameters:
+ * - contents: The file contents, NULL if the file does not exist.
+ * - size: Number of bytes.
+ * - base: Address of the first word of the files, OBJECT_BASE or 0.
+ * - symbols: Pointer to store the symbols.
+ * - num_symbols: Pointer to store the number of symbols.
+ *
+ * Returns:
+ * - 1 on success, 0 if a line is malformed.
+ ******************************************************************************/
+static int parseSymbols(const char* contents, size_t size, int base, ObjectSymbol** symbols, int* num_symbols){
+    const char *line, *end, *tab;
+    int capacity = 0;
+    long address;
+
+    *symbols = NULL;
+    *num_symbols = 0;
+    for (line = contents; contents && line < contents + size; line = end + 1) {
+        if (!(end = memchr(line, '\n', contents + size - line))) end = contents + size;
+        if (end == line) continue;
+        tab = memchr(line, '\t', end - line);
+        if (!tab || tab == line || tab - line > MAX_LABEL || end - tab - 1 < SIZE_OF_ADDRESS ||
+            (address = decodeBase4(tab + 1, SIZE_OF_ADDRESS)) < 0) return 0;
+
+        if (*num_symbols == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            *symbols = (ObjectSymbol*)memRealloc(MEM_LABELS, *symbols, capacity * sizeof(ObjectSymbol));
+            if (!*symbols) {
+                fprintf(stderr, "Error, Failed to allocate memory for the symbols\n");
+                exit(1);
+            }
+        }
+        memcpy((*symbols)[*num_symbols].name, line, tab - line);
+        (*symbols)[*num_symbols].name[tab - line] = '\0';
+        if (base == OBJECT_BASE && address < OBJECT_BASE) address += OBJECT_MEMORY;
+        (*symbols)[(*num_symbols)++].address = (unsigned short)(address + OBJECT_BASE - base);
+    }
+    return 1;
+}
+
+
+/*******************************************************************************
+ * Rebases a relocatable image to OBJECT_BASE: adds it to the address in every
+ * word its .rel file lists, which must be a relocatable label word.
+ *
+ * Returns:
+ * - 1 on success, 0 if the relocation file is malformed.
+ ******************************************************************************/
+static int rebaseObject(char* name, ObjectImage* image){
+    char *contents;
+    const char *line, *end;
+    size_t size = 0;
+    long address;
+    int valid = 1, word;
+
+    contents = readObjectPart(name, RELOCATION_EXT, &size);
+    for (line = contents; valid && contents && line < contents + size; line = end + 1) {
+        if (!(end = memchr(line, '\n', contents + size - line))) end = contents + size;
+        if (end == line) continue;
+        address = end - line < SIZE_OF_ADDRESS ? -1 : decodeBase4(line, SIZE_OF_ADDRESS);
+        valid = address >= 0 && address < image->ICF && ((word = image->words[OBJECT_BASE + address]) & 3) == 2;
+        if (valid) image->words[OBJECT_BASE + address] = (short)(((((word >> 2) + OBJECT_BASE) & 0xFF) << 2) | 2);
+    }
+    memFree(contents);
+    return valid;
+}
+
+
+/*******************************************************************************
+ * Loads an object program: the .ob image, and the entry and extern symbols of
+ * its .ent and .ext files when it has them. The words of the image are
+ * placed at their addresses, the code from OBJECT_BASE and the data after it.
+ * The files keep the low 4 digits of an address, so an address below
+ * OBJECT_BASE is one past the first OBJECT_MEMORY words. A relocatable
+ * object file, whose first word is at address 0, is rebased to OBJECT_BASE
+ * with its .rel file.
+ *
+ * Parameters:
+ * - name: The program name; the .ob, .ent and .ext files are found by
+ *   replacing its extension.
+ * - image: The image to fill, released with freeObject.
+ *
+ * Returns:
+ * - 1 on success, 0 if the program cannot be read (reported on stderr).
+ ******************************************************************************/
+int loadObject(char* name, ObjectImage* image){
+    char *contents, *entries, *externs;
+    const char *line, *end, *space;
+    size_t size, entries_size = 0, externs_size = 0;
+    long address, word, expected = OBJECT_BASE;
+    int valid, base = OBJECT_BASE;
+
+    memset(image, 0, sizeof(ObjectImage));
+    if (!(contents = readObjectPart(name, OBJECT_EXT, &size))) {
+        fprintf(stderr, "Error: Cannot read the object file of %s\n", name);
+        return 0;
+    }
+
+    /* The header: the code and data word counts */
+    valid = 0;
+    if ((end = memchr(contents, '\n', size))) {
+        for (line = contents; line < end && (*line == '\t' || *line == ' '); line++);
+        space = memchr(line, ' ', end - line);
+        if (space && space > line && end > space + 1) {
+            image->ICF = (int)decodeBase4(line, space - line);
+            image->DCF = (int)decodeBase4(space + 1, end - space - 1 - (end[-1] == '\r'));
+            valid = image->ICF >= 0 && image->DCF >= 0;
+        }
+    }
+    valid = valid && image->ICF + image->DCF <= OBJECT_MAX_WORDS;
+
+    /* Every word on its own "address<tab>word" line, at consecutive addresses
+       from OBJECT_BASE, or from 0 in a relocatable object file */
+    for (line = end ? end + 1 : contents; valid && line < contents + size; line = end + 1) {
+        if (!(end = memchr(line, '\n', contents + size - line))) end = contents + size;
+        if (end == line) continue;
+        if (expected == OBJECT_BASE && end - line > SIZE_OF_ADDRESS && decodeBase4(line, SIZE_OF_ADDRESS) == 0) base = 0;
+        if (end - line < SIZE_OF_ADDRESS + 1 + SIZE_OF_WORD || line[SIZE_OF_ADDRESS] != '\t' ||
+            (address = decodeBase4(line, SIZE_OF_ADDRESS)) != (expected - OBJECT_BASE + base) % OBJECT_MEMORY ||
+            (word = decodeBase4(line + SIZE_OF_ADDRESS + 1, SIZE_OF_WORD)) < 0) {
+            valid = 0;
+            break;
+        }
+        image->words[expected++] = (short)word;
+    }
+    memFree(contents);
+    if (!valid || expected != OBJECT_BASE + image->ICF + image->DCF) {
+        fprintf(stderr, "Error: Malformed object file of %s\n", name);
+        return 0;
+    }
+
+    entries = readObjectPart(name, ENTRY_EXT, &entries_size);
+    externs = readObjectPart(name, EXTERN_EXT, &externs_size);
+    valid = parseSymbols(entries, entries_size, base, &image->entries, &image->num_entries) &&
+            parseSymbols(externs, externs_size, base, &image->externs, &image->num_externs);
+    memFree(entries);
+    memFree(externs);
+    if (!valid) {
+        fprintf(stderr, "Error: Malformed entry or extern file of %s\n", name);
+        freeObject(image);
+        return 0;
+    }
+    if (base != OBJECT_BASE && !rebaseObject(name, image)) {
+        fprintf(stderr, "Error: Malformed relocation file of %s\n", name);
+        freeObject(image);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*******************************************************************************
+ * Releases the symbols of a loaded object program.
+ ******************************************************************************/
+void freeObject(ObjectImage* image){
+    memFree(image->entries);
+    memFree(image->externs);
+    image->entries = image->externs = NULL;
+    image->num_entries = image->num_externs = 0;
+}
+
+
+/*******************************************************************************
+ * Decodes the instruction at an address of an image into its opcode and
+ * operands, the way encodeInstructionWords lays them out: the addressing modes in
+ * the first word, then a word per operand, two for a matrix, and one word
+ * shared by a source and a destination register.
+ *
+ * Parameters:
+ * - words: The words of memory, only their low 10 bits are used.
+ * - pc: Address of the instruction.
+ * - end: First address past the words the instruction may use.
+ * - ins: The instruction to fill.
+ *
+ * Returns:
+ * - NULL if the words are an instruction, otherwise why they are not.
+ ******************************************************************************/
+const char* decodeObjectInstruction(const short words[], int pc, int end, ObjectInstruction* ins){
+    ObjectOperand *op;
+    int word = words[pc] & 0x3FF, pos = pc + 1, i, operand_word;
+
+    ins->opcode = word >> 6;
+    ins->num_operands = getNumOperand(ins->opcode);
+    for (i = 0; i < ins->num_operands; i++) {
+        op = &ins->operands[i];
+        op->mode = (word >> (ins->num_operands == 2 && i == 0 ? 4 : 2)) & 3;
+        op->are = op->row = op->col = 0;
+
+        /* A destination register shares the word of a source register */
+        if (i == 1 && op->mode == REGISTER && ins->operands[0].mode == REGISTER) {
+            op->word = pos - 1;
+            op->value = ((words[pos - 1] & 0x3FF) >> 2) & 0xF;
+            if (op->value >= 8) return "invalid register";
+            continue;
+        }
+
+        op->word = pos;
+        if (pos + (op->mode == MATRIX) >= end) return "instruction runs past the end of its words";
+        operand_word = words[pos++] & 0x3FF;
+        switch (op->mode) {
+            case IMMEDIATE:
+                op->value = (((operand_word >> 2) & 0xFF) ^ 0x80) - 0x80;
+                op->are = operand_word & 3;
+                break;
+
+            case LABEL:
+            case MATRIX:
+                op->value = operand_word >> 2;
+                op->are = operand_word & 3;
+                if (op->mode == LABEL) break;
+                operand_word = words[pos++] & 0x3FF;
+                op->row = (operand_word >> 6) & 0xF;
+                op->col = (operand_word >> 2) & 0xF;
+                if (op->row >= 8 || op->col >= 8) return "invalid matrix register";
+                break;
+
+            default:
+                op->value = ins->num_operands == 2 && i == 0 ? operand_word >> 6 : (operand_word >> 2) & 0xF;
+                if (op->value >= 8) return "invalid register";
+        }
+    }
+    ins->length = pos - pc;
+    return NULL;
+}
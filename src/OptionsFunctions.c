@@ -0,0 +1,247 @@
+#include "Assembler.h"
+
+/* Options of the current run, filled by parseOptions */
+AssemblerOptions Options = {0};
+
+
+/*******************************************************************************
+ * Parses the command line into the options structure.
+ * Arguments starting with "--" (and -o) are options, all others are source files.
+ *
+ * Supported options:
+ * - --macros <cache>: preload a precompiled macro library.
+ * - --compile-macros <source> <cache>: compile a macro library and exit.
+ * - --keep-am / --no-am: keep or drop the expanded .am file, kept by default
+ *   unless -o is given.
+ * - --threads <n>: collect labels and encode large files with n threads.
+ * - --chunk-lines <n>: lines per chunk of the parallel passes, by default
+ *   the lines are split evenly among the threads.
+ * - --stream: never hold a whole source or .am file in memory.
+ * - -o <target>: write all outputs as one framed stream to target, - for stdout.
+ * - --output-dir <dir>: create the output files in dir.
+ * - --async-io <n>: n I/O threads read sources ahead and write outputs.
+ * - --stats: report per file and batch statistics on stderr.
+ * - --stats-json <file>: the same report as JSON in file, - for stderr.
+ * - --trace <file>: write Chrome trace events of the run to file.
+ * - --mem-report: report the allocations of every subsystem on stderr.
+ * - --max-errors <n>: stop a file after n lines with errors.
+ * - --fail-fast: stop a file at its first error, as --max-errors 1.
+ * - --diagnostics-json: print the diagnostics as JSON lines on stderr.
+ * - --check: only check the sources, writing no files.
+ * - --lsp: serve the language server protocol on stdin and stdout, in
+ *   --check mode.
+ * - --xref: write a binary cross-reference index of the symbols and macros
+ *   of every file.
+ * - --xref-text: the same index, also as text.
+ * - --run: run the object programs named by the files instead of
+ *   assembling them.
+ * - --max-steps <n>: fault a program that runs n instructions.
+ * - --dump: print the registers and memory of a program when it halts.
+ * - --disassemble: write the object programs named by the files back as
+ *   source instead of assembling them.
+ * - --verify: disassemble, and assemble every disassembly again to compare
+ *   it with its object program.
+ * - --link <name>: link the object modules named by the files into one
+ *   program instead of assembling them.
+ * - --relocatable: assemble from address 0 and list the words to rebase in
+ *   a .rel file.
+ *
+ * Parameters:
+ * - argc: Number of command line arguments.
+ * - argv: The command line arguments.
+ * - options: Pointer to the options structure to fill.
+ *
+ * Returns:
+ * - 1 if the command line is valid, 0 otherwise.
+ ******************************************************************************/
+int parseOptions(int argc, char** argv, AssemblerOptions* options){
+    int i;
+
+    options->files = (char**)memAlloc(MEM_FILE_NAMES, argc * sizeof(char*));
+    if (!options->files) {
+        fprintf(stderr, "Error: Failed to allocate memory for file names!\n");
+        return 0;
+    }
+    options->num_files = 0;
+    options->keep_am = -1;
+    options->threads = 1;
+    options->chunk_lines = 0;
+    options->image_words = MAX_LENGTH;
+    options->load_base = OBJECT_BASE;
+    options->max_steps = SIM_MAX_STEPS;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--macros") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: Missing cache file after --macros\n");
+                return 0;
+            }
+            options->macro_cache = argv[++i];
+        }
+        else if (strcmp(argv[i], "--compile-macros") == 0) {
+            if (i + 2 >= argc) {
+                fprintf(stderr, "Error: Usage --compile-macros <source> <cache>\n");
+                return 0;
+            }
+            options->compile_source = argv[++i];
+            options->compile_target = argv[++i];
+        }
+        else if (strcmp(argv[i], "--keep-am") == 0) {
+            options->keep_am = 1;
+        }
+        else if (strcmp(argv[i], "--no-am") == 0) {
+            options->keep_am = 0;
+        }
+        else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output-dir") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: Missing target after %s\n", argv[i]);
+                return 0;
+            }
+            if (strcmp(argv[i], "-o") == 0) options->output = argv[++i];
+            else options->output_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stream") == 0) {
+            options->stream = 1;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            options->stats = STATS_TEXT;
+        }
+        else if (strcmp(argv[i], "--check") == 0) {
+            options->check = 1;
+        }
+        else if (strcmp(argv[i], "--lsp") == 0) {
+            options->lsp = options->check = 1;
+        }
+        else if (strcmp(argv[i], "--xref") == 0) {
+            if (!options->xref) options->xref = XREF_BINARY;
+        }
+        else if (strcmp(argv[i], "--xref-text") == 0) {
+            options->xref = XREF_TEXT;
+        }
+        else if (strcmp(argv[i], "--run") == 0) {
+            options->run = 1;
+        }
+        else if (strcmp(argv[i], "--dump") == 0) {
+            options->dump = 1;
+        }
+        else if (strcmp(argv[i], "--disassemble") == 0) {
+            options->disassemble = 1;
+        }
+        else if (strcmp(argv[i], "--verify") == 0) {
+            options->disassemble = options->verify = 1;
+        }
+        else if (strcmp(argv[i], "--relocatable") == 0) {
+            options->relocatable = 1;
+            options->load_base = 0;
+        }
+        else if (strcmp(argv[i], "--link") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: Missing program name after --link\n");
+                return 0;
+            }
+            options->link = argv[++i];
+        }
+        else if (strcmp(argv[i], "--max-steps") == 0) {
+            if (i + 1 >= argc || atol(argv[i + 1]) < 1) {
+                fprintf(stderr, "Error: Missing positive number after %s\n", argv[i]);
+                return 0;
+            }
+            options->max_steps = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--diagnostics-json") == 0) {
+            options->diag_json = 1;
+        }
+        else if (strcmp(argv[i], "--fail-fast") == 0) {
+            options->max_errors = 1;
+        }
+        else if (strcmp(argv[i], "--mem-report") == 0) {
+            options->mem_report = 1;
+        }
+        else if (strcmp(argv[i], "--trace") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: Missing file after --trace\n");
+                return 0;
+            }
+            options->trace = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stats-json") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: Missing file after --stats-json\n");
+                return 0;
+            }
+            options->stats = STATS_JSON;
+            options->stats_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "--chunk-lines") == 0 ||
+                 strcmp(argv[i], "--async-io") == 0 || strcmp(argv[i], "--max-errors") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                fprintf(stderr, "Error: Missing positive number after %s\n", argv[i]);
+                return 0;
+            }
+            if (strcmp(argv[i], "--threads") == 0) options->threads = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--async-io") == 0) options->async_io = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--max-errors") == 0) options->max_errors = atoi(argv[++i]);
+            else options->chunk_lines = atoi(argv[++i]);
+        }
+        else if (startsWith(argv[i], "--", 2)) {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            return 0;
+        }
+        else {
+            options->files[options->num_files++] = argv[i];
+        }
+    }
+
+    /* Running, disassembling and linking read object programs, one at a time */
+    if (options->run + options->disassemble + (options->link != NULL) > 1) {
+        fprintf(stderr, "Error: Only one of --run, --disassemble, --verify and --link can be given\n");
+        return 0;
+    }
+
+    /* A disassembly or a link writes only its own files, and a disassembly
+       is assembled again unchecked */
+    if (options->disassemble || options->link) {
+        options->check = 0;
+        options->keep_am = 0;
+        options->xref = 0;
+    }
+
+    /* Checking writes no output at all */
+    if (options->check) {
+        options->output = NULL;
+        options->keep_am = 0;
+        options->xref = 0;
+    }
+
+    /* The framed stream carries the .am files only when asked for */
+    if (options->keep_am == -1) options->keep_am = options->output == NULL;
+    return 1;
+}
+
+
+/*******************************************************************************
+ * Frees the memory allocated while parsing the options.
+ *
+ * Parameters:
+ * - options: Pointer to the options structure.
+ ******************************************************************************/
+void freeOptions(AssemblerOptions* options){
+    memFree(options->files);
+    options->files = NULL;
+    options->num_files = 0;
+    options->keep_am = 1;
+}
+
+
+/*******************************************************************************
+ * Checks if a file has as many lines with errors as --max-errors allows.
+ *
+ * Parameters:
+ * - errors: The error count of the file.
+ *
+ * Returns:
+ * - 1 if the file should stop, 0 otherwise or without a limit.
+ ******************************************************************************/
+int errorLimitReached(int errors){
+    return Options.max_errors > 0 && errors >= Options.max_errors;
+}
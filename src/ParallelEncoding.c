@@ -0,0 +1,241 @@
+#define _POSIX_C_SOURCE 200112L
+#include "Assembler.h"
+#include <pthread.h>
+
+/* Thread specific fixup log of the chunk being encoded */
+static pthread_key_t fixup_key;
+static pthread_once_t fixup_key_once = PTHREAD_ONCE_INIT;
+
+/* Work shared by the encoding threads */
+typedef struct EncodeWork {
+    EncodeChunk *chunks; /* All chunks of the file */
+    int num_chunks; /* Number of chunks */
+    LabelTable *table; /* Read only label table */
+    signed short *Code; /* Shared code image, chunks write disjoint ranges */
+    signed short *Data; /* Shared data image, chunks write disjoint ranges */
+} EncodeWork;
+
+
+/*******************************************************************************
+ * Creates the key of the thread specific fixup logs.
+ ******************************************************************************/
+static void createFixupKey(void){
+    pthread_key_create(&fixup_key, NULL);
+}
+
+
+/*******************************************************************************
+ * Defers a label reference or an entry mark to the fixup log of the chunk
+ * encoded by the calling thread. Outside the parallel encoder nothing is
+ * deferred and the caller updates the label itself.
+ *
+ * Parameters:
+ * - label: The referenced label.
+ * - pos: The position of the reference in the code image.
+ * - entry: 1 for an entry mark, 0 for a reference.
+ *
+ * Returns:
+ * - 1 if the fixup was deferred, 0 otherwise.
+ ******************************************************************************/
+int deferFixup(Label* label, unsigned short pos, int entry){
+    FixupLog *log;
+    Fixup *fixups;
+
+    pthread_once(&fixup_key_once, createFixupKey);
+    log = (FixupLog*)pthread_getspecific(fixup_key);
+    if (!log) return 0;
+
+    if (log->size == log->capacity) {
+        log->capacity = log->capacity ? log->capacity * 2 : 64;
+        fixups = (Fixup*)memRealloc(MEM_REFERENCES, log->fixups, log->capacity * sizeof(Fixup));
+        if (!fixups) {
+            fprintf(stderr, "Error, Failed to allocate memory for fixups\n");
+            exit(1);
+        }
+        log->fixups = fixups;
+    }
+    log->fixups[log->size].label = label;
+    log->fixups[log->size].pos = pos;
+    log->fixups[log->size].entry = entry;
+    log->size++;
+    return 1;
+}
+
+
+/*******************************************************************************
+ * Measures the code and data words a line adds, without encoding it and
+ * without reporting errors. The line is planned like the second pass plans
+ * it; a line with errors is not measured and is left to the sequential
+ * encoder, which reports them.
+ *
+ * Parameters:
+ * - source_line: The line of the .am file.
+ * - table: The label table.
+ * - sizes: Receives the number of code (sizes[0]) and data (sizes[1]) words.
+ *
+ * Returns:
+ * - 1 if the line was measured, 0 otherwise.
+ ******************************************************************************/
+int measureLine(char* source_line, LabelTable* table, int sizes[]){
+    LineTokens tokens;
+    LinePlan plan;
+
+    sizes[0] = sizes[1] = 0;
+    lexLine(source_line, &tokens);
+    if (!planTokens(&tokens, table, &plan, 0)) return 0;
+    sizes[0] = plan.words[0];
+    sizes[1] = plan.words[1];
+    return 1;
+}
+
+
+/*******************************************************************************
+ * Thread body measuring chunks.
+ ******************************************************************************/
+static void* measureChunks(void* arg){
+    ThreadTask *task = (ThreadTask*)arg;
+    EncodeWork *work = (EncodeWork*)task->shared;
+    EncodeChunk *chunk;
+    int sizes[2], i, j;
+
+    for (i = task->first; i < work->num_chunks; i += task->step) {
+        chunk = &work->chunks[i];
+        chunk->measured = 1;
+        for (j = 0; j < chunk->num_lines && chunk->measured; j++) {
+            chunk->measured = measureLine(chunk->lines + j * MAX_LINE_LENGTH, work->table, sizes);
+            chunk->size[0] += sizes[0];
+            chunk->size[1] += sizes[1];
+        }
+    }
+    return NULL;
+}
+
+
+/*******************************************************************************
+ * Thread body encoding chunks from their base counters. Every line is encoded
+ * from a copy, so the lines stay intact for a sequential retry.
+ ******************************************************************************/
+static void* encodeChunks(void* arg){
+    ThreadTask *task = (ThreadTask*)arg;
+    EncodeWork *work = (EncodeWork*)task->shared;
+    EncodeChunk *chunk;
+    char line[MAX_LINE_LENGTH];
+    int i, j;
+
+    pthread_once(&fixup_key_once, createFixupKey);
+    for (i = task->first; i < work->num_chunks; i += task->step) {
+        chunk = &work->chunks[i];
+        pthread_setspecific(fixup_key, &chunk->log);
+        for (j = 0; j < chunk->num_lines; j++) {
+            strcpy(line, chunk->lines + j * MAX_LINE_LENGTH);
+            ProcessLine(line, work->table, work->Code, work->Data, chunk->PC, chunk->first_line + j, &chunk->Error);
+        }
+        pthread_setspecific(fixup_key, NULL);
+    }
+    return NULL;
+}
+
+
+/*******************************************************************************
+ * Parallel second pass for large files.
+ * The expanded source is split into chunks of lines. The code and data size
+ * of every chunk is measured in parallel, a prefix sum gives the base IC and
+ * DC of each chunk, and the chunks are then encoded concurrently against the
+ * read only label table. Label references and entry marks are logged per
+ * chunk and merged in source order, so the result is identical to the
+ * sequential pass. Files with lines the measurement does not accept, or with
+ * errors from the first pass, are encoded sequentially.
+ *
+ * Parameters:
+ *   am_file - Pointer to the processed assembly file (.am file).
+ *   table - Pointer to the LabelTable.
+ *   Code - Array to hold the encoded instructions.
+ *   Data - Array to hold the encoded data.
+ *   PC - Program counters; PC[0] for instructions (IC) and PC[1] for data (DC).
+ *   Error - Pointer to the error count of the file.
+ ******************************************************************************/
+void ParallelSecondPass(FILE* am_file, LabelTable* table, signed short Code[], signed short Data[], int PC[], int* Error){
+    char *lines = NULL;
+    EncodeChunk *chunks = NULL;
+    EncodeWork work;
+    int num_lines = 0, num_chunks, chunk_lines, num_threads, i, j, parallel, mark = 0;
+
+    /* Read all lines of the .am file */
+    lines = readLines(am_file, &num_lines);
+
+    num_threads = Options.threads < MAX_THREADS ? Options.threads : MAX_THREADS;
+    chunk_lines = chunkLines(num_lines, num_threads);
+    num_chunks = (num_lines + chunk_lines - 1) / chunk_lines;
+    parallel = !*Error && num_threads > 1 && num_chunks > 1;
+
+    if (parallel) {
+        chunks = (EncodeChunk*)memCalloc(MEM_OTHER, num_chunks, sizeof(EncodeChunk));
+        if (!chunks) {
+            fprintf(stderr, "Error, Failed to allocate memory for the chunks\n");
+            exit(1);
+        }
+        for (i = 0; i < num_chunks; i++) {
+            chunks[i].lines = lines + i * chunk_lines * MAX_LINE_LENGTH;
+            chunks[i].first_line = i * chunk_lines + 1;
+            chunks[i].num_lines = (i == num_chunks - 1) ? num_lines - i * chunk_lines : chunk_lines;
+        }
+        work.chunks = chunks;
+        work.num_chunks = num_chunks;
+        work.table = table;
+        work.Code = Code;
+        work.Data = Data;
+
+        /* Measure every chunk, then place it with a prefix sum */
+        runParallel(measureChunks, "measure chunks", &work, num_threads);
+        for (i = 0; i < num_chunks && parallel; i++) {
+            parallel = chunks[i].measured;
+            chunks[i].PC[0] = PC[0];
+            chunks[i].PC[1] = PC[1];
+            PC[0] += chunks[i].size[0];
+            PC[1] += chunks[i].size[1];
+        }
+        /* A program overflowing the image is encoded sequentially, for its errors */
+        if ((PC[0] > Options.image_words || PC[1] > Options.image_words) && !Options.check) parallel = 0;
+        PC[0] = PC[1] = 0;
+    }
+
+    if (parallel) {
+        mark = diagCount();
+        runParallel(encodeChunks, "encode chunks", &work, num_threads);
+
+        /* Every chunk must end where the next one was placed */
+        for (i = 0; i < num_chunks - 1 && parallel; i++) {
+            parallel = chunks[i].PC[0] == chunks[i + 1].PC[0] && chunks[i].PC[1] == chunks[i + 1].PC[1];
+        }
+        if (parallel) {
+            /* Merge the fixups in source order */
+            for (i = 0; i < num_chunks; i++) {
+                for (j = 0; j < chunks[i].log.size; j++) {
+                    if (chunks[i].log.fixups[j].entry) chunks[i].log.fixups[j].label->ent = 1;
+                    else saveRef(chunks[i].log.fixups[j].label, chunks[i].log.fixups[j].pos);
+                }
+                *Error += chunks[i].Error;
+            }
+            PC[0] = chunks[num_chunks - 1].PC[0];
+            PC[1] = chunks[num_chunks - 1].PC[1];
+        } else {
+            /* Measurement and encoding disagree: drop the attempt, its
+               diagnostics included, and encode the lines sequentially */
+            memset(Code, 0, Options.image_words * sizeof(signed short));
+            memset(Data, 0, Options.image_words * sizeof(signed short));
+            diagDiscard(mark);
+        }
+    }
+
+    if (!parallel) {
+        for (i = 0; i < num_lines && !errorLimitReached(*Error); i++) {
+            ProcessLine(lines + i * MAX_LINE_LENGTH, table, Code, Data, PC, i + 1, Error);
+        }
+    }
+
+    if (chunks) {
+        for (i = 0; i < num_chunks; i++) memFree(chunks[i].log.fixups);
+        memFree(chunks);
+    }
+    memFree(lines);
+}
@@ -0,0 +1,126 @@
+#define _POSIX_C_SOURCE 200112L
+#include "Assembler.h"
+#include <pthread.h>
+
+
+/*******************************************************************************
+ * Reads all lines of a file into one buffer, the way fgets would read them.
+ * Line i starts at offset i * MAX_LINE_LENGTH.
+ *
+ * Parameters:
+ * - file: The file to read.
+ * - num_lines: Pointer to store the number of lines read.
+ *
+ * Returns:
+ * - The allocated buffer of lines.
+ ******************************************************************************/
+char* readLines(FILE* file, int* num_lines){
+    char *lines, *new_lines;
+    int capacity = 1024;
+
+    *num_lines = 0;
+    lines = (char*)memAlloc(MEM_LINES, capacity * MAX_LINE_LENGTH);
+    if (!lines) {
+        fprintf(stderr, "Error, Failed to allocate memory for the source lines\n");
+        exit(1);
+    }
+    while (fgets(lines + *num_lines * MAX_LINE_LENGTH, MAX_LINE_LENGTH, file)) {
+        if (++*num_lines == capacity) {
+            capacity *= 2;
+            new_lines = (char*)memRealloc(MEM_LINES, lines, capacity * MAX_LINE_LENGTH);
+            if (!new_lines) {
+                fprintf(stderr, "Error, Failed to allocate memory for the source lines\n");
+                exit(1);
+            }
+            lines = new_lines;
+        }
+    }
+    return lines;
+}
+
+
+/*******************************************************************************
+ * Gives the number of lines per chunk of a parallel pass. Unless set with
+ * --chunk-lines, the lines are split evenly among the threads, with at
+ * least PARALLEL_MIN_CHUNK_LINES lines per chunk so a thread is not started
+ * for a handful of lines.
+ *
+ * Parameters:
+ * - num_lines: The number of lines of the file.
+ * - num_threads: The number of threads of the pass.
+ *
+ * Returns:
+ * - The number of lines per chunk, at least 1.
+ ******************************************************************************/
+int chunkLines(int num_lines, int num_threads){
+    int chunk_lines;
+
+    if (Options.chunk_lines > 0) return Options.chunk_lines;
+    chunk_lines = (num_lines + num_threads - 1) / (num_threads > 0 ? num_threads : 1);
+    return chunk_lines > PARALLEL_MIN_CHUNK_LINES ? chunk_lines : PARALLEL_MIN_CHUNK_LINES;
+}
+
+
+/*******************************************************************************
+ * Runs the body of a task, as a span of the thread in the trace.
+ ******************************************************************************/
+static void* runTask(void* arg){
+    ThreadTask *task = (ThreadTask*)arg;
+    double start;
+    long share[2];
+    static const char *share_names[] = {"first", "step"};
+
+    if (!Options.trace) return task->body(task);
+
+    start = statsClock();
+    task->body(task);
+    share[0] = task->first;
+    share[1] = task->step;
+    traceEvent(TRACE_SPAN, task->name, Stats.file_name, start, statsClock() - start, share_names, share, 2);
+    return NULL;
+}
+
+
+/*******************************************************************************
+ * Body of a started thread, named as a worker in the trace.
+ ******************************************************************************/
+static void* startTask(void* arg){
+    traceThreadName("worker");
+    return runTask(arg);
+}
+
+
+/*******************************************************************************
+ * Runs a thread body on the given number of threads. Every thread gets a
+ * ThreadTask with the shared work and its share of the items (first, step).
+ * The calling thread takes the first share itself, and also the share of
+ * any thread that could not be started.
+ *
+ * Parameters:
+ * - body: The thread body, called with a ThreadTask.
+ * - name: Name of the work in the trace.
+ * - shared: The work shared by all threads.
+ * - num_threads: The number of threads, at most MAX_THREADS.
+ ******************************************************************************/
+void runParallel(void* (*body)(void*), const char* name, void* shared, int num_threads){
+    pthread_t threads[MAX_THREADS];
+    ThreadTask tasks[MAX_THREADS];
+    int started[MAX_THREADS];
+    int i;
+
+    if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+    for (i = 0; i < num_threads; i++) {
+        tasks[i].body = body;
+        tasks[i].name = name;
+        tasks[i].shared = shared;
+        tasks[i].first = i;
+        tasks[i].step = num_threads;
+        started[i] = i > 0 && pthread_create(&threads[i], NULL, startTask, &tasks[i]) == 0;
+    }
+    for (i = 0; i < num_threads; i++) {
+        if (!started[i]) runTask(&tasks[i]);
+    }
+    for (i = 1; i < num_threads; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+}
@@ -0,0 +1,246 @@
+#include "Assembler.h"
+
+/* A label definition found while scanning a chunk */
+typedef struct LabelCandidate {
+    char name[MAX_LABEL + 1]; /* Name of the label */
+    unsigned int hash_value; /* Hash of the name, selects the shard */
+    int line; /* Line number of the definition */
+    int ext; /* 1 for an extern definition */
+    int mat; /* 1 for a .mat definition */
+    int duplicate; /* Set by the shard if the name was defined on an earlier line */
+    Label *label; /* Label created by the shard for the first definition */
+    int next; /* Next candidate of the chunk in the same shard, -1 for none */
+} LabelCandidate;
+
+/* Lines of the .am file scanned by one thread */
+typedef struct LabelChunk {
+    char *lines; /* First line of the chunk, lines are MAX_LINE_LENGTH apart */
+    int first_line; /* Line number of the first line */
+    int num_lines; /* Number of lines in the chunk */
+    int scanned; /* 1 if every line of the chunk could be scanned */
+    LabelCandidate *candidates; /* Label definitions in line order */
+    int num_candidates; /* Number of candidates */
+    int capacity; /* Current capacity of the candidates array */
+    int *shard_first; /* First candidate of every shard, -1 for none */
+    int *shard_last; /* Last candidate of every shard, -1 for none */
+} LabelChunk;
+
+/* Work shared by the label collecting threads */
+typedef struct LabelWork {
+    LabelChunk *chunks; /* All chunks of the file */
+    int num_chunks; /* Number of chunks */
+    int num_shards; /* Number of symbol table shards */
+} LabelWork;
+
+
+/*******************************************************************************
+ * Scans a line for a label or extern definition, mirroring
+ * ProcessFirstPassLine but without reporting errors.
+ *
+ * Parameters:
+ * - source_line: The line of the .am file.
+ * - candidate: Receives the definition found on the line.
+ *
+ * Returns:
+ * - 1 for a valid definition, 0 if the line defines nothing, -1 if the line
+ *   has to be left to the sequential pass for its error messages.
+ ******************************************************************************/
+static int scanLabelLine(char* source_line, LabelCandidate* candidate){
+    char buffer[MAX_LINE_LENGTH + 1];
+    char *line = buffer, *label_name, *line_rest;
+    LineScan scan;
+    int len;
+
+    strcpy(buffer, source_line);
+    if (!isExtern(line) && !IsLabelDefinition(line)) return 0;
+
+    len = strlen(line) - 1;
+    while (len >= 0 && (line[len] == '\r' || line[len] == '\n')) line[len--] = '\0';
+    scanString(line, &scan);
+
+    if (isExtern(line)) {
+        label_name = deleteSpaces(line + strlen(".extern"), &scan);
+        if (!label_name || isEmptyOrComment(label_name)) return -1;
+        if (hasBlank(label_name, &scan)) return -1;
+        candidate->ext = 1;
+        candidate->mat = 0;
+    } else {
+        label_name = deleteSpaces(splitLabelDefinition(line, &scan, &line_rest), &scan);
+        line_rest = deleteSpaces(line_rest, &scan);
+        if (!label_name || !line_rest) return -1;
+        candidate->ext = 0;
+        candidate->mat = IsMatrixDirective(line_rest);
+    }
+
+    if (checkLabelName(label_name, &scan) != LABEL_OK) return -1;
+    strcpy(candidate->name, label_name);
+    candidate->hash_value = hash(label_name);
+    candidate->duplicate = 0;
+    candidate->label = NULL;
+    return 1;
+}
+
+
+/*******************************************************************************
+ * Thread body scanning chunks for label definitions. The candidates of a
+ * chunk are also listed per shard, in line order, so every shard visits only
+ * its own names.
+ ******************************************************************************/
+static void* scanChunks(void* arg){
+    ThreadTask *task = (ThreadTask*)arg;
+    LabelWork *work = (LabelWork*)task->shared;
+    LabelChunk *chunk;
+    LabelCandidate candidate;
+    int i, j, found, shard;
+
+    for (i = task->first; i < work->num_chunks; i += task->step) {
+        chunk = &work->chunks[i];
+        chunk->scanned = 1;
+        for (j = 0; j < chunk->num_lines && chunk->scanned; j++) {
+            found = scanLabelLine(chunk->lines + j * MAX_LINE_LENGTH, &candidate);
+            if (found < 0) chunk->scanned = 0;
+            if (found <= 0) continue;
+
+            if (chunk->num_candidates == chunk->capacity) {
+                chunk->capacity = chunk->capacity ? chunk->capacity * 2 : 64;
+                chunk->candidates = (LabelCandidate*)memRealloc(MEM_LABELS, chunk->candidates, chunk->capacity * sizeof(LabelCandidate));
+                if (!chunk->candidates) {
+                    fprintf(stderr, "Error, Failed to allocate memory for the label candidates\n");
+                    exit(1);
+                }
+            }
+            candidate.line = chunk->first_line + j;
+            candidate.next = -1;
+            shard = (int)(candidate.hash_value % work->num_shards);
+            if (chunk->shard_last[shard] == -1) chunk->shard_first[shard] = chunk->num_candidates;
+            else chunk->candidates[chunk->shard_last[shard]].next = chunk->num_candidates;
+            chunk->shard_last[shard] = chunk->num_candidates;
+            chunk->candidates[chunk->num_candidates++] = candidate;
+        }
+    }
+    return NULL;
+}
+
+
+/*******************************************************************************
+ * Thread body building symbol table shards. A shard owns the names whose
+ * hash falls into it and takes their definitions in line order, so the
+ * earliest definition of a name always wins and later ones are duplicates.
+ ******************************************************************************/
+static void* buildShards(void* arg){
+    ThreadTask *task = (ThreadTask*)arg;
+    LabelWork *work = (LabelWork*)task->shared;
+    LabelTable *shard;
+    LabelCandidate *candidate;
+    int s, i, j;
+
+    for (s = task->first; s < work->num_shards; s += task->step) {
+        shard = create_LabelTable(TABLE_SIZE);
+        for (i = 0; i < work->num_chunks; i++) {
+            for (j = work->chunks[i].shard_first[s]; j != -1; j = work->chunks[i].candidates[j].next) {
+                candidate = &work->chunks[i].candidates[j];
+                if (getLabel(shard, candidate->name)) {
+                    candidate->duplicate = 1;
+                    continue;
+                }
+                candidate->label = createLabel(candidate->name, candidate->ext, candidate->mat);
+                candidate->label->line = candidate->line;
+                insertLabel(shard, candidate->label);
+            }
+        }
+        /* The labels are handed over to the file's table, only the shard goes */
+        memFree(shard->Labels);
+        memFree(shard);
+    }
+    return NULL;
+}
+
+
+/*******************************************************************************
+ * Parallel first pass for large files.
+ * Chunks of lines are scanned concurrently for label definitions, then
+ * the definitions are deduplicated concurrently in symbol table shards keyed
+ * by the hash of the name. The surviving labels are linked into the file's
+ * table in line order, so the table (and the .ent/.ext files written from
+ * it) is identical to the sequential pass, and duplicate definitions are
+ * reported in line order. Files with lines the scan does not accept are
+ * processed sequentially, for the exact error messages.
+ *
+ * Parameters:
+ *   am_file - Pointer to the assembly file after macro processing.
+ *   table - Pointer to the empty label table to fill.
+ *   errorFlag - Pointer to the error count of the file.
+ ******************************************************************************/
+void ParallelFirstPass(FILE* am_file, LabelTable* table, int* errorFlag){
+    char *lines = NULL;
+    LabelChunk *chunks = NULL;
+    LabelCandidate *candidate;
+    LabelWork work;
+    int *shard_lists = NULL;
+    int num_lines = 0, num_chunks, chunk_lines, num_threads, i, j, parallel;
+
+    /* Read all lines of the .am file */
+    lines = readLines(am_file, &num_lines);
+    Stats.am_lines = num_lines;
+
+    num_threads = Options.threads < MAX_THREADS ? Options.threads : MAX_THREADS;
+    chunk_lines = chunkLines(num_lines, num_threads);
+    num_chunks = (num_lines + chunk_lines - 1) / chunk_lines;
+    parallel = num_threads > 1 && num_chunks > 1;
+
+    if (parallel) {
+        chunks = (LabelChunk*)memCalloc(MEM_LABELS, num_chunks, sizeof(LabelChunk));
+        shard_lists = (int*)memAlloc(MEM_LABELS, 2 * num_chunks * num_threads * sizeof(int));
+        if (!chunks || !shard_lists) {
+            fprintf(stderr, "Error, Failed to allocate memory for the chunks\n");
+            exit(1);
+        }
+        for (i = 0; i < 2 * num_chunks * num_threads; i++) shard_lists[i] = -1;
+        for (i = 0; i < num_chunks; i++) {
+            chunks[i].lines = lines + i * chunk_lines * MAX_LINE_LENGTH;
+            chunks[i].first_line = i * chunk_lines + 1;
+            chunks[i].num_lines = (i == num_chunks - 1) ? num_lines - i * chunk_lines : chunk_lines;
+            chunks[i].shard_first = shard_lists + 2 * i * num_threads;
+            chunks[i].shard_last = chunks[i].shard_first + num_threads;
+        }
+        work.chunks = chunks;
+        work.num_chunks = num_chunks;
+        work.num_shards = num_threads;
+
+        runParallel(scanChunks, "scan labels", &work, num_threads);
+        for (i = 0; i < num_chunks && parallel; i++) parallel = chunks[i].scanned;
+    }
+
+    if (parallel) {
+        runParallel(buildShards, "build shards", &work, num_threads);
+
+        /* Link the labels and report the duplicates in line order */
+        for (i = 0; i < num_chunks; i++) {
+            for (j = 0; j < chunks[i].num_candidates; j++) {
+                candidate = &chunks[i].candidates[j];
+                if (!candidate->duplicate) {
+                    insertLabel(table, candidate->label);
+                    continue;
+                }
+                if (errorLimitReached(*errorFlag)) continue;
+                if (candidate->ext)
+                    diagnose(candidate->line, DIAG_LABEL, "Duplicate extern label definition %s", candidate->name);
+                else
+                    diagnose(candidate->line, DIAG_LABEL, "Duplicate Label definition %s", candidate->name);
+                TRACE_PROBE3(diagnostic, Stats.file_name, candidate->line, TRACE_FIRST_PASS);
+                (*errorFlag)++;
+            }
+        }
+    } else {
+        for (i = 0; i < num_lines && !errorLimitReached(*errorFlag); i++) {
+            ProcessFirstPassLine(lines + i * MAX_LINE_LENGTH, table, i + 1, errorFlag);
+        }
+    }
+
+    if (chunks) {
+        for (i = 0; i < num_chunks; i++) memFree(chunks[i].candidates);
+        memFree(chunks);
+    }
+    memFree(shard_lists);
+    memFree(lines);
+}
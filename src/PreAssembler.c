@@ -1,114 +1,414 @@
+#define _GNU_SOURCE
 #include "Assembler.h"
+#include <unistd.h>
 
 /*******************************************************************************
  *MacroProcess function
  * Processes assembly source files to handle macros.
  * Reads input file line by line, expanding macros where defined and used,
  * Output a new file with a ".am" extension where macros have been expanded.
- * 
+ *
+ * Sources that define no macros and include no files (and no macro library is
+ * loaded) take a fast path that only strips comments and empty lines.
+ * In streaming mode the source is never read whole: every line is read
+ * and pre-processed on its own, so memory does not grow with the file.
+ * With --async-io the source may already have been read by an I/O thread.
+ *
  * Parameters:
  * - file_name: The name of the source assembly file to be processed.
- * 
+ *
  * Returns:
  * - A FILE pointer to the newly created file after macro processing.
  ******************************************************************************/
 FILE* PreAssembler(char* file_name) {
-    
+
     FILE* Source_file = NULL, *am_file = NULL; /* Pointers to the source and assembly files */
-    char* am_file_name = NULL; /* Pointer to the assembly file name */
 
+    char* source = NULL; /* Contents of the whole source file */
+    size_t size = 0, pos = 0; /* Size of the source and read position */
     char source_line[MAX_LINE_LENGTH] = {0}; /* Buffer for reading source lines */
     char* line = NULL; /* Pointer to the current line being processed */
+    const char* newline; /* Line end in the source, for the line count */
+    PreAssemblerState state; /* Macro and include state of this file */
+    int counter = 0, canonical = 0; /* Line counter and verbatim source flag */
 
-    MacroList macroList = {0}; /* Initialize macro list */
-    char macro_name[MAX_LINE_LENGTH] = {0}; /* Buffer for macro names */
-    int inside_macro = 0, counter = 0; /* Flag detecting inside macro and line counter */
-
-    char* tmp_buffer; /* Temp buffer for check usage */
+    /* A source read ahead by the I/O threads is already in memory */
+    source = takePrefetchedSource(file_name, &size);
 
     /* Open the source file for reading */
-    Source_file = fopen(file_name, "r");
-    if (!Source_file) {
-        fprintf(stderr, "Error opening file: %s\n", file_name);
+    if (!source && !(Source_file = fopen(file_name, "r"))) {
+        diagnose(0, DIAG_FILE, "Cannot open file %s", file_name);
         return NULL;
     }
 
-    /* Create the .am file for writing the processed output,
-     Return allocated memory contain the new file name */
-    am_file_name = changeFileNameExtension(file_name, AFTER_MACRO_EXT);
-    if(!am_file_name){
+    /* Read the whole source once, both paths work on the buffer */
+    if (!source && !Options.stream && !(source = readSourceFile(Source_file, &size))) {
         fclose(Source_file);
         return NULL;
     }
-    am_file = fopen(am_file_name, "w+b");
+
+    /* Create the .am file for writing the processed output */
+    am_file = openAmFile(file_name);
     if (!am_file){
-        fprintf(stderr, "Error, Failed to create file: %s\n", am_file_name);
-        /* Cleanup and return NULL on failure */
-        free(am_file_name);
-        fclose(Source_file);
+        memFree(source);
+        if (Source_file) fclose(Source_file);
         return NULL;
     }
-    /* Free the allocated filename string as it's no longer needed */
-    free(am_file_name);
 
-    /* Initialize the macro list structure */
-    initMacroList(&macroList);
+    /* Fast path: no macro machinery for sources without macros or includes */
+    if (source && !sourceNeedsMacroPass(source, size, &canonical)) {
+        for (newline = source; (newline = memchr(newline, '\n', source + size - newline)); newline++) Stats.source_lines++;
+        if (size > 0 && source[size - 1] != '\n') Stats.source_lines++;
+        if (!(canonical && Options.keep_am && (Source_file ? copySourceFile(Source_file, am_file, size)
+                                                           : fwrite(source, sizeof(char), size, am_file) == size))) {
+            while (nextSourceLine(source, size, &pos, source_line)) {
+                line = deleteSpaces(source_line, NULL);
+                if (!isEmptyOrComment(line)) fwrite(line, sizeof(char), strlen(line), am_file);
+            }
+        }
+        memFree(source);
+        if (Source_file) fclose(Source_file);
+        return rewindAmFile(am_file);
+    }
+
+    /* Initialize the macro list structure, falling back to the preloaded library */
+    memset(&state, 0, sizeof(state));
+    initMacroList(&state.macroList);
+    state.macroList.parent = getMacroLibrary();
+    state.am_file = am_file;
 
-    /* Read the source file line by line */
-    while (fgets(source_line, MAX_LINE_LENGTH, Source_file)) {
+    /* Read the source file line by line, from the buffer or straight from the file */
+    while (source ? nextSourceLine(source, size, &pos, source_line) : fgets(source_line, MAX_LINE_LENGTH, Source_file) != NULL) {
         counter++; /* Line counter for error messages */
-        /* Remove leading and trailing spaces from the read line */
-        line = deleteSpaces(source_line);
-        
-        /* Skip empty lines or comments */
-        if (isEmptyOrComment(line)) continue;
-        
-        /* Handling macro end marker */
-        if (startsWith(line, MCREND, strlen(MCREND))) {
-
-            /*Check for extra text after macro end*/
-            line += strlen(MCREND);
-            tmp_buffer = deleteSpaces(line);
-            if(isEmptyOrComment(tmp_buffer)  == 0){
-                fprintf(stderr, "Error at line %d, Extra Text after macro end.",counter);
-                return NULL;
-            }
+        if (!PreProcessLine(&state, source_line, counter, file_name)) {
+            TRACE_PROBE3(diagnostic, file_name, counter, TRACE_PREASM);
+            freeMacroList(&state.macroList);
+            memFree(state.included);
+            memFree(source);
+            if (Source_file) fclose(Source_file);
+            closeAmFile(am_file);
+            return NULL;
+        }
+    }
+
+    Stats.source_lines = counter;
+
+    /* Cleanup: Free allocated resources and close files */
+    freeMacroList(&state.macroList);
+    memFree(state.included);
+    memFree(source);
+    if (Source_file) fclose(Source_file);
+
+    /* Reset and return the ".am" file pointer to the beginning for further processing */
+    return rewindAmFile(am_file);
+}
+
+
+/*******************************************************************************
+ * Pre-processes a single source line.
+ * Collects macro definitions, expands macro uses and follows .include lines,
+ * writing the resulting lines to the .am file.
+ *
+ * Parameters:
+ * - state: The PreAssembler state of the current file.
+ * - source_line: The line to process (modified in place).
+ * - counter: The line number for error messages.
+ * - file_name: The name of the file the line was read from.
+ *
+ * Returns:
+ * - 1 on success, 0 on an error that stops pre-processing.
+ ******************************************************************************/
+int PreProcessLine(PreAssemblerState* state, char* source_line, int counter, char* file_name) {
+    char* line = NULL; /* Pointer to the current line being processed */
+    char* tmp_buffer; /* Temp buffer for check usage */
+    LineScan scan; /* Class bitmaps of the line, shared by its helpers */
+
+    /* Remove leading and trailing spaces from the read line */
+    scanString(source_line, &scan);
+    line = deleteSpaces(source_line, &scan);
 
-            inside_macro = 0; /* Not inside a macro anymore */
-            continue;
+    /* Skip empty lines or comments */
+    if (isEmptyOrComment(line)) return 1;
+
+    /* Handling macro end marker */
+    if (startsWith(line, MCREND, strlen(MCREND))) {
+
+        /*Check for extra text after macro end*/
+        line += strlen(MCREND);
+        tmp_buffer = deleteSpaces(line, &scan);
+        if(isEmptyOrComment(tmp_buffer)  == 0){
+            diagnose(counter, DIAG_MACRO, "Extra Text after macro end.");
+            return 0;
         }
-        
-        /* Handling macro start marker */
-        if (startsWith(line, MCRSTRT, strlen(MCRSTRT))) {
-
-            /* Extract and validate macro name */
-            strcpy(macro_name, getMacroName(line, &counter));
-            if(!IsValidMacroName(macro_name, &counter)) continue;
-
-            /* Insert the macro name into the macro list */
-            insertMacroName(&macroList, macro_name);
-            inside_macro = 1; /* Now inside a macro definition */
-            continue;
+
+        state->inside_macro = 0; /* Not inside a macro anymore */
+        return 1;
+    }
+
+    /* Handling macro start marker */
+    if (startsWith(line, MCRSTRT, strlen(MCRSTRT))) {
+
+        /* Extract and validate macro name */
+        if(!(tmp_buffer = getMacroName(line, &scan, &counter))) return 0;
+        strcpy(state->macro_name, tmp_buffer);
+        if(!IsValidMacroName(state->macro_name, &counter)) return 1;
+
+        /* Insert the macro name into the macro list */
+        insertMacroName(&state->macroList, state->macro_name);
+        if (Options.xref) xrefMacro(state->macro_name, counter, 1);
+        state->inside_macro = 1; /* Now inside a macro definition */
+        return 1;
+    }
+
+    /* Handling include lines, only allowed outside of macro definitions */
+    if (isIncludeDirective(line)) {
+        if (state->inside_macro) {
+            diagnose(counter, DIAG_INCLUDE, "%s is not allowed inside a macro", INCLUDE_DIRECTIVE);
+            return 0;
         }
-        
-        /* If inside a macro, insert the line into the macro's content */
-        if (inside_macro) 
-            insertMacroLine(&macroList, line, macro_name);
-        else {
-            /* If not inside a macro, try to find and replace any macros used in the line */
-            if(!findAndReplaceMacro(&macroList, line, am_file)){
-                /* If no macro replacement occurred, write the original line to the .am file */
-                fwrite(line, sizeof(char), strlen(line), am_file);
-            }
+        return ProcessIncludeLine(state, line, &scan, counter, file_name);
+    }
+
+    /* If inside a macro, insert the line into the macro's content */
+    if (state->inside_macro)
+        insertMacroLine(&state->macroList, line, state->macro_name);
+    else {
+        /* If not inside a macro, try to find and replace any macros used in the line */
+        if(!findAndReplaceMacro(&state->macroList, line, &scan, state->am_file)){
+            /* If no macro replacement occurred, write the original line to the .am file */
+            fwrite(line, sizeof(char), strlen(line), state->am_file);
         }
+        else if (Options.xref) xrefMacro(line, counter, 0); /* Record the macro use */
     }
+    return 1;
+}
 
-    /* Cleanup: Free allocated resources and close files */
-    freeMacroList(&macroList);
-    fclose(Source_file);
 
-    /* Reset and return the ".am" file pointer to the beginning for further processing */
-    rewind(am_file);
+/* With --check the .am file is a memory stream writing to this buffer */
+static char *check_buffer = NULL;
+static size_t check_size = 0;
+
+
+/*******************************************************************************
+ * Opens the .am file of a source file.
+ * Without --keep-am, or when writing to the framed output stream, the
+ * expanded source goes to an anonymous temporary file, and with --check
+ * it never leaves memory.
+ *
+ * Parameters:
+ * - file_name: The name of the source file.
+ *
+ * Returns:
+ * - The opened .am file, or NULL on failure.
+ ******************************************************************************/
+FILE* openAmFile(char* file_name) {
+    FILE* am_file = NULL;
+    char* am_file_name = NULL;
+
+    if (Options.check) {
+        am_file = open_memstream(&check_buffer, &check_size);
+        if (!am_file) fprintf(stderr, "Error, Failed to create the expanded source of: %s\n", file_name);
+        return am_file;
+    }
+
+    if (!Options.keep_am || Options.output_stream) {
+        am_file = tmpfile();
+        if (!am_file) fprintf(stderr, "Error, Failed to create temporary file for: %s\n", file_name);
+        return am_file;
+    }
+
+    /* Return allocated memory contain the new file name */
+    am_file_name = outputFileName(file_name, AFTER_MACRO_EXT);
+    if (!am_file_name) return NULL;
+    am_file = fopen(am_file_name, "w+b");
+    if (!am_file) fprintf(stderr, "Error, Failed to create file: %s\n", am_file_name);
+    memFree(am_file_name);
     return am_file;
 }
 
+
+/*******************************************************************************
+ * Makes a complete .am file readable from its start. With --check the
+ * memory stream it was written to is closed and its buffer is copied to a
+ * memory stream the passes can read.
+ *
+ * Parameters:
+ * - am_file: The .am file returned by openAmFile.
+ *
+ * Returns:
+ * - The .am file to read, or NULL on failure.
+ ******************************************************************************/
+FILE* rewindAmFile(FILE* am_file) {
+    FILE* reader = NULL;
+
+    if (!Options.check) {
+        rewind(am_file);
+        return am_file;
+    }
+
+    fclose(am_file);
+    reader = fmemopen(NULL, check_size + 1, "w+");
+    if (reader && fwrite(check_buffer, sizeof(char), check_size, reader) != check_size) {
+        fclose(reader);
+        reader = NULL;
+    }
+    if (reader) rewind(reader);
+    else fprintf(stderr, "Error, Failed to keep the expanded source in memory\n");
+    closeAmFile(NULL);
+    return reader;
+}
+
+
+/*******************************************************************************
+ * Closes a .am file that will not be read, releasing the --check buffer.
+ *
+ * Parameters:
+ * - am_file: The .am file, NULL if it is already closed.
+ ******************************************************************************/
+void closeAmFile(FILE* am_file) {
+    if (am_file) fclose(am_file);
+    /* The buffer comes from the C library, not from memAlloc */
+    (free)(check_buffer);
+    check_buffer = NULL;
+    check_size = 0;
+}
+
+
+/*******************************************************************************
+ * Reads a whole source file into a newly allocated buffer.
+ *
+ * Parameters:
+ * - source_file: The opened source file.
+ * - size: Pointer to store the number of bytes read.
+ *
+ * Returns:
+ * - The allocated buffer, or NULL on failure.
+ ******************************************************************************/
+char* readSourceFile(FILE* source_file, size_t* size) {
+    size_t capacity = 4096, n;
+    char *buffer, *new_buffer;
+
+    *size = 0;
+    buffer = (char*)memAlloc(MEM_LINES, capacity);
+    if (!buffer) {
+        fprintf(stderr, "Error, Failed to allocate memory for source file\n");
+        return NULL;
+    }
+    while ((n = fread(buffer + *size, 1, capacity - *size, source_file)) > 0) {
+        *size += n;
+        if (*size == capacity) {
+            capacity *= 2;
+            new_buffer = (char*)memRealloc(MEM_LINES, buffer, capacity);
+            if (!new_buffer) {
+                fprintf(stderr, "Error, Failed to allocate memory for source file\n");
+                memFree(buffer);
+                return NULL;
+            }
+            buffer = new_buffer;
+        }
+    }
+    return buffer;
+}
+
+
+/*******************************************************************************
+ * Copies the next line of a source buffer, the same way fgets would
+ * (at most MAX_LINE_LENGTH - 1 characters, keeping the newline).
+ *
+ * Parameters:
+ * - source: The source buffer.
+ * - size: The size of the source buffer.
+ * - pos: Pointer to the read position, advanced past the line.
+ * - line: Buffer of MAX_LINE_LENGTH characters receiving the line.
+ *
+ * Returns:
+ * - 1 if a line was read, 0 at the end of the buffer.
+ ******************************************************************************/
+int nextSourceLine(const char* source, size_t size, size_t* pos, char line[]) {
+    size_t len = 0;
+
+    if (*pos >= size) return 0;
+    while (*pos + len < size && len < MAX_LINE_LENGTH - 1) {
+        if (source[*pos + len++] == '\n') break;
+    }
+    memcpy(line, source + *pos, len);
+    line[len] = '\0';
+    *pos += len;
+    return 1;
+}
+
+
+/*******************************************************************************
+ * Pre-scans a source buffer to decide if the macro pass is needed.
+ * The pass is needed when a macro library is loaded or the source contains
+ * the macro start keyword or an include directive.
+ * Also reports whether the source is already in .am form (no comments,
+ * empty lines or surrounding spaces), so it can be copied verbatim.
+ *
+ * Parameters:
+ * - source: The source buffer.
+ * - size: The size of the source buffer.
+ * - canonical: Pointer to store the verbatim source flag.
+ *
+ * Returns:
+ * - 1 if the macro pass is needed, 0 otherwise.
+ ******************************************************************************/
+int sourceNeedsMacroPass(const char* source, size_t size, int* canonical) {
+    size_t i, start = 0, len = 0;
+    char c;
+
+    *canonical = 0;
+    if (getMacroLibrary()) return 1;
+
+    for (i = 0; i < size; i++) {
+        c = source[i];
+        if (c == 'm' && i + 4 <= size && memcmp(source + i, MCRSTRT, 4) == 0) return 1;
+        if (c == '.' && i + 8 <= size && memcmp(source + i, INCLUDE_DIRECTIVE, 8) == 0) return 1;
+    }
+
+    /* Check every fgets sized line is left untouched by the line cleanup */
+    *canonical = 1;
+    while (start < size && *canonical) {
+        for (len = 0; start + len < size && len < MAX_LINE_LENGTH - 1; )
+            if (source[start + len++] == '\n') break;
+        c = source[start];
+        if (isspace((unsigned char)c) || c == ';' || c == '\0' || memchr(source + start, '\0', len))
+            *canonical = 0;
+        else if (source[start + len - 1] != '\n' &&
+                 (source[start + len - 1] == ' ' || source[start + len - 1] == '\t'))
+            *canonical = 0;
+        start += len;
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+ * Copies a source file to the .am file inside the kernel.
+ *
+ * Parameters:
+ * - source_file: The opened source file.
+ * - am_file: The opened .am file.
+ * - size: Number of bytes to copy.
+ *
+ * Returns:
+ * - 1 if the whole file was copied, 0 if the caller has to write it.
+ ******************************************************************************/
+int copySourceFile(FILE* source_file, FILE* am_file, size_t size) {
+#ifdef __linux__
+    loff_t in_off = 0, out_off = 0;
+    ssize_t n = 1;
+
+    fflush(am_file);
+    while (size > 0 && n > 0) {
+        n = copy_file_range(fileno(source_file), &in_off, fileno(am_file), &out_off, size, 0);
+        if (n > 0) size -= n;
+    }
+    /* On a partial copy drop what was copied and let the caller write the file */
+    if (size != 0 && ftruncate(fileno(am_file), 0) != 0)
+        fprintf(stderr, "Error, Failed to reset the .am file\n");
+    return size == 0;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,350 @@
+#include "Assembler.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/* Positions below a limit in word w of a scan */
+#define VALID_BITS(limit, w) \
+    ((limit) >= ((w) + 1) * 32 ? 0xFFFFFFFFUL : \
+     (limit) <= (w) * 32 ? 0UL : ((1UL << ((limit) - (w) * 32)) - 1))
+
+
+/*******************************************************************************
+ * Stores the class mask of a block of bytes in a scan.
+ *
+ * Parameters:
+ * - scan: The scan to update.
+ * - cls: The class of the mask.
+ * - mask: One bit per byte of the block, bit 0 for the first byte.
+ * - pos: Position of the first byte of the block in the string.
+ ******************************************************************************/
+static void depositMask(LineScan* scan, int cls, unsigned long mask, int pos){
+    int w = pos >> 5, shift = pos & 31;
+
+    if (mask == 0 || w >= SCAN_WORDS) return;
+    scan->bits[cls][w] |= (mask << shift) & 0xFFFFFFFFUL;
+    if (shift && w + 1 < SCAN_WORDS) scan->bits[cls][w + 1] |= (mask >> (32 - shift)) & 0xFFFFFFFFUL;
+}
+
+
+/*******************************************************************************
+ * Classifies a string one byte at a time.
+ ******************************************************************************/
+static void scanScalar(const char* str, LineScan* scan){
+    int i;
+    unsigned char c;
+
+    for (i = 0; i < SCAN_CAPACITY && str[i] != '\0'; i++) {
+        c = (unsigned char)str[i];
+        switch (c) {
+            case ' ': case '\t':
+                depositMask(scan, SCAN_BLANK, 1UL, i);
+                depositMask(scan, SCAN_SPACE, 1UL, i);
+                break;
+            case '\n': case '\r': case '\v': case '\f':
+                depositMask(scan, SCAN_SPACE, 1UL, i);
+                break;
+            case ',': depositMask(scan, SCAN_COMMA, 1UL, i); break;
+            case ':': depositMask(scan, SCAN_COLON, 1UL, i); break;
+            case '[': depositMask(scan, SCAN_OPEN, 1UL, i); break;
+            case ']': depositMask(scan, SCAN_CLOSE, 1UL, i); break;
+            case '\"': depositMask(scan, SCAN_QUOTE, 1UL, i); break;
+            case ';': depositMask(scan, SCAN_SEMICOLON, 1UL, i); break;
+        }
+    }
+    scan->length = (i < SCAN_CAPACITY) ? i : -1;
+}
+
+
+#ifdef SCAN_X86
+/*******************************************************************************
+ * Classifies a string 16 bytes at a time with SSE2.
+ * Blocks are loaded aligned, so no load crosses a page boundary; the bytes
+ * before the string and after its terminator are masked out.
+ ******************************************************************************/
+__attribute__((no_sanitize_address))
+static void scanSSE2(const char* str, LineScan* scan){
+    const char *block = (const char*)((size_t)str & ~(size_t)15);
+    int offset = (int)(str - block), pos = -offset, n;
+    unsigned long zero, keep;
+    __m128i v;
+
+    for (; pos < SCAN_CAPACITY; block += 16, pos += 16) {
+        v = _mm_load_si128((const __m128i*)block);
+        zero = (unsigned long)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        keep = 0xFFFFUL;
+        if (pos < 0) {
+            zero &= keep << offset;
+            keep &= keep << offset;
+        }
+        if (zero) keep &= (zero & (~zero + 1)) - 1; /* Bytes before the terminator */
+
+#define SSE2_CLASS(cls, cmp) \
+        depositMask(scan, cls, (((unsigned long)_mm_movemask_epi8(cmp) & keep) >> (pos < 0 ? offset : 0)), pos < 0 ? 0 : pos)
+
+        SSE2_CLASS(SCAN_BLANK, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                            _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))));
+        SSE2_CLASS(SCAN_SPACE, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                            _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(8)),
+                                                          _mm_cmplt_epi8(v, _mm_set1_epi8(14)))));
+        SSE2_CLASS(SCAN_COMMA, _mm_cmpeq_epi8(v, _mm_set1_epi8(',')));
+        SSE2_CLASS(SCAN_COLON, _mm_cmpeq_epi8(v, _mm_set1_epi8(':')));
+        SSE2_CLASS(SCAN_OPEN, _mm_cmpeq_epi8(v, _mm_set1_epi8('[')));
+        SSE2_CLASS(SCAN_CLOSE, _mm_cmpeq_epi8(v, _mm_set1_epi8(']')));
+        SSE2_CLASS(SCAN_QUOTE, _mm_cmpeq_epi8(v, _mm_set1_epi8('\"')));
+        SSE2_CLASS(SCAN_SEMICOLON, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+#undef SSE2_CLASS
+
+        if (zero) {
+            for (n = 0; !(zero & (1UL << n)); n++);
+            scan->length = (pos + n < SCAN_CAPACITY) ? pos + n : -1;
+            return;
+        }
+    }
+    scan->length = -1;
+}
+
+
+/*******************************************************************************
+ * Classifies a string 32 bytes at a time with AVX2, like scanSSE2.
+ ******************************************************************************/
+__attribute__((target("avx2"), no_sanitize_address))
+static void scanAVX2(const char* str, LineScan* scan){
+    const char *block = (const char*)((size_t)str & ~(size_t)31);
+    int offset = (int)(str - block), pos = -offset, n;
+    unsigned long zero, keep;
+    __m256i v;
+
+    for (; pos < SCAN_CAPACITY; block += 32, pos += 32) {
+        v = _mm256_load_si256((const __m256i*)block);
+        zero = (unsigned long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        keep = 0xFFFFFFFFUL;
+        if (pos < 0) {
+            zero &= (keep << offset) & 0xFFFFFFFFUL;
+            keep &= (keep << offset) & 0xFFFFFFFFUL;
+        }
+        if (zero) keep &= (zero & (~zero + 1)) - 1; /* Bytes before the terminator */
+
+#define AVX2_CLASS(cls, cmp) \
+        depositMask(scan, cls, ((unsigned long)(unsigned int)_mm256_movemask_epi8(cmp) & keep) >> (pos < 0 ? offset : 0), pos < 0 ? 0 : pos)
+
+        AVX2_CLASS(SCAN_BLANK, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                               _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))));
+        AVX2_CLASS(SCAN_SPACE, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                               _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(8)),
+                                                                _mm256_cmpgt_epi8(_mm256_set1_epi8(14), v))));
+        AVX2_CLASS(SCAN_COMMA, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')));
+        AVX2_CLASS(SCAN_COLON, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')));
+        AVX2_CLASS(SCAN_OPEN, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('[')));
+        AVX2_CLASS(SCAN_CLOSE, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(']')));
+        AVX2_CLASS(SCAN_QUOTE, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\"')));
+        AVX2_CLASS(SCAN_SEMICOLON, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')));
+#undef AVX2_CLASS
+
+        if (zero) {
+            for (n = 0; !(zero & (1UL << n)); n++);
+            scan->length = (pos + n < SCAN_CAPACITY) ? pos + n : -1;
+            return;
+        }
+    }
+    scan->length = -1;
+}
+#endif
+
+
+/*******************************************************************************
+ * Classifies the bytes of a string in one pass. Every class (blanks, white
+ * space, commas, colons, brackets, quotes and semicolons) gets a bitmap of
+ * its positions, so callers answer their questions with bit operations
+ * instead of rescanning the string. Uses AVX2 or SSE2 when available.
+ *
+ * Parameters:
+ * - str: The string to classify.
+ * - scan: Receives the length and the class bitmaps.
+ *
+ * Returns:
+ * - 1 if the string was classified, 0 if it is SCAN_CAPACITY bytes or longer.
+ ******************************************************************************/
+int scanString(const char* str, LineScan* scan){
+    memset(scan->bits, 0, sizeof(scan->bits));
+    scan->text = str;
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("avx2")) scanAVX2(str, scan);
+    else scanSSE2(str, scan);
+#else
+    scanScalar(str, scan);
+#endif
+    return scan->length >= 0;
+}
+
+
+/*******************************************************************************
+ * Classifies a string with the portable kernel only, to check the vector
+ * kernels against it.
+ *
+ * Parameters:
+ * - str: The string to classify.
+ * - scan: Receives the length and the class bitmaps.
+ *
+ * Returns:
+ * - 1 if the string was classified, 0 if it is SCAN_CAPACITY bytes or longer.
+ ******************************************************************************/
+int scanStringScalar(const char* str, LineScan* scan){
+    memset(scan->bits, 0, sizeof(scan->bits));
+    scan->text = str;
+    scanScalar(str, scan);
+    return scan->length >= 0;
+}
+
+
+/*******************************************************************************
+ * Finds the first position of a class in a range of a scanned string.
+ *
+ * Parameters:
+ * - scan: The scan of the string.
+ * - cls: The class to look for.
+ * - from: The first position of the range.
+ * - to: The position after the range.
+ *
+ * Returns:
+ * - The position, or -1 if the class does not occur in the range.
+ ******************************************************************************/
+int scanFirst(const LineScan* scan, int cls, int from, int to){
+    unsigned long bits;
+    int w, n;
+
+    if (from < 0) from = 0;
+    if (to > scan->length) to = scan->length;
+    for (w = from >> 5; w < SCAN_WORDS && w * 32 < to; w++) {
+        bits = scan->bits[cls][w] & VALID_BITS(to, w);
+        if (w == from >> 5) bits &= (0xFFFFFFFFUL << (from & 31)) & 0xFFFFFFFFUL;
+        if (bits) {
+            for (n = 0; !(bits & (1UL << n)); n++);
+            return w * 32 + n;
+        }
+    }
+    return -1;
+}
+
+
+/*******************************************************************************
+ * Finds the first position not in a class in a range of a scanned string.
+ *
+ * Parameters:
+ * - scan: The scan of the string.
+ * - cls: The class to skip.
+ * - from: The first position of the range.
+ * - to: The position after the range.
+ *
+ * Returns:
+ * - The position, or the end of the range if every byte is in the class.
+ ******************************************************************************/
+int scanFirstNot(const LineScan* scan, int cls, int from, int to){
+    unsigned long bits;
+    int w, n;
+
+    if (from < 0) from = 0;
+    if (to > scan->length) to = scan->length;
+    for (w = from >> 5; w < SCAN_WORDS && w * 32 < to; w++) {
+        bits = ~scan->bits[cls][w] & VALID_BITS(to, w);
+        if (w == from >> 5) bits &= (0xFFFFFFFFUL << (from & 31)) & 0xFFFFFFFFUL;
+        if (bits) {
+            for (n = 0; !(bits & (1UL << n)); n++);
+            return w * 32 + n;
+        }
+    }
+    return to;
+}
+
+
+/*******************************************************************************
+ * Finds the last position not in a class in a range of a scanned string.
+ *
+ * Parameters:
+ * - scan: The scan of the string.
+ * - cls: The class to skip.
+ * - from: The first position of the range.
+ * - to: The position after the range.
+ *
+ * Returns:
+ * - The position, or -1 if every byte of the range is in the class.
+ ******************************************************************************/
+int scanLastNot(const LineScan* scan, int cls, int from, int to){
+    unsigned long bits;
+    int w, n;
+
+    if (from < 0) from = 0;
+    if (to > scan->length) to = scan->length;
+    for (w = (to - 1) >> 5; w >= 0 && w >= from >> 5 && to > from; w--) {
+        bits = ~scan->bits[cls][w] & VALID_BITS(to, w);
+        if (w == from >> 5) bits &= (0xFFFFFFFFUL << (from & 31)) & 0xFFFFFFFFUL;
+        if (bits) {
+            for (n = 31; !(bits & (1UL << n)); n--);
+            return w * 32 + n;
+        }
+    }
+    return -1;
+}
+
+
+/*******************************************************************************
+ * Locates a string inside the line of a scan. Callers split and trim the
+ * line in place with scanCut, so the string ends at the first cut after it
+ * or with the line, without measuring it again.
+ *
+ * Parameters:
+ * - scan: The scan of the line, or NULL.
+ * - str: A string inside the scanned line.
+ * - end: Receives the position after the last byte of the string.
+ *
+ * Returns:
+ * - The position of the string in the line, or -1 if the scan does not
+ *   cover it.
+ ******************************************************************************/
+int scanSpan(const LineScan* scan, const char* str, int* end){
+    int from;
+
+    if (!scan || !str || scan->length < 0) return -1;
+    from = (int)(str - scan->text);
+    if (from < 0 || from > scan->length) return -1;
+    if ((*end = scanFirst(scan, SCAN_CUT, from, scan->length)) == -1) *end = scan->length;
+    return from;
+}
+
+
+/*******************************************************************************
+ * Terminates a scanned line at a position and records the cut in its scan,
+ * so later questions about the string before it stop there.
+ *
+ * Parameters:
+ * - scan: The scan of the line, or NULL.
+ * - at: The byte of the line to replace with the terminator.
+ ******************************************************************************/
+void scanCut(LineScan* scan, char* at){
+    int pos;
+
+    *at = '\0';
+    if (!scan || scan->length < 0) return;
+    pos = (int)(at - scan->text);
+    if (pos >= 0 && pos < scan->length) scan->bits[SCAN_CUT][pos >> 5] |= 1UL << (pos & 31);
+}
+
+
+/*******************************************************************************
+ * Checks if a string contains a space or a tab.
+ *
+ * Parameters:
+ * - str: The string to check.
+ * - scan: The scan of the line holding the string, or NULL.
+ *
+ * Returns:
+ * - 1 if the string contains a blank, 0 otherwise.
+ ******************************************************************************/
+int hasBlank(const char* str, const LineScan* scan){
+    int from, end;
+
+    if ((from = scanSpan(scan, str, &end)) == -1) return strpbrk(str, " \t") != NULL;
+    return scanFirst(scan, SCAN_BLANK, from, end) != -1;
+}
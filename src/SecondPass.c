@@ -13,21 +13,32 @@
  *   Code - Array to hold the encoded instructions.
  *   Data - Array to hold the encoded data.
  *   PC - Program counters; PC[0] for instructions (IC) and PC[1] for data (DC).
- *   Error - Pointer to an integer flag indicating if an error has occurred.
+ *   Error - Pointer to the error count of the file. Lines are encoded until the
+ *           end or until it reaches --max-errors.
  */
 void SecondPass(FILE* am_file, LabelTable* table, signed short Code[], signed short Data[], int PC[], int* Error) {
     char line[MAX_LINE_LENGTH]; /* Buffer to store each line read from the file. */
     int line_count = 0; /* Line counter for error reporting and processing. */
 
-   
-    while (fgets(line, MAX_LINE_LENGTH, am_file)){
+    /* Large files can be split into chunks encoded by several threads,
+       unless streaming, as the parallel pass holds every line in memory. */
+    if (Options.threads > 1 && !Options.stream) {
+        ParallelSecondPass(am_file, table, Code, Data, PC, Error);
+    }
+    else while (!errorLimitReached(*Error) && fgets(line, MAX_LINE_LENGTH, am_file)){
         line_count++; 
         /* Process each line to encode instructions and data. */
         ProcessLine(line, table, Code, Data, PC, line_count, Error); 
     }
     
+    /* Words past the image were dropped, a program that overflows it is not written. */
+    if (!Options.check && (PC[0] > Options.image_words || PC[1] > Options.image_words)) {
+        diagnose(0, DIAG_FILE, "Program of %d code and %d data words does not fit in %d words", PC[0], PC[1], Options.image_words);
+        (*Error)++;
+    }
+
     /* After processing all lines, update label addresses if no errors occurred. */
-    if (!*Error) {
+    if (!*Error && !Options.check) {
         reallocateLabels(table, Code, PC[0]);
     }
     /* Close the .am file. */
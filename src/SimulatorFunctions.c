@@ -0,0 +1,510 @@
+#include "Assembler.h"
+
+/* Registers r0 to r7, kept after the memory words */
+#define SIM_REGISTERS 8
+/* Longest instruction: its first word and two matrix operands */
+#define SIM_MAX_LENGTH 5
+/* Why a simulated program halted */
+#define SIM_RUNNING 0
+#define SIM_STOPPED 1
+#define SIM_FAULT 2
+#define SIM_LIMIT 3
+/* Dispatch codes after the 16 opcodes: an instruction to decode, and words
+ * that are not an instruction */
+#define SIM_DECODE 16
+#define SIM_INVALID 17
+
+/* Wraps a value to a signed 10 bit word */
+#define WRAP(value) ((short)((((value) & 0x3FF) ^ 0x200) - 0x200))
+
+/* An operand, decoded once: the word it reads and writes, or how to find it */
+typedef struct SimOperand {
+    short *location; /* The register, memory word or constant of the operand, NULL for matrix and external operands */
+    short constant; /* Value of an immediate operand */
+    short address; /* Address of a label, or of the first element of a matrix */
+    short jump; /* Address a jump to a label goes to, -1 when it is found as the jump runs */
+    short rows, cols; /* Dimensions of a matrix, 0 when they are not known */
+    short symbol; /* Extern use of an external label in the image's externs, -1 if it is not named */
+    unsigned char mode; /* IMMEDIATE, LABEL, MATRIX or REGISTER */
+    unsigned char external; /* 1 if the label is external and was never linked */
+    unsigned char row, col; /* Registers indexing a matrix */
+} SimOperand;
+
+/* An instruction, decoded the first time it runs and again after its words change */
+typedef struct SimInstruction {
+    unsigned char opcode; /* The opcode, 0 (mov) to 15 (stop), or SIM_DECODE or SIM_INVALID */
+    unsigned char length; /* Words of the instruction */
+    const char *fault; /* Why the words are not a valid instruction, NULL if they are */
+    SimOperand src; /* Source operand of two operand instructions */
+    SimOperand dst; /* Destination, the only operand of one operand instructions */
+} SimInstruction;
+
+/* A matrix of the program, found in its .am file */
+typedef struct SimMatrix {
+    int address; /* Address of the first element */
+    int rows, cols; /* Dimensions */
+} SimMatrix;
+
+/* The machine running a program */
+typedef struct Simulator {
+    short cells[OBJECT_MEMORY + SIM_REGISTERS]; /* The memory words, then the registers, as signed 10 bit values */
+    SimInstruction code[OBJECT_MEMORY + SIM_MAX_LENGTH]; /* The decoded instruction at every address, and past the end */
+    ObjectImage image; /* The loaded program */
+    SimMatrix *matrices; /* Matrices of the program */
+    int num_matrices; /* Number of matrices */
+    int stack[SIM_STACK_DEPTH]; /* Return addresses of jsr */
+    int depth; /* Return addresses on the stack */
+    int zero, negative; /* Flags of the last comparison or arithmetic result */
+    char fault[2 * MAX_LINE_LENGTH]; /* Why the program faulted */
+} Simulator;
+
+static const char *halt_names[] = {"running", "stop", "fault", "limit"};
+static char encoding_table[] = {'a', 'b', 'c', 'd'};
+
+
+/*******************************************************************************
+ * Ignores the diagnostics of the .am file, which already assembled.
+ ******************************************************************************/
+static void ignoreDiagnostic(void* context, int line, int code, const char* message){
+    (void)context;
+    (void)line;
+    (void)code;
+    (void)message;
+}
+
+
+/*******************************************************************************
+ * Finds the dimensions of the matrices of a program in the .am file next to
+ * its object file, as the object file keeps only their elements. Every line
+ * is measured the way the parallel encoder does, which gives the address of
+ * each .mat label. Matrices after a line that cannot be measured, or of a
+ * program without its .am file, stay unknown.
+ *
+ * Parameters:
+ * - sim: The simulator.
+ * - name: The program name.
+ ******************************************************************************/
+static void loadMatrices(Simulator* sim, char* name){
+    char line[MAX_LINE_LENGTH], copy[MAX_LINE_LENGTH];
+    char *am_name = changeFileNameExtension(name, AFTER_MACRO_EXT), *text, *label_name, *save = NULL;
+    LabelTable *table;
+    FILE *am_file;
+    int errors = 0, capacity = 0, address = OBJECT_BASE, sizes[2], rows, cols;
+
+    am_file = am_name ? fopen(am_name, "r") : NULL;
+    memFree(am_name);
+    if (!am_file) return;
+
+    table = FirstPass(am_file, &errors);
+    diagDrain(ignoreDiagnostic, NULL);
+    while (!errors && fgets(line, MAX_LINE_LENGTH, am_file)) {
+        strcpy(copy, line);
+        if (!(text = deleteSpaces(copy, NULL)) || isEmptyOrComment(text)) continue;
+        if (!measureLine(line, table, sizes)) break;
+
+        if (IsLabelDefinition(text)) {
+            label_name = nextToken(text, ":", &save);
+            text = deleteSpaces(nextToken(NULL, "\r\n", &save), NULL);
+            if (label_name && text && IsMatrixDirective(text) &&
+                sscanf(text + strlen(".mat"), " [%d ] [%d ]", &rows, &cols) == 2 && rows > 0 && cols > 0) {
+                if (sim->num_matrices == capacity) {
+                    capacity = capacity ? capacity * 2 : 8;
+                    sim->matrices = (SimMatrix*)memRealloc(MEM_OTHER, sim->matrices, capacity * sizeof(SimMatrix));
+                    if (!sim->matrices) {
+                        fprintf(stderr, "Error, Failed to allocate memory for the matrices\n");
+                        exit(1);
+                    }
+                }
+                sim->matrices[sim->num_matrices].address = address;
+                sim->matrices[sim->num_matrices].rows = rows;
+                sim->matrices[sim->num_matrices++].cols = cols;
+            }
+        }
+        address += sizes[0] + sizes[1];
+    }
+    freeLabelTable(table);
+    fclose(am_file);
+}
+
+
+/*******************************************************************************
+ * Resolves a decoded operand to the word it reads and writes.
+ *
+ * Parameters:
+ * - sim: The simulator.
+ * - op: The operand to fill.
+ * - decoded: The operand as decodeObjectInstruction found it.
+ ******************************************************************************/
+static void resolveOperand(Simulator* sim, SimOperand* op, const ObjectOperand* decoded){
+    int i;
+
+    op->mode = (unsigned char)decoded->mode;
+    op->symbol = op->jump = -1;
+    switch (decoded->mode) {
+        case IMMEDIATE:
+            op->constant = (short)decoded->value;
+            op->location = &op->constant;
+            break;
+
+        case REGISTER:
+            op->location = &sim->cells[OBJECT_MEMORY + decoded->value];
+            break;
+
+        default:
+            op->address = (short)decoded->value;
+            op->external = decoded->are == 1;
+            op->location = decoded->mode == LABEL && !op->external ? &sim->cells[op->address] : NULL;
+            if (op->location) op->jump = op->address;
+            for (i = 0; op->external && i < sim->image.num_externs; i++)
+                if (sim->image.externs[i].address == decoded->word) op->symbol = (short)i;
+            op->row = (unsigned char)decoded->row;
+            op->col = (unsigned char)decoded->col;
+            for (i = 0; decoded->mode == MATRIX && i < sim->num_matrices; i++) {
+                if (sim->matrices[i].address == op->address) {
+                    op->rows = (short)sim->matrices[i].rows;
+                    op->cols = (short)sim->matrices[i].cols;
+                }
+            }
+    }
+}
+
+
+/*******************************************************************************
+ * Decodes the instruction at an address into its compact form.
+ *
+ * Parameters:
+ * - sim: The simulator.
+ * - pc: The address of the instruction.
+ ******************************************************************************/
+static void decodeInstruction(Simulator* sim, int pc){
+    SimInstruction *ins = &sim->code[pc];
+    ObjectInstruction decoded;
+
+    memset(ins, 0, sizeof(SimInstruction));
+    ins->opcode = SIM_INVALID;
+    if (pc >= OBJECT_MEMORY) {
+        ins->fault = "program runs past the end of memory";
+        return;
+    }
+    if ((ins->fault = decodeObjectInstruction(sim->cells, pc, OBJECT_MEMORY, &decoded))) return;
+
+    ins->opcode = (unsigned char)decoded.opcode;
+    ins->length = (unsigned char)decoded.length;
+    if (decoded.num_operands == 2) resolveOperand(sim, &ins->src, &decoded.operands[0]);
+    if (decoded.num_operands >= 1) resolveOperand(sim, &ins->dst, &decoded.operands[decoded.num_operands - 1]);
+}
+
+
+/*******************************************************************************
+ * Drops the decoded instructions that may include a word that was written.
+ ******************************************************************************/
+static void invalidate(Simulator* sim, int address){
+    int i;
+
+    for (i = address; i >= 0 && i > address - SIM_MAX_LENGTH; i--) sim->code[i].opcode = SIM_DECODE;
+}
+
+
+/*******************************************************************************
+ * Finds the word of a matrix or external operand.
+ *
+ * Parameters:
+ * - sim: The simulator.
+ * - op: The operand.
+ *
+ * Returns:
+ * - The word, or NULL with the fault of the simulator set.
+ ******************************************************************************/
+static short* locate(Simulator* sim, SimOperand* op){
+    int row, col, address;
+
+    if (op->external) {
+        if (op->symbol >= 0)
+            sprintf(sim->fault, "external label %s was never linked", sim->image.externs[op->symbol].name);
+        else
+            sprintf(sim->fault, "external label was never linked");
+        return NULL;
+    }
+    if (!op->cols) {
+        sprintf(sim->fault, "unknown dimensions of the matrix at address %d, its .am file is needed", op->address);
+        return NULL;
+    }
+    row = sim->cells[OBJECT_MEMORY + op->row];
+    col = sim->cells[OBJECT_MEMORY + op->col];
+    if (row < 0 || row >= op->rows || col < 0 || col >= op->cols) {
+        sprintf(sim->fault, "matrix index [%d][%d] outside [%d][%d]", row, col, op->rows, op->cols);
+        return NULL;
+    }
+    address = op->address + row * op->cols + col;
+    if (address >= OBJECT_MEMORY) {
+        sprintf(sim->fault, "matrix element past the end of memory");
+        return NULL;
+    }
+    return &sim->cells[address];
+}
+
+
+/*******************************************************************************
+ * Finds the address an operand names, the target of lea and of the jumps.
+ * A register holds the address itself.
+ *
+ * Returns:
+ * - The address, or -1 with the fault of the simulator set.
+ ******************************************************************************/
+static int target(Simulator* sim, SimOperand* op){
+    short *word;
+    int address;
+
+    switch (op->mode) {
+        case LABEL:
+            if (!op->external) return op->address;
+            locate(sim, op);
+            return -1;
+
+        case MATRIX:
+            return (word = locate(sim, op)) ? (int)(word - sim->cells) : -1;
+
+        case REGISTER:
+            if ((address = *op->location) >= 0 && address < OBJECT_MEMORY) return address;
+            sprintf(sim->fault, "register holds the address %d, outside memory", address);
+            return -1;
+
+        default:
+            sprintf(sim->fault, "immediate operand has no address");
+            return -1;
+    }
+}
+
+
+/* The word of an operand, NULL on a fault */
+#define LOCATE(op) ((op).location ? (op).location : locate(sim, &(op)))
+
+/* Writes a word, dropping the decoded instructions over a memory word */
+#define STORE(word, value) do { \
+        *(word) = WRAP(value); \
+        if ((word) < sim->cells + OBJECT_MEMORY) invalidate(sim, (int)((word) - sim->cells)); \
+    } while (0)
+
+/* The address a jump goes to, -1 on a fault */
+#define TARGET(op) ((op).jump >= 0 ? (op).jump : target(sim, &(op)))
+
+/* Sets the flags from a result */
+#define FLAGS(value) (zero = (value) == 0, negative = (value) < 0)
+
+
+/*******************************************************************************
+ * Runs a loaded program from OBJECT_BASE until it stops, faults or executes
+ * the step limit. Dispatch is a switch over the decoded opcode; the words of
+ * operands are resolved to pointers when decoding, so only matrix and
+ * external operands do any work when they run.
+ *
+ * Semantics of the instructions, on signed 10 bit words:
+ * - mov, add, sub, clr, not, inc, dec write their destination; all but mov
+ *   set the zero and negative flags from the result.
+ * - cmp sets the flags from source minus destination.
+ * - lea writes the address of its source.
+ * - jmp, bne (when zero is clear) and jsr jump to the address of their
+ *   operand, the value of a register operand; rts returns from jsr.
+ * - red reads a character from stdin, -1 at the end of input.
+ * - prn prints the value of its operand as a decimal line on stdout.
+ *
+ * Parameters:
+ * - sim: The simulator.
+ * - pc_out: Pointer to store the address of the halting instruction.
+ * - steps_out: Pointer to store the number of executed instructions.
+ *
+ * Returns:
+ * - SIM_STOPPED, SIM_FAULT or SIM_LIMIT.
+ ******************************************************************************/
+static int execute(Simulator* sim, int* pc_out, long* steps_out){
+    SimInstruction *ins;
+    short *src, *dst;
+    long steps = 0, limit = Options.max_steps;
+    int pc = OBJECT_BASE, next, address, c, status = SIM_LIMIT, zero = 0, negative = 0;
+
+    while (steps < limit) {
+        ins = &sim->code[pc];
+        next = pc + ins->length;
+
+        switch (ins->opcode) {
+            case 0: /* mov */
+                if (!(src = LOCATE(ins->src)) || !(dst = LOCATE(ins->dst))) goto fault;
+                STORE(dst, *src);
+                break;
+            case 1: /* cmp */
+                if (!(src = LOCATE(ins->src)) || !(dst = LOCATE(ins->dst))) goto fault;
+                FLAGS(*src - *dst);
+                break;
+            case 2: /* add */
+                if (!(src = LOCATE(ins->src)) || !(dst = LOCATE(ins->dst))) goto fault;
+                STORE(dst, *dst + *src);
+                FLAGS(*dst);
+                break;
+            case 3: /* sub */
+                if (!(src = LOCATE(ins->src)) || !(dst = LOCATE(ins->dst))) goto fault;
+                STORE(dst, *dst - *src);
+                FLAGS(*dst);
+                break;
+            case 4: /* lea */
+                if ((address = target(sim, &ins->src)) < 0 || !(dst = LOCATE(ins->dst))) goto fault;
+                STORE(dst, address);
+                break;
+            case 5: /* clr */
+                if (!(dst = LOCATE(ins->dst))) goto fault;
+                STORE(dst, 0);
+                FLAGS(0);
+                break;
+            case 6: /* not */
+                if (!(dst = LOCATE(ins->dst))) goto fault;
+                STORE(dst, ~*dst);
+                FLAGS(*dst);
+                break;
+            case 7: /* inc */
+                if (!(dst = LOCATE(ins->dst))) goto fault;
+                STORE(dst, *dst + 1);
+                FLAGS(*dst);
+                break;
+            case 8: /* dec */
+                if (!(dst = LOCATE(ins->dst))) goto fault;
+                STORE(dst, *dst - 1);
+                FLAGS(*dst);
+                break;
+            case 10: /* bne */
+                if (zero) break;
+                /* Taken, as jmp */
+            case 9: /* jmp */
+                if ((next = TARGET(ins->dst)) < 0) goto fault;
+                break;
+            case 11: /* jsr */
+                if ((address = TARGET(ins->dst)) < 0) goto fault;
+                if (sim->depth == SIM_STACK_DEPTH) {
+                    sprintf(sim->fault, "jsr nested deeper than %d calls", SIM_STACK_DEPTH);
+                    goto fault;
+                }
+                sim->stack[sim->depth++] = next;
+                next = address;
+                break;
+            case 12: /* red */
+                if (!(dst = LOCATE(ins->dst))) goto fault;
+                c = getchar();
+                STORE(dst, c == EOF ? -1 : c);
+                break;
+            case 13: /* prn */
+                if (!(dst = LOCATE(ins->dst))) goto fault;
+                printf("%d\n", *dst);
+                break;
+            case 14: /* rts */
+                if (!sim->depth) {
+                    sprintf(sim->fault, "rts without a jsr");
+                    goto fault;
+                }
+                next = sim->stack[--sim->depth];
+                break;
+            case 15: /* stop */
+                status = SIM_STOPPED;
+                steps++;
+                goto halt;
+            case SIM_DECODE:
+                decodeInstruction(sim, pc);
+                continue;
+            default:
+                sprintf(sim->fault, "%s", ins->fault);
+                goto fault;
+        }
+        steps++;
+        pc = next;
+    }
+    goto halt;
+
+fault:
+    status = SIM_FAULT;
+halt:
+    sim->zero = zero;
+    sim->negative = negative;
+    *pc_out = pc;
+    *steps_out = steps;
+    return status;
+}
+
+
+/*******************************************************************************
+ * Prints the state of a halted program on stdout: why and where it halted,
+ * the executed instructions, the registers, the flags, the value of every
+ * entry and the memory words, as "address<tab>word" lines in the letters of
+ * the object file for the image and for every other nonzero word.
+ ******************************************************************************/
+static void dumpState(Simulator* sim, int status, int pc, long steps){
+    char address[SIZE_OF_ADDRESS + 1] = {'\0'}, word[SIZE_OF_WORD + 1] = {'\0'};
+    ObjectSymbol *entry;
+    int i, image_end = OBJECT_BASE + sim->image.ICF + sim->image.DCF;
+
+    encodeBase4(encoding_table, pc, address, SIZE_OF_ADDRESS);
+    printf("halt\t%s\npc\t%s\nsteps\t%ld\n", halt_names[status], address, steps);
+    for (i = 0; i < SIM_REGISTERS; i++) printf("r%d\t%d\n", i, sim->cells[OBJECT_MEMORY + i]);
+    printf("zero\t%d\nnegative\t%d\n", sim->zero, sim->negative);
+
+    for (i = 0; i < sim->image.num_entries; i++) {
+        entry = &sim->image.entries[i];
+        encodeBase4(encoding_table, entry->address, address, SIZE_OF_ADDRESS);
+        printf("entry\t%s\t%s\t%d\n", entry->name, address, entry->address < OBJECT_MEMORY ? sim->cells[entry->address] : 0);
+    }
+
+    for (i = 0; i < OBJECT_MEMORY; i++) {
+        if (!sim->cells[i] && (i < OBJECT_BASE || i >= image_end)) continue;
+        encodeBase4(encoding_table, i, address, SIZE_OF_ADDRESS);
+        encodeBase4(encoding_table, sim->cells[i], word, SIZE_OF_WORD);
+        printf("%s\t%s\n", address, word);
+    }
+}
+
+
+/*******************************************************************************
+ * Loads an object program and runs it. The .ob file gives the memory image,
+ * the .ext file names the external labels a fault reports, the .ent file the
+ * symbols the dump shows and the .am file the matrix dimensions. Every
+ * instruction is decoded once, the first time it runs; a write over its
+ * words decodes it again.
+ *
+ * Parameters:
+ * - name: The program, its .ob file or any name with the same base.
+ *
+ * Returns:
+ * - 1 if the program ran to its stop instruction, 0 otherwise.
+ ******************************************************************************/
+int simulate(char* name){
+    Simulator *sim;
+    long steps;
+    int status, pc, i;
+
+    sim = (Simulator*)memCalloc(MEM_OTHER, 1, sizeof(Simulator));
+    if (!sim) {
+        fprintf(stderr, "Error, Failed to allocate memory for the simulator\n");
+        exit(1);
+    }
+    if (!loadObject(name, &sim->image)) {
+        memFree(sim);
+        return 0;
+    }
+    if (sim->image.ICF + sim->image.DCF > OBJECT_MEMORY - OBJECT_BASE) {
+        fprintf(stderr, "Error: The image of %s does not fit in the %d words of memory\n", name, OBJECT_MEMORY);
+        freeObject(&sim->image);
+        memFree(sim);
+        return 0;
+    }
+    for (i = 0; i < OBJECT_MEMORY; i++) sim->cells[i] = WRAP(sim->image.words[i]);
+    for (i = 0; i < OBJECT_MEMORY + SIM_MAX_LENGTH; i++) sim->code[i].opcode = SIM_DECODE;
+    loadMatrices(sim, name);
+
+    status = execute(sim, &pc, &steps);
+    if (status == SIM_FAULT)
+        fprintf(stderr, "Error: %s: %s at address %d\n", name, sim->fault, pc);
+    else if (status == SIM_LIMIT)
+        fprintf(stderr, "Error: %s: stopped after %ld steps at address %d\n", name, steps, pc);
+    if (Options.dump) dumpState(sim, status, pc, steps);
+    fflush(stdout);
+
+    freeObject(&sim->image);
+    memFree(sim->matrices);
+    memFree(sim);
+    return status == SIM_STOPPED;
+}
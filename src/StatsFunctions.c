@@ -0,0 +1,269 @@
+#define _POSIX_C_SOURCE 200112L
+#include "Assembler.h"
+#include <time.h>
+
+/* Counters of the file being assembled */
+FileStats Stats;
+
+static FileStats total; /* Sum of every finished file */
+static FILE *report; /* Stream of the report, opened by the first file */
+
+static const char *phase_names[STATS_PHASES] = {"preasm", "first_pass", "second_pass", "output"};
+static const char *output_names[STATS_OUTPUTS] = {".am", ".ob", ".ent", ".ext"};
+
+
+/*******************************************************************************
+ * Adds to a counter that several threads may update at once.
+ *
+ * Parameters:
+ * - counter: The counter.
+ * - n: The amount to add.
+ ******************************************************************************/
+void statsAdd(long* counter, long n){
+#ifdef __GNUC__
+    __sync_fetch_and_add(counter, n);
+#else
+    *counter += n;
+#endif
+}
+
+
+/*******************************************************************************
+ * Returns the time of the monotonic clock in seconds.
+ ******************************************************************************/
+double statsClock(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*******************************************************************************
+ * Resets the counters before a file is assembled.
+ *
+ * Parameters:
+ * - file_name: The file about to be assembled.
+ ******************************************************************************/
+void statsBeginFile(char* file_name){
+    memset(&Stats, 0, sizeof(Stats));
+    Stats.file_name = file_name;
+    memBeginFile();
+}
+
+
+/*******************************************************************************
+ * Counts the bytes of a closed output file under its extension.
+ *
+ * Parameters:
+ * - name: The name of the output file.
+ * - bytes: The number of bytes written.
+ ******************************************************************************/
+void statsOutputBytes(const char* name, long bytes){
+    size_t len = strlen(name), ext_len;
+    int i;
+
+    for (i = 0; i < STATS_OUTPUTS; i++) {
+        ext_len = strlen(output_names[i]);
+        if (len >= ext_len && strcmp(name + len - ext_len, output_names[i]) == 0) {
+            statsAdd(&Stats.output_bytes[i], bytes);
+            return;
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * Writes a string as a JSON string literal.
+ ******************************************************************************/
+static void printJsonString(FILE* out, const char* str){
+    fputc('"', out);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') fprintf(out, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20) fprintf(out, "\\u%04x", (unsigned char)*str);
+        else fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+
+/*******************************************************************************
+ * Returns the stream of the report: stderr for the text report, the
+ * --stats-json file for JSON, or stderr if that file cannot be created.
+ ******************************************************************************/
+static FILE* reportStream(void){
+    if (report) return report;
+    report = stderr;
+    if (Options.stats == STATS_JSON && strcmp(Options.stats_file, "-") != 0 && !(report = fopen(Options.stats_file, "w"))) {
+        fprintf(stderr, "Error: Could not create %s, reporting on stderr\n", Options.stats_file);
+        report = stderr;
+    }
+    return report;
+}
+
+
+/*******************************************************************************
+ * Prints the statistics of a file, or of the batch when file_name is NULL.
+ *
+ * Parameters:
+ * - out: The stream to print to.
+ * - file_name: The source file, NULL for the aggregate.
+ * - stats: The statistics to print.
+ ******************************************************************************/
+static void printStats(FILE* out, char* file_name, FileStats* stats){
+    double load = stats->table_size ? (double)stats->labels / stats->table_size : 0, sum = 0;
+    int i;
+
+    for (i = 0; i < STATS_PHASES; i++) sum += stats->phase_time[i];
+
+    if (Options.stats == STATS_JSON) {
+        fprintf(out, "{");
+        if (file_name) {
+            fprintf(out, "\"file\": ");
+            printJsonString(out, file_name);
+            fprintf(out, ", \"failed\": %s", stats->failed ? "true" : "false");
+        } else {
+            fprintf(out, "\"files\": %d, \"failed\": %d", stats->files, stats->failed);
+        }
+        fprintf(out, ", \"time_ms\": {");
+        for (i = 0; i < STATS_PHASES; i++) fprintf(out, "\"%s\": %.3f, ", phase_names[i], stats->phase_time[i] * 1e3);
+        fprintf(out, "\"total\": %.3f}", sum * 1e3);
+        fprintf(out, ", \"source_lines\": %ld, \"am_lines\": %ld, \"macro_expansions\": %ld",
+                stats->source_lines, stats->am_lines, stats->macro_expansions);
+        fprintf(out, ", \"labels\": %ld, \"table_size\": %ld, \"load_factor\": %.3f, \"chains\": [",
+                stats->labels, stats->table_size, load);
+        for (i = 0; i < STATS_CHAINS; i++) fprintf(out, "%s%ld", i ? ", " : "", stats->chains[i]);
+        fprintf(out, "], \"resizes\": %ld, \"references\": %ld, \"IC\": %ld, \"DC\": %ld, \"output_bytes\": {",
+                stats->resizes, stats->references, stats->IC, stats->DC);
+        for (i = 0; i < STATS_OUTPUTS; i++) fprintf(out, "%s\"%s\": %ld", i ? ", " : "", output_names[i], stats->output_bytes[i]);
+        fprintf(out, "}, \"allocations\": %ld}", stats->allocations);
+        return;
+    }
+
+    if (file_name) fprintf(out, "Stats for %s%s:\n", file_name, stats->failed ? " (failed)" : "");
+    else fprintf(out, "Stats for %d files (%d failed):\n", stats->files, stats->failed);
+    fprintf(out, "  time (ms):");
+    for (i = 0; i < STATS_PHASES; i++) fprintf(out, " %s %.3f,", phase_names[i], stats->phase_time[i] * 1e3);
+    fprintf(out, " total %.3f\n", sum * 1e3);
+    fprintf(out, "  lines: %ld source, %ld after macro expansion, %ld macro expansions\n",
+            stats->source_lines, stats->am_lines, stats->macro_expansions);
+    fprintf(out, "  labels: %ld in %ld buckets, load factor %.2f, %ld resizes, %ld references\n",
+            stats->labels, stats->table_size, load, stats->resizes, stats->references);
+    fprintf(out, "  chains:");
+    for (i = 0; i < STATS_CHAINS; i++) fprintf(out, " %d%s:%ld", i, i == STATS_CHAINS - 1 ? "+" : "", stats->chains[i]);
+    fprintf(out, "\n  image: IC %ld, DC %ld\n  output bytes:", stats->IC, stats->DC);
+    for (i = 0; i < STATS_OUTPUTS; i++) fprintf(out, " %s %ld%s", output_names[i], stats->output_bytes[i], i < STATS_OUTPUTS - 1 ? "," : "");
+    fprintf(out, "\n  allocations: %ld\n", stats->allocations);
+}
+
+
+/*******************************************************************************
+ * Records the spans of the finished file and its phases, and the image
+ * counters, in the trace.
+ ******************************************************************************/
+static void traceFile(void){
+    static const char *phase_spans[STATS_PHASES] = {"preassemble", "pass 1", "pass 2", "write"};
+    static const char *file_names[] = {"lines", "labels", "words"};
+    static const char *preasm_names[] = {"lines", "macro_expansions"};
+    static const char *pass1_names[] = {"lines", "labels"};
+    static const char *pass2_names[] = {"IC", "DC"};
+    static const char *write_names[] = {"bytes"};
+    static const char **phase_names_of[STATS_PHASES] = {preasm_names, pass1_names, pass2_names, write_names};
+    long args[STATS_PHASES][2], file_args[3];
+    int num_args[STATS_PHASES] = {2, 2, 2, 1}, i;
+
+    args[STATS_PREASM][0] = Stats.source_lines;
+    args[STATS_PREASM][1] = Stats.macro_expansions;
+    args[STATS_FIRST_PASS][0] = Stats.am_lines;
+    args[STATS_FIRST_PASS][1] = Stats.labels;
+    args[STATS_SECOND_PASS][0] = Stats.IC;
+    args[STATS_SECOND_PASS][1] = Stats.DC;
+    args[STATS_OUTPUT][0] = Stats.output_bytes[STATS_OB] + Stats.output_bytes[STATS_ENT] + Stats.output_bytes[STATS_EXT];
+    for (i = 0; i < STATS_PHASES; i++) {
+        if (Stats.phase_start[i] > 0)
+            traceEvent(TRACE_SPAN, phase_spans[i], Stats.file_name, Stats.phase_start[i], Stats.phase_time[i],
+                       phase_names_of[i], args[i], num_args[i]);
+    }
+
+    file_args[0] = Stats.source_lines;
+    file_args[1] = Stats.labels;
+    file_args[2] = Stats.IC + Stats.DC;
+    traceEvent(TRACE_SPAN, "file", Stats.file_name, Stats.phase_start[STATS_PREASM],
+               statsClock() - Stats.phase_start[STATS_PREASM], file_names, file_args, 3);
+    traceEvent(TRACE_COUNTER, "image", NULL, statsClock(), 0, pass2_names, args[STATS_SECOND_PASS], 2);
+}
+
+
+/*******************************************************************************
+ * Completes the counters of a file from its label table and counters,
+ * prints them with --stats and adds them to the aggregate.
+ *
+ * Parameters:
+ * - file_name: The source file.
+ * - table: The label table of the file, NULL if preassembly failed.
+ * - PC: The final counters.
+ * - failed: 1 if the file did not assemble.
+ ******************************************************************************/
+void statsEndFile(char* file_name, LabelTable* table, int PC[], int failed){
+    Label *label;
+    Reference *ref;
+    int i, length;
+
+    /* The table is only walked once, when the file is done */
+    if (table) {
+        Stats.table_size = table->table_size;
+        for (i = 0; i < table->table_size; i++) {
+            for (length = 0, label = table->Labels[i]; label; label = label->next, length++) {
+                for (ref = label->ref; ref; ref = ref->next) Stats.references++;
+            }
+            Stats.labels += length;
+            Stats.chains[length < STATS_CHAINS ? length : STATS_CHAINS - 1]++;
+        }
+    }
+    Stats.IC = PC[0];
+    Stats.DC = PC[1];
+    Stats.allocations = memFileAllocations();
+    Stats.failed = failed;
+    Stats.files = 1;
+    if (Options.trace) traceFile();
+
+    if (Options.stats) {
+        if (Options.stats == STATS_JSON) fprintf(reportStream(), "%s\n    ", total.files ? "," : "{\n  \"files\": [");
+        printStats(reportStream(), file_name, &Stats);
+        if (Options.stats == STATS_TEXT) fprintf(reportStream(), "\n");
+    }
+
+    for (i = 0; i < STATS_PHASES; i++) total.phase_time[i] += Stats.phase_time[i];
+    for (i = 0; i < STATS_CHAINS; i++) total.chains[i] += Stats.chains[i];
+    for (i = 0; i < STATS_OUTPUTS; i++) total.output_bytes[i] += Stats.output_bytes[i];
+    total.source_lines += Stats.source_lines;
+    total.am_lines += Stats.am_lines;
+    total.macro_expansions += Stats.macro_expansions;
+    total.labels += Stats.labels;
+    total.table_size += Stats.table_size;
+    total.resizes += Stats.resizes;
+    total.references += Stats.references;
+    total.IC += Stats.IC;
+    total.DC += Stats.DC;
+    total.allocations += Stats.allocations;
+    total.files += Stats.files;
+    total.failed += Stats.failed;
+}
+
+
+/*******************************************************************************
+ * Prints the aggregate of the whole batch with --stats.
+ ******************************************************************************/
+void statsReport(void){
+    if (!Options.stats) return;
+
+    if (Options.stats == STATS_JSON) {
+        fprintf(reportStream(), "%s\n  ],\n  \"total\": ", total.files ? "" : "{\n  \"files\": [");
+        printStats(report, NULL, &total);
+        fprintf(report, "\n}\n");
+    } else {
+        printStats(reportStream(), NULL, &total);
+    }
+    if (report != stderr) fclose(report);
+    report = NULL;
+}
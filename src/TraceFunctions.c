@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 200112L
+#include "Assembler.h"
+#include <pthread.h>
+
+/* Events recorded by one thread */
+typedef struct TraceBuffer {
+    TraceEvent *events; /* Events in the order they were recorded */
+    int size; /* Number of events */
+    int capacity; /* Current capacity of the events array */
+    int tid; /* Thread id in the trace */
+    const char *thread_name; /* Name of the thread in the trace */
+    struct TraceBuffer *next; /* Next buffer of the run */
+} TraceBuffer;
+
+static pthread_key_t buffer_key; /* The TraceBuffer of the calling thread */
+static pthread_mutex_t buffers_lock; /* Guards buffers and next_tid */
+static TraceBuffer *buffers; /* Every buffer of the run, newest first */
+static int next_tid = 1; /* Id of the next thread to record an event */
+static double origin; /* Clock time of the start of the trace */
+static int tracing; /* 1 between traceStart and traceWrite */
+
+
+/*******************************************************************************
+ * Starts tracing, with the calling thread as the main thread.
+ ******************************************************************************/
+void traceStart(void){
+    pthread_key_create(&buffer_key, NULL);
+    pthread_mutex_init(&buffers_lock, NULL);
+    origin = statsClock();
+    tracing = 1;
+    traceThreadName("main");
+}
+
+
+/*******************************************************************************
+ * Returns the buffer of the calling thread, created by its first event.
+ * Buffers outlive their threads, they are only written and freed by
+ * traceWrite.
+ ******************************************************************************/
+static TraceBuffer* threadBuffer(void){
+    TraceBuffer *buffer = (TraceBuffer*)pthread_getspecific(buffer_key);
+
+    if (buffer) return buffer;
+    buffer = (TraceBuffer*)memCalloc(MEM_OTHER, 1, sizeof(TraceBuffer));
+    if (!buffer) {
+        fprintf(stderr, "Error, Failed to allocate memory for the trace\n");
+        exit(1);
+    }
+    buffer->thread_name = "thread";
+    pthread_mutex_lock(&buffers_lock);
+    buffer->tid = next_tid++;
+    buffer->next = buffers;
+    buffers = buffer;
+    pthread_mutex_unlock(&buffers_lock);
+    pthread_setspecific(buffer_key, buffer);
+    return buffer;
+}
+
+
+/*******************************************************************************
+ * Names the calling thread in the trace.
+ *
+ * Parameters:
+ * - name: A static name.
+ ******************************************************************************/
+void traceThreadName(const char* name){
+    if (!tracing) return;
+    threadBuffer()->thread_name = name;
+}
+
+
+/*******************************************************************************
+ * Records an event in the buffer of the calling thread.
+ *
+ * Parameters:
+ * - phase: TRACE_SPAN or TRACE_COUNTER.
+ * - name: A static name of the event.
+ * - file: The source file of the event, NULL for none. Must stay valid
+ *   until traceWrite.
+ * - start: Clock time of the start of the event, from statsClock.
+ * - duration: Duration of a span in seconds.
+ * - arg_names: Static names of the numeric arguments.
+ * - args: The numeric arguments.
+ * - num_args: Number of arguments, at most TRACE_ARGS.
+ ******************************************************************************/
+void traceEvent(char phase, const char* name, const char* file, double start, double duration,
+                const char** arg_names, const long* args, int num_args){
+    TraceBuffer *buffer;
+    TraceEvent *event;
+    int i;
+
+    if (!tracing) return;
+    buffer = threadBuffer();
+    if (buffer->size == buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        buffer->events = (TraceEvent*)memRealloc(MEM_OTHER, buffer->events, buffer->capacity * sizeof(TraceEvent));
+        if (!buffer->events) {
+            fprintf(stderr, "Error, Failed to allocate memory for the trace\n");
+            exit(1);
+        }
+    }
+    event = &buffer->events[buffer->size++];
+    event->phase = phase;
+    event->name = name;
+    event->file = file;
+    event->start = start;
+    event->duration = duration;
+    event->num_args = num_args < TRACE_ARGS ? num_args : TRACE_ARGS;
+    for (i = 0; i < event->num_args; i++) {
+        event->arg_names[i] = arg_names[i];
+        event->args[i] = args[i];
+    }
+}
+
+
+/*******************************************************************************
+ * Writes a string as a JSON string literal.
+ ******************************************************************************/
+static void writeJsonString(FILE* out, const char* str){
+    fputc('"', out);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') fprintf(out, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20) fprintf(out, "\\u%04x", (unsigned char)*str);
+        else fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+
+/*******************************************************************************
+ * Writes every recorded event as Chrome trace events to the --trace file
+ * and frees the buffers. Times are in microseconds since traceStart.
+ ******************************************************************************/
+void traceWrite(void){
+    TraceBuffer *buffer, *next;
+    TraceEvent *event;
+    FILE *out;
+    int first = 1, i, j;
+
+    if (!tracing) return;
+    tracing = 0;
+
+    if (!(out = fopen(Options.trace, "w"))) {
+        fprintf(stderr, "Error: Could not create trace file %s\n", Options.trace);
+    } else {
+        fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+        for (buffer = buffers; buffer; buffer = buffer->next) {
+            fprintf(out, "%s\n{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                    first ? "" : ",", buffer->tid, buffer->thread_name);
+            first = 0;
+            for (i = 0; i < buffer->size; i++) {
+                event = &buffer->events[i];
+                fprintf(out, ",\n{\"ph\": \"%c\", \"name\": \"%s\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f",
+                        event->phase, event->name, buffer->tid, (event->start - origin) * 1e6);
+                if (event->phase == TRACE_SPAN) fprintf(out, ", \"dur\": %.3f", event->duration * 1e6);
+                fprintf(out, ", \"args\": {");
+                if (event->file) {
+                    fprintf(out, "\"file\": ");
+                    writeJsonString(out, event->file);
+                }
+                for (j = 0; j < event->num_args; j++)
+                    fprintf(out, "%s\"%s\": %ld", j || event->file ? ", " : "", event->arg_names[j], event->args[j]);
+                fprintf(out, "}}");
+            }
+        }
+        fprintf(out, "\n]}\n");
+        fclose(out);
+    }
+
+    for (buffer = buffers; buffer; buffer = next) {
+        next = buffer->next;
+        memFree(buffer->events);
+        memFree(buffer);
+    }
+    buffers = NULL;
+    pthread_key_delete(buffer_key);
+    pthread_mutex_destroy(&buffers_lock);
+}
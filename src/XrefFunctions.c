@@ -0,0 +1,343 @@
+#define _POSIX_C_SOURCE 200112L
+#include "Assembler.h"
+#include <pthread.h>
+
+/* A macro definition or use seen by the PreAssembler */
+typedef struct XrefMacroSite {
+    char *name; /* Name of the macro */
+    int line; /* Source line of the definition or use */
+    int definition; /* 1 for the definition, 0 for a use */
+} XrefMacroSite;
+
+/* A symbol of the index, a label or a macro */
+typedef struct XrefSymbol {
+    const char *name; /* Name of the symbol */
+    unsigned long flags; /* XREF_* flags */
+    unsigned long line; /* Line of the definition, 0 if unknown */
+    unsigned long address; /* Address of a label, 0 for extern labels and macros */
+    Label *label; /* The label, NULL for a macro */
+    XrefMacroSite *sites; /* First site of a macro in the sorted sites */
+    int num_sites; /* Sites of the macro */
+    unsigned long first_use; /* Index of the first use in the uses array */
+    unsigned long num_uses; /* Number of uses */
+} XrefSymbol;
+
+/* A use of a symbol */
+typedef struct XrefUse {
+    unsigned long line; /* Line of the use */
+    unsigned long address; /* Code address of a label reference, 0 for a macro use */
+} XrefUse;
+
+static pthread_mutex_t xref_lock = PTHREAD_MUTEX_INITIALIZER; /* Guards the line starts, the parallel pass records from several threads */
+static XrefMacroSite *macro_sites; /* Macro definitions and uses of the current file */
+static int num_macro_sites; /* Number of macro sites */
+static int macro_capacity; /* Capacity of the macro sites array */
+static int *line_starts; /* Instruction counter plus one before every line, 0 if not encoded */
+static int line_capacity; /* Capacity of the line starts array */
+
+
+/*******************************************************************************
+ * Records a macro definition or use for the cross-reference of the file.
+ *
+ * Parameters:
+ * - name: The name of the macro, up to the end of the line.
+ * - line: The source line.
+ * - definition: 1 for the definition, 0 for a use.
+ ******************************************************************************/
+void xrefMacro(const char* name, int line, int definition){
+    XrefMacroSite *site;
+    size_t len = strcspn(name, "\r\n");
+
+    if (num_macro_sites == macro_capacity) {
+        macro_capacity = macro_capacity ? macro_capacity * 2 : 32;
+        macro_sites = (XrefMacroSite*)memRealloc(MEM_OUTPUT, macro_sites, macro_capacity * sizeof(XrefMacroSite));
+        if (!macro_sites) {
+            fprintf(stderr, "Error, Failed to allocate memory for the cross-reference\n");
+            exit(1);
+        }
+    }
+    site = &macro_sites[num_macro_sites++];
+    if (!(site->name = (char*)memAlloc(MEM_OUTPUT, len + 1))) {
+        fprintf(stderr, "Error, Failed to allocate memory for the cross-reference\n");
+        exit(1);
+    }
+    memcpy(site->name, name, len);
+    site->name[len] = '\0';
+    site->line = line;
+    site->definition = definition;
+}
+
+
+/*******************************************************************************
+ * Records the instruction counter before a line of the second pass, so the
+ * code positions of label references can be traced back to their lines.
+ * A line encoded again overwrites its earlier start.
+ *
+ * Parameters:
+ * - line: The line of the .am file.
+ * - IC: The instruction counter before the line.
+ ******************************************************************************/
+void xrefLine(int line, int IC){
+    int capacity;
+
+    if (line < 1) return;
+    pthread_mutex_lock(&xref_lock);
+    if (line >= line_capacity) {
+        for (capacity = line_capacity ? line_capacity : 1024; capacity <= line; capacity *= 2);
+        line_starts = (int*)memRealloc(MEM_OUTPUT, line_starts, capacity * sizeof(int));
+        if (!line_starts) {
+            fprintf(stderr, "Error, Failed to allocate memory for the cross-reference\n");
+            exit(1);
+        }
+        memset(line_starts + line_capacity, 0, (capacity - line_capacity) * sizeof(int));
+        line_capacity = capacity;
+    }
+    line_starts[line] = IC + 1;
+    pthread_mutex_unlock(&xref_lock);
+}
+
+
+/*******************************************************************************
+ * Finds the line whose code holds a code position: the last line starting
+ * at or before it, as the instruction counter only grows along the lines.
+ *
+ * Returns:
+ * - The line, 0 if no line was recorded before the position.
+ ******************************************************************************/
+static unsigned long lineOfPosition(int pos){
+    int low = 1, high = line_capacity - 1, middle, found = 0;
+
+    while (low <= high) {
+        middle = low + (high - low) / 2;
+        if (line_starts[middle] && line_starts[middle] - 1 <= pos) {
+            found = middle;
+            low = middle + 1;
+        }
+        else high = middle - 1;
+    }
+    return (unsigned long)found;
+}
+
+
+/*******************************************************************************
+ * Orders macro sites by name, the definition first, then by line.
+ ******************************************************************************/
+static int compareSites(const void* a, const void* b){
+    const XrefMacroSite *first = (const XrefMacroSite*)a, *second = (const XrefMacroSite*)b;
+    int result = strcmp(first->name, second->name);
+
+    if (result) return result;
+    if (first->definition != second->definition) return second->definition - first->definition;
+    return (first->line > second->line) - (first->line < second->line);
+}
+
+
+/*******************************************************************************
+ * Orders symbols by name, the binary search key of the index, labels first.
+ ******************************************************************************/
+static int compareSymbols(const void* a, const void* b){
+    const XrefSymbol *first = (const XrefSymbol*)a, *second = (const XrefSymbol*)b;
+    int result = strcmp(first->name, second->name);
+
+    if (result) return result;
+    return (first->flags > second->flags) - (first->flags < second->flags);
+}
+
+
+/*******************************************************************************
+ * Orders the uses of a symbol by line, then by address.
+ ******************************************************************************/
+static int compareUses(const void* a, const void* b){
+    const XrefUse *first = (const XrefUse*)a, *second = (const XrefUse*)b;
+
+    if (first->line != second->line) return first->line < second->line ? -1 : 1;
+    return (first->address > second->address) - (first->address < second->address);
+}
+
+
+/*******************************************************************************
+ * Writes the text form of the index: every symbol as a line "name, kind,
+ * definition line, address", tab separated, followed by a tab indented
+ * "line, address" line for every use. Addresses are in the base 4 letters
+ * of the .ob file, - when there is none.
+ ******************************************************************************/
+static void writeXrefText(char* file_name, XrefSymbol* symbols, int num_symbols, XrefUse* uses){
+    static char encoding_table[] = {'a', 'b', 'c', 'd'};
+    char line[2 * MAX_LINE_LENGTH], address[SIZE_OF_ADDRESS + 1] = {'\0'};
+    OutputFile *text = openOutputFile(file_name, XREF_TEXT_EXT);
+    unsigned long j;
+    int i, len;
+
+    for (i = 0; i < num_symbols; i++) {
+        if (symbols[i].address) encodeBase4(encoding_table, symbols[i].address, address, SIZE_OF_ADDRESS);
+        len = sprintf(line, "%s\t%s%s%s\t%lu\t%s\n", symbols[i].name,
+                      symbols[i].flags & XREF_MACRO ? "macro" : symbols[i].flags & XREF_EXTERN ? "extern" : "label",
+                      symbols[i].flags & XREF_MATRIX ? ",mat" : "", symbols[i].flags & XREF_ENTRY ? ",entry" : "",
+                      symbols[i].line, symbols[i].address ? address : "-");
+        writeOutput(text, line, len);
+
+        for (j = symbols[i].first_use; j < symbols[i].first_use + symbols[i].num_uses; j++) {
+            if (uses[j].address) encodeBase4(encoding_table, uses[j].address, address, SIZE_OF_ADDRESS);
+            len = sprintf(line, "\t%lu\t%s\n", uses[j].line, uses[j].address ? address : "-");
+            writeOutput(text, line, len);
+        }
+    }
+    closeOutputFile(text);
+}
+
+
+/*******************************************************************************
+ * Writes the cross-reference index of an assembled file.
+ *
+ * Index layout (all numbers are 32 bit little endian):
+ * - header: magic "XREF", version, payload size, FNV-1a hash of the payload.
+ * - payload: symbol count, use count, the symbols, the uses, the names.
+ *   Every symbol is six numbers: offset of its name in the names, XREF_*
+ *   flags, definition line, address, index of its first use, use count.
+ *   The symbols are sorted by name, so a fixed size record can be found by
+ *   binary search. Every use is its line and code address, the uses of a
+ *   symbol are contiguous and sorted by line. The names end with '\0'.
+ *
+ * Labels are defined and referenced on lines of the .am file, like the
+ * errors of the passes; macros on lines of the source that defines them.
+ * Addresses are the final ones of the .ob file, 0 when there is none.
+ *
+ * Parameters:
+ * - table: The label table of the file, with its references.
+ * - file_name: The source file name.
+ ******************************************************************************/
+static void writeXref(LabelTable* table, char* file_name){
+    XrefSymbol *symbols, *symbol;
+    XrefUse *uses;
+    Label *label;
+    Reference *ref;
+    OutputFile *index;
+    unsigned char header[XREF_HEADER_SIZE], *payload, *record;
+    unsigned long num_uses = 0, size, names, pos;
+    int num_symbols = 0, i, j;
+
+    if (num_macro_sites) qsort(macro_sites, num_macro_sites, sizeof(XrefMacroSite), compareSites);
+    for (i = 0; i < table->table_size; i++) {
+        for (label = table->Labels[i]; label; label = label->next) {
+            num_symbols++;
+            for (ref = label->ref; ref; ref = ref->next) num_uses++;
+        }
+    }
+    for (i = 0; i < num_macro_sites; i++) {
+        if (i == 0 || strcmp(macro_sites[i].name, macro_sites[i - 1].name) != 0) num_symbols++;
+        if (!macro_sites[i].definition) num_uses++;
+    }
+
+    symbols = (XrefSymbol*)memCalloc(MEM_OUTPUT, num_symbols ? num_symbols : 1, sizeof(XrefSymbol));
+    uses = (XrefUse*)memCalloc(MEM_OUTPUT, num_uses ? num_uses : 1, sizeof(XrefUse));
+    if (!symbols || !uses) {
+        fprintf(stderr, "Error, Failed to allocate memory for the cross-reference\n");
+        exit(1);
+    }
+
+    /* The labels, then a symbol for every macro name */
+    symbol = symbols;
+    for (i = 0; i < table->table_size; i++) {
+        for (label = table->Labels[i]; label; label = label->next, symbol++) {
+            symbol->name = label->name;
+            symbol->flags = (label->ext ? XREF_EXTERN : 0) | (label->ent ? XREF_ENTRY : 0) | (label->mat ? XREF_MATRIX : 0);
+            symbol->line = label->line;
+            symbol->address = label->ext ? 0 : label->address;
+            symbol->label = label;
+        }
+    }
+    for (i = 0; i < num_macro_sites; i = j, symbol++) {
+        for (j = i + 1; j < num_macro_sites && strcmp(macro_sites[j].name, macro_sites[i].name) == 0; j++);
+        symbol->name = macro_sites[i].name;
+        symbol->flags = XREF_MACRO;
+        symbol->line = macro_sites[i].definition ? macro_sites[i].line : 0;
+        symbol->sites = &macro_sites[i];
+        symbol->num_sites = j - i;
+    }
+    qsort(symbols, num_symbols, sizeof(XrefSymbol), compareSymbols);
+
+    /* The uses of every symbol, in symbol order, and the size of the names */
+    num_uses = 0;
+    names = 0;
+    for (i = 0; i < num_symbols; i++) {
+        symbol = &symbols[i];
+        symbol->first_use = num_uses;
+        if (symbol->label) {
+            for (ref = symbol->label->ref; ref; ref = ref->next, num_uses++) {
+                uses[num_uses].line = lineOfPosition(ref->pos);
+                uses[num_uses].address = ref->pos + Options.load_base;
+            }
+        }
+        for (j = 0; j < symbol->num_sites; j++) {
+            if (symbol->sites[j].definition) continue;
+            uses[num_uses].line = symbol->sites[j].line;
+            uses[num_uses++].address = 0;
+        }
+        symbol->num_uses = num_uses - symbol->first_use;
+        qsort(uses + symbol->first_use, symbol->num_uses, sizeof(XrefUse), compareUses);
+        names += strlen(symbol->name) + 1;
+    }
+
+    size = 8 + num_symbols * XREF_SYMBOL_SIZE + num_uses * XREF_USE_SIZE + names;
+    if (!(payload = (unsigned char*)memAlloc(MEM_OUTPUT, size))) {
+        fprintf(stderr, "Error, Failed to allocate memory for the cross-reference\n");
+        exit(1);
+    }
+    putWord32(payload, num_symbols);
+    putWord32(payload + 4, num_uses);
+    record = payload + 8;
+    pos = 0;
+    for (i = 0; i < num_symbols; i++, record += XREF_SYMBOL_SIZE) {
+        putWord32(record, pos);
+        putWord32(record + 4, symbols[i].flags);
+        putWord32(record + 8, symbols[i].line);
+        putWord32(record + 12, symbols[i].address);
+        putWord32(record + 16, symbols[i].first_use);
+        putWord32(record + 20, symbols[i].num_uses);
+        strcpy((char*)payload + size - names + pos, symbols[i].name);
+        pos += strlen(symbols[i].name) + 1;
+    }
+    for (i = 0; i < (int)num_uses; i++, record += XREF_USE_SIZE) {
+        putWord32(record, uses[i].line);
+        putWord32(record + 4, uses[i].address);
+    }
+
+    memcpy(header, XREF_MAGIC, 4);
+    putWord32(header + 4, XREF_VERSION);
+    putWord32(header + 8, size);
+    putWord32(header + 12, cacheHash(payload, size));
+    index = openOutputFile(file_name, XREF_EXT);
+    writeOutput(index, (char*)header, XREF_HEADER_SIZE);
+    writeOutput(index, (char*)payload, size);
+    closeOutputFile(index);
+
+    if (Options.xref == XREF_TEXT) writeXrefText(file_name, symbols, num_symbols, uses);
+
+    memFree(payload);
+    memFree(uses);
+    memFree(symbols);
+}
+
+
+/*******************************************************************************
+ * Ends the cross-reference of a file: with --xref the index of an assembled
+ * file is written, and the sites recorded for the file are released.
+ *
+ * Parameters:
+ * - table: The label table of the file, NULL if it has none.
+ * - file_name: The source file name.
+ * - failed: 1 if the file did not assemble, nothing is written then.
+ ******************************************************************************/
+void xrefEndFile(LabelTable* table, char* file_name, int failed){
+    int i;
+
+    if (Options.xref && !failed && table) writeXref(table, file_name);
+
+    for (i = 0; i < num_macro_sites; i++) memFree(macro_sites[i].name);
+    memFree(macro_sites);
+    macro_sites = NULL;
+    num_macro_sites = macro_capacity = 0;
+    memFree(line_starts);
+    line_starts = NULL;
+    line_capacity = 0;
+}
@@ -0,0 +1,6 @@
+; file link_lib.as - links with link_main.as
+.entry TOTAL
+.entry ADDONE
+ADDONE: add #1, r1
+ rts
+TOTAL: .data 41
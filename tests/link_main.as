@@ -0,0 +1,11 @@
+; file link_main.as - links with link_lib.as
+.entry MAIN
+.extern TOTAL
+.extern ADDONE
+MAIN: mov TOTAL, r1
+ jsr ADDONE
+ prn r1
+ add STEP, r1
+ prn r1
+ stop
+STEP: .data 8
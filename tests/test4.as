@@ -0,0 +1,11 @@
+; file include.as - .include of a nested and a repeated file
+.entry MAIN
+MAIN: mov #3, r1
+ add COUNT, r1
+ prn r1
+ jsr SHOW
+ stop
+SHOW: prn TEXT
+ rts
+.include "test4_data.inc"
+.include "./test4_text.inc"